@@ -1156,6 +1156,20 @@ asm volatile(
 	addi a0, a0, 4\n\
 	blt a0, a1, 1b\n\
 2:"
+#if defined(FUNCONF_FUN_FAST) && FUNCONF_FUN_FAST
+	// FUN_FAST code from FLASH to RAM.  Weak, since not every linker script has it.
+"	.weak _highcode_lma, _highcode_vma_start, _highcode_vma_end\n\
+	la a0, _highcode_lma\n\
+	la a1, _highcode_vma_start\n\
+	la a2, _highcode_vma_end\n\
+1:	bgeu a1, a2, 2f\n\
+	lw a3, 0(a0)\n\
+	sw a3, 0(a1)\n\
+	addi a0, a0, 4\n\
+	addi a1, a1, 4\n\
+	j 1b\n\
+2:\n"
+#endif
 	// This loads DATA from FLASH to RAM.
 "	la a0, _data_lma\n\
 	la a1, _data_vma\n\
@@ -1214,9 +1228,10 @@ void handle_reset( void )
 	addi a0, a0, 4\n\
 	bltu a0, a1, 1b\n\
 2:\n"
-#ifdef CH5xx
-	/* Load highcode code section from FLASH to HIGHRAM */
-"	la a0, _highcode_lma\n\
+#if defined(CH5xx) || ( defined(FUNCONF_FUN_FAST) && FUNCONF_FUN_FAST )
+	/* Load highcode (FUN_FAST) code section from FLASH to RAM.  Weak, since not every linker script has it. */
+"	.weak _highcode_lma, _highcode_vma_start, _highcode_vma_end\n\
+	la a0, _highcode_lma\n\
 	la a1, _highcode_vma_start\n\
 	la a2, _highcode_vma_end\n\
 	bgeu a1, a2, 2f\n\
@@ -1926,8 +1941,40 @@ void StartV5F(v5f_main function)
 }
 #endif
 
+#if defined(FUNCONF_STACK_WATERMARK) && FUNCONF_STACK_WATERMARK
+extern uint32_t end;
+#if defined(CH32H41x)
+extern uint32_t _v3f_stack;
+#define FUN_STACK_TOP _v3f_stack
+#else
+extern uint32_t _eusrstack;
+#define FUN_STACK_TOP _eusrstack
+#endif
+
+void funStackWatermarkFill( void )
+{
+	// Nothing below sp is in use yet, this function doesn't call anything.
+	uint32_t * p;
+	asm volatile( "mv %0, sp" : "=r"( p ) );
+	while( --p >= &end )
+		*p = FUN_STACK_CANARY;
+}
+
+uint32_t funStackUsed( void )
+{
+	uint32_t * p = &end;
+	uint32_t * top = &FUN_STACK_TOP;
+	while( p < top && *p != FUN_STACK_CANARY ) p++; // Skip the heap, if there is one.
+	while( p < top && *p == FUN_STACK_CANARY ) p++;
+	return (uint8_t *)top - (uint8_t *)p;
+}
+#endif
+
 void SystemInit( void )
 {
+#if defined(FUNCONF_STACK_WATERMARK) && FUNCONF_STACK_WATERMARK
+	funStackWatermarkFill();
+#endif
 #if defined(CH32V30x) && defined(TARGET_MCU_MEMORY_SPLIT)
 	FLASH->OBR = TARGET_MCU_MEMORY_SPLIT<<8;
 #endif
@@ -90,6 +90,8 @@
 #define FUNCONF_SUPPORT_CONSTRUCTORS 0	// Call functions with __attribute__((constructor)) in SystemInit()
 #define FUNCONF_ICACHE_EN 1				// Enables ICache on cores that support it, may require power-down + power up to work properly at flash time.
 #define FUNCONF_OVERRIDE_STARTUP 0      // User code will have its own `handle_reset` and `InterruptVector`
+#define FUNCONF_STACK_WATERMARK 0       // SystemInit() fills the free stack with a canary, see funStackUsed() and minichlink -W
+#define FUNCONF_FUN_FAST 0              // FUN_FAST functions go to RAM on CH32 parts.  Set with FUNFAST=1 in the Makefile, the linker script needs it too.
 */
 
 // Sanity check for when porting old code.
@@ -337,6 +339,23 @@
 #define WEAK __attribute__((weak))
 #endif
 
+// Run a function from RAM (ITCM on the H41x), no flash wait states.  RAM is
+// copied from flash at startup.  Instead of marking functions by hand,
+// "make fastplace" can pick them from a profile, see misc/fastplace.py.
+// Other CH32 parts need FUNFAST=1, without it the function stays in flash
+// and the startup code has no copy loop.
+#ifndef FUN_FAST
+	#if defined(CH5xx)
+		#define FUN_FAST __HIGH_CODE
+	#elif defined(CH32H41x)
+		#define FUN_FAST __ITCM
+	#elif defined(FUNCONF_FUN_FAST) && FUNCONF_FUN_FAST
+		#define FUN_FAST __attribute__((section(".highcode")))
+	#else
+		#define FUN_FAST
+	#endif
+#endif
+
 #ifdef __cplusplus
  extern "C" {
 #endif
@@ -1108,6 +1127,18 @@ void handle_debug_input( int numbytes, uint8_t * data );
 // Call functions with __attribute__((constructor)). Defining FUNCONF_SUPPORT_CONSTRUCTORS 1 will do it for you
 void CallConstructors( void );
 
+#if defined(FUNCONF_STACK_WATERMARK) && FUNCONF_STACK_WATERMARK
+// Written over the free RAM between the heap and the stack by SystemInit().
+// minichlink -W looks for it too, so keep the two in sync.
+#define FUN_STACK_CANARY 0xf0cacc1a
+
+// Fills everything below the current stack pointer with FUN_STACK_CANARY.
+void funStackWatermarkFill( void );
+
+// Most stack ever used since the fill, in bytes.
+uint32_t funStackUsed( void );
+#endif
+
 // Functions from ch32fun.c
 #include <stdarg.h>
 
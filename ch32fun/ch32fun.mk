@@ -41,6 +41,23 @@ ifeq ($(DEBUG),1)
 	EXTRA_CFLAGS+=-DFUNCONF_DEBUG=1
 endif
 
+# Instrument every function outside of ch32fun/ for extralibs/lib_funprof.h
+ifeq ($(FUNPROF),1)
+	EXTRA_CFLAGS+=-DFUNPROF_INSTRUMENT=1 -finstrument-functions -finstrument-functions-exclude-file-list=ch32fun/,lib_funprof.h
+endif
+
+# Functions picked by "make fastplace" go to RAM, delete $(TARGET).fast.ld to undo.
+FUN_FAST_LIST?=$(wildcard $(TARGET).fast.ld)
+
+# FUN_FAST functions in RAM on CH32 parts (CH5xx and the H41x always do it)
+ifneq ($(FUN_FAST_LIST),)
+	FUNFAST?=1
+endif
+ifeq ($(FUNFAST),1)
+	EXTRA_CFLAGS+=-DFUNCONF_FUN_FAST=1
+	FUN_FAST_LDFLAGS=-DFUNCONF_FUN_FAST=1
+endif
+
 CFLAGS?=-g -Os -flto -ffunction-sections -fdata-sections -fmessage-length=0 -msmall-data-limit=8
 LDFLAGS+=-Wl,--print-memory-usage -Wl,-Map=$(TARGET).map
 
@@ -405,7 +422,7 @@ FLASH_EXT_COMMAND?=$(MINICHLINK)/minichlink -w $< $(EXT_ORIGIN) -b
 
 .PHONY : $(GENERATED_LD_FILE)
 $(GENERATED_LD_FILE) :
-	$(PREFIX)-gcc -E -P -x c -DTARGET_MCU=$(TARGET_MCU) -DMCU_PACKAGE=$(MCU_PACKAGE) -DTARGET_MCU_LD=$(TARGET_MCU_LD) -DTARGET_MCU_MEMORY_SPLIT=$(TARGET_MCU_MEMORY_SPLIT) $(CH32FUN)/ch32fun.ld > $(GENERATED_LD_FILE)
+	$(PREFIX)-gcc -E -P -x c -DTARGET_MCU=$(TARGET_MCU) -DMCU_PACKAGE=$(MCU_PACKAGE) -DTARGET_MCU_LD=$(TARGET_MCU_LD) -DTARGET_MCU_MEMORY_SPLIT=$(TARGET_MCU_MEMORY_SPLIT) $(FUN_FAST_LDFLAGS) $(if $(FUN_FAST_LIST),-DFUN_FAST_LIST=\"$(abspath $(FUN_FAST_LIST))\") $(CH32FUN)/ch32fun.ld > $(GENERATED_LD_FILE)
 
 $(TARGET).elf : $(FILES_TO_COMPILE) $(LINKER_SCRIPT) $(EXTRA_ELF_DEPENDENCIES)
 	$(PREFIX)-gcc -o $@ $(FILES_TO_COMPILE) $(CFLAGS) $(LDFLAGS)
@@ -426,7 +443,32 @@ cv_flash_ext : $(TARGET)_ext.bin
 	make -C $(MINICHLINK) all
 	$(FLASH_EXT_COMMAND)
 
+cv_profile : $(TARGET).elf $(MINICHLINK)/minichlink
+	$(PREFIX)-nm -n $(TARGET).elf > $(TARGET).nm
+	$(MINICHLINK)/minichlink -F $(TARGET).nm
+
+# Statistical profile of the running firmware, writes $(TARGET).prof for fastplace and $(TARGET).folded.
+SAMPLE_SECONDS?=5
+cv_sample : $(TARGET).elf $(MINICHLINK)/minichlink
+	$(PREFIX)-nm -n $(TARGET).elf > $(TARGET).nm
+	$(MINICHLINK)/minichlink -O $(SAMPLE_SECONDS) $(TARGET).nm
+
+# Worst case stack depth of main and every interrupt handler, from -fstack-usage and the call graph.
+# STACK_ISR_NEST is how many interrupts can be on the stack at once, 2 with FUNCONF_ENABLE_HPE (nesting).
+STACK_ISR_NEST?=1
+stackreport : $(FILES_TO_COMPILE) $(LINKER_SCRIPT) $(EXTRA_ELF_DEPENDENCIES)
+	rm -rf $(TARGET).su.d && mkdir -p $(TARGET).su.d
+	$(PREFIX)-gcc -o $(TARGET).elf $(FILES_TO_COMPILE) $(CFLAGS) $(LDFLAGS) -fstack-usage -dumpdir $(TARGET).su.d/
+	python3 $(CH32FUN)/../misc/stackreport.py --prefix $(PREFIX) --nest $(STACK_ISR_NEST) $(TARGET).elf $(TARGET).su.d
+
+# Move the hottest functions of a profile (make cv_sample) to RAM, up to FAST_BUDGET bytes.
+# Then rebuild.  Only functions in their own section move, so it needs -ffunction-sections.
+FAST_BUDGET?=1024
+FAST_PROFILE?=$(TARGET).prof
+fastplace : $(TARGET).elf
+	python3 $(CH32FUN)/../misc/fastplace.py --prefix $(PREFIX) --budget $(FAST_BUDGET) $(TARGET).elf $(FAST_PROFILE) -o $(TARGET).fast.ld
+
 cv_clean :
-	rm -rf $(TARGET).elf $(TARGET).bin $(TARGET)_ext.bin $(TARGET).hex $(TARGET).lst $(TARGET).map $(TARGET).hex $(GENERATED_LD_FILE) || true
+	rm -rf $(TARGET).su.d $(TARGET).elf $(TARGET).bin $(TARGET)_ext.bin $(TARGET).hex $(TARGET).lst $(TARGET).map $(TARGET).nm $(TARGET).prof $(TARGET).folded $(TARGET).hex $(GENERATED_LD_FILE) || true
 
 build : $(TARGET).bin
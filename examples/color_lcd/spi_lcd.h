@@ -56,6 +56,14 @@ enum {
 // enough memory to hold 16 lines of the display for fast character drawing
 #define CACHE_SIZE (320*CACHED_LINES)
 #endif
+// number of commands the display list can hold
+#ifndef LCD_DL_SIZE
+#ifdef CH32V003
+#define LCD_DL_SIZE 12
+#else
+#define LCD_DL_SIZE 64
+#endif
+#endif
 // memory offset of visible area (80x160 out of 240x320)
 
 // Proportional font data taken from Adafruit_GFX library
@@ -87,6 +95,12 @@ int lcdWriteStringCustom(GFXfont *pFont, int x, int y, char *szMsg, uint16_t usF
 void lcdOrientation(int iOrientation);
 void lcdRectangle(int x, int y, int cx, int cy, uint16_t usColor, int bFill);
 void lcdEllipse(int centerX, int centerY, int radiusX, int radiusY, uint16_t color, int bFilled);
+// Display list: record a frame, then send it in one flicker-free pass
+void lcdDLBegin(uint16_t usBGColor);
+int lcdDLRectangle(int x, int y, int cx, int cy, uint16_t usColor, int bFill);
+int lcdDLEllipse(int iCenterX, int iCenterY, int iRadiusX, int iRadiusY, uint16_t usColor, int bFill);
+int lcdDLWriteString(int x, int y, char *szMsg, uint16_t usFGColor, uint16_t usBGColor, int iFontSize);
+void lcdDLRender(void);
 
 void memset16(uint16_t *u16Dest, uint16_t u16Pattern, int iLen);
 #define COLOR_BLACK 0
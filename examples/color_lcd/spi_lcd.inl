@@ -28,6 +28,22 @@ static uint8_t u8Cache0[CACHE_SIZE]; // ping-pong data buffers
 static uint8_t u8Cache1[CACHE_SIZE];
 static uint8_t *pCache0 = u8Cache0, *pCache1 = u8Cache1;
 volatile int bDMA = 0;
+// display list
+enum {
+	DL_RECTANGLE = 0,
+	DL_ELLIPSE,
+	DL_STRING
+};
+typedef struct {
+	uint8_t u8Type;
+	uint8_t u8Param; // fill flag or font size
+	int16_t x, y, cx, cy; // bounding box (center + radii for ellipses)
+	uint16_t u16FG, u16BG; // already byte swapped for the LCD
+	char *szMsg;
+} DLCMD;
+static DLCMD dlList[LCD_DL_SIZE];
+static int iDLCount;
+static uint16_t u16DLBG;
 
 const uint8_t ucILI9341InitList[] = {
         4, 0xEF, 0x03, 0x80, 0x02,
@@ -356,7 +372,7 @@ void memset16(uint16_t *u16Dest, uint16_t u16Pattern, int iLen)
 		u16Dest = (uint16_t *)u32D;
 	}
 	while (iLen) {
-		*u16Dest += u16Pattern;
+		*u16Dest++ = u16Pattern;
 		iLen--;
 	}
 } /* memset16() */
@@ -1195,4 +1211,249 @@ uint16_t *d;
     iCursorY = y;
    return 0;
 } /* lcdWriteStringCustom() */
+//
+// Display list drawing
+// Instead of sending each primitive to the LCD as it's drawn, the commands
+// are recorded and lcdDLRender() builds the frame from top to bottom a band of
+// lines at a time. Each band is rasterized into one of the ping-pong buffers
+// while DMA is sending the previous one, so the SPI bus stays busy and the
+// whole screen is replaced in a single pass with no erase (no flicker) using
+// only the 2 line caches we already have
+//
+void lcdDLBegin(uint16_t usBGColor)
+{
+	iDLCount = 0;
+	u16DLBG = __builtin_bswap16(usBGColor);
+} /* lcdDLBegin() */
+
+//
+// Get the next free display list entry
+//
+static DLCMD *DLNew(int iType)
+{
+	DLCMD *pCmd;
+	if (iDLCount >= LCD_DL_SIZE) return NULL; // list is full
+	pCmd = &dlList[iDLCount++];
+	pCmd->u8Type = (uint8_t)iType;
+	return pCmd;
+} /* DLNew() */
+
+int lcdDLRectangle(int x, int y, int cx, int cy, uint16_t usColor, int bFill)
+{
+	DLCMD *pCmd;
+	if (cx <= 0 || cy <= 0) return 0; // nothing to draw
+	pCmd = DLNew(DL_RECTANGLE);
+	if (pCmd == NULL) return -1;
+	pCmd->x = x; pCmd->y = y; pCmd->cx = cx; pCmd->cy = cy;
+	pCmd->u16FG = __builtin_bswap16(usColor);
+	pCmd->u8Param = (uint8_t)bFill;
+	return 0;
+} /* lcdDLRectangle() */
+
+int lcdDLEllipse(int iCenterX, int iCenterY, int iRadiusX, int iRadiusY, uint16_t usColor, int bFill)
+{
+	DLCMD *pCmd;
+	if (iRadiusX < 0 || iRadiusY < 0) return 0;
+	pCmd = DLNew(DL_ELLIPSE);
+	if (pCmd == NULL) return -1;
+	pCmd->x = iCenterX; pCmd->y = iCenterY; pCmd->cx = iRadiusX; pCmd->cy = iRadiusY;
+	pCmd->u16FG = __builtin_bswap16(usColor);
+	pCmd->u8Param = (uint8_t)bFill;
+	return 0;
+} /* lcdDLEllipse() */
+
+//
+// The string is not copied; it must stay valid until lcdDLRender() is called
+//
+int lcdDLWriteString(int x, int y, char *szMsg, uint16_t usFGColor, uint16_t usBGColor, int iFontSize)
+{
+	DLCMD *pCmd;
+	int cx;
+	if (iFontSize < 0 || iFontSize >= FONT_COUNT) return -1;
+	pCmd = DLNew(DL_STRING);
+	if (pCmd == NULL) return -1;
+	cx = (iFontSize == FONT_12x16) ? 12 : (iFontSize == FONT_8x8) ? 8 : 6;
+	pCmd->x = x; pCmd->y = y;
+	pCmd->cx = cx * strlen(szMsg);
+	pCmd->cy = (iFontSize == FONT_12x16) ? 16 : 8;
+	pCmd->u16FG = __builtin_bswap16(usFGColor);
+	pCmd->u16BG = __builtin_bswap16(usBGColor);
+	pCmd->u8Param = (uint8_t)iFontSize;
+	pCmd->szMsg = szMsg;
+	return 0;
+} /* lcdDLWriteString() */
+
+//
+// Fill a horizontal run of pixels (x1 to x2 inclusive) on one line of the band
+//
+static void DLSpan(uint16_t *pRow, int x1, int x2, uint16_t u16Color)
+{
+	if (x1 < 0) x1 = 0;
+	if (x2 >= iLCDWidth) x2 = iLCDWidth-1;
+	while (x1 <= x2)
+		pRow[x1++] = u16Color;
+} /* DLSpan() */
+
+//
+// Integer square root (no multiplier needed)
+//
+static uint32_t DLSqrt(uint32_t u32)
+{
+	uint32_t u32Root = 0, u32Bit = 1UL << 30;
+	while (u32Bit > u32) u32Bit >>= 2;
+	while (u32Bit) {
+		if (u32 >= u32Root + u32Bit) {
+			u32 -= u32Root + u32Bit;
+			u32Root = (u32Root >> 1) + u32Bit;
+		} else {
+			u32Root >>= 1;
+		}
+		u32Bit >>= 2;
+	}
+	return u32Root;
+} /* DLSqrt() */
+
+//
+// Half width of an ellipse dy lines away from its center (-1 = outside)
+// worked out in half pixels so the edges round to the nearest pixel
+//
+static int DLEllipseX(int dy, int iRadiusX, int iRadiusY)
+{
+	if (dy < -iRadiusY || dy > iRadiusY) return -1;
+	if (iRadiusY == 0) return iRadiusX;
+	return (iRadiusX * (int)DLSqrt((iRadiusY*iRadiusY - dy*dy)*4) + iRadiusY) / (iRadiusY*2);
+} /* DLEllipseX() */
+
+//
+// Draw the part of one text line which falls on the given display line
+// this produces the same pixels as lcdWriteString()
+//
+static void DLStringLine(uint16_t *pRow, DLCMD *pCmd, int iLine)
+{
+	int i, j, px, cx;
+	uint8_t *s, ucMask;
+	uint16_t u16Cell[12];
+	char *szMsg = pCmd->szMsg;
+
+	if (pCmd->u8Param == FONT_12x16) {
+		int bLower = iLine & 1;
+		cx = 12;
+		ucMask = 1 << (iLine >> 1);
+		for (px = pCmd->x; *szMsg && px < iLCDWidth; px += cx) {
+			uint8_t c0, c1, ucMask1 = ucMask << 1, ucMask2 = ucMask >> 1;
+			s = (uint8_t *)&ucSmallFont[((unsigned char)*szMsg++ - 32) * 5];
+			for (j=0; j<12; j++)
+				u16Cell[j] = pCmd->u16BG;
+			for (j=0; j<5; j++) {
+				c0 = s[j];
+				if (c0 & ucMask)
+					u16Cell[j*2] = u16Cell[j*2+1] = pCmd->u16FG;
+				if (j == 4) continue;
+				// smooth the diagonals
+				c1 = s[j+1];
+				if (bLower) {
+					if ((c0 & ucMask) && (~c1 & ucMask) && (~c0 & ucMask1) && (c1 & ucMask1))
+						u16Cell[j*2+2] = pCmd->u16FG;
+					else if ((~c0 & ucMask) && (c1 & ucMask) && (c0 & ucMask1) && (~c1 & ucMask1))
+						u16Cell[j*2+1] = pCmd->u16FG;
+				} else {
+					if ((c0 & ucMask2) && (~c1 & ucMask2) && (~c0 & ucMask) && (c1 & ucMask))
+						u16Cell[j*2+1] = pCmd->u16FG;
+					else if ((~c0 & ucMask2) && (c1 & ucMask2) && (c0 & ucMask) && (~c1 & ucMask))
+						u16Cell[j*2+2] = pCmd->u16FG;
+				}
+			} // for j
+			for (j=0; j<cx; j++)
+				if (px+j >= 0 && px+j < iLCDWidth) pRow[px+j] = u16Cell[j];
+		} // for each character
+		return;
+	} // 12x16
+
+	cx = (pCmd->u8Param == FONT_8x8) ? 8 : 6;
+	ucMask = 1 << iLine;
+	for (px = pCmd->x; *szMsg && px < iLCDWidth; px += cx) {
+		if (pCmd->u8Param == FONT_8x8)
+			s = (uint8_t *)&ucFont[((unsigned char)*szMsg++ - 32) * 7];
+		else
+			s = (uint8_t *)&ucSmallFont[((unsigned char)*szMsg++ - 32) * 5];
+		for (j=0; j<cx-1; j++)
+			u16Cell[j] = (s[j] & ucMask) ? pCmd->u16FG : pCmd->u16BG;
+		u16Cell[cx-1] = pCmd->u16BG; // last column is blank
+		for (i=0; i<cx; i++)
+			if (px+i >= 0 && px+i < iLCDWidth) pRow[px+i] = u16Cell[i];
+	} // for each character
+} /* DLStringLine() */
+
+//
+// Rasterize the display list into lines y to y+iLines-1 of the frame
+//
+static void DLDrawBand(uint16_t *pBand, int y, int iLines)
+{
+	int i, ty, y1, y2, iOuter, iInner, w;
+	uint16_t *pRow;
+	DLCMD *pCmd;
+
+	memset16(pBand, u16DLBG, iLines * iLCDWidth);
+	for (i=0; i<iDLCount; i++) { // later commands draw over earlier ones
+		pCmd = &dlList[i];
+		if (pCmd->u8Type == DL_ELLIPSE) {
+			y1 = pCmd->y - pCmd->cy; y2 = pCmd->y + pCmd->cy + 1;
+		} else {
+			y1 = pCmd->y; y2 = pCmd->y + pCmd->cy;
+		}
+		if (y1 < y) y1 = y; // clip to this band
+		if (y2 > y + iLines) y2 = y + iLines;
+		for (ty = y1; ty < y2; ty++) {
+			pRow = &pBand[(ty - y) * iLCDWidth];
+			switch (pCmd->u8Type) {
+			case DL_RECTANGLE:
+				if (pCmd->u8Param || ty == pCmd->y || ty == pCmd->y + pCmd->cy - 1) {
+					DLSpan(pRow, pCmd->x, pCmd->x + pCmd->cx - 1, pCmd->u16FG);
+				} else { // left and right edges
+					DLSpan(pRow, pCmd->x, pCmd->x, pCmd->u16FG);
+					DLSpan(pRow, pCmd->x + pCmd->cx - 1, pCmd->x + pCmd->cx - 1, pCmd->u16FG);
+				}
+				break;
+			case DL_ELLIPSE:
+				iOuter = DLEllipseX(ty - pCmd->y, pCmd->cx, pCmd->cy);
+				if (pCmd->u8Param) {
+					DLSpan(pRow, pCmd->x - iOuter, pCmd->x + iOuter, pCmd->u16FG);
+					break;
+				}
+				// the outline has to reach the width of the narrower neighbor line to stay connected
+				iInner = DLEllipseX(ty - pCmd->y - 1, pCmd->cx, pCmd->cy);
+				w = DLEllipseX(ty - pCmd->y + 1, pCmd->cx, pCmd->cy);
+				if (w < iInner) iInner = w;
+				w = iOuter - iInner;
+				if (w < 1) w = 1;
+				DLSpan(pRow, pCmd->x - iOuter, pCmd->x - iOuter + w - 1, pCmd->u16FG);
+				DLSpan(pRow, pCmd->x + iOuter - w + 1, pCmd->x + iOuter, pCmd->u16FG);
+				break;
+			case DL_STRING:
+				DLStringLine(pRow, pCmd, ty - pCmd->y);
+				break;
+			}
+		} // for ty
+	} // for each command
+} /* DLDrawBand() */
+
+//
+// Draw the whole display list to the LCD
+// The display list is left intact, so the same frame can be drawn again or
+// more commands added before rendering the next one
+//
+void lcdDLRender(void)
+{
+	int y, iLines, iBand;
+
+	iBand = CACHE_SIZE / (iLCDWidth * 2); // number of lines which fit in one buffer
+	lcdSetPosition(0, 0, iLCDWidth, iLCDHeight);
+	for (y = 0; y < iLCDHeight; y += iBand) {
+		iLines = iBand;
+		if (y + iLines > iLCDHeight) iLines = iLCDHeight - y;
+		// pCache1 may still be going out over DMA; pCache0 is ours
+		DLDrawBand((uint16_t *)pCache0, y, iLines);
+		lcdWriteDATA(pCache0, iLines * iLCDWidth * 2); // starts DMA and swaps the buffers
+	} // for each band
+} /* lcdDLRender() */
 // end of spi_lcd.inl
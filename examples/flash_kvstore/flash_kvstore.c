@@ -0,0 +1,88 @@
+// Settings and counters in flash (extralibs/lib_flash.h, lib_kvstore.h)
+//
+// Counts boots and seconds of uptime in a key/value store in the last 2K of
+// flash, and keeps a "calibration" value that only gets written when it
+// changes.  Prints how long each kv_set() took, and erases the spare sector
+// a page at a time from the main loop with kv_idle().
+//
+// Every write wears the flash, so uptime is only saved every SAVE_EVERY
+// seconds (a power cut loses up to that much).  On a V003 a record takes a
+// 64 byte page, so a 1K sector holds 16, and 3 of those go to copying the
+// current keys over when the log moves on.  At 6 uptime saves and 1
+// calibration change an hour, each of the two sectors is erased about every
+// 4 hours, and ~10K erase cycles last about 4 years.  Saving every second
+// would erase them every 26 seconds and wear the flash out in 3 days.
+
+#include "ch32fun.h"
+#include <stdio.h>
+
+#define SAVE_EVERY 600  // seconds
+#define CAL_EVERY  3600 // seconds, a stand-in for a real recalibration
+
+#define KV_BASE 0x08003800 // Last 2K of a 16K V003, keep the firmware below it
+#include "lib_flash.h"
+#include "lib_kvstore.h"
+
+enum
+{
+	KEY_BOOTS,
+	KEY_UPTIME,
+	KEY_CAL,
+};
+
+typedef struct
+{
+	int16_t offset;
+	uint16_t gain;
+} calibration;
+
+int main()
+{
+	SystemInit();
+
+	int keys = kv_init();
+	printf( "kv_init: %d keys\n", keys );
+
+	uint32_t boots = 0;
+	uint32_t uptime = 0;
+	calibration cal = { 0, 1000 };
+	kv_get( KEY_BOOTS, &boots, sizeof( boots ) );
+	kv_get( KEY_UPTIME, &uptime, sizeof( uptime ) );
+	kv_get( KEY_CAL, &cal, sizeof( cal ) );
+
+	boots++;
+	kv_set( KEY_BOOTS, &boots, sizeof( boots ) );
+	printf( "Boot %lu, %lu seconds so far, calibration %d/%u\n", boots, uptime, cal.offset, cal.gain );
+
+	uint32_t next = SysTick->CNT;
+	while( 1 )
+	{
+		if( (int32_t)( SysTick->CNT - next ) < 0 )
+		{
+			// Nothing else to do, get the spare ready so kv_set() never erases.
+			kv_idle();
+			continue;
+		}
+		next += Ticks_from_Ms( 1000 );
+		uptime++;
+
+		// Rewriting the same value costs nothing.
+		kv_set( KEY_CAL, &cal, sizeof( cal ) );
+		if( uptime % CAL_EVERY == 0 )
+		{
+			cal.offset++;
+			kv_set( KEY_CAL, &cal, sizeof( cal ) );
+		}
+
+		if( uptime % SAVE_EVERY )
+		{
+			printf( "Uptime %lu s\n", uptime );
+			continue;
+		}
+
+		uint32_t t0 = SysTick->CNT;
+		int r = kv_set( KEY_UPTIME, &uptime, sizeof( uptime ) );
+		uint32_t t1 = SysTick->CNT;
+		printf( "Uptime %lu s saved, kv_set %s in %lu ticks\n", uptime, r ? "failed" : "took", t1 - t0 );
+	}
+}
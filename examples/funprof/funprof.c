@@ -0,0 +1,67 @@
+// Profiles a few functions and a zone with extralibs/lib_funprof.h
+// make flash, wait a moment, then make profile.
+
+#include "ch32fun.h"
+#include <stdio.h>
+
+#define FUNPROF_ENTRIES 64
+#include "lib_funprof.h"
+
+uint8_t data[64];
+
+uint32_t crc32( const uint8_t * d, int len )
+{
+	uint32_t crc = 0xffffffff;
+	while( len-- )
+	{
+		crc ^= *(d++);
+		for( int i = 0; i < 8; i++ )
+			crc = ( crc >> 1 ) ^ ( 0xedb88320 & -( crc & 1 ) );
+	}
+	return ~crc;
+}
+
+void fill( uint32_t seed )
+{
+	for( int i = 0; i < sizeof( data ); i++ )
+		data[i] = seed = seed * 1103515245 + 12345;
+}
+
+void sort( void )
+{
+	for( int i = 0; i < sizeof( data ); i++ )
+		for( int j = 0; j < sizeof( data ) - 1 - i; j++ )
+			if( data[j] > data[j+1] )
+			{
+				uint8_t t = data[j];
+				data[j] = data[j+1];
+				data[j+1] = t;
+			}
+}
+
+uint32_t work( uint32_t seed )
+{
+	fill( seed );
+	sort();
+	return crc32( data, sizeof( data ) );
+}
+
+int main()
+{
+	SystemInit();
+	FunProfInit();
+
+	funGpioInitAll();
+	funPinMode( PC1, GPIO_Speed_10MHz | GPIO_CNF_OUT_PP );
+
+	uint32_t seed = 0;
+	while( 1 )
+	{
+		seed = work( seed );
+
+		FUN_PROF_BEGIN( blink );
+		funDigitalWrite( PC1, seed & 1 );
+		Delay_Us( 50 );
+		FUN_PROF_END( blink );
+	}
+}
@@ -0,0 +1,67 @@
+// Board pin setup from one table (extralibs/lib_pintable.h)
+//
+// Sets up the pins with FUNPINS_INIT(), then blinks the LED while the button
+// on PC3 is not pressed.  Holding the button switches the LED and I2C pins to
+// the "parked" table (analog inputs) with FUNPINS_APPLY().
+// At startup, it prints how long the same setup takes with funPinMode().
+
+#include "ch32fun.h"
+#include "lib_pintable.h"
+#include <stdio.h>
+
+#define LED_PIN PD0
+#define BUTTON_PIN PC3
+
+#define BOARD_PINS( X ) \
+	X( PD0, GPIO_CFGLR_OUT_10Mhz_PP, 1 )    /* LED, off (active low) */ \
+	X( PD4, GPIO_CFGLR_OUT_10Mhz_PP, 0 )    /* Enable for some external part, held low */ \
+	X( PC1, GPIO_CFGLR_OUT_10Mhz_AF_OD, 1 ) /* SDA */ \
+	X( PC2, GPIO_CFGLR_OUT_10Mhz_AF_OD, 1 ) /* SCL */ \
+	X( PC3, GPIO_CFGLR_IN_PUPD, 1 )         /* Button to GND, pulled up */ \
+	X( PA1, GPIO_CFGLR_IN_ANALOG, 0 )       /* ADC */
+
+#define PARKED_PINS( X ) \
+	X( PD0, GPIO_CFGLR_IN_ANALOG, 0 ) \
+	X( PC1, GPIO_CFGLR_IN_ANALOG, 0 ) \
+	X( PC2, GPIO_CFGLR_IN_ANALOG, 0 )
+
+#define RESTORE_PINS( X ) \
+	X( PD0, GPIO_CFGLR_OUT_10Mhz_PP, 1 ) \
+	X( PC1, GPIO_CFGLR_OUT_10Mhz_AF_OD, 1 ) \
+	X( PC2, GPIO_CFGLR_OUT_10Mhz_AF_OD, 1 )
+
+#define PIN_MODE_AND_LEVEL( pin, mode, lvl ) \
+	funDigitalWrite( pin, lvl ); \
+	funPinMode( pin, mode );
+
+int main()
+{
+	SystemInit();
+
+	uint32_t t0 = SysTick->CNT;
+	FUNPINS_INIT( BOARD_PINS, 0 );
+	uint32_t t1 = SysTick->CNT;
+	funGpioInitAll();
+	BOARD_PINS( PIN_MODE_AND_LEVEL )
+	uint32_t t2 = SysTick->CNT;
+
+	printf( "Table: %lu ticks, funPinMode: %lu ticks\n", t1 - t0, t2 - t1 );
+
+	int parked = 0;
+	while( 1 )
+	{
+		int pressed = !funDigitalRead( BUTTON_PIN );
+		if( pressed != parked )
+		{
+			parked = pressed;
+			if( parked )
+				FUNPINS_APPLY( PARKED_PINS );
+			else
+				FUNPINS_APPLY( RESTORE_PINS );
+		}
+
+		if( !parked )
+			funDigitalWrite( LED_PIN, !funDigitalRead( LED_PIN ) );
+		Delay_Ms( 250 );
+	}
+}
@@ -0,0 +1,107 @@
+// Queued DMA I2C master (extralibs/lib_i2c_master.h)
+//
+// Scans the bus, then reads 6 bytes from an MPU6050 (0x68) every 100ms,
+// and keeps a counter in a 24C02 EEPROM (0x50), all from callbacks.
+// Main only prints and blinks the LED, it never waits on the bus.
+
+#include "ch32fun.h"
+#include "lib_i2c_master.h"
+#include <stdio.h>
+
+#define LED_PIN PD0
+
+static volatile uint8_t scan_found[16]; // Bitmap of ACKing addresses
+static volatile int scan_done;
+static i2cm_xfer probe;
+
+static uint8_t accel[6];
+static volatile int accel_ready;
+static i2cm_xfer imu_read = { .addr = 0x68, .hdr = { 0x3b }, .hdrlen = 1, .rbuf = accel, .rlen = 6 };
+static i2cm_xfer imu_wake = { .addr = 0x68, .hdr = { 0x6b, 0x00 }, .hdrlen = 2 };
+
+static uint8_t boots;
+static i2cm_xfer eeprom_read = { .addr = 0x50, .hdr = { 0x00 }, .hdrlen = 1, .rbuf = &boots, .rlen = 1 };
+static i2cm_xfer eeprom_write = { .addr = 0x50, .hdr = { 0x00 }, .hdrlen = 1, .wbuf = &boots, .wlen = 1 };
+
+static void probe_done( i2cm_xfer * x )
+{
+	if( x->status == I2CM_OK )
+		scan_found[x->addr >> 3] |= 1 << ( x->addr & 7 );
+
+	if( x->addr < 0x77 )
+	{
+		x->addr++;
+		i2cm_submit( x );
+	}
+	else
+	{
+		scan_done = 1;
+	}
+}
+
+static void imu_done( i2cm_xfer * x )
+{
+	if( x->status == I2CM_OK )
+		accel_ready = 1;
+}
+
+static void eeprom_done( i2cm_xfer * x )
+{
+	if( x->status != I2CM_OK )
+		return;
+	boots++;
+	i2cm_submit( &eeprom_write ); // Writes from the callback, goes out right after this read
+}
+
+int main()
+{
+	SystemInit();
+
+	funGpioInitAll();
+	funPinMode( LED_PIN, GPIO_CFGLR_OUT_10Mhz_PP );
+
+	i2cm_init();
+
+	probe.addr = 0x08;
+	probe.done = probe_done;
+	i2cm_submit( &probe );
+
+	imu_read.done = imu_done;
+	eeprom_read.done = eeprom_done;
+	i2cm_submit( &imu_wake );
+	i2cm_submit( &eeprom_read );
+
+	uint32_t last = funSysTick32();
+	int reported = 0;
+
+	while( 1 )
+	{
+		i2cm_poll();
+
+		if( scan_done && !reported )
+		{
+			reported = 1;
+			printf( "Found:" );
+			for( int a = 0x08; a < 0x78; a++ )
+				if( scan_found[a >> 3] & ( 1 << ( a & 7 ) ) )
+					printf( " %02x", a );
+			printf( "\nEEPROM: %d, boot count %d\n", eeprom_write.status, boots );
+		}
+
+		if( accel_ready )
+		{
+			accel_ready = 0;
+			printf( "ax %6d ay %6d az %6d\n",
+				(int16_t)( accel[0] << 8 | accel[1] ),
+				(int16_t)( accel[2] << 8 | accel[3] ),
+				(int16_t)( accel[4] << 8 | accel[5] ) );
+		}
+
+		if( TimeElapsed32( funSysTick32(), last ) >= (int32_t)Ticks_from_Ms( 100 ) )
+		{
+			last = funSysTick32();
+			if( i2cm_submit( &imu_read ) == 0 )
+				funDigitalWrite( LED_PIN, !funDigitalRead( LED_PIN ) );
+		}
+	}
+}
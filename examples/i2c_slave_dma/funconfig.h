@@ -0,0 +1,15 @@
+#ifndef _FUNCONFIG_H
+#define _FUNCONFIG_H
+
+// Place configuration items here, you can see a full list in ch32fun/ch32fun.h
+// To reconfigure to a different processor, update TARGET_MCU in the  Makefile
+
+// Build with 1 for the board that runs the benchmark against the slave.
+#ifndef BENCH_MASTER
+#define BENCH_MASTER 0
+#endif
+
+#define I2CS_STATS 1
+#define I2CM_CLKRATE 400000 // Fast-mode, the most the V003's I2C is rated for
+
+#endif
@@ -0,0 +1,107 @@
+// DMA register-map I2C slave (extralibs/lib_i2c_slave.h), with a benchmark.
+//
+// The slave (default build) keeps a 32-bit counter in registers 0-3 and a
+// copy of it in 4-7, and bumps both as fast as it can through the shadow
+// buffer.  Register 8 is writable, its bit 0 drives the LED.  Once a second
+// it prints how many transactions it served and how long its interrupts took.
+//
+// Built with BENCH_MASTER=1 (funconfig.h), a second board reads the 8 bytes
+// back to back at 400kHz, and counts how often the two copies didn't match
+// (a torn read, should stay 0) and the time per transaction.
+
+#include "ch32fun.h"
+#include <stdio.h>
+#include <string.h>
+
+#define LED_PIN PD0
+#define SLAVE_ADDR 0x09
+
+#if !BENCH_MASTER
+
+#include "lib_i2c_slave.h"
+
+static uint8_t regs[9], regs_shadow[9];
+static void on_write( uint8_t reg, uint8_t len );
+static i2cs_map map = { .regs = regs, .shadow = regs_shadow, .size = sizeof( regs ), .wsize = sizeof( regs ), .on_write = on_write };
+
+static void on_write( uint8_t reg, uint8_t len )
+{
+	if( reg <= 8 && reg + len > 8 )
+		funDigitalWrite( LED_PIN, regs[8] & 1 );
+}
+
+int main()
+{
+	SystemInit();
+
+	funGpioInitAll();
+	funPinMode( LED_PIN, GPIO_CFGLR_OUT_10Mhz_PP );
+
+	i2cs_init( SLAVE_ADDR, &map );
+
+	uint32_t count = 0;
+	uint32_t last = funSysTick32();
+
+	while( 1 )
+	{
+		count++;
+		uint8_t * r = i2cs_edit( &map );
+		for( int i = 0; i < 4; i++ )
+			r[i] = r[i + 4] = count >> ( 24 - i * 8 );
+		i2cs_publish( &map );
+
+		if( TimeElapsed32( funSysTick32(), last ) >= (int32_t)Ticks_from_Ms( 1000 ) )
+		{
+			last = funSysTick32();
+			__disable_irq();
+			struct i2cs_stats_s s = i2cs_stats;
+			memset( &i2cs_stats, 0, sizeof( i2cs_stats ) );
+			__enable_irq();
+
+			printf( "%lu transactions, %lu irqs, avg %lu max %lu ticks per irq\n",
+				s.transactions, s.irqs, s.irqs ? s.ticks / s.irqs : 0, s.max_ticks );
+		}
+	}
+}
+
+#else
+
+#include "lib_i2c_master.h"
+
+static uint8_t rx[8];
+static i2cm_xfer rd = { .addr = SLAVE_ADDR, .hdr = { 0 }, .hdrlen = 1, .rbuf = rx, .rlen = sizeof( rx ) };
+
+int main()
+{
+	SystemInit();
+
+	funGpioInitAll();
+	funPinMode( LED_PIN, GPIO_CFGLR_OUT_10Mhz_PP );
+
+	i2cm_init();
+
+	uint32_t done = 0, torn = 0, failed = 0;
+	uint32_t last = funSysTick32();
+
+	while( 1 )
+	{
+		i2cm_submit( &rd );
+		if( i2cm_wait( &rd ) != I2CM_OK )
+			failed++;
+		else if( memcmp( rx, rx + 4, 4 ) )
+			torn++;
+		done++;
+
+		uint32_t dt = TimeElapsed32( funSysTick32(), last );
+		if( dt >= (int32_t)Ticks_from_Ms( 1000 ) )
+		{
+			last = funSysTick32();
+			printf( "%lu reads, %lu us each, %lu torn, %lu failed\n",
+				done, dt / DELAY_US_TIME / done, torn, failed );
+			done = torn = failed = 0;
+			funDigitalWrite( LED_PIN, !funDigitalRead( LED_PIN ) );
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,85 @@
+// Runs a few independent periodic activities with lib_sched, instead of
+// one big hand-written state machine in main.  The core sleeps in wfi
+// whenever nothing is due.
+//
+// PC1 blinks, PC0 mirrors rising edges on PD3 (EXTI), and a status line is
+// printed every second.
+
+#include "ch32fun.h"
+#include <stdio.h>
+#include "lib_sched.h"
+
+volatile uint32_t edges;
+
+void EXTI7_0_IRQHandler( void ) __attribute__((interrupt));
+void EXTI7_0_IRQHandler( void )
+{
+	edges++;
+	EXTI->INTFR = EXTI_Line3;
+}
+
+sched_task blink;
+sched_task edge;
+sched_task status;
+
+int blink_task( sched_task * t )
+{
+	TASK_BEGIN( t );
+	while( 1 )
+	{
+		funDigitalWrite( PC1, FUN_HIGH );
+		TASK_EVERY( t, Ticks_from_Ms( 50 ) );
+		funDigitalWrite( PC1, FUN_LOW );
+		TASK_EVERY( t, Ticks_from_Ms( 450 ) );
+	}
+	TASK_END( t );
+}
+
+int edge_task( sched_task * t )
+{
+	static uint32_t seen;
+	TASK_BEGIN( t );
+	while( 1 )
+	{
+		// Woken by the EXTI interrupt, no polling loop in main.
+		TASK_WAIT_UNTIL( t, edges != seen );
+		seen = edges;
+		funDigitalWrite( PC0, FUN_HIGH );
+		TASK_SLEEP( t, Ticks_from_Ms( 20 ) );
+		funDigitalWrite( PC0, FUN_LOW );
+	}
+	TASK_END( t );
+}
+
+int status_task( sched_task * t )
+{
+	static uint32_t seconds;
+	TASK_BEGIN( t );
+	while( 1 )
+	{
+		printf( "%lu s, %lu edges\n", seconds++, edges );
+		TASK_EVERY( t, Ticks_from_Ms( 1000 ) );
+	}
+	TASK_END( t );
+}
+
+int main()
+{
+	SystemInit();
+	funGpioInitAll();
+
+	funPinMode( PC0, GPIO_CFGLR_OUT_10Mhz_PP );
+	funPinMode( PC1, GPIO_CFGLR_OUT_10Mhz_PP );
+	funPinMode( PD3, GPIO_CFGLR_IN_FLOAT );
+
+	AFIO->EXTICR = AFIO_EXTICR_EXTI3_PD;
+	EXTI->INTENR = EXTI_INTENR_MR3; // Enable EXT3
+	EXTI->RTENR = EXTI_RTENR_TR3;  // Rising edge trigger
+	NVIC_EnableIRQ( EXTI7_0_IRQn );
+
+	sched_init();
+	sched_add( &blink, blink_task, 0 );
+	sched_add( &edge, edge_task, 0 );
+	sched_add( &status, status_task, Ticks_from_Ms( 10 ) );
+	sched_run();
+}
@@ -0,0 +1,43 @@
+// Blinks PC1 with Delay_Ms(), but the delays are spent in Standby.
+// See extralibs/lib_tickless.h
+
+#include "ch32fun.h"
+#include <stdio.h>
+
+#define TICKLESS_OVERRIDE_DELAY_MS
+#include "lib_tickless.h"
+
+// Rough datasheet numbers for a V003 at 48MHz / in Standby with AWU.
+// Measure your own board and put its numbers here.
+#define RUN_UA   5000
+#define SLEEP_UA 10
+
+int main()
+{
+	SystemInit();
+
+	// This delay gives us some time to reprogram the device.
+	// Otherwise if the device enters standby mode we can't
+	// program it any more.
+	DelaySysTick( Ticks_from_Ms( 5000 ) );
+
+	funGpioInitAll();
+	funPinMode( PC1, GPIO_Speed_10MHz | GPIO_CNF_OUT_PP );
+
+	TicklessInit();
+
+	int count = 0;
+	while( 1 )
+	{
+		uint32_t start = funSysTick32();
+		funDigitalWrite( PC1, FUN_HIGH );
+		Delay_Ms( 20 );
+		funDigitalWrite( PC1, FUN_LOW );
+		Delay_Ms( 980 );
+
+		// Should stay close to 1000, since the time slept is added back to SysTick.
+		printf( "Loop took %lu ms\n", ( funSysTick32() - start ) / DELAY_MS_TIME );
+		if( ( ++count % 10 ) == 0 )
+			TicklessReport( RUN_UA, SLEEP_UA );
+	}
+}
@@ -3,11 +3,13 @@
 
 #include "ch32fun.h"
 #include <stdio.h>
+#include "lib_spsc.h"
 
-#define RX_BUF_LEN 16 // size of receive circular buffer
+#define RX_BUF_LEN 16 // size of receive circular buffer, must be a power of two
 
 u8 rx_buf[RX_BUF_LEN] = {0}; // DMA receive buffer for incoming data
 u8 cmd_buf[RX_BUF_LEN] = {0}; // buffer for complete command strings
+spsc_bytes rx_ring; // the DMA is the producer, main is the consumer
 
 void process_cmd(u8* buf)
 {
@@ -54,48 +56,29 @@ int main()
 	// EN: 1 (enable DMA)
 	DMA1_Channel5->CFGR = DMA_CFGR1_CIRC | DMA_CFGR1_MINC | DMA_CFGR1_EN;
 
+	spsc_init( &rx_ring, rx_buf, RX_BUF_LEN );
 
 	while(1)
 	{
-		static u32 tail = 0; // current read position in rx_buf
-		static u32 cmd_end = 0; // end index of current command in rx_buf
-		static u32 cmd_st = 0; // start index of current command in rx_buf
-
-		// calculate head position based on DMA counter (modulo when DMA1_Channel5->CNTR = 0)
-		u32 head = (RX_BUF_LEN - DMA1_Channel5->CNTR) % RX_BUF_LEN; // current write position in rx_buf
-		
-		// process new bytes in rx_buf. when a newline character is detected, the command is copied to cmd_buf
-		while (tail != head)
+		static u32 cmd_len = 0; // number of bytes in cmd_buf
+
+		// tell the ring where the DMA is writing now (CNTR counts down from RX_BUF_LEN)
+		spsc_produce_to( &rx_ring, RX_BUF_LEN - DMA1_Channel5->CNTR );
+
+		// process new bytes in rx_buf. when a newline character is detected, the command is processed
+		u8 c;
+		while ( spsc_get( &rx_ring, &c ) == 0 )
 		{
-			if ( rx_buf[tail] == '\n' ) 
+			cmd_buf[cmd_len++] = c;
+			if ( c == '\n' || cmd_len == RX_BUF_LEN - 1 )
 			{
-				cmd_end = tail;
-				u32 cmd_i = 0; // carret position in cmd_buf
-				if (cmd_end > cmd_st)
-				{
-					for (u32 rx_i = cmd_st; rx_i < cmd_end + 1; rx_i++, cmd_i++) {
-						cmd_buf[cmd_i] = rx_buf[rx_i];
-					}
-				} else if (cmd_st > cmd_end) { // handle wrap around
-					for (u32 rx_i = cmd_st; rx_i < RX_BUF_LEN; rx_i++, cmd_i++) {
-						cmd_buf[cmd_i] = rx_buf[rx_i];
-					}
-					for (u32 rx_i = 0; rx_i < cmd_end + 1; rx_i++, cmd_i++) {
-						cmd_buf[cmd_i] = rx_buf[rx_i];
-					}
-				}
-
 				// null terminate
-				cmd_buf[cmd_i] = '\0';
+				cmd_buf[cmd_len] = '\0';
 
 				process_cmd(cmd_buf);
 
-				// update start position for next command
-				cmd_st = (cmd_end + 1) % RX_BUF_LEN;
+				cmd_len = 0;
 			}
-
-			// move to next position 
-			tail = (tail+1) % RX_BUF_LEN;
 		}
 	}
 }
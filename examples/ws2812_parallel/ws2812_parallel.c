@@ -0,0 +1,64 @@
+// 8 strips of WS2812B's, on PC0..PC7, all updated at once.
+
+#include "ch32fun.h"
+#include <stdio.h>
+
+#define WS2812BPAR_IMPLEMENTATION
+#define WS2812BPAR_STRIPS 8
+#define WS2812BPAR_PORT GPIOC
+#define WS2812BPAR_FIRST_PIN 0
+#include "ws2812b_dma_parallel.h"
+
+// Per strip.  The 2K of a V003 also holds the 576 byte DMA buffer and the
+// 256 byte LUT, 8 x 48 LEDs would leave about 64 bytes for the stack.
+#ifdef CH32V003
+#define NR_LEDS 16
+#else
+#define NR_LEDS 48
+#endif
+
+uint8_t framebuffer[WS2812BPAR_STRIPS][NR_LEDS][3]; // G, R, B
+
+// 0..255 -> 0..255..0
+static uint8_t Triangle( uint8_t x )
+{
+	return ( x < 128 ) ? x * 2 : ( 255 - x ) * 2;
+}
+
+int main()
+{
+	int frame = 0;
+
+	SystemInit();
+	WS2812BParInit();
+	WS2812BParSetBrightness( 64 );
+
+	while(1)
+	{
+		int s, i;
+
+		// Each strip gets its own hue, and a wave running along it.
+		for( s = 0; s < WS2812BPAR_STRIPS; s++ )
+		{
+			for( i = 0; i < NR_LEDS; i++ )
+			{
+				uint8_t wave = Triangle( frame * 4 + i * 8 );
+				uint8_t hue = s * 32;
+				framebuffer[s][i][0] = ( Triangle( hue ) * wave ) >> 8;
+				framebuffer[s][i][1] = ( Triangle( hue + 85 ) * wave ) >> 8;
+				framebuffer[s][i][2] = ( Triangle( hue + 170 ) * wave ) >> 8;
+			}
+		}
+
+		uint32_t start = SysTick->CNT;
+		WS2812BParStart( &framebuffer[0][0][0], NR_LEDS );
+		while( WS2812BParInUse );
+		uint32_t took = SysTick->CNT - start;
+
+		if( ( frame & 63 ) == 0 )
+			printf( "%d LEDs on %d strips in %lu us\n", NR_LEDS * WS2812BPAR_STRIPS, WS2812BPAR_STRIPS, took / ( DELAY_US_TIME ) );
+
+		frame++;
+		Delay_Ms( 10 );
+	}
+}
@@ -1,43 +1,98 @@
 #include "ch32fun.h"
 #include <stdio.h>
+#define AES_HW 1 // This is the engine's test, build with AES_HW 0 for the software
+#include "lib_aes.h"
 
-#define AES_BASE ((uint32_t)0x4000c300)
-
-typedef struct {
-	volatile uint32_t CFG;
-	volatile uint32_t STA; // Completely (?) useless
-	volatile uint32_t some_reg1; // Don't know yet what are these 4 for
-	volatile uint32_t some_reg2;
-	volatile uint32_t some_reg3;
-	volatile uint32_t some_reg4;
-	volatile uint32_t data[4];
-	volatile uint32_t key[4];
-} AES_Type;
-
-#define AES ((AES_Type *) AES_BASE)
-
-void doAES(uint32_t * key, uint32_t * in, uint32_t * out, uint8_t enc) {
-	
-	AES->CFG = 0x100; // Don't know what it does, maybe enables the peripheral or clock for it
-	AES->CFG = enc?0:2; // Type of operation
-	AES->key[0] = key[0];
-	AES->key[1] = key[1];
-	AES->key[2] = key[2];
-	AES->key[3] = key[3];
-	AES->data[0] = in[0];
-	AES->data[1] = in[1];
-	AES->data[2] = in[2];
-	AES->data[3] = in[3];
-	// AES->STA &= 0xfffffffd;
-	// AES->STA |= 1;
-	AES->CFG |= 1; // Start process
-  
-  while(AES->CFG & 1); // Wait for it to finish
-  
-	out[0] = AES->data[0];
-	out[1] = AES->data[1];
-	out[2] = AES->data[2];
-	out[3] = AES->data[3];
+// Known answers, from FIPS-197, SP 800-38A and RFC 3610.
+static const uint8_t fips_key[16] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+static const uint8_t fips_pt[16] = { 0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff };
+static const uint8_t fips_ct[16] = { 0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a };
+
+static const uint8_t sp_key[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+static const uint8_t sp_pt[32] = {
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+	0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51 };
+static const uint8_t sp_cbc_iv[16] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f };
+static const uint8_t sp_cbc_ct[32] = {
+	0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46, 0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+	0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee, 0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2 };
+static const uint8_t sp_ctr_iv[16] = { 0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff };
+static const uint8_t sp_ctr_ct[32] = {
+	0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26, 0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+	0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff, 0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff };
+
+static const uint8_t ccm_key[16] = { 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf };
+static const uint8_t ccm_nonce[13] = { 0x00, 0x00, 0x00, 0x03, 0x02, 0x01, 0x00, 0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5 };
+static const uint8_t ccm_aad[8] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07 };
+static const uint8_t ccm_pt[23] = {
+	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+	0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e };
+static const uint8_t ccm_ct[23] = {
+	0x58, 0x8c, 0x97, 0x9a, 0x61, 0xc6, 0x63, 0xd2, 0xf0, 0x66, 0xd0, 0xc2, 0xc0, 0xf9, 0x89, 0x80,
+	0x6d, 0x5f, 0x6b, 0x61, 0xda, 0xc3, 0x84 };
+static const uint8_t ccm_tag[8] = { 0x17, 0xe8, 0xd1, 0x2c, 0xfd, 0xf9, 0x26, 0xe0 };
+
+static int failed;
+
+static void check( const char * name, const uint8_t * got, const uint8_t * want, int len )
+{
+	int ok = memcmp( got, want, len ) == 0;
+	printf( " %s %s\n", ok ? "ok  " : "FAIL", name );
+	if( !ok ) failed++;
+}
+
+static void known_answers()
+{
+	aes_ctx c;
+	uint8_t out[32], iv[16], tag[8];
+
+	aes_init( &c, fips_key );
+	aes_encrypt_block( &c, fips_pt, out );
+	check( "FIPS-197 encrypt", out, fips_ct, 16 );
+	aes_decrypt_block( &c, out, out );
+	check( "FIPS-197 decrypt", out, fips_pt, 16 );
+
+	// Two blocks on one key load.
+	aes_init( &c, sp_key );
+	memcpy( iv, sp_cbc_iv, 16 );
+	aes_cbc_encrypt( &c, iv, sp_pt, out, 32 );
+	check( "SP 800-38A CBC encrypt", out, sp_cbc_ct, 32 );
+	memcpy( iv, sp_cbc_iv, 16 );
+	aes_cbc_decrypt( &c, iv, out, out, 32 );
+	check( "SP 800-38A CBC decrypt", out, sp_pt, 32 );
+	memcpy( iv, sp_ctr_iv, 16 );
+	aes_ctr( &c, iv, sp_pt, out, 32 );
+	check( "SP 800-38A CTR", out, sp_ctr_ct, 32 );
+
+	aes_init( &c, ccm_key );
+	aes_ccm_encrypt( &c, ccm_nonce, 13, ccm_aad, 8, ccm_pt, out, 23, tag, 8 );
+	check( "RFC 3610 CCM encrypt", out, ccm_ct, 23 );
+	check( "RFC 3610 CCM tag", tag, ccm_tag, 8 );
+	if( aes_ccm_decrypt( &c, ccm_nonce, 13, ccm_aad, 8, out, out, 23, tag, 8 ) ) memset( out, 0, 23 );
+	check( "RFC 3610 CCM decrypt", out, ccm_pt, 23 );
+}
+
+// A radio packet's worth, the key once and then every block, as before.
+static void timing()
+{
+	aes_ctx c;
+	uint8_t buf[64] = { 0 }, ctr[16] = { 0 };
+	int i;
+
+	aes_init( &c, sp_key );
+	uint32_t start = funSysTick32();
+	aes_ctr( &c, ctr, buf, buf, sizeof( buf ) );
+	uint32_t once = funSysTick32() - start;
+
+	start = funSysTick32();
+	for( i = 0; i < sizeof( buf ); i += 16 )
+	{
+		aes_reload();
+		aes_encrypt_block( &c, ctr, buf + i );
+	}
+	uint32_t every = funSysTick32() - start;
+
+	printf( "\n%d byte CTR: %lu ticks, %lu with the key loaded for every block\n", (int)sizeof( buf ), once, every );
 }
 
 int main()
@@ -47,11 +102,14 @@ int main()
 	printf("ch32fun HW AES example\n");
 	printf("----------------------\n\n");
 
-	char key[16] = "ch32 is very fun";
-	char plain_text[16] = "ch5xx can do aes";
+	aes_ctx c;
+	uint8_t key[16] = "ch32 is very fun";
+	uint8_t plain_text[16] = "ch5xx can do aes";
 	uint8_t secret_message[16] = {0xD7,0xF6, 0x79, 0x38, 0x60, 0x2A, 0xCC, 0x2F, 0x50, 0xF7, 0x2A, 0x8B, 0x2B, 0x04, 0x31, 0x52};
 	uint8_t output_data[16];
 
+	aes_init( &c, key );
+
 	printf("128 bit key:\n ");
 	for (int i = 0; i < 16; i++) {
 		printf("%c", key[i]);
@@ -63,7 +121,7 @@ int main()
 	}
 	printf("\n\n");
 
-	doAES(key, plain_text, output_data, 1);
+	aes_encrypt_block( &c, plain_text, output_data );
 	printf("normal text:\n ");
 	for (int i = 0; i < 16; i++) {
 		printf("%c", plain_text[i]);
@@ -81,12 +139,17 @@ int main()
 	}
 	printf("\n\n");
 
-	doAES(key, secret_message, output_data, 0);
+	aes_decrypt_block( &c, secret_message, output_data );
 	printf("decrypted message:\n ");
 	for (int i = 0; i < 16; i++) {
 		printf("%c", output_data[i]);
 	}
-	printf("\n");
+	printf("\n\n");
+
+	printf("known answers (%s):\n", AES_HW ? "engine" : "software");
+	known_answers();
+	printf( failed ? " %d FAILED\n" : " all passed\n", failed );
+	timing();
 
 	while(1)
 	{
@@ -0,0 +1,59 @@
+/*
+ * Acknowledged packets between two or more iSLER nodes, with lib_isler_link.h.
+ * Build one board with NODE 1, the sink, which prints what it gets.  The
+ * others (NODE 2, 3, ...) send it a counter every second and print how the
+ * link is doing: acks, retries, lost frames, RSSI and channel.
+ */
+#include "ch32fun.h"
+#include "lib_isler_link.h"
+#include <stdio.h>
+
+#ifndef NODE
+#define NODE 2
+#endif
+
+#define SINK 1
+#define ACCESS_ADDRESS 0x5A1E4C3B // Any but the BLE advertising one
+
+struct reading
+{
+	uint32_t count;
+	uint32_t uptime_ms;
+};
+
+int main()
+{
+	SystemInit();
+
+	isl_init( ACCESS_ADDRESS, NODE, LL_TX_POWER_0_DBM );
+	printf( ".~ isler_link node %d ~.\n", NODE );
+
+	struct reading r = { 0 };
+	uint32_t next = funSysTick32();
+
+	while( 1 )
+	{
+		isl_poll();
+
+		isl_packet p;
+		while( isl_recv( &p ) == 0 )
+		{
+			struct reading * in = (struct reading *)p.data;
+			printf( "from %d: count %lu, %lu ms, RSSI %d\n", p.src, in->count, in->uptime_ms, p.rssi );
+		}
+
+		if( NODE != SINK && (int32_t)( funSysTick32() - next ) >= 0 )
+		{
+			next += Ticks_from_Ms( 1000 );
+			r.count++;
+			r.uptime_ms += 1000;
+			if( isl_send( SINK, &r, sizeof( r ) ) )
+				printf( "TX queue full\n" );
+
+			isl_peer s;
+			if( isl_peer_stats( SINK, &s ) == 0 )
+				printf( "sink: %lu sent, %lu acked, %lu retries, %lu lost, RSSI %d, channel %d\n",
+					s.sent, s.acked, s.retries, s.lost, s.rssi, isl_channels[s.chan] );
+		}
+	}
+}
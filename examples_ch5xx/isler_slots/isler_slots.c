@@ -0,0 +1,65 @@
+/*
+ * Sleeping iSLER sensors, with lib_isler_slots.h.  Build one board with
+ * NODE 1, the coordinator, which sends a beacon every second and prints what
+ * the sensors send.  The others (NODE 2, 3, ...) sleep between beacons, send
+ * a reading after each one, and print how well they keep up with the beacon.
+ */
+#include "ch32fun.h"
+#include "lib_isler_slots.h"
+#include <stdio.h>
+
+#ifndef NODE
+#define NODE 2
+#endif
+
+#define COORDINATOR 1
+#define ACCESS_ADDRESS 0x5A1E4C3B // Any but the BLE advertising one
+#define PERIOD_MS 1000
+
+struct reading
+{
+	uint32_t count;
+	int32_t error;
+};
+
+int main()
+{
+	SystemInit();
+
+	isl_init( ACCESS_ADDRESS, NODE, LL_TX_POWER_0_DBM );
+	printf( ".~ isler_slots node %d ~.\n", NODE );
+
+	isl_packet p;
+	if( NODE == COORDINATOR )
+	{
+		isl_slot_beacon_init( PERIOD_MS );
+		while( 1 )
+		{
+			isl_slot_beacon_poll();
+			isl_poll();
+			while( isl_recv( &p ) == 0 )
+			{
+				struct reading * in = (struct reading *)p.data;
+				printf( "from %d: count %lu, off by %ld ticks, RSSI %d\n", p.src, in->count, in->error, p.rssi );
+			}
+		}
+	}
+
+	struct reading r = { 0 };
+	isl_slot_init();
+	while( 1 )
+	{
+		if( isl_slot_wait() )
+		{
+			printf( "no beacon (%lu missed)\n", isl_slot_stats.missed );
+			continue;
+		}
+		r.count++;
+		r.error = isl_slot_stats.error;
+		isl_send( COORDINATOR, &r, sizeof( r ) );
+		isl_slot_stay( 5 );
+		while( isl_recv( &p ) == 0 )
+			printf( "from %d: %d bytes\n", p.src, p.len );
+		printf( "beacon %lu, period %lu ticks, off by %ld\n", isl_slot_stats.beacons, isl_slot_stats.period, isl_slot_stats.error );
+	}
+}
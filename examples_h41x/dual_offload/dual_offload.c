@@ -0,0 +1,86 @@
+/* The V3F hands blocks of samples to the V5F, which filters them from ITCM
+ * while the V3F keeps printing.  The V5F also sends a message back with the
+ * running total, through a mailbox.
+ *
+ * V3F uses UART1 and outputs on PA9
+ * V5F uses UART6 and outputs on PA12
+ */
+
+#include "ch32fun.h"
+#include <stdio.h>
+#include "lib_ipc.h"
+
+#define BLOCK 256
+#define TAPS 16
+
+struct block
+{
+	int16_t in[BLOCK];
+	int32_t out[BLOCK];
+};
+
+struct report
+{
+	uint32_t blocks;
+	int32_t last;
+};
+
+static struct block blocks[2];
+static struct report reports[4];
+static ipc_mbox to_v3f;
+
+static const int16_t taps[TAPS] = { 1, 2, 4, 7, 11, 15, 18, 20, 20, 18, 15, 11, 7, 4, 2, 1 };
+
+int __ITCM fir( void * arg )
+{
+	struct block * b = (struct block *)arg;
+	static uint32_t count;
+	int i, j;
+	for( i = TAPS - 1; i < BLOCK; i++ )
+	{
+		int32_t acc = 0;
+		for( j = 0; j < TAPS; j++ )
+			acc += b->in[i - j] * taps[j];
+		b->out[i] = acc;
+	}
+
+	struct report r = { ++count, b->out[BLOCK - 1] };
+	ipc_send( &to_v3f, &r );
+	return BLOCK - TAPS + 1;
+}
+
+int main_V5F()
+{
+	printf( "V5F worker up\r\n" );
+	ipc_worker();
+	return 0;
+}
+
+int main()
+{
+	SystemInit();
+
+	ipc_mbox_init( &to_v3f, reports, sizeof( reports[0] ), 4 );
+	StartV5F( main_V5F );
+
+	ipc_job jobs[2];
+	int n = 0, i;
+	while( 1 )
+	{
+		// Double buffered: fill one block while the V5F works on the other.
+		struct block * b = &blocks[n & 1];
+		for( i = 0; i < BLOCK; i++ )
+			b->in[i] = ( ( i + n ) & 31 ) * 100 - 1600;
+		ipc_offload( &jobs[n & 1], fir, b );
+
+		if( n > 0 )
+		{
+			int done = ipc_job_wait( &jobs[( n - 1 ) & 1] );
+			struct report r;
+			while( ipc_recv( &to_v3f, &r ) == 0 )
+				printf( "Block %lu: %d samples, last %ld\r\n", r.blocks, done, r.last );
+		}
+		n++;
+		Delay_Ms( 500 );
+	}
+}
@@ -7,53 +7,15 @@ UART_config_t uart;
 CDC_config_t cdc;
 volatile uint8_t uart_debug = 0;
 
-void uart_reset() {
-	// Reset UART state
-#if defined(CH570_CH572)
-	// Manually clearing FIFO, because CH570 doesn't have reset UART function
-	for(int i = 0; i <= UART(cdc.uart->number)->RFC; i++)
-	{
-		UART(cdc.uart->number)->THR;
-	}
-#endif
-#ifndef CH5xx
-	UART(cdc.uart->number)->CTLR1 &= ~CTLR1_UE_Set;
-	UART_TX_DMA->MADDR = (uintptr_t)uart_tx_buffer;
-	UART_RX_DMA->CFGR &= ~DMA_CFGR1_EN;
-	UART_RX_DMA->MADDR = (uintptr_t)uart_rx_buffer;
-	UART_RX_DMA->CFGR |= DMA_CFGR1_EN;
-#endif
-	memset(uart_tx_buffer, 0, UART_TX_BUF_SIZE);
-	memset(uart_rx_buffer, 0, UART_RX_BUF_SIZE);
-	cdc.rx_remain = 0;
-	cdc.rx_pos = 0;
-	cdc.rxing = 0;
-	cdc.tx_pos = 0;
-	cdc.tx_remain = 0;
-	cdc.txing = 0;
-	cdc.rx_dma_cnt = 0;
-	cdc.tx_stop = 1;
-	USBFS->UEP2_DMA = (uintptr_t)(uart_tx_buffer);
-
-	// UEP_CTRL_RX(2) &= ~USBFS_UEP_R_RES_MASK;
-  // UEP_CTRL_RX(2) |= USBFS_UEP_R_RES_ACK;
-}
-
+// Sets baudrate and frame format, without touching FIFOs, DMA or buffers.
 void uart_config(UART_config_t * uart) {
 	uint8_t i = uart->number;
 #ifdef CH5xx
-#if defined(CH570_CH572)
-	UART(i)->FCR = RB_FCR_FIFO_EN;
-#else
-	UART(i)->IER = RB_IER_RESET; // Reset UART
-	UART(i)->FCR = RB_FCR_TX_FIFO_CLR | RB_FCR_RX_FIFO_CLR | RB_FCR_FIFO_EN;
-#endif
 	UART(i)->LCR = uart->word_length | uart->parity | uart->stop_bits;
 	UART(i)->DIV = 1;
-	UART(i)->IER = RB_IER_TXD_EN;
 	UART(i)->DL = ((10 * FUNCONF_SYSTEM_CORE_CLOCK / 8 / uart->baud) + 5) / 10 ;
-	Delay_Ms(1);
 #else
+	UART(i)->CTLR1 &= ~CTLR1_UE_Set;
 	UART(i)->CTLR1 = uart->word_length | uart->parity | USART_Mode_Rx | USART_Mode_Tx;
 	UART(i)->CTLR2 = uart->stop_bits;
 	uint8_t pb1_div = (RCC->CFGR0 & RCC_PPRE1) >> 8;
@@ -76,12 +38,115 @@ void uart_config(UART_config_t * uart) {
 		UART(i)->BRR = UART_CALC_DIV(uart->baud * 16);
 		break;
 	}
-	
+
 	UART(i)->STATR = (uint16_t)(~USART_FLAG_TC);
 	UART(i)->CTLR1 |= CTLR1_UE_Set;
 #endif
 }
 
+static inline uint32_t uart_rx_head(CDC_config_t * ctx) {
+#ifdef CH5xx
+	return ctx->rx_head;
+#else
+	return (UART_RX_BUF_SIZE - UART_RX_DMA->CNTR) & (UART_RX_BUF_SIZE - 1);
+#endif
+}
+
+// Starts sending the oldest slot, if the UART is free. Called with the USB interrupt
+// masked, or from it.
+static void uart_tx_start(CDC_config_t * ctx) {
+	if (ctx->txing || ctx->tx_tail == ctx->tx_head) return;
+	// Anything received after a line coding change waits until it has been applied.
+	if (ctx->reconfig && ctx->tx_tail == ctx->reconfig_at) return;
+	ctx->txing = 1;
+#ifdef CH5xx
+	ctx->tx_pos = 0;
+	UART(ctx->uart->number)->IER |= RB_IER_THR_EMPTY;
+#else
+	uint32_t slot = ctx->tx_tail % UART_TX_SLOTS;
+	UART_TX_DMA->MADDR = (uintptr_t)uart_tx_buffer[slot];
+	UART_TX_DMA->CNTR = ctx->tx_len[slot];
+	UART_TX_DMA->CFGR |= DMA_CFGR1_EN;
+#endif
+}
+
+// A slot has been sent, hand it back to USB.
+static void uart_tx_done(CDC_config_t * ctx) {
+	NVIC_DisableIRQ(USB_IRQn);
+	ctx->tx_tail++;
+	ctx->txing = 0;
+	if (ctx->tx_nak) {
+		ctx->tx_nak = 0;
+		UEP_DMA(2) = (uintptr_t)uart_tx_buffer[ctx->tx_head % UART_TX_SLOTS];
+		USBFS_SendACK(2, 0);
+	}
+	uart_tx_start(ctx);
+	NVIC_EnableIRQ(USB_IRQn);
+}
+
+#ifdef CH5xx
+static void uart_rx_drain(CDC_config_t * ctx) {
+	uint32_t head = ctx->rx_head;
+	while (UART(ctx->uart->number)->RFC) {
+		uint8_t c = UART(ctx->uart->number)->THR;
+		uint32_t next = (head + 1) & (UART_RX_BUF_SIZE - 1);
+		// USB isn't keeping up, drop what doesn't fit rather than overwrite what is queued
+		if (next == ctx->rx_tail) {
+			ctx->rx_overruns++;
+			continue;
+		}
+		uart_rx_buffer[head] = c;
+		head = next;
+	}
+	ctx->rx_head = head;
+}
+
+void UART_RXTX_IRQHandler(void) __attribute__((interrupt));
+void UART_RXTX_IRQHandler(void) {
+	UART_TypeDef * u = UART(cdc.uart->number);
+	uint8_t iir;
+	while (!((iir = u->IIR) & RB_IIR_NO_INT)) {
+		switch (iir & RB_IIR_INT_MASK) {
+		case UART_II_RECV_TOUT:
+			// No new characters for a while, the FIFO timeout doubles as idle line detection
+			cdc.rx_idle = 1;
+			// fallthrough
+		case UART_II_RECV_RDY:
+			uart_rx_drain(&cdc);
+			break;
+		case UART_II_THR_EMPTY:
+			if (!cdc.txing) {
+				u->IER &= ~RB_IER_THR_EMPTY;
+				break;
+			}
+			uint32_t slot = cdc.tx_tail % UART_TX_SLOTS;
+			int space = UART_FIFO_SIZE - u->TFC;
+			while (space-- > 0 && cdc.tx_pos < cdc.tx_len[slot]) {
+				u->THR = uart_tx_buffer[slot][cdc.tx_pos++];
+			}
+			if (cdc.tx_pos == cdc.tx_len[slot]) {
+				u->IER &= ~RB_IER_THR_EMPTY;
+				uart_tx_done(&cdc);
+			}
+			break;
+		default:
+			// Line status, reading LSR clears it
+			if (u->LSR & RB_LSR_OVER_ERR) cdc.rx_overruns++;
+			break;
+		}
+	}
+}
+#else
+void UART_TX_DMA_IRQHandler(void) __attribute__((interrupt));
+void UART_TX_DMA_IRQHandler(void) {
+	if (DMA1->INTFR & UART_TX_DMA_TCIF) {
+		DMA1->INTFCR = UART_TX_DMA_TCIF;
+		UART_TX_DMA->CFGR &= ~DMA_CFGR1_EN;
+		uart_tx_done(&cdc);
+	}
+}
+#endif
+
 void cdc_init(CDC_config_t * ctx) {
 
 	uart.number = UART_NUMBER;
@@ -96,7 +161,6 @@ void cdc_init(CDC_config_t * ctx) {
 #endif
 
 	cdc.uart = &uart;
-	cdc.tx_wrap_pos = UART_TX_BUF_SIZE;
 
 	cdc.cdc_cfg[0] = (uint8_t)(UART_DEFALT_BAUD);
 	cdc.cdc_cfg[1] = (uint8_t)(UART_DEFALT_BAUD >> 8);
@@ -107,195 +171,177 @@ void cdc_init(CDC_config_t * ctx) {
 	cdc.cdc_cfg[6] = 8;
 	cdc.cdc_cfg[7] = UART_RX_TIMEOUT * 10;
 
-	uart_config(cdc.uart);
+#ifdef CH5xx
+	uint8_t i = ctx->uart->number;
+#if defined(CH570_CH572)
+	UART(i)->FCR = RB_FCR_FIFO_EN;
+	// Manually clearing FIFO, because CH570 doesn't have reset UART function
+	while (UART(i)->RFC) UART(i)->THR;
+#else
+	UART(i)->IER = RB_IER_RESET; // Reset UART
+	UART(i)->FCR = RB_FCR_TX_FIFO_CLR | RB_FCR_RX_FIFO_CLR | RB_FCR_FIFO_EN;
+#endif
+	uart_config(ctx->uart);
+	// Interrupt at 4 bytes, which leaves room for 4 more while the interrupt gets there
+	UART(i)->FCR = (2 << 6) | RB_FCR_FIFO_EN;
+	UART(i)->MCR |= RB_MCR_INT_OE;
+	UART(i)->IER = RB_IER_TXD_EN | RB_IER_RECV_RDY | RB_IER_LINE_STAT;
+	Delay_Ms(1);
+	NVIC_EnableIRQ(UART_RXTX_IRQn);
+#else
+	uart_config(ctx->uart);
 
-#ifndef CH5xx
-	
-	// UART Tx-DMA configuration
-	UART_TX_DMA->CFGR = DMA_DIR_PeripheralDST | DMA_MemoryInc_Enable | DMA_Priority_Medium;
+	// UART Tx-DMA configuration, one USB packet per transfer, chained from the TC interrupt
+	UART_TX_DMA->CFGR = DMA_DIR_PeripheralDST | DMA_MemoryInc_Enable | DMA_Priority_Medium | DMA_CFGR1_TCIE;
 	UART_TX_DMA->PADDR = (uint32_t)(&UART(ctx->uart->number)->DATAR);
-	UART_TX_DMA->MADDR = (uintptr_t)uart_tx_buffer;
+	NVIC_EnableIRQ(UART_TX_DMA_IRQn);
 
-	// UART Rx-DMA configuration
-	UART_RX_DMA->CFGR = DMA_Mode_Circular | DMA_MemoryInc_Enable | DMA_Priority_Medium;
+	// UART Rx-DMA configuration, circular, never stopped
+	UART_RX_DMA->CFGR = DMA_Mode_Circular | DMA_MemoryInc_Enable | DMA_Priority_High;
 	UART_RX_DMA->CNTR = UART_RX_BUF_SIZE;
 	UART_RX_DMA->PADDR = (uint32_t)(&UART(ctx->uart->number)->DATAR);
 	UART_RX_DMA->MADDR = (uintptr_t)uart_rx_buffer;
 	UART_RX_DMA->CFGR |= DMA_CFGR1_EN;
-	
+
 	UART(ctx->uart->number)->CTLR3 = USART_DMAReq_Tx | USART_DMAReq_Rx;
 #endif
-	USBFS->UEP2_DMA = (uintptr_t)uart_tx_buffer;
+	UEP_DMA(2) = (uintptr_t)uart_tx_buffer[0];
 }
 
-void uart_process_rx(CDC_config_t * ctx) {
-	
-	uint32_t packlen = 0;
-	int ret;
-	NVIC_DisableIRQ(USB_IRQn);
-#ifndef CH5xx
-	uint32_t transferred;
-	uint32_t current_rx_dma_cnt;
-	
-	current_rx_dma_cnt = UART_RX_DMA->CNTR;
-	if (ctx->rx_dma_cnt != current_rx_dma_cnt) {
-		if (uart_debug) printf("uart rx, current_rx_dma_cnt = %ld, rx_dma_cnt= %ld\n", current_rx_dma_cnt, ctx->rx_dma_cnt);
-		if (ctx->rx_dma_cnt > current_rx_dma_cnt) {
-			transferred = ctx->rx_dma_cnt - current_rx_dma_cnt;
-		} else {
-			transferred = UART_RX_BUF_SIZE - current_rx_dma_cnt;
-			transferred += ctx->rx_dma_cnt;
-		}
-		ctx->rx_dma_cnt = current_rx_dma_cnt;
-
-		if ((ctx->rx_remain += transferred) > UART_RX_BUF_SIZE) {
-			printf("[RX buffer overflow]: %ld\n", ctx->rx_remain);
-			ctx->rx_remain = UART_RX_BUF_SIZE;
-		}
-		// else ctx->rx_remain += transferred;
-
-		ctx->rx_timeout = 0;
+// USB interrupt, EP2 OUT packet has been written to the slot at tx_head.
+void cdc_out_packet(CDC_config_t * ctx, int len) {
+	if (len) {
+		ctx->tx_len[ctx->tx_head % UART_TX_SLOTS] = len;
+		ctx->tx_head++;
 	}
-#else
-	if (UART(ctx->uart->number)->RFC) {
-		if (uart_debug) printf("\nuart rxing = %d, rx_remain = %ld, RFC = %d\n", ctx->rxing, ctx->rx_remain, UART(ctx->uart->number)->RFC);
-		
-		int i;
-		uint32_t pos = ctx->rx_pos+ctx->rx_remain;
-		
-		for (i = 0; i <= UART(ctx->uart->number)->RFC; i++) {
-			if ((pos + i) >= UART_RX_BUF_SIZE) pos -= UART_RX_BUF_SIZE;
-			uart_rx_buffer[pos+i] = UART(ctx->uart->number)->THR;
-		}
-		
-		if ((ctx->rx_remain += i) > UART_RX_BUF_SIZE) {
-			printf("[RX buffer overflow]: %ld\n", ctx->rx_remain);
-			ctx->rx_remain = UART_RX_BUF_SIZE;
-		}
-		ctx->rx_timeout = 0;
+	if (ctx->tx_head - ctx->tx_tail >= UART_TX_SLOTS) {
+		// Out of slots, the host retries until one is sent
+		USBFS_SendNAK(2, 0);
+		ctx->tx_nak = 1;
+	} else {
+		UEP_DMA(2) = (uintptr_t)uart_tx_buffer[ctx->tx_head % UART_TX_SLOTS];
 	}
+#ifdef CH5xx
+	NVIC_DisableIRQ(UART_RXTX_IRQn);
+	uart_tx_start(ctx);
+	NVIC_EnableIRQ(UART_RXTX_IRQn);
+#else
+	NVIC_DisableIRQ(UART_TX_DMA_IRQn);
+	uart_tx_start(ctx);
+	NVIC_EnableIRQ(UART_TX_DMA_IRQn);
 #endif
-	NVIC_EnableIRQ(USB_IRQn);
-	if (ctx->rx_remain) {
-		if (ctx->rxing == 0) {
-
-			if( ctx->rx_remain >= USBFS_PACKET_SIZE ) packlen = USBFS_PACKET_SIZE;
-			else if (ctx->rx_timeout >= UART_RX_TIMEOUT) packlen = ctx->rx_remain;
-			
-			if (packlen > (UART_RX_BUF_SIZE - ctx->rx_pos)) packlen = (UART_RX_BUF_SIZE - ctx->rx_pos);
+}
 
-			if (packlen) {
-				NVIC_DisableIRQ(USB_IRQn);
-				ctx->usb_timeout = 0;
-				ret = USBFS_SendEndpointNEW(3, (uint8_t*)(uart_rx_buffer + ctx->rx_pos), packlen, 1);
-				if (ret == 0) {
-					ctx->rxing = packlen;
-					ctx->rx_remain -= packlen;
-					ctx->rx_pos += packlen;
-					if (ctx->rx_pos >= UART_RX_BUF_SIZE) ctx->rx_pos = 0;
-					// Indicate we are done sending for now, so host can pass data further
-					// https://electronics.stackexchange.com/questions/253669/usb-cdc-help-with-zero-packets
-					if (packlen == USBFS_PACKET_SIZE) ctx->zero_packet_pending = 1;
-				}
-				NVIC_EnableIRQ(USB_IRQn);
-			}
-		} else {
-			// Manually clear rxing flag if haven't receive IN request
-			if (ctx->usb_timeout >= UART_USB_TIMEOUT) {
-				ctx->rxing = 0;
-				USBFSCTX.USBFS_Endp_Busy[3] = 0;
-			}
-		}
-	}
-	if (ctx->zero_packet_pending && ctx->rxing == 0 && ctx->usb_timeout >= UART_ZERO_TIMEOUT) {
-		NVIC_DisableIRQ( USB_IRQn );
-		ctx->usb_timeout = 0;
-		ctx->rxing = 1;
-		USBFS_SendACK(3, 1);
-		ctx->zero_packet_pending = 0;
-		NVIC_EnableIRQ( USB_IRQn );
+// Copies the next IN packet to buf. Returns its length, -1 for a ZLP, 0 for nothing to send.
+// Only sends full packets while data keeps coming in, and what is left once the line goes idle.
+static int cdc_in_prepare(CDC_config_t * ctx, uint8_t * buf) {
+	uint32_t tail = ctx->rx_tail;
+	uint32_t avail = (uart_rx_head(ctx) - tail) & (UART_RX_BUF_SIZE - 1);
+	if (avail >= USBFS_PACKET_SIZE || (avail && ctx->rx_idle)) {
+		uint32_t len = (avail > USBFS_PACKET_SIZE) ? USBFS_PACKET_SIZE : avail;
+		uint32_t first = UART_RX_BUF_SIZE - tail;
+		if (first > len) first = len;
+		memcpy(buf, uart_rx_buffer + tail, first);
+		memcpy(buf + first, uart_rx_buffer, len - first);
+		return len;
 	}
+	// Indicate we are done sending for now, so host can pass data further
+	// https://electronics.stackexchange.com/questions/253669/usb-cdc-help-with-zero-packets
+	if (ctx->rx_last_full && ctx->rx_idle) return -1;
+	return 0;
 }
 
-void uart_process_tx(CDC_config_t * ctx) {
-#ifndef CH5xx
-	if (ctx->txing) {
-		// Check for UART Transmission Completed flag
-		if (USART2->STATR & USART_FLAG_TC) {
-			if (uart_debug) printf("TC\n");
-			UART(ctx->uart->number)->STATR = ~(USART_FLAG_TC); // Clear TX end flag
-			UART_TX_DMA->CFGR &= (uint16_t)(~DMA_CFGR1_EN); // Disable TX DMA
-			
-			if (UART_TX_DMA->CNTR) {
-				printf("[TX fault] DMA->CNTR = %ld, pos = %d, remain = %ld", UART_TX_DMA->CNTR, ctx->tx_pos, ctx->tx_remain);
-			}
-
-			NVIC_DisableIRQ(USB_IRQn);
-			ctx->tx_remain -= ctx->txing;
-			ctx->tx_pos += ctx->txing;
-			if( ctx->tx_pos & 0x3 ) ctx->tx_pos = (ctx->tx_pos + 4) & ~0x3;
-			ctx->txing = 0;
-			if ((ctx->tx_stop) && (!ctx->tx_remain)) {
-				USBFS_SendACK(2, 0);
-				ctx->tx_stop = 0;
-			}
-			
-			NVIC_EnableIRQ(USB_IRQn);
-		}
-		
-	}
-	if (ctx->txing == 0 && ctx->tx_remain) {
-			NVIC_DisableIRQ(USB_IRQn);
+static void cdc_in_commit(CDC_config_t * ctx, int len) {
+	if (len < 0) len = 0;
+	ctx->rx_tail = (ctx->rx_tail + len) & (UART_RX_BUF_SIZE - 1);
+	ctx->rx_last_full = (len == USBFS_PACKET_SIZE);
+	if (ctx->rx_tail == uart_rx_head(ctx)) ctx->rx_idle = 0;
+	ctx->rxing = 1;
+}
 
-			if (ctx->tx_wrap_pos <= ctx->tx_pos) {
-				ctx->tx_pos = 0;
-				ctx->tx_wrap_pos = UART_TX_BUF_SIZE;
-			}
+// USB interrupt, the previous EP3 packet was picked up. Returns what HandleInRequest should.
+int cdc_in_next(CDC_config_t * ctx, uint8_t * buf) {
+	int len = cdc_in_prepare(ctx, buf);
+	if (len) cdc_in_commit(ctx, len);
+	else ctx->rxing = 0;
+	return len;
+}
 
-			UART_TX_DMA->MADDR = (uint32_t)(uart_tx_buffer + ctx->tx_pos); // Set address for DMA to read from
-			uint32_t to_send = (ctx->tx_pos + ctx->tx_remain < ctx->tx_wrap_pos)?ctx->tx_remain:(ctx->tx_wrap_pos - ctx->tx_pos);
-			
-			if (to_send == 0) return;
-			UART_TX_DMA->CNTR = to_send;
-			if (uart_debug) printf("tx-pos = %d, to_send = %ld, txing = %ld\n", ctx->tx_pos, to_send, ctx->txing);
-			if (uart_debug) printf("transmission started: tx_pos = %d, tx_remain = %ld, to_send = %ld UART_TX_DMA->MADDR = %08lx\n", ctx->tx_pos, ctx->tx_remain, to_send, UART_TX_DMA->MADDR);
-			
-			UART_TX_DMA->CFGR |= (uint16_t)(DMA_CFGR1_EN);  // Enable TX DMA
-			// UART(ctx->uart->number)->CTLR3 |= USART_DMAReq_Tx;  // Enable UART DMA transmission
-			ctx->txing = to_send;
-			
-			NVIC_EnableIRQ(USB_IRQn);
-	}
-#else
-	
-	int local_pos = ctx->tx_pos;
-	// ctx->txing = 1;
-	while (ctx->tx_remain && UART(ctx->uart->number)->TFC != UART_FIFO_SIZE) {
-		UART(ctx->uart->number)->THR = uart_tx_buffer[local_pos++];
-		if (ctx->tx_wrap_pos <= local_pos) {
-			local_pos = 0;
-			ctx->tx_wrap_pos = UART_TX_BUF_SIZE;
+void uart_process_rx(CDC_config_t * ctx) {
+	uint32_t head = uart_rx_head(ctx);
+	uint32_t moved = (head - ctx->rx_seen_head) & (UART_RX_BUF_SIZE - 1);
+	if (moved) {
+		if (uart_debug) printf("uart rx, head = %ld, tail = %ld\n", head, ctx->rx_tail);
+#ifndef CH5xx
+		// The circular DMA never stops, so it runs over rx_tail when USB falls a whole
+		// buffer behind. Whatever was queued is mixed with newer data then, drop all of it.
+		// Only seen if this is called at least once per buffer's worth of bytes.
+		NVIC_DisableIRQ(USB_IRQn);
+		uint32_t queued = (ctx->rx_seen_head - ctx->rx_tail) & (UART_RX_BUF_SIZE - 1);
+		if (queued + moved >= UART_RX_BUF_SIZE) {
+			ctx->rx_tail = head;
+			ctx->rx_overruns++;
 		}
-		ctx->tx_remain--;
+		NVIC_EnableIRQ(USB_IRQn);
+#endif
+		ctx->rx_seen_head = head;
+		ctx->rx_timeout = 0;
 	}
+#ifndef CH5xx
+	// IDLE and ORE clear on a read of STATR followed by one of DATAR. DATAR belongs to the
+	// DMA, reading it here could take a byte that just arrived, so the DMA's next read
+	// clears them instead. IDLE then stays set while the line is quiet, and only counts
+	// if no bytes came in since the last call.
+	uint16_t statr = UART(ctx->uart->number)->STATR;
+	if ((statr & USART_FLAG_IDLE) && !moved) ctx->rx_idle = 1;
+	if (statr & USART_FLAG_ORE) ctx->rx_overruns++;
+#endif
+	if (ctx->rx_timeout >= UART_RX_TIMEOUT) ctx->rx_idle = 1;
 
-	if (ctx->tx_stop && !ctx->tx_remain && UART(ctx->uart->number)->TFC == 0) {
-		NVIC_DisableIRQ(USB_IRQn);
-		if( ctx->tx_pos & 0x3 ) ctx->tx_pos = (ctx->tx_pos + 4) & ~0x3;
-		ctx->txing = 0;
-		USBFS_SendACK(2, 0);
-		ctx->tx_stop = 0;
-		NVIC_EnableIRQ(USB_IRQn);
-	} else {
-		ctx->tx_pos = local_pos;
+	// Once the IN pipeline stalls (nothing was ready at the last IN), restart it from here.
+	if (ctx->rxing) return;
+	NVIC_DisableIRQ(USB_IRQn);
+	if (!ctx->rxing) {
+		uint8_t * buf = USBFSCTX.ENDPOINTS[3];
+		int len = cdc_in_prepare(ctx, buf);
+		if (len && USBFS_SendEndpointNEW(3, buf, (len < 0) ? 0 : len, 0) == 0)
+			cdc_in_commit(ctx, len);
 	}
-	// ctx->txing = 0;
-	
+	NVIC_EnableIRQ(USB_IRQn);
+}
+
+// Line coding is applied here, once everything queued before the change has left the UART.
+void uart_process_tx(CDC_config_t * ctx) {
+	if (!ctx->reconfig || ctx->txing || ctx->tx_tail != ctx->reconfig_at) return;
+#ifdef CH5xx
+	if (!(UART(ctx->uart->number)->LSR & RB_LSR_TX_ALL_EMP)) return;
+	NVIC_DisableIRQ(UART_RXTX_IRQn);
+	uart_rx_drain(ctx);
+#else
+	if (!(UART(ctx->uart->number)->STATR & USART_FLAG_TC)) return;
 #endif
+	*ctx->uart = ctx->pending;
+	uart_config(ctx->uart);
+	if (uart_debug) printf("uart reconfigured, %ld baud\n", ctx->uart->baud);
+#ifdef CH5xx
+	NVIC_EnableIRQ(UART_RXTX_IRQn);
+#endif
+	NVIC_DisableIRQ(USB_IRQn);
+	ctx->reconfig = 0;
+#ifdef CH5xx
+	NVIC_DisableIRQ(UART_RXTX_IRQn);
+	uart_tx_start(ctx);
+	NVIC_EnableIRQ(UART_RXTX_IRQn);
+#else
+	NVIC_DisableIRQ(UART_TX_DMA_IRQn);
+	uart_tx_start(ctx);
+	NVIC_EnableIRQ(UART_TX_DMA_IRQn);
+#endif
+	NVIC_EnableIRQ(USB_IRQn);
 }
 
 void uart_send_break(uint8_t n) {
 #ifndef CH5xx
 	UART(n)->CTLR1 |= CTLR1_SBK_Set;
 #endif
-}
\ No newline at end of file
+}
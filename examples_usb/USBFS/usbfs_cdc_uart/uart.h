@@ -46,6 +46,9 @@ typedef struct {
 
 #define UART_TX_DMA         DMA1_CH(7)
 #define UART_RX_DMA         DMA1_CH(6)
+#define UART_TX_DMA_IRQn    DMA1_Channel7_IRQn
+#define UART_TX_DMA_TCIF    DMA_TCIF7
+#define UART_TX_DMA_IRQHandler DMA1_Channel7_IRQHandler
 
 /*** Macro Functions by ADBeta*********************************************************/
 // DIV  = round( (HCLK / (16 * BAUD)) * 16 )
@@ -59,11 +62,9 @@ typedef struct {
 
 #endif
 
-#define UART_TX_BUF_SIZE    1024
-#define UART_RX_BUF_SIZE    2048
-#define UART_USB_TIMEOUT    600
-#define UART_ZERO_TIMEOUT   60
-#define UART_RX_TIMEOUT     3
+#define UART_TX_BUF_SIZE    1024 // Power of 2, at least 2 USB packets
+#define UART_RX_BUF_SIZE    2048 // Power of 2
+#define UART_RX_TIMEOUT     3    // ms, send a short packet even if the line never went idle
 
 #ifndef UART_NUMBER
 #if defined(CH5xx)
@@ -73,12 +74,21 @@ typedef struct {
 #endif
 #endif
 
+#ifdef CH5xx
+#define UART_CAT_(a, b, c)  a##b##c
+#define UART_CAT(a, b, c)   UART_CAT_(a, b, c)
+#define UART_RXTX_IRQn      UART_CAT(UART, UART_NUMBER, _IRQn)
+#define UART_RXTX_IRQHandler UART_CAT(UART, UART_NUMBER, _IRQHandler)
+#endif
+
 #define UART_DEFALT_BAUD    115200
 #define UART_DEFAULT_WORDL  USART_WordLength_8b
 #define UART_DEFAULT_STOPB  USART_StopBits_1
 #define UART_DEFAULT_PARITY USART_Parity_No
 
-__attribute__ ((aligned(4))) uint8_t uart_tx_buffer[UART_TX_BUF_SIZE];
+// USB OUT packets land straight in these slots, one packet per slot, and the UART sends from them.
+#define UART_TX_SLOTS       (UART_TX_BUF_SIZE / USBFS_PACKET_SIZE)
+__attribute__ ((aligned(4))) uint8_t uart_tx_buffer[UART_TX_SLOTS][USBFS_PACKET_SIZE];
 __attribute__ ((aligned(4))) uint8_t uart_rx_buffer[UART_RX_BUF_SIZE];
 
 typedef struct {
@@ -93,24 +103,31 @@ typedef struct {
 typedef struct {
 	UART_config_t* uart;
 	uint8_t cdc_cfg[8];
-	uint32_t usb_timeout;
-
-	volatile uint8_t rxing;
-	uint32_t rx_pos; // Current position in Rx buffer
-	volatile uint32_t rx_remain; // Number of bytes left to send from Rx buffer to USB
-	uint32_t rx_dma_cnt; // Last value of CNTR of RX buffer DMA
-	uint8_t zero_packet_pending;
-	uint32_t rx_timeout;
-	
-	uint32_t txing; // Number of bytes currently in transmission ot UART
-	int tx_pos; // Outgoing position in a TX bufer
-	volatile uint32_t tx_remain; // Number of unsent bytes
-	uint32_t tx_wrap_pos; // Position in the buffer to wrap to 0
-	uint8_t tx_stop; // Stop incomming data and let UART sent the buffer
-
-	uint8_t error;
-	
+
+	// UART -> USB. rx_head is written by the DMA (or the UART interrupt on CH5xx), rx_tail by the USB side.
+	volatile uint32_t rx_head;
+	volatile uint32_t rx_tail;
+	volatile uint8_t rxing; // EP3 has a packet armed
+	volatile uint8_t rx_idle; // Line went idle, short packets are fine now
+	uint8_t rx_last_full; // Last packet was 64 bytes, end the transfer with a ZLP
+	volatile uint32_t rx_timeout;
+	uint32_t rx_seen_head;
+
+	// USB -> UART. tx_head is written by the USB interrupt, tx_tail when a slot has been sent.
+	uint8_t tx_len[UART_TX_SLOTS];
+	volatile uint32_t tx_head;
+	volatile uint32_t tx_tail;
+	volatile uint8_t txing;
+	uint8_t tx_pos; // Position in the slot being sent, CH5xx only
+	volatile uint8_t tx_nak; // EP2 is NAK'd, all slots are full
+
+	// Line coding waits until everything queued before it was sent.
+	UART_config_t pending;
+	volatile uint8_t reconfig;
+	uint32_t reconfig_at;
+
+	uint32_t rx_overruns;
 } CDC_config_t;
 
 #include "uart.c"
-#endif
\ No newline at end of file
+#endif
@@ -47,8 +47,8 @@ int HandleInRequest( struct _USBState * ctx, int endp, uint8_t * data, int len )
 			// ret = -1; // Just ACK
 			break;
 		case 3:
-			cdc.rxing = 0;
-			// ret = -1; // ACK, without it RX was stuck in some cases, leaving for now as a reminder
+			// Chain the next packet right away, if there is one
+			ret = cdc_in_next( &cdc, data );
 			break;
 	}
 	return ret;
@@ -64,38 +64,37 @@ void HandleDataOut( struct _USBState * ctx, int endp, uint8_t * data, int len )
 		{
 			if( usb_debug ) printf( "CDC_SET_LINE_CODING\n" );
 
-			// Need to save incoming config, we will send it back later when asked
-			cdc.cdc_cfg[0] = CTRL0BUFF[0];
-			cdc.cdc_cfg[1] = CTRL0BUFF[1];
-			cdc.cdc_cfg[2] = CTRL0BUFF[2];
-			cdc.cdc_cfg[3] = CTRL0BUFF[3];
-			cdc.cdc_cfg[4] = CTRL0BUFF[4];
-			cdc.cdc_cfg[5] = CTRL0BUFF[5];
-			cdc.cdc_cfg[6] = CTRL0BUFF[6];
+			// Takes effect once everything received so far has been sent at the old settings.
+			// Built aside, so a rejected coding leaves a change that is still waiting alone.
+			UART_config_t next = *cdc.uart;
+			UART_config_t * pending = &next;
+			int valid = 1;
+
 			// First 4 bytes of config make a baudrate
 			uint32_t baud = CTRL0BUFF[0];
 			baud += ((uint32_t)CTRL0BUFF[1] << 8);
 			baud += ((uint32_t)CTRL0BUFF[2] << 16);
 			baud += ((uint32_t)CTRL0BUFF[3] << 24);
-			cdc.uart->baud = baud;
+			pending->baud = baud;
 
 			// Then one byte for stop bits (0 - 1 stop bit, 1 - 1.5 stop bit, 2 - 2 stop bits)
 			// CH5xx are missing 1.5 stop bit option
 			switch( CTRL0BUFF[4] )
 			{
 				case 0:
-					cdc.uart->stop_bits = USART_StopBits_1;
+					pending->stop_bits = USART_StopBits_1;
 					break;
 #if !defined(CH5xx)
 				case 1:
-					cdc.uart->stop_bits = USART_StopBits_1_5;
+					pending->stop_bits = USART_StopBits_1_5;
 					break;
 #endif
 				case 2:
-					cdc.uart->stop_bits = USART_StopBits_2;
+					pending->stop_bits = USART_StopBits_2;
 					break;
 				default:
 					USBFS_SendNAK( 0, 0 );
+					valid = 0;
 					break;
 			}
 
@@ -104,24 +103,25 @@ void HandleDataOut( struct _USBState * ctx, int endp, uint8_t * data, int len )
 			switch( CTRL0BUFF[5] )
 			{
 				case 0:
-					cdc.uart->parity = USART_Parity_No;
+					pending->parity = USART_Parity_No;
 					break;
 				case 1:
-					cdc.uart->parity = USART_Parity_Odd;
+					pending->parity = USART_Parity_Odd;
 					break;
 				case 2:
-					cdc.uart->parity = USART_Parity_Even;
+					pending->parity = USART_Parity_Even;
 					break;
 #if defined(CH5xx)
 				case 3:
-					cdc.uart->parity = USART_Parity_Mark;
+					pending->parity = USART_Parity_Mark;
 					break;
 				case 4:
-					cdc.uart->parity = USART_Parity_Space;
+					pending->parity = USART_Parity_Space;
 					break;
 #endif
 				default:
 					USBFS_SendNAK( 0, 0 );
+					valid = 0;
 					break;
 			}
 
@@ -131,65 +131,44 @@ void HandleDataOut( struct _USBState * ctx, int endp, uint8_t * data, int len )
 			{
 #if defined(CH5xx) || defined(CH32H41x)
 				case 5:
-					cdc.uart->word_length = USART_WordLength_5b;
+					pending->word_length = USART_WordLength_5b;
 					break;
 				case 6:
-					cdc.uart->word_length = USART_WordLength_6b;
+					pending->word_length = USART_WordLength_6b;
 					break;
 				case 7:
-					cdc.uart->word_length = USART_WordLength_7b;
+					pending->word_length = USART_WordLength_7b;
 					break;
 #endif
 				case 8:
-					cdc.uart->word_length = USART_WordLength_8b;
+					pending->word_length = USART_WordLength_8b;
 					break;
 				default:
 					USBFS_SendNAK( 0, 0 );
+					valid = 0;
 					break;
 			}
 
-#ifdef CH5xx
-			uart_reset();
-#endif
-			uart_config( cdc.uart );
+			if( valid )
+			{
+				// Need to save incoming config, we will send it back later when asked
+				cdc.cdc_cfg[0] = CTRL0BUFF[0];
+				cdc.cdc_cfg[1] = CTRL0BUFF[1];
+				cdc.cdc_cfg[2] = CTRL0BUFF[2];
+				cdc.cdc_cfg[3] = CTRL0BUFF[3];
+				cdc.cdc_cfg[4] = CTRL0BUFF[4];
+				cdc.cdc_cfg[5] = CTRL0BUFF[5];
+				cdc.cdc_cfg[6] = CTRL0BUFF[6];
+				cdc.pending = next;
+				cdc.reconfig_at = cdc.tx_head;
+				cdc.reconfig = 1;
+			}
 		}
 	}
 
 	if( endp == 2 )
 	{
-		if( cdc.tx_stop )
-		{
-			cdc.tx_stop = 0;
-			return;
-		}
-		
-		int pad = 4 - USBFS->RX_LEN;
-		if( pad < 0 ) pad = 0;
-		uint32_t write_pos = cdc.tx_pos + cdc.tx_remain + USBFS->RX_LEN;
-		if( write_pos > cdc.tx_wrap_pos ) write_pos -= cdc.tx_wrap_pos;
-		
-		if( write_pos & 0x3 )
-		{
-			write_pos = (write_pos + 4) & ~0x3;
-			USBFS_SendNAK( 2, 0 );
-			cdc.tx_stop = 1;
-		}
-
-		if( write_pos > ( UART_TX_BUF_SIZE - 64) )
-		{
-			cdc.tx_wrap_pos = cdc.tx_pos + cdc.tx_remain + USBFS->RX_LEN;
-			write_pos = 0;
-		}
-		
-		USBFS->UEP2_DMA = (uintptr_t)(uart_tx_buffer + write_pos);
-		
-		if( cdc.tx_remain >= ( UART_TX_BUF_SIZE ) )
-		{
-			if( usb_debug ) printf( "Buffer overflow, %c\n", uart_tx_buffer[UART_TX_BUF_SIZE - 63] );
-			USBFS_SendNAK( 2, 0 );
-			cdc.tx_stop = 1;
-		}
-		cdc.tx_remain += USBFS->RX_LEN;
+		cdc_out_packet( &cdc, len );
 	}
 }
 
@@ -276,7 +255,6 @@ void systick_init()
 #endif
 	
 	cdc.rx_timeout = 0;
-	cdc.usb_timeout = 0;
 	millis_cnt = 0;
 
 	NVIC_EnableIRQ(SysTick_IRQn);
@@ -301,7 +279,6 @@ void SysTick_Handler(void)
 	SysTick->CMP7 = (uint8_t)(cmp_tmp >> 56);
 #endif
 	cdc.rx_timeout++;
-	cdc.usb_timeout++;
 	millis_cnt++;
 }
 
@@ -348,8 +325,6 @@ int main()
 	printf( "Type 'd' for USB and 'D' for UART\n" );
 	printf( "---------------------------------\n" );
 
-	UEP_DMA(2) = (uintptr_t)uart_tx_buffer;
-
 	while(1)
 	{
 #if FUNCONF_USE_DEBUGPRINTF
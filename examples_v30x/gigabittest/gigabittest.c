@@ -7,8 +7,36 @@
 // PA10 for Rev F or earlier of cnlohr's board
 #define CH32V307GIGABIT_PHY_RSTB PA10
 
+// Set to 1 to blast max-size frames as fast as the ring allows, and count
+// everything received, reporting Mbit/s once a second.
+#define THROUGHPUT_TEST 0
+
+#if THROUGHPUT_TEST
+#define CH32V307GIGABIT_RXBUFNB 16
+#define CH32V307GIGABIT_TXBUFNB 16
+#define CH32V307GIGABIT_RX_COALESCE_FRAMES 4
+#define CH32V307GIGABIT_BATCH_RX
+#endif
+
 #include "ch32v307gigabit.h"
 
+#if THROUGHPUT_TEST
+volatile uint32_t rx_frames;
+volatile uint32_t rx_bytes;
+volatile uint32_t rx_batches;
+
+uint32_t ch32v307ethInitHandlePacketBatch( ch32v307ethFrame * frames, int count )
+{
+	int i;
+	uint32_t bytes = 0;
+	for( i = 0; i < count; i++ )
+		bytes += frames[i].frame_length;
+	rx_bytes += bytes;
+	rx_frames += count;
+	rx_batches++;
+	return 0;
+}
+#else
 int ch32v307ethInitHandlePacket( uint8_t * data, int frame_length, ETH_DMADESCTypeDef * dmadesc )
 {
 	printf( "Rx: %d\n", (int)frame_length );
@@ -20,6 +48,7 @@ int ch32v307ethInitHandlePacket( uint8_t * data, int frame_length, ETH_DMADESCTy
 	printf( "\n" );
 	return 0;
 }
+#endif
 
 void ch32v307ethHandleReconfig( int link, int speed, int duplex )
 {
@@ -28,9 +57,72 @@ void ch32v307ethHandleReconfig( int link, int speed, int duplex )
 
 void ch32v307ethInitHandleTXC( void )
 {
+#if !THROUGHPUT_TEST
 	printf( "TX Ok\n" );
+#endif
 }
 
+#if THROUGHPUT_TEST
+// Broadcast UDP header, sent from its own buffer, the payload is never copied.
+uint8_t blast_header[42] = {
+	0xff, 0xff, 0xff, 0xff, 0xff, 0xff, // Destination
+	0x02, 0xcd, 0xef, 0x12, 0x34, 0x56, // Source
+	0x08, 0x00, // IP
+	0x45, 0x00, // IP version + ToS
+	0x05, 0xdc, // 1500-byte full payload.
+	0x00, 0x00, // Identification
+	0x40, 0x00, // Flags (Don't fragment) and offset.
+	0x40, //TTL
+	0x11, // UDP
+	0x00, 0x00, // Header Checksum
+	0x01, 0x02, 0x03, 0x04, // Source Address
+	0xff, 0xff, 0xff, 0xff, // Destionation Address
+	0x04, 0x01, // Port 1025 Source
+	0x04, 0x02, // Port 1026 Destination
+	0x05, 0xc8, // 1472-byte payload
+	0x00, 0x00, // Checksum
+};
+uint8_t blast_payload[1472];
+
+static void ThroughputTest( void )
+{
+	uint32_t tx_frames = 0;
+	uint32_t tx_full = 0;
+	uint32_t last = funSysTick32();
+
+	for( int i = 0; i < sizeof(blast_payload); i++ )
+		blast_payload[i] = i;
+
+	while(1)
+	{
+		// Only ask for a TX complete interrupt once per ring.
+		if( ch32v307ethTransmitGather( blast_header, sizeof(blast_header), blast_payload, sizeof(blast_payload),
+			( tx_frames % CH32V307GIGABIT_TXBUFNB ) == 0 ) == 0 )
+			tx_frames++;
+		else
+			tx_full++;
+
+		ch32v307ethPollRx();
+
+		uint32_t now = funSysTick32();
+		if( TimeElapsed32( now, last ) >= Ticks_from_Ms(1000) )
+		{
+			last = now;
+			ch32v307ethTickPhy();
+			uint32_t txbits = tx_frames * ( sizeof(blast_header) + sizeof(blast_payload) ) * 8;
+			printf( "TX: %lu frames %lu Mbit/s (ring full %lu) RX: %lu frames %lu Mbit/s in %lu batches\n",
+				tx_frames, txbits / 1000000, tx_full,
+				rx_frames, rx_bytes * 8 / 1000000, rx_batches );
+			tx_frames = 0;
+			tx_full = 0;
+			rx_frames = 0;
+			rx_bytes = 0;
+			rx_batches = 0;
+		}
+	}
+}
+#endif
+
 int main()
 {
 	SystemInit();
@@ -42,6 +134,10 @@ int main()
 	printf( "R: %d\n",r );
 	printf( "%02x:%02x:%02x:%02x:%02x:%02x\n", ch32v307eth_mac[0], ch32v307eth_mac[1], ch32v307eth_mac[2], ch32v307eth_mac[3], ch32v307eth_mac[4], ch32v307eth_mac[5] );
 
+#if THROUGHPUT_TEST
+	ThroughputTest();
+#endif
+
 	uint8_t testframe[] = { 
 		0xff, 0xff, 0xff, 0xff, 0xff, 0xff, // Destination
 		0x02, 0xcd, 0xef, 0x12, 0x34, 0x56, // Source
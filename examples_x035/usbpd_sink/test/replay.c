@@ -0,0 +1,246 @@
+/*
+ * Host replay of a USB PD trace through usbpd.h
+ *
+ * The USBPD peripheral is replaced by a struct in RAM. Messages from the source are put
+ * in the receive buffer and the USBPD interrupt is called, so they go through the same
+ * GoodCRC and ProcessMessage() path as on the chip. USBPD_Tick() is called once per ms.
+ * Everything the sink sends and every event it reports has to match the trace, at the
+ * same ms and in the same order. The trace is written by hand from the PD spec, not
+ * recorded from usbpd.h, so after a change of behaviour the expectations are edited too.
+ *
+ * make -C examples_x035/usbpd_sink/test
+ */
+#include "ch32fun.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+static USBPD_DETAILED_TypeDef fake_usbpd;
+static RCC_TypeDef fake_rcc;
+static GPIO_TypeDef fake_gpioc;
+static AFIO_TypeDef fake_afio;
+static int irqEnabled;
+
+#undef USBPD
+#define USBPD ( &fake_usbpd )
+#undef RCC
+#define RCC ( &fake_rcc )
+#undef GPIOC
+#define GPIOC ( &fake_gpioc )
+#undef AFIO
+#define AFIO ( &fake_afio )
+#define NVIC_EnableIRQ( irq ) ( irqEnabled = 1 )
+#define NVIC_DisableIRQ( irq ) ( irqEnabled = 0 )
+#undef Delay_Us
+#define Delay_Us( us ) ( (void)0 )
+// The RISC-V interrupt attribute means something else to the host compiler
+#define interrupt used
+
+#define USBPD_IMPLEMENTATION
+// USBPD->DMA takes a 32 bit address, the host's pointers are wider. Only Receive() and
+// Pump() look at it, and they compare it truncated the same way.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+#include "usbpd.h"
+#pragma GCC diagnostic pop
+
+// What the sink did and hasn't been matched against the trace yet
+static struct
+{
+	uint32_t ms;
+	char text[128];
+} s_seen[16];
+static int s_seenCount;
+static uint32_t s_now;
+
+static void Seen( const char *text )
+{
+	if ( s_seenCount == sizeof( s_seen ) / sizeof( s_seen[0] ) )
+	{
+		printf( "FAIL more than %d unmatched messages and events at %u ms\n", s_seenCount, s_now );
+		exit( 1 );
+	}
+	s_seen[s_seenCount].ms = s_now;
+	snprintf( s_seen[s_seenCount].text, sizeof( s_seen[0].text ), "%s", text );
+	s_seenCount++;
+}
+
+static void OnEvent( USBPD_Event_e event )
+{
+	char text[64];
+	snprintf( text, sizeof( text ), "! %s", USBPD_EventToStr( event ) );
+	Seen( text );
+}
+
+/**
+ * @brief  Finish whatever the sink started sending, as the TX_END interrupt would
+ * @param  None
+ * @return None
+ */
+static void Pump( void )
+{
+	while ( fake_usbpd.CONTROL & PD_TX_EN )
+	{
+		if ( fake_usbpd.TX_SEL == UPD_HARD_RESET )
+		{
+			Seen( "> hard_reset" );
+		}
+		else if ( fake_usbpd.DMA == (uint32_t)(uintptr_t)s_txBuffer )
+		{
+			char text[128] = ">";
+			for ( int i = 0; i < fake_usbpd.BMC_TX_SZ; i++ )
+			{
+				snprintf( text + strlen( text ), sizeof( text ) - strlen( text ), " %02x", s_txBuffer[i] );
+			}
+			Seen( text );
+		}
+		// GoodCRC replies (from s_crcBuffer) are not in the trace
+
+		fake_usbpd.CONTROL &= ~PD_TX_EN;
+		fake_usbpd.STATUS = IF_TX_END;
+		USBPD_IRQHandler();
+		fake_usbpd.STATUS = 0;
+	}
+}
+
+static void Tick( void )
+{
+	s_now++;
+	USBPD_Tick();
+	Pump();
+}
+
+/**
+ * @brief  A message from the source, lost like on the chip if the receiver isn't listening
+ * @param  message - header and data objects
+ * @param  length - in bytes, without the CRC
+ * @return None
+ */
+static void Receive( const uint8_t *message, int length )
+{
+	if ( !irqEnabled || fake_usbpd.DMA != (uint32_t)(uintptr_t)s_buffer ) return;
+	memcpy( s_buffer, message, length );
+	fake_usbpd.BMC_BYTE_CNT = length + 4;
+	fake_usbpd.STATUS = IF_RX_ACT | BMC_AUX_SOP0;
+	USBPD_IRQHandler();
+	fake_usbpd.STATUS = 0;
+	Pump();
+}
+
+static void HardResetSignal( void )
+{
+	if ( !irqEnabled ) return;
+	fake_usbpd.STATUS = IF_RX_RESET;
+	USBPD_IRQHandler();
+	fake_usbpd.STATUS = 0;
+	Pump();
+}
+
+static int Fail( const char *file, int line, const char *why, const char *text )
+{
+	printf( "FAIL %s:%d: %s '%s' at %u ms", file, line, why, text, s_now );
+	if ( s_seenCount ) printf( ", sink did '%s' at %u ms", s_seen[0].text, s_seen[0].ms );
+	printf( "\n" );
+	return 1;
+}
+
+int main( int argc, char **argv )
+{
+	const char *file = argc > 1 ? argv[1] : "trace.txt";
+	FILE *f = fopen( file, "r" );
+	if ( !f )
+	{
+		printf( "FAIL can't open %s\n", file );
+		return 1;
+	}
+
+	USBPD_Init( eUSBPD_VCC_5V0 );
+	USBPD_SetCallback( OnEvent );
+	USBPD_Reset();
+
+	char line[256];
+	int lineNumber = 0, checked = 0;
+	while ( fgets( line, sizeof( line ), f ) )
+	{
+		lineNumber++;
+
+		// "<ms> <what>", comments start with #, whitespace is not significant
+		char text[256], *out = text;
+		for ( char *in = line; *in && *in != '#'; in++ )
+		{
+			if ( isspace( (unsigned char)*in ) )
+			{
+				if ( out != text && out[-1] != ' ' ) *out++ = ' ';
+			}
+			else
+			{
+				*out++ = tolower( (unsigned char)*in );
+			}
+		}
+		if ( out != text && out[-1] == ' ' ) out--;
+		*out = 0;
+		if ( !text[0] ) continue;
+
+		char *what;
+		const uint32_t ms = strtoul( text, &what, 10 );
+		if ( *what++ != ' ' ) return Fail( file, lineNumber, "no time in", text );
+		if ( ms < s_now ) return Fail( file, lineNumber, "time goes back in", text );
+		while ( s_now < ms ) Tick();
+
+		if ( what[0] == '>' || what[0] == '!' )
+		{
+			if ( !s_seenCount || s_seen[0].ms != ms || strcasecmp( s_seen[0].text, what ) )
+			{
+				return Fail( file, lineNumber, "expected", what );
+			}
+			s_seenCount--;
+			memmove( s_seen, s_seen + 1, s_seenCount * sizeof( s_seen[0] ) );
+			checked++;
+			continue;
+		}
+
+		// Anything the sink did up to here must have been in the trace
+		if ( s_seenCount ) return Fail( file, lineNumber, "unexpected, before", what );
+
+		if ( what[0] == '<' )
+		{
+			uint8_t message[34];
+			int length = 0;
+			char *p = what + 1;
+			while ( *p && length < (int)sizeof( message ) )
+			{
+				message[length++] = strtoul( p, &p, 16 );
+				while ( *p == ' ' ) p++;
+			}
+			Receive( message, length );
+		}
+		else if ( !strcmp( what, "attach" ) )
+		{
+			fake_usbpd.PORT_CC1 |= PA_CC_AI;
+		}
+		else if ( !strcmp( what, "detach" ) )
+		{
+			fake_usbpd.PORT_CC1 &= ~PA_CC_AI;
+		}
+		else if ( !strcmp( what, "hard_reset" ) )
+		{
+			HardResetSignal();
+		}
+		else if ( !strncmp( what, "select ", 7 ) )
+		{
+			unsigned index, voltage;
+			if ( sscanf( what + 7, "%u %u", &index, &voltage ) != 2 ) return Fail( file, lineNumber, "bad", what );
+			USBPD_SelectPDO( index, voltage );
+		}
+		else if ( strcmp( what, "end" ) )
+		{
+			return Fail( file, lineNumber, "unknown", what );
+		}
+	}
+	fclose( f );
+
+	if ( s_seenCount ) return Fail( file, lineNumber, "unexpected at the end of", file );
+	printf( "ok   usbpd replay %s, %d messages and events over %u ms\n", file, checked, s_now );
+	return 0;
+}
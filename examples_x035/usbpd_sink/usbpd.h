@@ -3,6 +3,8 @@
  *	Configuration:
  *		- USBPD_IMPLEMENTATION: Enable USB PD implementation
  *		- FUNCONF_USBPD_NO_STR: Disable string conversion functions
+ *		- USBPD_PPS_KEEPALIVE_MS: How often a PPS contract is renewed (default 8000, must be under 10s)
+ *		- USBPD_SINK_CURRENT_10MA: Current reported when the source asks for our capabilities (default 300)
  *	Notes:
  *		- This library is based on the USB Power Delivery Specification.
  *			https://www.usb.org/document-library/usb-power-delivery
@@ -10,17 +12,25 @@
  *			are taken directly from the spec above.
  *		- Not all messages are implemented.
  *		- Formatting macros are provided next to the struct deffinitions.
+ *		- Nothing blocks. GoodCRC is sent from the USBPD interrupt, received messages are handled there too,
+ *			and USBPD_Tick() (every 1ms) sends our replies/requests and runs the spec timers, including
+ *			the PPS keep-alive. The callback is called from either of those, keep it short.
  *	Basic usage:
  *		USBPD_VCC_e vcc = eUSBPD_VCC_5V0; // set the VCC voltage
  *		USBPD_Result_e result = USBPD_Init( vcc ); // initialize the peripheral
+ *		USBPD_SetCallback( OnEvent ); // optional
+ *		USBPD_Reset();
  *
- *		// wait for negotiation to complete.
- *		while ( eUSBPD_BUSY == ( result = USBPD_SinkNegotiate() ) );
+ *		// from a 1ms timer interrupt:
+ *		USBPD_Tick();
  *
+ *		// the first PDO (5V) is requested by default, to pick another one, at any time:
  *		USBPD_SPR_CapabilitiesMessage_t *capabilities;
  *		const size_t count = USBPD_GetCapabilities( &capabilities );
  *		USBPD_SelectPDO( count - 1, voltage ); // select the last supply (voltage is only used for PPS)
  *
+ *		// eUSBPD_EVENT_CONTRACT or USBPD_GetState() == eSTATE_PS_RDY tell when it's in effect
+ *
  *	The above is not a complete example, check the funtion declarations below for more details.
  */
 
@@ -470,6 +480,24 @@ typedef enum
 	eSTATE_MAX,
 } USBPD_State_e;
 
+typedef enum
+{
+	eUSBPD_EVENT_ATTACHED, // a source was plugged in
+	eUSBPD_EVENT_DETACHED, // the source was unplugged, the library is back in eSTATE_IDLE
+	eUSBPD_EVENT_SOURCE_CAPS, // new capabilities, USBPD_SelectPDO() may be called from the callback
+	eUSBPD_EVENT_CONTRACT, // a new contract is in place (not sent for PPS keep-alive requests)
+	eUSBPD_EVENT_REJECTED, // the source rejected the request, the previous contract is kept
+	eUSBPD_EVENT_HARD_RESET, // hard reset sent or received, the source will go back to 5V
+	eUSBPD_EVENT_ERROR, // the source stopped responding, even to hard resets
+} USBPD_Event_e;
+
+/**
+ * @brief  Event callback, called from interrupt context (USBPD IRQ or USBPD_Tick())
+ * @param  event: what happened
+ * @return None
+ */
+typedef void ( *USBPD_Callback_t )( USBPD_Event_e event );
+
 /**
  * @brief  Initialize the USB PD module
  * @param  vcc: VCC voltage level (3.3V or 5V)
@@ -478,11 +506,21 @@ typedef enum
 USBPD_Result_e USBPD_Init( USBPD_VCC_e vcc );
 
 /**
- * @brief  Negotiate with the USB PD Source, must be called periodically
+ * @brief  Run the timers of the policy engine, must be called every millisecond
+ *         (e.g. from SysTick_Handler). Never blocks.
+ *         Detects attach/detach, sends requests and the PPS keep-alive, handles timeouts.
+ * @note   Call it from the main loop or from an interrupt with the same priority as USBPD_IRQn.
  * @param  None
- * @return USBPD_BUSY if negotiation is in progress, eUSBPD_OK if successful, or an error code
+ * @return None
+ */
+void USBPD_Tick( void );
+
+/**
+ * @brief  Set the function to be called when something happens
+ * @param  callback: function to call, or NULL
+ * @return None
  */
-USBPD_Result_e USBPD_SinkNegotiate( void );
+void USBPD_SetCallback( USBPD_Callback_t callback );
 
 /**
  * @brief  Reset the USB PD module
@@ -513,13 +551,30 @@ const char *USBPD_StateToStr( USBPD_State_e state );
 const char *USBPD_ResultToStr( USBPD_Result_e result );
 
 /**
- * @brief  Select a new Power Data Object (PDO) to be used. No re-negotiation is needed.
+ * @brief  Convert USB PD event to string
+ * @param  event: USBPD_Event_e to convert
+ * @return Pointer to a string representing the event
+ */
+const char *USBPD_EventToStr( USBPD_Event_e event );
+
+/**
+ * @brief  Select the Power Data Object (PDO) to request. Does not block, the request is sent
+ *         on the next USBPD_Tick() once any negotiation in progress is done.
+ *         The selection is kept when the source sends new capabilities, as long as it still fits.
  * @param  index: Index of the PDO to select (0-based)
- * @param  voltageIn100mV: Desired output voltage in 100mV units (e.g., 500 for 5V) (only applicable for PPS)
+ * @param  voltageIn100mV: Desired output voltage in 100mV units (e.g., 50 for 5V) (only applicable for PPS)
  * @return USBPD_Result_e
  */
 USBPD_Result_e USBPD_SelectPDO( uint8_t index, uint32_t voltageIn100mV );
 
+/**
+ * @brief  Get the contract currently in place
+ * @param[out] index: PDO index of the contract (can be NULL)
+ * @param[out] voltageIn100mV: requested voltage for PPS contracts (can be NULL)
+ * @return true if there is an explicit contract
+ */
+bool USBPD_GetContract( uint8_t *index, uint32_t *voltageIn100mV );
+
 /**
  * @brief  Get the capabilities of the USB PD Source
  * @param[out] capabilities: Pointer to a pointer where the capabilities message structure is stored
@@ -545,6 +600,56 @@ USBPD_SpecificationRevision_e USBPD_GetVersion( void );
 
 #include <string.h>
 
+#ifndef USBPD_PPS_KEEPALIVE_MS
+#define USBPD_PPS_KEEPALIVE_MS 8000 // PPS contracts must be renewed at least every 10s (tPPSRequest)
+#endif
+
+#ifndef USBPD_SINK_CURRENT_10MA
+#define USBPD_SINK_CURRENT_10MA 300 // operational current reported in our Sink_Capabilities
+#endif
+
+// Timer values from the spec, in ms
+#define USBPD_T_SINK_WAIT_CAP 620 // tTypeCSinkWaitCap
+#define USBPD_T_HARD_RESET_RECOVER 2000 // tSrcRecover + VBUS back on + tTypeCSinkWaitCap
+#define USBPD_T_SENDER_RESPONSE 30 // tSenderResponse
+#define USBPD_T_PS_TRANSITION 500 // tPSTransition
+#define USBPD_T_SINK_REQUEST 100 // tSinkRequest
+#define USBPD_T_RECEIVE 2 // tReceive is 1ms, the tick may come any time within the first one
+#define USBPD_T_DETACH 10 // CC line low this long means unplugged
+#define USBPD_N_HARD_RESET 2 // nHardResetCount
+
+typedef enum
+{
+	eTIMER_STATE, // state timeout (SinkWaitCap, SenderResponse, PSTransition)
+	eTIMER_TX, // waiting for a GoodCRC
+	eTIMER_REQUEST, // SinkRequest after a Wait
+	eTIMER_PPS, // PPS keep-alive
+	eTIMER_MAX,
+} USBPD_Timer_e;
+
+typedef enum
+{
+	eTX_IDLE,
+	eTX_SENDING, // message is going out
+	eTX_WAIT_CRC, // waiting for the GoodCRC
+	eTX_HARD_RESET, // hard reset is going out
+} USBPD_TxState_e;
+
+typedef enum
+{
+	eREPLY_NONE,
+	eREPLY_REQUEST,
+	eREPLY_ACCEPT,
+	eREPLY_SINK_CAP,
+	eREPLY_NOT_SUPPORTED,
+	eREPLY_SOFT_RESET,
+} USBPD_Reply_e;
+
+// Selection is packed so it can be changed atomically from the application
+#define USBPD_SELECT( index, voltage ) ( ( (uint32_t)( index ) << 16 ) | ( ( voltage ) & 0xffff ) )
+#define USBPD_SELECT_INDEX( select ) ( ( select ) >> 16 )
+#define USBPD_SELECT_VOLTAGE( select ) ( ( select ) & 0xffff )
+
 typedef struct
 {
 	uint32_t ccCount;
@@ -553,19 +658,39 @@ typedef struct
 	USBPD_CC_e lastCCLine;
 	USBPD_SPR_CapabilitiesMessage_t caps;
 	uint8_t messageID;
+	uint8_t rxMessageID; // last MessageID received, 0xff if none since the last reset
 	uint8_t pdoCount;
-	bool gotSourceGoodCRC;
+	uint8_t txType; // MessageType of the message being sent, 0xff for data messages
+	uint8_t txSize;
+	uint8_t txRetries;
+	uint8_t hardResets;
+	uint8_t detachCount;
+	volatile bool sendingGoodCRC;
+	volatile USBPD_TxState_e txState;
+	USBPD_Reply_e reply;
+	bool hasContract;
+	volatile bool selectPending; // application changed the selection
+	volatile uint32_t select; // USBPD_SELECT() the application wants
+	uint32_t request; // USBPD_SELECT() last requested
+	uint32_t contract; // USBPD_SELECT() of the contract in place
+	uint32_t now; // ms, counted by USBPD_Tick()
+	uint32_t timerActive; // bit per USBPD_Timer_e
+	uint32_t timerDeadline[eTIMER_MAX];
+	USBPD_Callback_t callback;
 } USBPD_Instance_t;
 
-static __attribute__( ( aligned( 4 ) ) ) uint8_t s_buffer[34];
+static __attribute__( ( aligned( 4 ) ) ) uint8_t s_buffer[34]; // receive DMA buffer
+static __attribute__( ( aligned( 4 ) ) ) uint8_t s_txBuffer[34]; // our messages, kept for retries
+static __attribute__( ( aligned( 4 ) ) ) uint8_t s_crcBuffer[4]; // GoodCRC replies
+static __attribute__( ( aligned( 4 ) ) ) uint8_t s_message[34]; // received message being processed
 static USBPD_Instance_t s_instance = {
 	.pdVersion = eUSBPD_REV_30,
+	.rxMessageID = 0xff,
 };
 
 static USBPD_CC_e GetActiveCCLine( void );
 static void SwitchRXMode( void );
 static void SendMessage( uint8_t size );
-static void ParsePacket( void );
 
 USBPD_Result_e USBPD_Init( USBPD_VCC_e vcc )
 {
@@ -597,60 +722,521 @@ USBPD_Result_e USBPD_Init( USBPD_VCC_e vcc )
 	return eUSBPD_OK;
 }
 
-USBPD_Result_e USBPD_SinkNegotiate( void )
+static void StartTimer( USBPD_Timer_e timer, uint32_t ms )
+{
+	s_instance.timerDeadline[timer] = s_instance.now + ms;
+	s_instance.timerActive |= 1u << timer;
+}
+
+static void StopTimer( USBPD_Timer_e timer )
+{
+	s_instance.timerActive &= ~( 1u << timer );
+}
+
+/**
+ * @brief  Check if a timer ran out, an expired timer is stopped
+ * @param  timer: timer to check
+ * @return true once, when the timer runs out
+ */
+static bool TimerExpired( USBPD_Timer_e timer )
+{
+	if ( !( s_instance.timerActive & ( 1u << timer ) ) ||
+		 (int32_t)( s_instance.now - s_instance.timerDeadline[timer] ) < 0 )
+	{
+		return false;
+	}
+	StopTimer( timer );
+	return true;
+}
+
+static void Event( USBPD_Event_e event )
 {
-	switch ( s_instance.state )
+	if ( s_instance.callback )
 	{
-		case eSTATE_IDLE:;
-			const uint8_t ccLine = GetActiveCCLine();
-			if ( ccLine == eUSBPD_CCNONE )
+		s_instance.callback( event );
+	}
+}
+
+/**
+ * @brief  Reset the protocol layer (MessageID counters), after a soft or hard reset
+ * @param  None
+ * @return None
+ */
+static void ResetProtocol( void )
+{
+	s_instance.messageID = 0;
+	s_instance.rxMessageID = 0xff;
+	s_instance.txState = eTX_IDLE;
+	StopTimer( eTIMER_TX );
+}
+
+/**
+ * @brief  Go back to waiting for Source_Capabilities
+ * @param  timeout: how long to wait before sending a hard reset
+ * @return None
+ */
+static void WaitForCapabilities( uint32_t timeout )
+{
+	s_instance.state = eSTATE_CABLE_DETECT;
+	s_instance.hasContract = false;
+	s_instance.reply = eREPLY_NONE;
+	StopTimer( eTIMER_REQUEST );
+	StopTimer( eTIMER_PPS );
+	StartTimer( eTIMER_STATE, timeout );
+}
+
+/**
+ * @brief  Send the message in s_txBuffer, GoodCRC and retries are handled by the ISR and USBPD_Tick()
+ * @param  None
+ * @return None
+ */
+static void TransmitMessage( void )
+{
+	s_instance.txState = eTX_SENDING;
+	USBPD->DMA = (uint32_t)s_txBuffer;
+	SendMessage( s_instance.txSize );
+}
+
+static void SendControlMessage( USBPD_ControlMessage_e type )
+{
+	*(USBPD_MessageHeader_t *)&s_txBuffer[0] = ( USBPD_MessageHeader_t ){
+		.MessageID = s_instance.messageID,
+		.MessageType = type,
+		.SpecificationRevision = s_instance.pdVersion,
+	};
+	s_instance.txType = type;
+	s_instance.txSize = sizeof( USBPD_MessageHeader_t );
+	s_instance.txRetries = 0;
+	TransmitMessage();
+}
+
+static void SendSinkCapabilities( void )
+{
+	*(USBPD_MessageHeader_t *)&s_txBuffer[0] = ( USBPD_MessageHeader_t ){
+		.MessageID = s_instance.messageID,
+		.MessageType = eUSBPD_DATA_MSG_SINK_CAP,
+		.NumberOfDataObjects = 1u,
+		.SpecificationRevision = s_instance.pdVersion,
+	};
+	USBPD_SinkPDO_t *const pdo = (USBPD_SinkPDO_t *)&s_txBuffer[sizeof( USBPD_MessageHeader_t )];
+	*pdo = ( USBPD_SinkPDO_t ){
+		.FixedSupply =
 			{
-				s_instance.ccCount = 0;
-				s_instance.lastCCLine = eUSBPD_CCNONE;
+				.CurrentIn10mA = USBPD_SINK_CURRENT_10MA,
+				.VoltageIn50mV = 100, // vSafe5V
+				.USBComsCapable = 1u,
+				.PDOType = eUSBPD_PDO_FIXED,
+			},
+	};
+	s_instance.txType = 0xff;
+	s_instance.txSize = sizeof( USBPD_MessageHeader_t ) + sizeof( USBPD_SinkPDO_t );
+	s_instance.txRetries = 0;
+	TransmitMessage();
+}
+
+/**
+ * @brief  Send a Request for the PDO the application selected
+ * @param  None
+ * @return None
+ */
+static void SendRequest( void )
+{
+	uint32_t index = USBPD_SELECT_INDEX( s_instance.select );
+	uint32_t voltageIn100mV = USBPD_SELECT_VOLTAGE( s_instance.select );
+	s_instance.selectPending = false;
+
+	if ( index >= s_instance.pdoCount )
+	{
+		index = 0; // selection no longer offered, fall back to vSafe5V
+	}
+
+	const USBPD_SourcePDO_t *const pdo = &s_instance.caps.Source[index];
+
+	*(USBPD_MessageHeader_t *)&s_txBuffer[0] = ( USBPD_MessageHeader_t ){
+		.MessageID = s_instance.messageID,
+		.MessageType = eUSBPD_DATA_MSG_REQUEST,
+		.NumberOfDataObjects = 1u,
+		.SpecificationRevision = s_instance.pdVersion,
+	};
+	USBPD_RequestDataObject_t *const rdo = (USBPD_RequestDataObject_t *)&s_txBuffer[sizeof( USBPD_MessageHeader_t )];
+
+	if ( USBPD_IsPPS( pdo ) )
+	{
+		// Clamp voltage to min/max NOTE: Maybe we should return an error if the voltage is out of range?
+		const uint32_t minVoltage = pdo->SPR_PPS.MinVoltageIn100mV;
+		const uint32_t maxVoltage = pdo->SPR_PPS.MaxVoltageIn100mV;
+		voltageIn100mV = voltageIn100mV > maxVoltage ? maxVoltage : voltageIn100mV;
+		voltageIn100mV = voltageIn100mV < minVoltage ? minVoltage : voltageIn100mV;
+
+		*rdo = ( USBPD_RequestDataObject_t ){
+			.PPS =
+				{
+					.ObjectPosition = index + 1,
+					.OutputVoltageIn20mV = voltageIn100mV * 5,
+					.OperatingCurrentIn50mA = pdo->SPR_PPS.MaxCurrentIn50mA,
+					.NoUSBSuspended = 1u,
+					.USBComsCapable = 1u, // TODO: Should have these are arguments or define
+				},
+		};
+	}
+	else
+	{
+		voltageIn100mV = 0;
+		*rdo = ( USBPD_RequestDataObject_t ){
+			.FixedAndVariable =
+				{
+					.ObjectPosition = index + 1,
+					.MaxCurrentIn10mA = pdo->FixedSupply.MaxCurrentIn10mA,
+					.OperatingCurrentIn10mA = pdo->FixedSupply.MaxCurrentIn10mA,
+					.USBComsCapable = 1u,
+					.NoUSBSuspended = 1u,
+				},
+		};
+	}
+
+	s_instance.request = USBPD_SELECT( index, voltageIn100mV );
+	s_instance.state = eSTATE_WAIT_ACCEPT;
+	s_instance.txType = 0xff;
+	s_instance.txSize = sizeof( USBPD_MessageHeader_t ) + sizeof( USBPD_RequestDataObject_t );
+	s_instance.txRetries = 0;
+	TransmitMessage();
+}
+
+/**
+ * @brief  Send a hard reset, gives up after nHardResetCount tries
+ * @param  None
+ * @return None
+ */
+static void SendHardReset( void )
+{
+	if ( s_instance.hardResets >= USBPD_N_HARD_RESET )
+	{
+		// source is not responding, nothing more we can do until it is replugged
+		StopTimer( eTIMER_STATE );
+		Event( eUSBPD_EVENT_ERROR );
+		return;
+	}
+
+	s_instance.hardResets++;
+	s_instance.hasContract = false;
+	s_instance.txState = eTX_HARD_RESET;
+	USBPD->BMC_CLK_CNT = UPD_TMR_TX;
+	USBPD->TX_SEL = UPD_HARD_RESET;
+	USBPD->BMC_TX_SZ = 0;
+	USBPD->STATUS = 0;
+	USBPD->CONTROL |= BMC_START | PD_TX_EN;
+	Event( eUSBPD_EVENT_HARD_RESET );
+}
+
+/**
+ * @brief  Our message was acknowledged with a GoodCRC
+ * @param  None
+ * @return None
+ */
+static void MessageSent( void )
+{
+	s_instance.messageID = ( s_instance.messageID + 1 ) & 7;
+	s_instance.txState = eTX_IDLE;
+	StopTimer( eTIMER_TX );
+
+	if ( s_instance.txType == 0xff && s_instance.state == eSTATE_WAIT_ACCEPT )
+	{
+		StartTimer( eTIMER_STATE, USBPD_T_SENDER_RESPONSE );
+	}
+	else if ( s_instance.txType == eUSBPD_CTRL_MSG_SOFT_RESET )
+	{
+		WaitForCapabilities( USBPD_T_SINK_WAIT_CAP );
+	}
+}
+
+/**
+ * @brief  No GoodCRC after all retries, soft reset, or hard reset if that fails too
+ * @param  None
+ * @return None
+ */
+static void MessageFailed( void )
+{
+	s_instance.txState = eTX_IDLE;
+
+	if ( s_instance.txType == eUSBPD_CTRL_MSG_SOFT_RESET )
+	{
+		SendHardReset();
+		return;
+	}
+
+	WaitForCapabilities( USBPD_T_SINK_WAIT_CAP );
+	s_instance.reply = eREPLY_SOFT_RESET;
+}
+
+/**
+ * @brief  Policy engine, handle a message from the source (in s_message), GoodCRC has already been sent.
+ *         Runs in the ISR, anything we need to send is left for USBPD_Tick()
+ * @param  None
+ * @return None
+ */
+static void ProcessMessage( void )
+{
+	const USBPD_MessageHeader_t message = *(USBPD_MessageHeader_t *)s_message;
+
+	if ( message.MessageID == s_instance.rxMessageID &&
+		 !( message.NumberOfDataObjects == 0u && message.MessageType == eUSBPD_CTRL_MSG_SOFT_RESET ) )
+	{
+		return; // retry of a message we already have
+	}
+	s_instance.rxMessageID = message.MessageID;
+
+	if ( message.Extended )
+	{
+		if ( s_instance.state == eSTATE_PS_RDY ) s_instance.reply = eREPLY_NOT_SUPPORTED;
+		return;
+	}
+
+	if ( message.NumberOfDataObjects == 0u )
+	{
+		switch ( (USBPD_ControlMessage_e)message.MessageType )
+		{
+			case eUSBPD_CTRL_MSG_ACCEPT:
+				if ( s_instance.state == eSTATE_WAIT_ACCEPT )
+				{
+					s_instance.state = eSTATE_WAIT_PS_RDY;
+					StartTimer( eTIMER_STATE, USBPD_T_PS_TRANSITION );
+				}
 				break;
-			}
 
-			if ( s_instance.lastCCLine != ccLine )
-			{
-				s_instance.lastCCLine = ccLine;
-				s_instance.ccCount = 0;
-			}
-			else
-			{
-				s_instance.ccCount++;
-			}
+			case eUSBPD_CTRL_MSG_REJECT:
+			case eUSBPD_CTRL_MSG_WAIT:
+				if ( s_instance.state != eSTATE_WAIT_ACCEPT ) break;
+				StopTimer( eTIMER_STATE );
+				s_instance.state = s_instance.hasContract ? eSTATE_PS_RDY : eSTATE_SOURCE_CAP;
+				if ( message.MessageType == eUSBPD_CTRL_MSG_WAIT )
+				{
+					StartTimer( eTIMER_REQUEST, USBPD_T_SINK_REQUEST );
+					break;
+				}
+				if ( !s_instance.hasContract )
+				{
+					// vSafe5V can not be rejected
+					s_instance.select = USBPD_SELECT( 0, 0 );
+					s_instance.reply = eREPLY_REQUEST;
+				}
+				else
+				{
+					if ( !s_instance.selectPending )
+					{
+						s_instance.select = s_instance.contract; // keep the old contract, don't ask again
+					}
+					if ( USBPD_IsPPS( &s_instance.caps.Source[USBPD_SELECT_INDEX( s_instance.contract )] ) )
+					{
+						StartTimer( eTIMER_PPS, USBPD_T_SINK_REQUEST ); // old PPS contract still needs its keep-alive
+					}
+				}
+				Event( eUSBPD_EVENT_REJECTED );
+				break;
 
-			if ( s_instance.ccCount > 10 )
-			{
-				if ( ccLine == eUSBPD_CC2 )
+			case eUSBPD_CTRL_MSG_PS_RDY:
+				if ( s_instance.state != eSTATE_WAIT_PS_RDY ) break;
+				StopTimer( eTIMER_STATE );
+				s_instance.state = eSTATE_PS_RDY;
+				s_instance.hardResets = 0;
+				if ( USBPD_IsPPS( &s_instance.caps.Source[USBPD_SELECT_INDEX( s_instance.request )] ) )
 				{
-					USBPD->CONFIG |= CC_SEL;
+					StartTimer( eTIMER_PPS, USBPD_PPS_KEEPALIVE_MS );
 				}
 				else
 				{
-					USBPD->CONFIG &= ~CC_SEL;
+					StopTimer( eTIMER_PPS );
 				}
+				if ( !s_instance.hasContract || s_instance.contract != s_instance.request )
+				{
+					s_instance.hasContract = true;
+					s_instance.contract = s_instance.request;
+					Event( eUSBPD_EVENT_CONTRACT );
+				}
+				break;
+
+			case eUSBPD_CTRL_MSG_SOFT_RESET:
+				ResetProtocol();
+				s_instance.rxMessageID = message.MessageID;
+				WaitForCapabilities( USBPD_T_SINK_WAIT_CAP );
+				s_instance.reply = eREPLY_ACCEPT;
+				break;
+
+			case eUSBPD_CTRL_MSG_GET_SINK_CAP: s_instance.reply = eREPLY_SINK_CAP; break;
 
-				s_instance.ccCount = 0;
-				s_instance.state = eSTATE_CABLE_DETECT;
+			case eUSBPD_CTRL_MSG_GOODCRC:
+			case eUSBPD_CTRL_MSG_PING: break;
 
-				SwitchRXMode();
-				// NVIC_SetPriority(USBPD_IRQn, 0x00); // TODO: Is this needed?
-				NVIC_EnableIRQ( USBPD_IRQn );
+			default:
+				if ( s_instance.state == eSTATE_PS_RDY ) s_instance.reply = eREPLY_NOT_SUPPORTED;
+				break;
+		}
+	}
+	else
+	{
+		switch ( (USBPD_DataMessage_e)message.MessageType )
+		{
+			case eUSBPD_DATA_MSG_SOURCE_CAP:
+				StopTimer( eTIMER_STATE );
+				StopTimer( eTIMER_REQUEST );
+				s_instance.state = eSTATE_SOURCE_CAP;
+				s_instance.pdoCount = message.NumberOfDataObjects;
+				s_instance.pdVersion = message.SpecificationRevision > eUSBPD_REV_30 ? eUSBPD_REV_30
+																					 : message.SpecificationRevision;
+				memset( &s_instance.caps, 0, sizeof( USBPD_SPR_CapabilitiesMessage_t ) );
+				memcpy( &s_instance.caps, &s_message[2], message.NumberOfDataObjects * sizeof( uint32_t ) );
+				Event( eUSBPD_EVENT_SOURCE_CAPS ); // the application may call USBPD_SelectPDO() here
+				s_instance.reply = eREPLY_REQUEST;
+				break;
+
+			case eUSBPD_DATA_MSG_VENDOR_DEFINED: break; // ignored
+
+			default:
+				if ( s_instance.state == eSTATE_PS_RDY ) s_instance.reply = eREPLY_NOT_SUPPORTED;
+				break;
+		}
+	}
+}
+
+void USBPD_Tick( void )
+{
+	s_instance.now++;
+
+	if ( s_instance.state == eSTATE_IDLE )
+	{
+		const uint8_t ccLine = GetActiveCCLine();
+		if ( ccLine == eUSBPD_CCNONE )
+		{
+			s_instance.ccCount = 0;
+			s_instance.lastCCLine = eUSBPD_CCNONE;
+			return;
+		}
+
+		if ( s_instance.lastCCLine != ccLine )
+		{
+			s_instance.lastCCLine = ccLine;
+			s_instance.ccCount = 0;
+		}
+		else
+		{
+			s_instance.ccCount++;
+		}
+
+		if ( s_instance.ccCount > 10 )
+		{
+			if ( ccLine == eUSBPD_CC2 )
+			{
+				USBPD->CONFIG |= CC_SEL;
 			}
-			break;
+			else
+			{
+				USBPD->CONFIG &= ~CC_SEL;
+			}
+
+			s_instance.ccCount = 0;
+			s_instance.detachCount = 0;
+			ResetProtocol();
+			WaitForCapabilities( USBPD_T_SINK_WAIT_CAP );
+
+			SwitchRXMode();
+			Event( eUSBPD_EVENT_ATTACHED );
+			NVIC_EnableIRQ( USBPD_IRQn );
+		}
+		return;
+	}
+
+	NVIC_DisableIRQ( USBPD_IRQn );
+
+	const bool busy = s_instance.sendingGoodCRC || s_instance.txState == eTX_SENDING ||
+					  s_instance.txState == eTX_HARD_RESET;
+
+	// the CC line toggles during messages, only a long low means the source is gone
+	const uint32_t ccPort = ( USBPD->CONFIG & CC_SEL ) ? USBPD->PORT_CC2 : USBPD->PORT_CC1;
+	if ( busy || ( ccPort & PA_CC_AI ) )
+	{
+		s_instance.detachCount = 0;
+	}
+	else if ( ++s_instance.detachCount >= USBPD_T_DETACH )
+	{
+		USBPD_Reset();
+		Event( eUSBPD_EVENT_DETACHED );
+		return; // IRQ stays disabled until the next attach
+	}
+
+	if ( busy )
+	{
+		// can't send right now, timers are looked at again on the next tick
+		NVIC_EnableIRQ( USBPD_IRQn );
+		return;
+	}
 
-		case eSTATE_SOURCE_CAP:
-			USBPD_SelectPDO( 0, 0 ); // Select the first PDO by default
-			s_instance.state = eSTATE_WAIT_ACCEPT;
-			break;
+	if ( TimerExpired( eTIMER_TX ) && s_instance.txState == eTX_WAIT_CRC )
+	{
+		const uint8_t retries = s_instance.pdVersion >= eUSBPD_REV_30 ? 2 : 3; // nRetryCount
+		if ( s_instance.txRetries < retries )
+		{
+			s_instance.txRetries++;
+			TransmitMessage();
+		}
+		else
+		{
+			MessageFailed();
+		}
+	}
 
-		case eSTATE_PS_RDY: return eUSBPD_OK;
+	if ( TimerExpired( eTIMER_STATE ) )
+	{
+		switch ( s_instance.state )
+		{
+			case eSTATE_CABLE_DETECT: // no Source_Capabilities (SinkWaitCapTimer)
+			case eSTATE_WAIT_ACCEPT: // no response to our Request (SenderResponseTimer)
+			case eSTATE_WAIT_PS_RDY: // no PS_RDY (PSTransitionTimer)
+				s_instance.txState = eTX_IDLE;
+				SendHardReset();
+				break;
+			default: break;
+		}
+	}
 
-		default: break;
+	if ( s_instance.txState == eTX_IDLE )
+	{
+		const USBPD_Reply_e reply = s_instance.reply;
+		s_instance.reply = eREPLY_NONE;
+		switch ( reply )
+		{
+			case eREPLY_REQUEST: SendRequest(); break;
+			case eREPLY_ACCEPT: SendControlMessage( eUSBPD_CTRL_MSG_ACCEPT ); break;
+			case eREPLY_SINK_CAP: SendSinkCapabilities(); break;
+			case eREPLY_NOT_SUPPORTED:
+				SendControlMessage(
+					s_instance.pdVersion >= eUSBPD_REV_30 ? eUSBPD_CTRL_MSG_NOT_SUPPORTED : eUSBPD_CTRL_MSG_REJECT );
+				break;
+			case eREPLY_SOFT_RESET:
+				ResetProtocol();
+				SendControlMessage( eUSBPD_CTRL_MSG_SOFT_RESET );
+				break;
+			default:
+				if ( TimerExpired( eTIMER_REQUEST ) )
+				{
+					SendRequest(); // retry after a Wait
+				}
+				else if ( s_instance.state == eSTATE_PS_RDY && s_instance.selectPending )
+				{
+					SendRequest(); // application selected a different PDO
+				}
+				else if ( s_instance.state == eSTATE_PS_RDY && TimerExpired( eTIMER_PPS ) )
+				{
+					SendRequest(); // PPS keep-alive
+				}
+				break;
+		}
 	}
 
-	return eUSBPD_BUSY;
+	NVIC_EnableIRQ( USBPD_IRQn );
+}
+
+void USBPD_SetCallback( USBPD_Callback_t callback )
+{
+	s_instance.callback = callback;
 }
 
 void USBPD_Reset( void )
@@ -658,6 +1244,8 @@ void USBPD_Reset( void )
 	NVIC_DisableIRQ( USBPD_IRQn );
 	s_instance = ( USBPD_Instance_t ){
 		.pdVersion = eUSBPD_REV_30,
+		.rxMessageID = 0xff,
+		.callback = s_instance.callback,
 	};
 }
 
@@ -678,6 +1266,12 @@ const char *USBPD_ResultToStr( USBPD_Result_e result )
 	(void)result;
 	return "";
 }
+
+const char *USBPD_EventToStr( USBPD_Event_e event )
+{
+	(void)event;
+	return "";
+}
 #else
 const char *USBPD_StateToStr( USBPD_State_e state )
 {
@@ -706,6 +1300,21 @@ const char *USBPD_ResultToStr( USBPD_Result_e result )
 		default: return "Unknown Result";
 	}
 }
+
+const char *USBPD_EventToStr( USBPD_Event_e event )
+{
+	switch ( event )
+	{
+		case eUSBPD_EVENT_ATTACHED: return "Attached";
+		case eUSBPD_EVENT_DETACHED: return "Detached";
+		case eUSBPD_EVENT_SOURCE_CAPS: return "Source Capabilities";
+		case eUSBPD_EVENT_CONTRACT: return "Contract";
+		case eUSBPD_EVENT_REJECTED: return "Rejected";
+		case eUSBPD_EVENT_HARD_RESET: return "Hard Reset";
+		case eUSBPD_EVENT_ERROR: return "Error";
+		default: return "Unknown Event";
+	}
+}
 #endif // FUNCONF_USBPD_NO_STR
 
 USBPD_Result_e USBPD_SelectPDO( uint8_t index, uint32_t voltageIn100mV )
@@ -715,52 +1324,24 @@ USBPD_Result_e USBPD_SelectPDO( uint8_t index, uint32_t voltageIn100mV )
 		return eUSBPD_ERROR_ARGS;
 	}
 
-	const USBPD_SourcePDO_t *const pdo = &s_instance.caps.Source[index];
+	s_instance.select = USBPD_SELECT( index, voltageIn100mV );
+	s_instance.selectPending = true;
 
-	*(USBPD_MessageHeader_t *)&s_buffer[0] = ( USBPD_MessageHeader_t ){
-		.MessageID = s_instance.messageID,
-		.MessageType = eUSBPD_DATA_MSG_REQUEST,
-		.NumberOfDataObjects = 1u,
-		.SpecificationRevision = s_instance.pdVersion,
-	};
-	USBPD_RequestDataObject_t *const rdo = (USBPD_RequestDataObject_t *)&s_buffer[sizeof( USBPD_MessageHeader_t )];
+	return eUSBPD_OK;
+}
 
-	if ( USBPD_IsPPS( pdo ) )
+bool USBPD_GetContract( uint8_t *index, uint32_t *voltageIn100mV )
+{
+	const uint32_t contract = s_instance.contract;
+	if ( index )
 	{
-		// Clamp voltage to min/max NOTE: Maybe we should return an error if the voltage is out of range?
-		const uint32_t minVoltage = pdo->SPR_PPS.MinVoltageIn100mV;
-		const uint32_t maxVoltage = pdo->SPR_PPS.MaxVoltageIn100mV;
-		voltageIn100mV = voltageIn100mV > maxVoltage ? maxVoltage : voltageIn100mV;
-		voltageIn100mV = voltageIn100mV < minVoltage ? minVoltage : voltageIn100mV;
-
-		*rdo = ( USBPD_RequestDataObject_t ){
-			.PPS =
-				{
-					.ObjectPosition = index + 1,
-					.OutputVoltageIn20mV = voltageIn100mV * 5,
-					.OperatingCurrentIn50mA = pdo->SPR_PPS.MaxCurrentIn50mA,
-					.NoUSBSuspended = 1u,
-					.USBComsCapable = 1u, // TODO: Should have these are arguments or define
-				},
-		};
+		*index = USBPD_SELECT_INDEX( contract );
 	}
-	else
+	if ( voltageIn100mV )
 	{
-		*rdo = ( USBPD_RequestDataObject_t ){
-			.FixedAndVariable =
-				{
-					.ObjectPosition = index + 1,
-					.MaxCurrentIn10mA = pdo->FixedSupply.MaxCurrentIn10mA,
-					.OperatingCurrentIn10mA = pdo->FixedSupply.MaxCurrentIn10mA,
-					.USBComsCapable = 1u,
-					.NoUSBSuspended = 1u,
-				},
-		};
+		*voltageIn100mV = USBPD_SELECT_VOLTAGE( contract );
 	}
-
-	SendMessage( 6 );
-
-	return eUSBPD_OK;
+	return s_instance.hasContract;
 }
 
 /**
@@ -827,6 +1408,7 @@ static USBPD_CC_e GetActiveCCLine( void )
  */
 static void SwitchRXMode( void )
 {
+	USBPD->DMA = (uint32_t)s_buffer;
 	USBPD->BMC_CLK_CNT = UPD_TMR_RX;
 	USBPD->CONTROL = ( USBPD->CONTROL & ~PD_TX_EN ) | BMC_START;
 }
@@ -846,64 +1428,22 @@ static void SendMessage( uint8_t size )
 }
 
 /**
- * @brief  Parse the received packet
- * @param  None
+ * @brief  Reply to a received message with GoodCRC, this has to start within tTransmit (195us)
+ *         so it is sent straight from the ISR
+ * @param  messageID: MessageID of the received message
  * @return None
  */
-static void ParsePacket( void )
+static void SendGoodCRC( uint8_t messageID )
 {
-	bool sendGoodCRC = true;
-	USBPD_MessageHeader_t message = *(USBPD_MessageHeader_t *)s_buffer;
-
-	USBPD_State_e nextState = s_instance.state;
-
-	if ( message.NumberOfDataObjects == 0u )
-	{
-		switch ( (USBPD_ControlMessage_e)message.MessageType )
-		{
-			case eUSBPD_CTRL_MSG_GOODCRC:
-				sendGoodCRC = false;
-				s_instance.messageID++;
-				break;
-
-			case eUSBPD_CTRL_MSG_ACCEPT: nextState = eSTATE_WAIT_PS_RDY; break;
-
-			case eUSBPD_CTRL_MSG_REJECT: nextState = eSTATE_SOURCE_CAP; break;
-
-			case eUSBPD_CTRL_MSG_PS_RDY: nextState = eSTATE_PS_RDY; break;
-
-			default: break;
-		}
-	}
-	else
-	{
-		switch ( (USBPD_DataMessage_e)message.MessageType )
-		{
-
-			case eUSBPD_DATA_MSG_SOURCE_CAP:
-				nextState = eSTATE_SOURCE_CAP;
-				s_instance.pdoCount = message.NumberOfDataObjects;
-				s_instance.pdVersion = message.SpecificationRevision;
-				memcpy( &s_instance.caps, &s_buffer[2], sizeof( USBPD_SPR_CapabilitiesMessage_t ) );
-				break;
-
-			default: break;
-		}
-	}
-
-	if ( message.Extended || sendGoodCRC )
-	{
-		Delay_Us( 30 );
-		USBPD_ControlMessage_t reply = ( USBPD_ControlMessage_t ){
-			.MessageID = message.MessageID,
-			.MessageType = eUSBPD_CTRL_MSG_GOODCRC,
-			.SpecificationRevision = s_instance.pdVersion,
-		};
-		*(uint16_t *)&s_buffer[0] = reply.data;
-		SendMessage( sizeof( reply ) );
-	}
-
-	s_instance.state = nextState;
+	Delay_Us( 30 ); // tInterFrameGap
+	*(USBPD_ControlMessage_t *)s_crcBuffer = ( USBPD_ControlMessage_t ){
+		.MessageID = messageID,
+		.MessageType = eUSBPD_CTRL_MSG_GOODCRC,
+		.SpecificationRevision = s_instance.pdVersion,
+	};
+	s_instance.sendingGoodCRC = true;
+	USBPD->DMA = (uint32_t)s_crcBuffer;
+	SendMessage( sizeof( USBPD_ControlMessage_t ) );
 }
 
 void USBPD_IRQHandler( void ) __attribute__( ( interrupt ) );
@@ -915,22 +1455,55 @@ void USBPD_IRQHandler( void )
 		// Check if we received a SOP0 packet
 		if ( ( ( USBPD->STATUS & BMC_AUX_MASK ) == BMC_AUX_SOP0 ) && ( USBPD->BMC_BYTE_CNT >= 6 ) )
 		{
-			ParsePacket();
+			const USBPD_MessageHeader_t message = *(USBPD_MessageHeader_t *)s_buffer;
+			if ( message.NumberOfDataObjects == 0u && message.MessageType == eUSBPD_CTRL_MSG_GOODCRC )
+			{
+				if ( s_instance.txState == eTX_WAIT_CRC && message.MessageID == s_instance.messageID )
+				{
+					MessageSent();
+				}
+			}
+			else if ( !s_instance.sendingGoodCRC )
+			{
+				memcpy( s_message, s_buffer, sizeof( s_message ) );
+				SendGoodCRC( message.MessageID );
+			}
 		}
 		USBPD->STATUS |= IF_RX_ACT;
 	}
 
-	// Transmit complete interrupt (GoodCRC only)
+	// Transmit complete interrupt
 	if ( USBPD->STATUS & IF_TX_END )
 	{
 		SwitchRXMode();
 		USBPD->STATUS |= IF_TX_END;
+
+		if ( s_instance.sendingGoodCRC )
+		{
+			s_instance.sendingGoodCRC = false;
+			ProcessMessage();
+		}
+		else if ( s_instance.txState == eTX_SENDING )
+		{
+			s_instance.txState = eTX_WAIT_CRC;
+			StartTimer( eTIMER_TX, USBPD_T_RECEIVE );
+		}
+		else if ( s_instance.txState == eTX_HARD_RESET )
+		{
+			ResetProtocol();
+			WaitForCapabilities( USBPD_T_HARD_RESET_RECOVER );
+		}
 	}
 
 	// Reset interrupt
 	if ( USBPD->STATUS & IF_RX_RESET )
 	{
 		USBPD->STATUS |= IF_RX_RESET;
+		s_instance.sendingGoodCRC = false;
+		ResetProtocol();
+		WaitForCapabilities( USBPD_T_HARD_RESET_RECOVER );
+		SwitchRXMode();
+		Event( eUSBPD_EVENT_HARD_RESET );
 	}
 }
 
@@ -58,6 +58,51 @@ int getchar( void )
 }
 
 
+static volatile uint32_t s_events = 0; // bit per USBPD_Event_e, reported from the main loop
+
+/**
+ * @brief  USB PD event callback, runs in interrupt context so only take note of the event
+ * @param  event - what happened
+ * @return None
+ */
+static void OnUSBPDEvent( USBPD_Event_e event )
+{
+	s_events |= 1u << event;
+}
+
+/**
+ * @brief  Print the capabilities of the source
+ * @param  debuggerAttached - only print when a debugger is attached
+ * @return None
+ */
+static void PrintCapabilities( const bool debuggerAttached )
+{
+	USBPD_SPR_CapabilitiesMessage_t *capabilities;
+	const size_t count = USBPD_GetCapabilities( &capabilities );
+
+	LOG( "USB PD V%d.0 capabilities:", USBPD_GetVersion() + 1 );
+	for ( size_t i = 0; i < count; i++ )
+	{
+		const USBPD_SourcePDO_t *pdo = &capabilities->Source[i];
+		switch ( pdo->Header.PDOType )
+		{
+			case eUSBPD_PDO_FIXED: LOG( "%d: " FIXED_SUPPLY_FMT, i, FIXED_SUPPLY_FMT_ARGS( pdo ) ); break;
+			case eUSBPD_PDO_BATTERY: LOG( "%d: " BATTERY_SUPPLY_FMT, i, BATTERY_SUPPLY_FMT_ARGS( pdo ) ); break;
+			case eUSBPD_PDO_VARIABLE: LOG( "%d: " VARIABLE_SUPPLY_FMT, i, VARIABLE_SUPPLY_FMT_ARGS( pdo ) ); break;
+			case eUSBPD_PDO_AUGMENTED:
+				switch ( pdo->Header.AugmentedType )
+				{
+					case eUSBPD_APDO_SPR_PPS: LOG( "%d: " SPR_PPS_FMT, i, SPR_PPS_FMT_ARGS( pdo ) ); break;
+					case eUSBPD_APDO_SPR_AVS: LOG( "%d: " SPR_AVS_FMT, i, SPR_AVS_FMT_ARGS( pdo ) ); break;
+					case eUSBPD_APDO_EPR_AVS: LOG( "%d: " EPR_AVS_FMT, i, EPR_AVS_FMT_ARGS( pdo ) ); break;
+					default: LOG( "  Unknown Augmented PDO type: %d", pdo->Header.AugmentedType ); break;
+				}
+				break;
+			default: LOG( "  Unknown PDO type: %d", pdo->Header.PDOType ); break;
+		}
+	}
+}
+
 /**
  * @brief  Application entry point
  * @param  None
@@ -69,8 +114,9 @@ int main( void )
 
 	const bool debuggerAttached = !WaitForDebuggerToAttach( 1000 );
 	bool cycleSupplies = false;
-
-	SysTick_Init();
+	uint8_t cycleIndex = 0;
+	uint32_t cycleVoltage = 0;
+	uint32_t lastCycle = 0;
 
 	LOG( "System started" );
 
@@ -87,112 +133,85 @@ int main( void )
 			;
 	}
 
-	LOG( "You can press 'r' to reset USB PD negotiation,\n"
-		 "'q' to reset the board,\n"
-		 "'c' to toggle cycling through supplies." );
-
-loop_start:
-
+	USBPD_SetCallback( OnUSBPDEvent );
 	USBPD_Reset();
 
-	LOG( "USB PD init done" );
+	// USB PD runs from here on in the USBPD and SysTick interrupts
+	SysTick_Init();
 
-	const uint32_t start = s_systickCount;
-	const uint32_t timeout = 20000;
-	uint32_t lastLog = 0;
+	LOG( "You can press 'r' to reset USB PD negotiation,\n"
+		 "'q' to reset the board,\n"
+		 "'c' to toggle cycling through supplies." );
 
-	while ( eUSBPD_BUSY == ( result = USBPD_SinkNegotiate() ) )
+	while ( 1 )
 	{
-		if ( ( s_systickCount - start ) > timeout )
+		// Nothing in here has to wait for USB PD, a control loop could run here instead
+		const uint32_t events = __atomic_exchange_n( &s_events, 0, __ATOMIC_RELAXED );
+		for ( int event = 0; event <= eUSBPD_EVENT_ERROR; event++ )
 		{
-			LOG( "USB PD negotiation timed out" );
-			break;
+			if ( !( events & ( 1u << event ) ) ) continue;
+
+			LOG( "USB PD event: %s, state: %s", USBPD_EventToStr( event ), USBPD_StateToStr( USBPD_GetState() ) );
+			if ( event == eUSBPD_EVENT_SOURCE_CAPS )
+			{
+				PrintCapabilities( debuggerAttached );
+			}
+			else if ( event == eUSBPD_EVENT_CONTRACT )
+			{
+				uint8_t index;
+				uint32_t voltage;
+				USBPD_GetContract( &index, &voltage );
+				LOG( "Contract for PDO %d %d mV", index, (int)voltage * 100 );
+			}
 		}
 
-		if ( s_systickCount > ( lastLog + 1000 ) )
+		if ( cycleSupplies && USBPD_GetState() == eSTATE_PS_RDY && ( s_systickCount - lastCycle ) >= 1000 )
 		{
-			LOG( "Negotiating USB PD: %s", USBPD_StateToStr( USBPD_GetState() ) );
-			lastLog = s_systickCount;
+			USBPD_SPR_CapabilitiesMessage_t *capabilities;
+			const size_t count = USBPD_GetCapabilities( &capabilities );
+			if ( cycleIndex >= count ) cycleIndex = 0;
+
+			const USBPD_SourcePDO_t *pdo = &capabilities->Source[cycleIndex];
+			if ( USBPD_IsPPS( pdo ) )
+			{
+				if ( cycleVoltage < pdo->SPR_PPS.MinVoltageIn100mV ) cycleVoltage = pdo->SPR_PPS.MinVoltageIn100mV;
+				LOG( "Selecting PDO %d, PPS voltage %d mV", cycleIndex, (int)cycleVoltage * 100 );
+				USBPD_SelectPDO( cycleIndex, cycleVoltage );
+				cycleVoltage += 10;
+				if ( cycleVoltage > pdo->SPR_PPS.MaxVoltageIn100mV )
+				{
+					cycleVoltage = 0;
+					cycleIndex++;
+				}
+			}
+			else
+			{
+				LOG( "Selecting PDO %d", cycleIndex );
+				USBPD_SelectPDO( cycleIndex, 0 );
+				cycleIndex++;
+			}
+			lastCycle = s_systickCount;
 		}
 
 		if ( !debuggerAttached ) continue;
 
 		switch ( getchar() )
 		{
-			case 'r': LOG( "Resetting USB PD negotiation" ); goto loop_start;
+			case 'r':
+				LOG( "Resetting USB PD negotiation" );
+				USBPD_Reset();
+				break;
 			case 'q': NVIC_SystemReset();
 			case 'c':
 				cycleSupplies = !cycleSupplies;
+				cycleIndex = 0;
+				cycleVoltage = 0;
 				LOG( "Cycling through supplies %s", cycleSupplies ? "on" : "off" );
 				break;
 			case -1: break;
 			default: break;
 		}
 	}
-
-	if ( eUSBPD_OK != result )
-	{
-		LOG( "USB PD negotiation failed: %s, state: %s", USBPD_ResultToStr( result ),
-			USBPD_StateToStr( USBPD_GetState() ) );
-	}
-	else
-	{
-		LOG( "USB PD V%d.0 negotiation done", USBPD_GetVersion() );
-
-		USBPD_SPR_CapabilitiesMessage_t *capabilities;
-		const size_t count = USBPD_GetCapabilities( &capabilities );
-
-		LOG( "USB PD capabilities:" );
-		for ( size_t i = 0; i < count; i++ )
-		{
-			const USBPD_SourcePDO_t *pdo = &capabilities->Source[i];
-			switch ( pdo->Header.PDOType )
-			{
-				case eUSBPD_PDO_FIXED: LOG( "%d: " FIXED_SUPPLY_FMT, i, FIXED_SUPPLY_FMT_ARGS( pdo ) ); break;
-				case eUSBPD_PDO_BATTERY: LOG( "%d: " BATTERY_SUPPLY_FMT, i, BATTERY_SUPPLY_FMT_ARGS( pdo ) ); break;
-				case eUSBPD_PDO_VARIABLE: LOG( "%d: " VARIABLE_SUPPLY_FMT, i, VARIABLE_SUPPLY_FMT_ARGS( pdo ) ); break;
-				case eUSBPD_PDO_AUGMENTED:
-					switch ( pdo->Header.AugmentedType )
-					{
-						case eUSBPD_APDO_SPR_PPS: LOG( "%d: " SPR_PPS_FMT, i, SPR_PPS_FMT_ARGS( pdo ) ); break;
-						case eUSBPD_APDO_SPR_AVS: LOG( "%d: " SPR_AVS_FMT, i, SPR_AVS_FMT_ARGS( pdo ) ); break;
-						case eUSBPD_APDO_EPR_AVS: LOG( "%d: " EPR_AVS_FMT, i, EPR_AVS_FMT_ARGS( pdo ) ); break;
-						default: LOG( "  Unknown Augmented PDO type: %d", pdo->Header.AugmentedType ); break;
-					}
-					break;
-				default: LOG( "  Unknown PDO type: %d", pdo->Header.PDOType ); break;
-			}
-		}
-
-		if ( cycleSupplies )
-		{
-			LOG( "Cycling though PDO" );
-			for ( size_t i = 0; i < count; i++ )
-			{
-				const USBPD_SourcePDO_t *pdo = &capabilities->Source[i];
-				LOG( "Selecting PDO %d", i );
-				if ( USBPD_IsPPS( pdo ) )
-				{
-					for ( uint32_t voltage = pdo->SPR_PPS.MinVoltageIn100mV; voltage <= pdo->SPR_PPS.MaxVoltageIn100mV;
-						  voltage += 10 )
-					{
-						LOG( "Setting PPS voltage to %d mV", (int)voltage * 10 );
-						USBPD_SelectPDO( i, voltage );
-						Delay_Ms( 1000 );
-					}
-				}
-				else
-				{
-					USBPD_SelectPDO( i, 0 );
-				}
-				Delay_Ms( 1000 );
-			}
-		}
-	}
-
-	Delay_Ms( 3000 );
-
-	goto loop_start;
 }
 
 /**
@@ -243,6 +262,8 @@ void SysTick_Handler( void )
 
 	// Update counter
 	s_systickCount++;
+
+	USBPD_Tick();
 }
 
 //------------------------------------------------------------------------------
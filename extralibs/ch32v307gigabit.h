@@ -7,9 +7,45 @@
 // #define CH32V307GIGABIT_MCO25 1
 // #define CH32V307GIGABIT_PHYADDRESS 0
 
+#ifndef CH32V307GIGABIT_RXBUFNB
 #define CH32V307GIGABIT_RXBUFNB 8
+#endif
+
+#ifndef CH32V307GIGABIT_TXBUFNB
 #define CH32V307GIGABIT_TXBUFNB 8
+#endif
+
+#ifndef CH32V307GIGABIT_BUFFSIZE
 #define CH32V307GIGABIT_BUFFSIZE 1524 // 1518 + 4, Rounded up.
+#endif
+
+// Interrupt coalescing.  Only every Nth RX descriptor raises an interrupt
+// (the rest have DIC set), and every interrupt drains all ready descriptors.
+// If this is more than 1, call ch32v307ethPollRx() from your main loop so
+// that frames sitting in the ring for longer than
+// CH32V307GIGABIT_RX_COALESCE_TIMEOUT SysTicks still get handled.
+#ifndef CH32V307GIGABIT_RX_COALESCE_FRAMES
+#define CH32V307GIGABIT_RX_COALESCE_FRAMES 1
+#endif
+
+#ifndef CH32V307GIGABIT_RX_COALESCE_TIMEOUT
+#define CH32V307GIGABIT_RX_COALESCE_TIMEOUT Ticks_from_Us(100)
+#endif
+
+// Define CH32V307GIGABIT_BATCH_RX to get all frames of an interrupt handed
+// to ch32v307ethInitHandlePacketBatch() at once, instead of one call per frame
+// to ch32v307ethInitHandlePacket().
+#ifndef CH32V307GIGABIT_RX_BATCH_MAX
+#define CH32V307GIGABIT_RX_BATCH_MAX ((CH32V307GIGABIT_RXBUFNB<32)?CH32V307GIGABIT_RXBUFNB:32)
+#endif
+
+#if CH32V307GIGABIT_RX_BATCH_MAX > 32
+#error CH32V307GIGABIT_RX_BATCH_MAX must be 32 or less (hold mask is 32 bits)
+#endif
+
+#if CH32V307GIGABIT_RX_BATCH_MAX > CH32V307GIGABIT_RXBUFNB
+#error CH32V307GIGABIT_RX_BATCH_MAX must be CH32V307GIGABIT_RXBUFNB or less (a batch is one pass over the ring)
+#endif
 
 #define CH32V307GIGABIT_CFG_CLOCK_DELAY 4 // 0..7
 #define CH32V307GIGABIT_CFG_CLOCK_PHASE 0
@@ -40,12 +76,26 @@ typedef struct
   uint32_t   Buffer2NextDescAddr;   /* Buffer2 or next descriptor address pointer */
 } ETH_DMADESCTypeDef;
 
+typedef struct
+{
+	uint8_t * data;
+	int frame_length;
+	ETH_DMADESCTypeDef * dmadesc;
+} ch32v307ethFrame;
+
 // You must provide:
 
 void ch32v307ethHandleReconfig( int link, int speed, int duplex );
 
+#ifdef CH32V307GIGABIT_BATCH_RX
+// Called once per drain with every good frame that was ready.  Return a mask
+// with bit n set for each frames[n] you are still holding onto; those are not
+// handed back to the hardware until you call ch32v307ethReleaseRx() on them.
+uint32_t ch32v307ethInitHandlePacketBatch( ch32v307ethFrame * frames, int count );
+#else
 // Return non-zero to suppress OWN return (for if you are still holding onto the buffer)
 int ch32v307ethInitHandlePacket( uint8_t * data, int frame_length, ETH_DMADESCTypeDef * dmadesc );
+#endif
 
 void ch32v307ethInitHandleTXC( void );
 
@@ -53,6 +103,10 @@ void ch32v307ethInitHandleTXC( void );
 static void ch32v307ethGetMacInUC( uint8_t * mac );
 static int ch32v307ethInit( void );
 static int ch32v307ethTransmitStatic(uint8_t * buffer, uint32_t length, int enable_txc);  // Does not copy.
+// Send one frame made of two separate buffers, i.e. a header and a payload.  Does not copy.
+static int ch32v307ethTransmitGather( const uint8_t * header, uint32_t header_length, const uint8_t * payload, uint32_t payload_length, int enable_txc );
+static void ch32v307ethReleaseRx( ETH_DMADESCTypeDef * dmadesc ); // For frames you held onto.
+static void ch32v307ethPollRx( void ); // Only needed with CH32V307GIGABIT_RX_COALESCE_FRAMES > 1
 static int ch32v307ethTickPhy( void );
 
 // Data pursuent to ethernet.
@@ -63,6 +117,8 @@ ETH_DMADESCTypeDef ch32v307eth_DMATxDscrTab[CH32V307GIGABIT_TXBUFNB] __attribute
 uint8_t  ch32v307eth_MACRxBuf[CH32V307GIGABIT_RXBUFNB*CH32V307GIGABIT_BUFFSIZE] __attribute__((aligned(4))); // MAC receive buffer, 4-byte aligned
 ETH_DMADESCTypeDef * pDMARxGet;
 ETH_DMADESCTypeDef * pDMATxSet;
+uint32_t ch32v307eth_rxpending_since;
+uint8_t ch32v307eth_rxpending;
 
 
 // Internal functions
@@ -366,21 +422,27 @@ static int ch32v307ethInit( void )
 	ETH->MACFCR = 0; // No pause frames.
 
 	// Configure RX/TX chains.
+	// TX uses ring mode (not chained) so that Buffer2 can carry a second
+	// data buffer.  With DSL = 0 the descriptors are simply back-to-back,
+	// and TER on the last one wraps the hardware back to DMATDLAR.
 	ETH_DMADESCTypeDef *tdesc;
 	for(i = 0; i < CH32V307GIGABIT_TXBUFNB; i++)
 	{
 		tdesc = ch32v307eth_DMATxDscrTab + i;
 		tdesc->ControlBufferSize = 0;
-		tdesc->Status = ETH_DMATxDesc_TCH | ETH_DMATxDesc_IC | ETH_DMATxDesc_FS;
+		tdesc->Status = ( i == CH32V307GIGABIT_TXBUFNB - 1 ) ? ETH_DMATxDesc_TER : 0;
 		tdesc->Buffer1Addr = (uint32_t)0; // Populate with data.
-		tdesc->Buffer2NextDescAddr = (i < CH32V307GIGABIT_TXBUFNB - 1) ? ((uint32_t)(ch32v307eth_DMATxDscrTab + i + 1)) : (uint32_t)ch32v307eth_DMATxDscrTab;
+		tdesc->Buffer2NextDescAddr = (uint32_t)0;
 	}
+	ETH->DMABMR &= ~ETH_DMABMR_DSL;
 	ETH->DMATDLAR = (uint32_t)ch32v307eth_DMATxDscrTab;
 	for(i = 0; i < CH32V307GIGABIT_RXBUFNB; i++)
 	{
 		tdesc = ch32v307eth_DMARxDscrTab + i;
 		tdesc->Status = ETH_DMARxDesc_OWN;
-		tdesc->ControlBufferSize = ETH_DMARxDesc_RCH | (uint32_t)CH32V307GIGABIT_BUFFSIZE;
+		// Only every CH32V307GIGABIT_RX_COALESCE_FRAMES'th descriptor interrupts on completion.
+		tdesc->ControlBufferSize = ETH_DMARxDesc_RCH | (uint32_t)CH32V307GIGABIT_BUFFSIZE |
+			( ( ( i + 1 ) % CH32V307GIGABIT_RX_COALESCE_FRAMES ) ? ETH_DMARxDesc_DIC : 0 );
 		tdesc->Buffer1Addr = (uint32_t)(&ch32v307eth_MACRxBuf[i * CH32V307GIGABIT_BUFFSIZE]);
 		tdesc->Buffer2NextDescAddr = (i < CH32V307GIGABIT_RXBUFNB - 1) ? (uint32_t)(ch32v307eth_DMARxDscrTab + i + 1) : (uint32_t)(ch32v307eth_DMARxDscrTab);
 	}
@@ -409,6 +471,128 @@ static int ch32v307ethInit( void )
 	return 0;
 }
 
+static inline ETH_DMADESCTypeDef * ch32v307ethNextRx( ETH_DMADESCTypeDef * desc )
+{
+	// Tricky logic for figuring out the next packet. Originally
+	// discussed in ch32v30x_eth.c in ETH_DropRxPkt
+	if((desc->ControlBufferSize & ETH_DMARxDesc_RCH) != (uint32_t)RESET)
+		return (ETH_DMADESCTypeDef *)(desc->Buffer2NextDescAddr);
+	else if((desc->ControlBufferSize & ETH_DMARxDesc_RER) != (uint32_t)RESET)
+		return (ETH_DMADESCTypeDef *)(ETH->DMARDLAR);
+	else
+		return (ETH_DMADESCTypeDef *)((uint32_t)desc + 0x10 + ((ETH->DMABMR & ETH_DMABMR_DSL) >> 2));
+}
+
+// Handles every descriptor the hardware has filled in, not just the one that
+// caused the interrupt.  Must be called from the ETH IRQ, or with it disabled.
+static void ch32v307ethDrainRx( void )
+{
+#ifdef CH32V307GIGABIT_BATCH_RX
+	ch32v307ethFrame frames[CH32V307GIGABIT_RX_BATCH_MAX];
+	int nframes = 0;
+#endif
+
+	// Received a packet, normally.
+	// Status is in Table 27-17 Definitions of RDes0
+	do
+	{
+		uint32_t status = pDMARxGet->Status;
+		if( status & ETH_DMARxDesc_OWN ) break;
+
+		// We only have a valid packet in a specific situation.
+		// So, we take the status, then mask off the bits we care about
+		// And see if they're equal to the ones that need to be set/unset.
+		const uint32_t mask = 
+			ETH_DMARxDesc_OWN |
+			ETH_DMARxDesc_LS |
+			ETH_DMARxDesc_ES |
+			ETH_DMARxDesc_FS;
+		const uint32_t eq = 
+			0 |
+			ETH_DMARxDesc_LS |
+			0 |
+			ETH_DMARxDesc_FS;
+
+		int suppress_own = 0;
+
+		if( ( status & mask ) == eq )
+		{
+			int32_t frame_length = ((status & ETH_DMARxDesc_FL) >> ETH_DMARXDESC_FRAME_LENGTHSHIFT) - 4;
+			if( frame_length > 0 )
+			{
+				uint8_t * data = (uint8_t*)pDMARxGet->Buffer1Addr;
+#ifdef CH32V307GIGABIT_BATCH_RX
+				frames[nframes].data = data;
+				frames[nframes].frame_length = frame_length;
+				frames[nframes].dmadesc = pDMARxGet;
+				nframes++;
+				suppress_own = 1; // Returned after the batch is handled.
+#else
+				suppress_own = ch32v307ethInitHandlePacket( data, frame_length, pDMARxGet );
+#endif
+			}
+		}
+		// Otherwise, Invalid Packet
+
+		// Relinquish control back to underlying hardware.
+		if( !suppress_own )
+			pDMARxGet->Status = ETH_DMARxDesc_OWN;
+
+		pDMARxGet = ch32v307ethNextRx( pDMARxGet );
+
+#ifdef CH32V307GIGABIT_BATCH_RX
+		if( nframes == CH32V307GIGABIT_RX_BATCH_MAX )
+		{
+			uint32_t held = ch32v307ethInitHandlePacketBatch( frames, nframes );
+			for( int i = 0; i < nframes; i++ )
+				if( !( held & (1u<<i) ) ) frames[i].dmadesc->Status = ETH_DMARxDesc_OWN;
+			nframes = 0;
+		}
+#endif
+	} while( 1 );
+
+#ifdef CH32V307GIGABIT_BATCH_RX
+	if( nframes )
+	{
+		uint32_t held = ch32v307ethInitHandlePacketBatch( frames, nframes );
+		for( int i = 0; i < nframes; i++ )
+			if( !( held & (1u<<i) ) ) frames[i].dmadesc->Status = ETH_DMARxDesc_OWN;
+	}
+#endif
+
+	ch32v307eth_rxpending = 0;
+
+	// If we ran out of descriptors, the receive process is suspended. Kick it.
+	ETH->DMARPDR = 0;
+}
+
+static void ch32v307ethReleaseRx( ETH_DMADESCTypeDef * dmadesc )
+{
+	dmadesc->Status = ETH_DMARxDesc_OWN;
+	ETH->DMARPDR = 0;
+}
+
+static void ch32v307ethPollRx( void )
+{
+#if CH32V307GIGABIT_RX_COALESCE_FRAMES > 1
+	if( pDMARxGet->Status & ETH_DMARxDesc_OWN ) return;
+
+	// Something is sitting in the ring without having raised an interrupt.
+	uint32_t now = funSysTick32();
+	if( !ch32v307eth_rxpending )
+	{
+		ch32v307eth_rxpending = 1;
+		ch32v307eth_rxpending_since = now;
+		return;
+	}
+	if( TimeElapsed32( now, ch32v307eth_rxpending_since ) < (int32_t)(CH32V307GIGABIT_RX_COALESCE_TIMEOUT) ) return;
+
+	NVIC_DisableIRQ( ETH_IRQn );
+	ch32v307ethDrainRx();
+	NVIC_EnableIRQ( ETH_IRQn );
+#endif
+}
+
 void ETH_IRQHandler( void ) __attribute__((interrupt));
 void ETH_IRQHandler( void )
 {
@@ -429,6 +613,8 @@ void ETH_IRQHandler( void )
 		    if (int_sta & ETH_DMA_IT_RBU)
 		    {
 		        ETH->DMASR = ETH_DMA_IT_RBU;
+		        // Ring is full.  With coalescing, the interrupting descriptor may not be reached yet.
+		        ch32v307ethDrainRx();
 		        if((INFO->CHIPID & 0xf0) == 0x10)
 		        {
 		            ((ETH_DMADESCTypeDef *)(((ETH_DMADESCTypeDef *)(ETH->DMACHRDR))->Buffer2NextDescAddr))->Status = ETH_DMARxDesc_OWN;
@@ -443,60 +629,9 @@ void ETH_IRQHandler( void )
 		{
 		    if( int_sta & ETH_DMA_IT_R )
 		    {
-				// Received a packet, normally.
-				// Status is in Table 27-17 Definitions of RDes0
-				do
-				{
-					// XXX TODO: Is this a good place to acknowledge? REVISIT: Should this go lower?
-					// XXX TODO: Restructure this to allow for 
-				    ETH->DMASR = ETH_DMA_IT_R;
-
-					uint32_t status = pDMARxGet->Status;
-					if( status & ETH_DMARxDesc_OWN ) break;
-
-					// We only have a valid packet in a specific situation.
-					// So, we take the status, then mask off the bits we care about
-					// And see if they're equal to the ones that need to be set/unset.
-					const uint32_t mask = 
-						ETH_DMARxDesc_OWN |
-						ETH_DMARxDesc_LS |
-						ETH_DMARxDesc_ES |
-						ETH_DMARxDesc_FS;
-					const uint32_t eq = 
-						0 |
-						ETH_DMARxDesc_LS |
-						0 |
-						ETH_DMARxDesc_FS;
-
-					int suppress_own = 0;
-
-					if( ( status & mask ) == eq )
-					{
-						int32_t frame_length = ((status & ETH_DMARxDesc_FL) >> ETH_DMARXDESC_FRAME_LENGTHSHIFT) - 4;
-						if( frame_length > 0 )
-						{
-							uint8_t * data = (uint8_t*)pDMARxGet->Buffer1Addr;
-							suppress_own = ch32v307ethInitHandlePacket( data, frame_length, pDMARxGet );
-						}
-					}
-					// Otherwise, Invalid Packet
-
-					// Relinquish control back to underlying hardware.
-					if( !suppress_own )
-						pDMARxGet->Status = ETH_DMARxDesc_OWN;
-
-					// Tricky logic for figuring out the next packet. Originally
-					// discussed in ch32v30x_eth.c in ETH_DropRxPkt
-					if((pDMARxGet->ControlBufferSize & ETH_DMARxDesc_RCH) != (uint32_t)RESET)
-						pDMARxGet = (ETH_DMADESCTypeDef *)(pDMARxGet->Buffer2NextDescAddr);
-					else
-					{
-						if((pDMARxGet->ControlBufferSize & ETH_DMARxDesc_RER) != (uint32_t)RESET)
-							pDMARxGet = (ETH_DMADESCTypeDef *)(ETH->DMARDLAR);
-						else
-							pDMARxGet = (ETH_DMADESCTypeDef *)((uint32_t)pDMARxGet + 0x10 + ((ETH->DMABMR & ETH_DMABMR_DSL) >> 2));
-					}
-				} while( 1 );
+				// XXX TODO: Is this a good place to acknowledge? REVISIT: Should this go lower?
+				ETH->DMASR = ETH_DMA_IT_R;
+				ch32v307ethDrainRx();
 		    }
 		    if( int_sta & ETH_DMA_IT_T )
 		    {
@@ -508,7 +643,7 @@ void ETH_IRQHandler( void )
 	} while( 1 );
 }
 
-static int ch32v307ethTransmitStatic(uint8_t * buffer, uint32_t length, int enable_txc)
+static int ch32v307ethTransmitGather( const uint8_t * header, uint32_t header_length, const uint8_t * payload, uint32_t payload_length, int enable_txc )
 {
 	// The official SDK waits until ETH_DMATxDesc_TTSS is set.
 	// This also provides a transmit timestamp, which could be
@@ -522,20 +657,24 @@ static int ch32v307ethTransmitStatic(uint8_t * buffer, uint32_t length, int enab
 		return -1;
 	}
 
-    pDMATxSet->ControlBufferSize = (length & ETH_DMATxDesc_TBS1);
-	pDMATxSet->Buffer1Addr = (uint32_t)buffer;
+	// In ring mode, Buffer2 is a second data buffer, sent right after Buffer1.
+	pDMATxSet->ControlBufferSize = (header_length & ETH_DMATxDesc_TBS1) | ((payload_length << 16) & ETH_DMATxDesc_TBS2);
+	pDMATxSet->Buffer1Addr = (uint32_t)header;
+	pDMATxSet->Buffer2NextDescAddr = (uint32_t)payload;
+
+	int last = ( pDMATxSet == ch32v307eth_DMATxDscrTab + CH32V307GIGABIT_TXBUFNB - 1 );
 
 	// Status is in Table 27-12 "Definitions of TDes0 bits"
 	enable_txc = enable_txc ? ETH_DMATxDesc_IC : 0;
-    pDMATxSet->Status = 
+	pDMATxSet->Status = 
 		ETH_DMATxDesc_LS |                  // Last Segment (This is all you need to have to transmit)
 		ETH_DMATxDesc_FS |                  // First Segment (Beginning of transmission)
 		enable_txc |                        // Interrupt when complete
-		ETH_DMATxDesc_TCH |                 // Next Descriptor Address Valid
+		( last ? ETH_DMATxDesc_TER : 0 ) |  // End of ring, wrap back to the start
 		ETH_DMATxDesc_CIC_TCPUDPICMP_Full | // Do all header checksums.
 		ETH_DMATxDesc_OWN;                  // Own back to hardware
 
-	pDMATxSet = (ETH_DMADESCTypeDef*)pDMATxSet->Buffer2NextDescAddr;
+	pDMATxSet = last ? ch32v307eth_DMATxDscrTab : ( pDMATxSet + 1 );
 
 	ETH->DMASR = ETH_DMASR_TBUS; // This resets the transmit process (or "starts" it)
 	ETH->DMATPDR = 0;
@@ -543,6 +682,11 @@ static int ch32v307ethTransmitStatic(uint8_t * buffer, uint32_t length, int enab
 	return 0;
 }
 
+static int ch32v307ethTransmitStatic(uint8_t * buffer, uint32_t length, int enable_txc)
+{
+	return ch32v307ethTransmitGather( buffer, length, 0, 0, enable_txc );
+}
+
 
 #endif
 
@@ -0,0 +1,689 @@
+#ifndef _FSUSB_MSC_H
+#define _FSUSB_MSC_H
+
+/* USB Mass Storage (Bulk-Only Transport, SCSI) class for fsusb.h.
+
+	The disk is any block device that can read 512-byte blocks and write whole
+	erase sectors (internal flash, SPI NOR, SD over SPI, ...):
+
+		int MyRead( const msc_blockdev * bd, uint32_t block, uint8_t * buf );
+		int MyWriteSector( const msc_blockdev * bd, uint32_t sector, const uint8_t * buf );
+
+		msc_blockdev disk = {
+			.blocks = 256,          // 128kB, in 512-byte blocks
+			.sector_size = 4096,    // Erase unit, a multiple of 512, <= MSC_MAX_SECTOR
+			.base = 0x20000,        // Passed through, for the callbacks to use
+			.read = MyRead,
+			.write_sector = MyWriteSector,
+		};
+
+	write_sector() is given a whole sector to erase and program.  For SD
+	cards, just use a sector_size of 512.  msc_spinor below is a ready made
+	backend for 25-series SPI NOR flash.
+
+	Writes are collected in a RAM cache of MSC_CACHE_SECTORS sector buffers,
+	so the eight 512-byte SCSI writes that make up a 4kB flash sector cost a
+	single erase.  Blocks of a sector the host did not write are read back
+	from the device before it is programmed.  The cache is written back when
+	a sector is complete, when the host moves on to another sector, on
+	SYNCHRONIZE CACHE / eject, or after MSC_FLUSH_MS of no writes.  Call
+	MSCFlush() before resetting into anything that reads the disk.
+
+	USB packets are stored into one sector buffer from the interrupt while
+	MSCPoll() programs another, so the host can send the next sector while
+	the previous one is being written back.  Only when every buffer is
+	waiting to be programmed is the OUT endpoint NAK'd.  Likewise, reads
+	fetch the next block into a second buffer while the current one is
+	being sent.
+
+	On CH5xx, ch5xx_flash.h masks interrupts while it erases/programs, the
+	USB hardware NAKs the host until it is done.  The write callback (and
+	anything it calls) has to be in RAM with __HIGH_CODE.
+
+	Hooking up, in your fsusb handlers:
+
+		HandleDataOut():      if( MSCHandleDataOut( endp, data, len ) ) return;
+		HandleInRequest():    MSCHandleInRequest( endp );
+		HandleSetupCustom():  class requests 0xFE, 0xFF: return MSCHandleSetup( ctx, setup_code );
+		main loop:            MSCPoll();
+
+	and call MSCInit( &disk, EP_MSC_IN, EP_MSC_OUT ) before USBFSSetup().
+
+	Options:
+		MSC_MAX_SECTOR     Largest sector_size, default 4096
+		MSC_CACHE_SECTORS  Sector buffers, default 2.  1 works, but the host waits for every erase.
+		MSC_READ_BUFFERS   Block buffers for reads, default 2.  1 turns off read-ahead.
+		MSC_FLUSH_MS       Write back a partial sector after this long, default 200
+		MSC_VENDOR, MSC_PRODUCT  INQUIRY strings, 8 and 16 characters
+*/
+
+#include <string.h>
+
+#ifndef MSC_MAX_SECTOR
+#define MSC_MAX_SECTOR 4096
+#endif
+
+#ifndef MSC_CACHE_SECTORS
+#define MSC_CACHE_SECTORS 2
+#endif
+
+#ifndef MSC_READ_BUFFERS
+#define MSC_READ_BUFFERS 2
+#endif
+
+#ifndef MSC_FLUSH_MS
+#define MSC_FLUSH_MS 200
+#endif
+
+#ifndef MSC_VENDOR
+#define MSC_VENDOR  "ch32fun "
+#endif
+
+#ifndef MSC_PRODUCT
+#define MSC_PRODUCT "Mass Storage    "
+#endif
+
+#if MSC_MAX_SECTOR / 512 > 32
+#error MSC_MAX_SECTOR can be at most 16kB
+#endif
+
+#if defined(CH571_CH573)
+#define MSC_NOW() ( 0 - funSysTick32() ) // Counts down
+#else
+#define MSC_NOW() funSysTick32()
+#endif
+
+#define MSC_BLOCK_SIZE 512
+
+typedef struct msc_blockdev_s msc_blockdev;
+struct msc_blockdev_s
+{
+	uint32_t blocks;       // Disk size, in 512-byte blocks
+	uint32_t sector_size;  // Erase unit in bytes, multiple of 512
+	uint32_t base;         // For the callbacks, i.e. where the disk starts on the device
+	int (*read)( const msc_blockdev * bd, uint32_t block, uint8_t * buf );                 // 0 on success
+	int (*write_sector)( const msc_blockdev * bd, uint32_t sector, const uint8_t * buf );  // 0 on success
+};
+
+void MSCInit( const msc_blockdev * bd, int ep_in, int ep_out );
+int MSCHandleDataOut( int endp, uint8_t * data, int len );
+void MSCHandleInRequest( int endp );
+int MSCHandleSetup( struct _USBState * ctx, int setup_code );
+void MSCPoll( void );
+int MSCFlush( void );
+
+#define MSC_CBW_SIGNATURE 0x43425355
+#define MSC_CSW_SIGNATURE 0x53425355
+
+// SCSI sense keys
+#define MSC_SENSE_NONE            0x00
+#define MSC_SENSE_MEDIUM_ERROR    0x03
+#define MSC_SENSE_ILLEGAL_REQUEST 0x05
+
+typedef enum
+{
+	MSC_IDLE,      // Waiting for a CBW
+	MSC_COMMAND,   // CBW received, MSCPoll() runs it
+	MSC_DATA_IN,   // MSCPoll() sending READ(10) data
+	MSC_DATA_OUT,  // Receiving WRITE(10) data in the interrupt
+	MSC_STATUS,    // MSCPoll() sends the CSW
+} msc_state_t;
+
+typedef enum
+{
+	MSC_CACHE_FREE,
+	MSC_CACHE_FILLING,  // Being written to by the host
+	MSC_CACHE_PENDING,  // Waiting for MSCPoll() to program it
+} msc_cache_state_t;
+
+struct msc_cbw
+{
+	uint32_t Signature;
+	uint32_t Tag;
+	uint32_t DataTransferLength;
+	uint8_t  Flags;
+	uint8_t  LUN;
+	uint8_t  CBLength;
+	uint8_t  CB[16];
+} __attribute__((packed));
+
+struct msc_csw
+{
+	uint32_t Signature;
+	uint32_t Tag;
+	uint32_t DataResidue;
+	uint8_t  Status;  // 0 = Passed, 1 = Failed
+} __attribute__((packed));
+
+struct msc_cache
+{
+	uint8_t data[MSC_MAX_SECTOR] __attribute__((aligned(4)));
+	uint32_t sector;
+	volatile uint32_t valid;  // One bit per block that holds host data
+	volatile uint8_t state;
+};
+
+struct msc_ctx
+{
+	const msc_blockdev * bd;
+	uint8_t ep_in, ep_out;
+	volatile uint8_t state;
+	volatile uint8_t nak;       // OUT endpoint is being held off
+	uint8_t write_error;        // Reported by the next SYNCHRONIZE CACHE
+	volatile int8_t filling;    // Cache buffer the host is writing into, or -1
+	uint32_t full_mask;         // valid when a whole sector has been written
+
+	struct msc_cbw cbw;
+	struct msc_csw csw;
+	uint32_t offset;            // Byte offset on the disk for READ/WRITE
+	volatile uint32_t remaining;
+	volatile uint32_t last_write;
+
+	uint8_t sense_key, sense_asc;
+
+	struct msc_cache cache[MSC_CACHE_SECTORS];
+
+	uint8_t rbuf[MSC_READ_BUFFERS][MSC_BLOCK_SIZE] __attribute__((aligned(4)));
+	uint32_t rblock[MSC_READ_BUFFERS];
+	uint8_t rnext;
+
+	uint32_t sector_erases;     // Statistics
+	uint32_t sector_readbacks;
+};
+
+struct msc_ctx msc;
+
+static inline uint32_t MSCBE32( const uint8_t * p ) { return ( p[0] << 24 ) | ( p[1] << 16 ) | ( p[2] << 8 ) | p[3]; }
+static inline void MSCPutBE32( uint8_t * p, uint32_t v ) { p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v; }
+
+void MSCInit( const msc_blockdev * bd, int ep_in, int ep_out )
+{
+	int i;
+	memset( &msc, 0, sizeof( msc ) );
+	msc.bd = bd;
+	msc.ep_in = ep_in;
+	msc.ep_out = ep_out;
+	msc.filling = -1;
+	msc.full_mask = ( bd->sector_size / MSC_BLOCK_SIZE >= 32 ) ? 0xffffffff : ( 1u << ( bd->sector_size / MSC_BLOCK_SIZE ) ) - 1;
+	for( i = 0; i < MSC_READ_BUFFERS; i++ )
+		msc.rblock[i] = 0xffffffff;
+}
+
+static void MSCSetSense( uint8_t key, uint8_t asc )
+{
+	msc.sense_key = key;
+	msc.sense_asc = asc;
+}
+
+static int MSCFindFree( void )
+{
+	int i;
+	for( i = 0; i < MSC_CACHE_SECTORS; i++ )
+		if( msc.cache[i].state == MSC_CACHE_FREE ) return i;
+	return -1;
+}
+
+// Interrupt context.  If the next packet needs a new buffer and there is none, hold the host off.
+static void MSCHoldOff( uint32_t sector )
+{
+	if( msc.filling >= 0 && msc.cache[(int)msc.filling].sector == sector ) return;
+	if( MSCFindFree() >= 0 ) return;
+	msc.nak = 1;
+	USBFS_SendNAK( msc.ep_out, 0 );
+}
+
+// Interrupt context.  Stores a WRITE(10) packet in the cache.
+static void MSCWritePacket( const uint8_t * data, uint32_t len )
+{
+	const uint32_t ss = msc.bd->sector_size;
+	struct msc_cache * c;
+
+	if( len > msc.remaining ) len = msc.remaining;
+
+	while( len )
+	{
+		uint32_t sector = msc.offset / ss;
+		uint32_t soff = msc.offset % ss;
+		uint32_t n = MSC_BLOCK_SIZE - ( soff % MSC_BLOCK_SIZE );
+		if( n > len ) n = len;
+
+		if( msc.filling < 0 || msc.cache[(int)msc.filling].sector != sector )
+		{
+			if( msc.filling >= 0 )
+				msc.cache[(int)msc.filling].state = MSC_CACHE_PENDING;
+			msc.filling = MSCFindFree();
+			if( msc.filling < 0 )
+			{
+				// Can't happen unless the host ignored the NAK, the data is lost.
+				MSCSetSense( MSC_SENSE_MEDIUM_ERROR, 0x0C );
+				msc.csw.Status = 1;
+				break;
+			}
+			c = &msc.cache[(int)msc.filling];
+			c->sector = sector;
+			c->valid = 0;
+			c->state = MSC_CACHE_FILLING;
+		}
+
+		c = &msc.cache[(int)msc.filling];
+		memcpy( c->data + soff, data, n );
+		if( ( soff + n ) % MSC_BLOCK_SIZE == 0 )
+			c->valid |= 1u << ( soff / MSC_BLOCK_SIZE );
+
+		// Complete sectors can go right away.
+		if( c->valid == msc.full_mask )
+		{
+			c->state = MSC_CACHE_PENDING;
+			msc.filling = -1;
+		}
+
+		data += n;
+		len -= n;
+		msc.offset += n;
+		msc.remaining -= n;
+	}
+
+	msc.last_write = MSC_NOW();
+
+	if( msc.remaining == 0 )
+	{
+		msc.state = MSC_STATUS;
+		return;
+	}
+
+	MSCHoldOff( msc.offset / ss );
+}
+
+int MSCHandleDataOut( int endp, uint8_t * data, int len )
+{
+	if( endp != msc.ep_out ) return 0;
+
+	if( msc.state == MSC_DATA_OUT )
+	{
+		MSCWritePacket( data, len );
+		return 1;
+	}
+
+	if( msc.state != MSC_IDLE || len != sizeof( struct msc_cbw ) ) return 1;
+	memcpy( &msc.cbw, data, sizeof( struct msc_cbw ) );
+	if( msc.cbw.Signature != MSC_CBW_SIGNATURE ) return 1;
+
+	msc.csw.Signature = MSC_CSW_SIGNATURE;
+	msc.csw.Tag = msc.cbw.Tag;
+	msc.csw.DataResidue = 0;
+	msc.csw.Status = 0;
+
+	if( msc.cbw.CB[0] == 0x2A ) // WRITE(10), data comes straight into the cache
+	{
+		uint32_t lba = MSCBE32( msc.cbw.CB + 2 );
+		uint32_t blocks = ( msc.cbw.CB[7] << 8 ) | msc.cbw.CB[8];
+		uint32_t bytes = blocks * MSC_BLOCK_SIZE;
+		if( lba + blocks > msc.bd->blocks || bytes != msc.cbw.DataTransferLength )
+		{
+			// Let MSCPoll() fail it.
+			msc.state = MSC_COMMAND;
+			return 1;
+		}
+		msc.offset = lba * MSC_BLOCK_SIZE;
+		msc.remaining = bytes;
+		msc.state = bytes ? MSC_DATA_OUT : MSC_STATUS;
+		if( bytes ) MSCHoldOff( msc.offset / msc.bd->sector_size );
+		return 1;
+	}
+
+	msc.state = MSC_COMMAND;
+	return 1;
+}
+
+void MSCHandleInRequest( int endp )
+{
+	// Nothing to do, MSCPoll() sends as soon as the endpoint is free.
+}
+
+int MSCHandleSetup( struct _USBState * ctx, int setup_code )
+{
+	switch( setup_code )
+	{
+	case 0xFE: // GET MAX LUN
+		ctx->pCtrlPayloadPtr = CTRL0BUFF;
+		ctx->pCtrlPayloadPtr[0] = 0;
+		return 1;
+	case 0xFF: // Bulk-Only Mass Storage Reset
+		msc.state = MSC_IDLE;
+		msc.remaining = 0;
+		return -1;
+	}
+	return 0;
+}
+
+// Programs one cache buffer, reading back whatever the host didn't write.
+static void MSCWriteBack( struct msc_cache * c )
+{
+	const msc_blockdev * bd = msc.bd;
+	int blocks = bd->sector_size / MSC_BLOCK_SIZE;
+	int b, ret = 0;
+
+	if( c->valid != msc.full_mask )
+	{
+		msc.sector_readbacks++;
+		for( b = 0; b < blocks; b++ )
+			if( !( c->valid & ( 1u << b ) ) )
+				ret |= bd->read( bd, c->sector * blocks + b, c->data + b * MSC_BLOCK_SIZE );
+	}
+	if( ret == 0 )
+		ret = bd->write_sector( bd, c->sector, c->data );
+	msc.sector_erases++;
+	if( ret ) msc.write_error = 1;
+
+	// Read buffers may hold what was there before.
+	for( b = 0; b < MSC_READ_BUFFERS; b++ )
+		if( msc.rblock[b] / blocks == c->sector )
+			msc.rblock[b] = 0xffffffff;
+
+	c->state = MSC_CACHE_FREE;
+
+	// A buffer is free again, let the host continue.
+	if( msc.nak )
+	{
+		msc.nak = 0;
+		USBFS_SendACK( msc.ep_out, 0 );
+	}
+}
+
+static void MSCWriteBackPending( void )
+{
+	int i;
+	for( i = 0; i < MSC_CACHE_SECTORS; i++ )
+		if( msc.cache[i].state == MSC_CACHE_PENDING )
+			MSCWriteBack( &msc.cache[i] );
+}
+
+int MSCFlush( void )
+{
+	int ret;
+
+	// Only while no WRITE(10) is in progress, the interrupt owns the filling buffer then.
+	__disable_irq();
+	if( msc.state != MSC_DATA_OUT && msc.filling >= 0 )
+	{
+		msc.cache[(int)msc.filling].state = MSC_CACHE_PENDING;
+		msc.filling = -1;
+	}
+	__enable_irq();
+	MSCWriteBackPending();
+	ret = msc.write_error;
+	msc.write_error = 0;
+	return ret;
+}
+
+static int MSCReadBlock( uint32_t block, uint8_t ** out )
+{
+	const msc_blockdev * bd = msc.bd;
+	uint32_t blocks_per_sector = bd->sector_size / MSC_BLOCK_SIZE;
+	uint32_t sector = block / blocks_per_sector;
+	uint32_t bit = 1u << ( block % blocks_per_sector );
+	int i;
+
+	// Newer data may still be in the write cache.
+	for( i = 0; i < MSC_CACHE_SECTORS; i++ )
+	{
+		struct msc_cache * c = &msc.cache[i];
+		if( c->state != MSC_CACHE_FREE && c->sector == sector && ( c->valid & bit ) )
+		{
+			*out = c->data + ( block % blocks_per_sector ) * MSC_BLOCK_SIZE;
+			return 0;
+		}
+	}
+
+	for( i = 0; i < MSC_READ_BUFFERS; i++ )
+	{
+		if( msc.rblock[i] == block )
+		{
+			*out = msc.rbuf[i];
+			return 0;
+		}
+	}
+
+	// Round robin, so read-ahead doesn't replace the block being sent.
+	i = msc.rnext;
+	msc.rnext = ( i + 1 ) % MSC_READ_BUFFERS;
+	msc.rblock[i] = 0xffffffff;
+	if( bd->read( bd, block, msc.rbuf[i] ) )
+		return -1;
+	msc.rblock[i] = block;
+	*out = msc.rbuf[i];
+	return 0;
+}
+
+static void MSCSendCSW( void )
+{
+	if( USBFS_SendEndpointNEW( msc.ep_in, (uint8_t*)&msc.csw, sizeof( msc.csw ), 1 ) != 0 ) return;
+	msc.state = MSC_IDLE;
+}
+
+static void MSCFail( uint8_t key, uint8_t asc )
+{
+	MSCSetSense( key, asc );
+	msc.csw.Status = 1;
+	msc.csw.DataResidue = msc.cbw.DataTransferLength;
+	msc.state = MSC_STATUS;
+}
+
+// Sends a response that fits in one packet, then the CSW.
+static void MSCReply( const uint8_t * buf, uint32_t len )
+{
+	if( len > msc.cbw.DataTransferLength ) len = msc.cbw.DataTransferLength;
+	if( len )
+		while( USBFS_SendEndpointNEW( msc.ep_in, (uint8_t*)buf, len, 1 ) != 0 );
+	msc.csw.DataResidue = msc.cbw.DataTransferLength - len;
+	msc.state = MSC_STATUS;
+}
+
+static void MSCCommand( void )
+{
+	const uint8_t * cb = msc.cbw.CB;
+	uint8_t r[36] __attribute__((aligned(4)));
+	uint32_t lba = MSCBE32( cb + 2 );
+	uint32_t blocks = ( cb[7] << 8 ) | cb[8];
+
+	memset( r, 0, sizeof( r ) );
+	switch( cb[0] )
+	{
+	case 0x00: // TEST UNIT READY
+		MSCReply( 0, 0 );
+		break;
+	case 0x03: // REQUEST SENSE
+		r[0] = 0x70;
+		r[2] = msc.sense_key;
+		r[7] = 10;
+		r[12] = msc.sense_asc;
+		MSCSetSense( MSC_SENSE_NONE, 0 );
+		MSCReply( r, 18 );
+		break;
+	case 0x12: // INQUIRY
+		r[1] = 0x80; // Removable
+		r[2] = 0x02;
+		r[3] = 0x02;
+		r[4] = 31;
+		memcpy( r + 8, MSC_VENDOR, 8 );
+		memcpy( r + 16, MSC_PRODUCT, 16 );
+		memcpy( r + 32, "1.00", 4 );
+		MSCReply( r, 36 );
+		break;
+	case 0x1A: // MODE SENSE(6)
+		r[0] = 3;
+		MSCReply( r, 4 );
+		break;
+	case 0x5A: // MODE SENSE(10)
+		r[1] = 6;
+		MSCReply( r, 8 );
+		break;
+	case 0x1B: // START STOP UNIT (eject)
+	case 0x35: // SYNCHRONIZE CACHE(10)
+		if( MSCFlush() )
+			MSCFail( MSC_SENSE_MEDIUM_ERROR, 0x0C );
+		else
+			MSCReply( 0, 0 );
+		break;
+	case 0x1E: // PREVENT ALLOW MEDIUM REMOVAL
+	case 0x2F: // VERIFY(10)
+		MSCReply( 0, 0 );
+		break;
+	case 0x23: // READ FORMAT CAPACITIES
+		r[3] = 8;
+		MSCPutBE32( r + 4, msc.bd->blocks );
+		r[8] = 0x02; // Formatted media
+		r[10] = MSC_BLOCK_SIZE >> 8;
+		MSCReply( r, 12 );
+		break;
+	case 0x25: // READ CAPACITY(10)
+		MSCPutBE32( r, msc.bd->blocks - 1 );
+		MSCPutBE32( r + 4, MSC_BLOCK_SIZE );
+		MSCReply( r, 8 );
+		break;
+	case 0x28: // READ(10)
+		if( lba + blocks > msc.bd->blocks || blocks * MSC_BLOCK_SIZE != msc.cbw.DataTransferLength )
+		{
+			MSCFail( MSC_SENSE_ILLEGAL_REQUEST, 0x21 );
+			break;
+		}
+		msc.offset = lba * MSC_BLOCK_SIZE;
+		msc.remaining = blocks * MSC_BLOCK_SIZE;
+		msc.state = blocks ? MSC_DATA_IN : MSC_STATUS;
+		break;
+	case 0x2A: // WRITE(10), only gets here if out of range
+		MSCFail( MSC_SENSE_ILLEGAL_REQUEST, 0x21 );
+		break;
+	default:
+		MSCFail( MSC_SENSE_ILLEGAL_REQUEST, 0x20 );
+		break;
+	}
+}
+
+static void MSCDataIn( void )
+{
+	uint32_t block = msc.offset / MSC_BLOCK_SIZE;
+	uint8_t * buf;
+
+	if( MSCReadBlock( block, &buf ) )
+	{
+		MSCSetSense( MSC_SENSE_MEDIUM_ERROR, 0x11 );
+		msc.csw.Status = 1;
+		msc.csw.DataResidue = msc.remaining;
+		msc.state = MSC_STATUS;
+		return;
+	}
+
+	if( USBFS_SendEndpointNEW( msc.ep_in, buf + msc.offset % MSC_BLOCK_SIZE, USBFS_PACKET_SIZE, 1 ) != 0 )
+		return;
+	msc.offset += USBFS_PACKET_SIZE;
+	msc.remaining -= USBFS_PACKET_SIZE;
+	if( msc.remaining == 0 )
+	{
+		msc.state = MSC_STATUS;
+		return;
+	}
+
+	// While the first packet of a block goes out, fetch the next block.
+	if( MSC_READ_BUFFERS > 1 && msc.offset % MSC_BLOCK_SIZE == USBFS_PACKET_SIZE && msc.remaining > MSC_BLOCK_SIZE - USBFS_PACKET_SIZE )
+		MSCReadBlock( block + 1, &buf );
+}
+
+void MSCPoll( void )
+{
+	switch( msc.state )
+	{
+	case MSC_COMMAND:
+		MSCCommand();
+		break;
+	case MSC_DATA_IN:
+		MSCDataIn();
+		break;
+	case MSC_STATUS:
+		MSCSendCSW();
+		break;
+	}
+
+	// Program complete sectors as they come in, while the host keeps sending.
+	MSCWriteBackPending();
+
+	if( msc.filling >= 0 && msc.state == MSC_IDLE && TimeElapsed32( MSC_NOW(), msc.last_write ) > (int32_t)Ticks_from_Ms( MSC_FLUSH_MS ) )
+		MSCFlush();
+}
+
+/* 25-series SPI NOR flash (W25Qxx, GD25Qxx, ...) backend.
+
+	msc_spinor nor = {
+		.bd = { .blocks = 4096, .sector_size = 4096, .base = 0, .read = MSCSpiNorRead, .write_sector = MSCSpiNorWriteSector },
+		.select = MySelect,  // CS low for 1, high for 0
+		.xfer = MyXfer,      // Send a byte, return the received byte
+	};
+	MSCInit( &nor.bd, EP_MSC_IN, EP_MSC_OUT );
+*/
+typedef struct
+{
+	msc_blockdev bd;  // Must be first
+	void (*select)( int on );
+	uint8_t (*xfer)( uint8_t b );
+} msc_spinor;
+
+static void MSCSpiNorCommand( const msc_spinor * nor, uint8_t cmd, uint32_t addr, int has_addr )
+{
+	nor->select( 1 );
+	nor->xfer( cmd );
+	if( has_addr )
+	{
+		nor->xfer( addr >> 16 );
+		nor->xfer( addr >> 8 );
+		nor->xfer( addr );
+	}
+}
+
+static void MSCSpiNorWait( const msc_spinor * nor )
+{
+	MSCSpiNorCommand( nor, 0x05, 0, 0 ); // Read status register
+	while( nor->xfer( 0xff ) & 1 );
+	nor->select( 0 );
+}
+
+static void MSCSpiNorWriteEnable( const msc_spinor * nor )
+{
+	MSCSpiNorCommand( nor, 0x06, 0, 0 );
+	nor->select( 0 );
+}
+
+int MSCSpiNorRead( const msc_blockdev * bd, uint32_t block, uint8_t * buf )
+{
+	const msc_spinor * nor = (const msc_spinor *)bd;
+	int i;
+	MSCSpiNorCommand( nor, 0x03, bd->base + block * MSC_BLOCK_SIZE, 1 );
+	for( i = 0; i < MSC_BLOCK_SIZE; i++ )
+		buf[i] = nor->xfer( 0xff );
+	nor->select( 0 );
+	return 0;
+}
+
+int MSCSpiNorWriteSector( const msc_blockdev * bd, uint32_t sector, const uint8_t * buf )
+{
+	const msc_spinor * nor = (const msc_spinor *)bd;
+	uint32_t addr = bd->base + sector * bd->sector_size;
+	uint32_t done, i;
+
+	MSCSpiNorWriteEnable( nor );
+	MSCSpiNorCommand( nor, 0x20, addr, 1 ); // 4kB sector erase
+	nor->select( 0 );
+	MSCSpiNorWait( nor );
+
+	for( done = 0; done < bd->sector_size; done += 256 )
+	{
+		MSCSpiNorWriteEnable( nor );
+		MSCSpiNorCommand( nor, 0x02, addr + done, 1 ); // Page program
+		for( i = 0; i < 256; i++ )
+			nor->xfer( buf[done + i] );
+		nor->select( 0 );
+		MSCSpiNorWait( nor );
+	}
+	return 0;
+}
+
+#endif
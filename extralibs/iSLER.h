@@ -11,6 +11,11 @@
 		// TX packets
 		iSLERTX(ACCESS_ADDRESS, adv, sizeof(adv), adv_channels[c], PHY_1M);
 
+		// Or without waiting for it to go out
+		iSLERTXStart(ACCESS_ADDRESS, adv, sizeof(adv), adv_channels[c], PHY_1M);
+		...
+		if(iSLERTXDone()) // sent
+
 	To receive packets, you can either:
 
 		#define ISLER_CALLBACK iSLERRXCallback
@@ -31,6 +36,8 @@
 		while(!rx_ready);
 		// Receive packet code.
 
+	For queues, acknowledgements and channel hopping on top of this, see
+	lib_isler_link.h.
 */
 
 // 2025-12-25 function rename.
@@ -808,8 +815,9 @@ int iSLERCRCOK() {
 #endif
 }
 
+// Starts sending and returns, adv must stay untouched until iSLERTXDone().
 __HIGH_CODE
-void iSLERTX(uint32_t access_address, uint8_t adv[], size_t len, uint8_t channel, uint8_t phy_mode) {
+void iSLERTXStart(uint32_t access_address, uint8_t adv[], size_t len, uint8_t channel, uint8_t phy_mode) {
 	BB->CTRL_TX = (BB->CTRL_TX & 0xfffffffc) | 1;
 
 	DevSetChannel(channel);
@@ -871,13 +879,25 @@ void iSLERTX(uint32_t access_address, uint8_t adv[], size_t len, uint8_t channel
 	BB->CTRL_TX &= 0xfffffffc;
 
 	LL->LL0 = 2; // Not sure what this does, but on RX it's 1
+}
 
-	while(LL->TMR); // wait for tx buffer to empty
+// After iSLERTXStart(), returns 0 while still sending, then stops the radio
+// and returns 1.  Call it until it does, but not after.
+__HIGH_CODE
+int iSLERTXDone() {
+	if(LL->TMR) return 0; // tx buffer not empty yet
 	DevSetMode(0);
 	if(LL->LL0 & 3) {
 		LL->CTRL_MOD &= CTRL_MOD_RFSTOP;
 		LL->LL0 |= 0x08;
 	}
+	return 1;
+}
+
+__HIGH_CODE
+void iSLERTX(uint32_t access_address, uint8_t adv[], size_t len, uint8_t channel, uint8_t phy_mode) {
+	iSLERTXStart(access_address, adv, len, channel, phy_mode);
+	while(!iSLERTXDone());
 }
 
 __HIGH_CODE
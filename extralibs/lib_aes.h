@@ -0,0 +1,489 @@
+#ifndef _LIB_AES_H
+#define _LIB_AES_H
+
+/* AES-128, with the CTR, CBC and CCM modes, on the CH5xx AES engine.
+
+	The engine (see examples_ch5xx/aes) does one 16 byte block at a time,
+	at 0x4000c300, on the CH58x and CH59x.  With AES_HW 1 this loads the
+	key once per context, not per block, and starts the next block before
+	working on the last one, so the CPU XORs and copies while the engine
+	runs.  The engine has no DMA that we know of.
+
+	AES_HW defaults to 0, software, everywhere.  The engine's answer for the
+	example's original vector isn't FIPS-197 AES-128 in any byte or word
+	order, so whether it is standard AES (and talks CTR/CBC/CCM with
+	anything else) is only known once examples_ch5xx/aes passes its known
+	answers on the chip.  Without the engine this header only needs
+	stdint.h and string.h, and it builds on the host too.
+
+		aes_ctx c;
+		aes_init( &c, key );                               // 16 bytes
+
+		aes_encrypt_block( &c, in, out );                  // ECB, one block
+		aes_decrypt_block( &c, in, out );
+
+		uint8_t ctr[16] = { nonce..., 0, 0, 0, 0 };
+		aes_ctr( &c, ctr, in, out, len );                  // either way, any len
+
+		uint8_t iv[16] = { ... };
+		aes_cbc_encrypt( &c, iv, in, out, len );           // len a multiple of 16
+		aes_cbc_decrypt( &c, iv, in, out, len );           // -1 if it isn't
+
+		// CCM, as RFC 3610 and BLE: nonce 7 to 13 bytes, tag 4 to 16
+		aes_ccm_encrypt( &c, nonce, 13, aad, alen, in, out, len, tag, 4 );
+		if( aes_ccm_decrypt( &c, nonce, 13, aad, alen, in, out, len, tag, 4 ) )
+			...                                            // -1, forged, out is zeroed
+
+	ctr and iv are left at what the next call continues with, so a stream
+	can be done in pieces, whole blocks at a time: a CTR call that ends in
+	the middle of a block throws the rest of that block's keystream away.
+	All of it works in place, out == in.
+
+	The engine keeps the key of the last context that used it, so mind
+	other users: the WCH BLE library uses it for its own encryption.  Call
+	aes_reload() after someone else did, and don't use it from interrupts
+	and main at the same time.  Define AES_HW_RELOAD_KEY to write the key
+	for every block like the WCH library does.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef AES_HW
+#define AES_HW 0 // The engine is opt-in, see above
+#endif
+
+#if AES_HW && !defined(CH58x) && !defined(CH59x)
+#error AES_HW 1 is only for the CH58x and CH59x engine
+#endif
+
+typedef struct
+{
+#if AES_HW
+	uint32_t key[4];
+#else
+	uint8_t rk[176]; // Round keys
+	uint8_t out[16]; // Result of the last aes_start()
+#endif
+} aes_ctx;
+
+void aes_init( aes_ctx * c, const uint8_t * key );
+void aes_reload( void );
+void aes_encrypt_block( aes_ctx * c, const uint8_t * in, uint8_t * out );
+void aes_decrypt_block( aes_ctx * c, const uint8_t * in, uint8_t * out );
+void aes_ctr( aes_ctx * c, uint8_t * ctr, const uint8_t * in, uint8_t * out, int len );
+int aes_cbc_encrypt( aes_ctx * c, uint8_t * iv, const uint8_t * in, uint8_t * out, int len );
+int aes_cbc_decrypt( aes_ctx * c, uint8_t * iv, const uint8_t * in, uint8_t * out, int len );
+int aes_ccm_encrypt( aes_ctx * c, const uint8_t * nonce, int nlen, const uint8_t * aad, int alen,
+	const uint8_t * in, uint8_t * out, int len, uint8_t * tag, int mlen );
+int aes_ccm_decrypt( aes_ctx * c, const uint8_t * nonce, int nlen, const uint8_t * aad, int alen,
+	const uint8_t * in, uint8_t * out, int len, const uint8_t * tag, int mlen );
+
+#if AES_HW
+
+#ifndef AES_BASE
+#define AES_BASE ((uint32_t)0x4000c300)
+
+typedef struct {
+	volatile uint32_t CFG;
+	volatile uint32_t STA;
+	volatile uint32_t some_reg1; // Used by the WCH library for packets, unknown
+	volatile uint32_t some_reg2;
+	volatile uint32_t some_reg3;
+	volatile uint32_t some_reg4;
+	volatile uint32_t data[4];
+	volatile uint32_t key[4];
+} AES_Type;
+
+#define AES ((AES_Type *) AES_BASE)
+#endif
+
+#define AES_CFG_START 0x001 // Set to start, clears when done
+#define AES_CFG_DEC   0x002
+#define AES_CFG_RESET 0x100 // Written before a new key, by the WCH library
+
+static const aes_ctx * aes_loaded; // Whose key the engine has
+static uint32_t aes_loaded_cfg;
+
+void aes_init( aes_ctx * c, const uint8_t * key )
+{
+	memcpy( c->key, key, 16 );
+	if( aes_loaded == c ) aes_loaded = 0;
+}
+
+void aes_reload( void )
+{
+	aes_loaded = 0;
+}
+
+// Starts a block, the result is for aes_result().
+static void aes_start( aes_ctx * c, const uint8_t * in, int dec )
+{
+	uint32_t w[4];
+	uint32_t cfg = dec ? AES_CFG_DEC : 0;
+	memcpy( w, in, 16 );
+#ifndef AES_HW_RELOAD_KEY
+	if( aes_loaded != c || aes_loaded_cfg != cfg )
+#endif
+	{
+		AES->CFG = AES_CFG_RESET;
+		AES->CFG = cfg;
+		AES->key[0] = c->key[0];
+		AES->key[1] = c->key[1];
+		AES->key[2] = c->key[2];
+		AES->key[3] = c->key[3];
+		aes_loaded = c;
+		aes_loaded_cfg = cfg;
+	}
+	AES->data[0] = w[0];
+	AES->data[1] = w[1];
+	AES->data[2] = w[2];
+	AES->data[3] = w[3];
+	AES->CFG = cfg | AES_CFG_START;
+}
+
+static void aes_result( aes_ctx * c, uint8_t * out )
+{
+	uint32_t w[4];
+	while( AES->CFG & AES_CFG_START );
+	w[0] = AES->data[0];
+	w[1] = AES->data[1];
+	w[2] = AES->data[2];
+	w[3] = AES->data[3];
+	memcpy( out, w, 16 );
+}
+
+#else
+
+static const uint8_t aes_sbox[256] = {
+	0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+	0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+	0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+	0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+	0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+	0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+	0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+	0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+	0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+	0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+	0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+	0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+	0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+	0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+	0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+	0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16 };
+
+static const uint8_t aes_inv_sbox[256] = {
+	0x52, 0x09, 0x6a, 0xd5, 0x30, 0x36, 0xa5, 0x38, 0xbf, 0x40, 0xa3, 0x9e, 0x81, 0xf3, 0xd7, 0xfb,
+	0x7c, 0xe3, 0x39, 0x82, 0x9b, 0x2f, 0xff, 0x87, 0x34, 0x8e, 0x43, 0x44, 0xc4, 0xde, 0xe9, 0xcb,
+	0x54, 0x7b, 0x94, 0x32, 0xa6, 0xc2, 0x23, 0x3d, 0xee, 0x4c, 0x95, 0x0b, 0x42, 0xfa, 0xc3, 0x4e,
+	0x08, 0x2e, 0xa1, 0x66, 0x28, 0xd9, 0x24, 0xb2, 0x76, 0x5b, 0xa2, 0x49, 0x6d, 0x8b, 0xd1, 0x25,
+	0x72, 0xf8, 0xf6, 0x64, 0x86, 0x68, 0x98, 0x16, 0xd4, 0xa4, 0x5c, 0xcc, 0x5d, 0x65, 0xb6, 0x92,
+	0x6c, 0x70, 0x48, 0x50, 0xfd, 0xed, 0xb9, 0xda, 0x5e, 0x15, 0x46, 0x57, 0xa7, 0x8d, 0x9d, 0x84,
+	0x90, 0xd8, 0xab, 0x00, 0x8c, 0xbc, 0xd3, 0x0a, 0xf7, 0xe4, 0x58, 0x05, 0xb8, 0xb3, 0x45, 0x06,
+	0xd0, 0x2c, 0x1e, 0x8f, 0xca, 0x3f, 0x0f, 0x02, 0xc1, 0xaf, 0xbd, 0x03, 0x01, 0x13, 0x8a, 0x6b,
+	0x3a, 0x91, 0x11, 0x41, 0x4f, 0x67, 0xdc, 0xea, 0x97, 0xf2, 0xcf, 0xce, 0xf0, 0xb4, 0xe6, 0x73,
+	0x96, 0xac, 0x74, 0x22, 0xe7, 0xad, 0x35, 0x85, 0xe2, 0xf9, 0x37, 0xe8, 0x1c, 0x75, 0xdf, 0x6e,
+	0x47, 0xf1, 0x1a, 0x71, 0x1d, 0x29, 0xc5, 0x89, 0x6f, 0xb7, 0x62, 0x0e, 0xaa, 0x18, 0xbe, 0x1b,
+	0xfc, 0x56, 0x3e, 0x4b, 0xc6, 0xd2, 0x79, 0x20, 0x9a, 0xdb, 0xc0, 0xfe, 0x78, 0xcd, 0x5a, 0xf4,
+	0x1f, 0xdd, 0xa8, 0x33, 0x88, 0x07, 0xc7, 0x31, 0xb1, 0x12, 0x10, 0x59, 0x27, 0x80, 0xec, 0x5f,
+	0x60, 0x51, 0x7f, 0xa9, 0x19, 0xb5, 0x4a, 0x0d, 0x2d, 0xe5, 0x7a, 0x9f, 0x93, 0xc9, 0x9c, 0xef,
+	0xa0, 0xe0, 0x3b, 0x4d, 0xae, 0x2a, 0xf5, 0xb0, 0xc8, 0xeb, 0xbb, 0x3c, 0x83, 0x53, 0x99, 0x61,
+	0x17, 0x2b, 0x04, 0x7e, 0xba, 0x77, 0xd6, 0x26, 0xe1, 0x69, 0x14, 0x63, 0x55, 0x21, 0x0c, 0x7d };
+
+static uint8_t aes_xtime( uint8_t x )
+{
+	return ( x << 1 ) ^ ( ( x & 0x80 ) ? 0x1b : 0 );
+}
+
+static uint8_t aes_mul( uint8_t x, uint8_t y )
+{
+	uint8_t r = 0;
+	for( ; y; y >>= 1, x = aes_xtime( x ) )
+		if( y & 1 ) r ^= x;
+	return r;
+}
+
+void aes_init( aes_ctx * c, const uint8_t * key )
+{
+	uint8_t * rk = c->rk;
+	uint8_t rcon = 1;
+	int i;
+	memcpy( rk, key, 16 );
+	for( i = 16; i < 176; i += 4 )
+	{
+		uint8_t t0 = rk[i - 4], t1 = rk[i - 3], t2 = rk[i - 2], t3 = rk[i - 1];
+		if( ( i & 15 ) == 0 )
+		{
+			uint8_t t = t0;
+			t0 = aes_sbox[t1] ^ rcon;
+			t1 = aes_sbox[t2];
+			t2 = aes_sbox[t3];
+			t3 = aes_sbox[t];
+			rcon = aes_xtime( rcon );
+		}
+		rk[i + 0] = rk[i - 16] ^ t0;
+		rk[i + 1] = rk[i - 15] ^ t1;
+		rk[i + 2] = rk[i - 14] ^ t2;
+		rk[i + 3] = rk[i - 13] ^ t3;
+	}
+}
+
+void aes_reload( void )
+{
+}
+
+static void aes_add_key( uint8_t * s, const uint8_t * k )
+{
+	int i;
+	for( i = 0; i < 16; i++ ) s[i] ^= k[i];
+}
+
+// SubBytes and ShiftRows together, the state is column by column.
+static void aes_sub_shift( uint8_t * s, const uint8_t * box, int dir )
+{
+	uint8_t t[16];
+	int i;
+	for( i = 0; i < 16; i++ )
+		t[i] = box[s[( i + 4 * dir * ( i & 3 ) ) & 15]];
+	memcpy( s, t, 16 );
+}
+
+static void aes_sw_encrypt( const aes_ctx * c, uint8_t * s )
+{
+	int r, i;
+	aes_add_key( s, c->rk );
+	for( r = 1; r < 10; r++ )
+	{
+		aes_sub_shift( s, aes_sbox, 1 );
+		for( i = 0; i < 16; i += 4 )
+		{
+			uint8_t a0 = s[i], a1 = s[i + 1], a2 = s[i + 2], a3 = s[i + 3];
+			uint8_t all = a0 ^ a1 ^ a2 ^ a3;
+			s[i + 0] ^= all ^ aes_xtime( a0 ^ a1 );
+			s[i + 1] ^= all ^ aes_xtime( a1 ^ a2 );
+			s[i + 2] ^= all ^ aes_xtime( a2 ^ a3 );
+			s[i + 3] ^= all ^ aes_xtime( a3 ^ a0 );
+		}
+		aes_add_key( s, c->rk + 16 * r );
+	}
+	aes_sub_shift( s, aes_sbox, 1 );
+	aes_add_key( s, c->rk + 160 );
+}
+
+static void aes_sw_decrypt( const aes_ctx * c, uint8_t * s )
+{
+	int r, i;
+	aes_add_key( s, c->rk + 160 );
+	for( r = 9; r > 0; r-- )
+	{
+		aes_sub_shift( s, aes_inv_sbox, -1 );
+		aes_add_key( s, c->rk + 16 * r );
+		for( i = 0; i < 16; i += 4 )
+		{
+			uint8_t a0 = s[i], a1 = s[i + 1], a2 = s[i + 2], a3 = s[i + 3];
+			s[i + 0] = aes_mul( a0, 14 ) ^ aes_mul( a1, 11 ) ^ aes_mul( a2, 13 ) ^ aes_mul( a3, 9 );
+			s[i + 1] = aes_mul( a0, 9 ) ^ aes_mul( a1, 14 ) ^ aes_mul( a2, 11 ) ^ aes_mul( a3, 13 );
+			s[i + 2] = aes_mul( a0, 13 ) ^ aes_mul( a1, 9 ) ^ aes_mul( a2, 14 ) ^ aes_mul( a3, 11 );
+			s[i + 3] = aes_mul( a0, 11 ) ^ aes_mul( a1, 13 ) ^ aes_mul( a2, 9 ) ^ aes_mul( a3, 14 );
+		}
+	}
+	aes_sub_shift( s, aes_inv_sbox, -1 );
+	aes_add_key( s, c->rk );
+}
+
+static void aes_start( aes_ctx * c, const uint8_t * in, int dec )
+{
+	memcpy( c->out, in, 16 );
+	if( dec ) aes_sw_decrypt( c, c->out );
+	else aes_sw_encrypt( c, c->out );
+}
+
+static void aes_result( aes_ctx * c, uint8_t * out )
+{
+	memcpy( out, c->out, 16 );
+}
+
+#endif
+
+void aes_encrypt_block( aes_ctx * c, const uint8_t * in, uint8_t * out )
+{
+	aes_start( c, in, 0 );
+	aes_result( c, out );
+}
+
+void aes_decrypt_block( aes_ctx * c, const uint8_t * in, uint8_t * out )
+{
+	aes_start( c, in, 1 );
+	aes_result( c, out );
+}
+
+static void aes_xor( uint8_t * out, const uint8_t * a, const uint8_t * b, int len )
+{
+	int i;
+	for( i = 0; i < len; i++ ) out[i] = a[i] ^ b[i];
+}
+
+// The counter is big endian, all 16 bytes of it.
+static void aes_ctr_inc( uint8_t * ctr )
+{
+	int i;
+	for( i = 15; i >= 0 && ++ctr[i] == 0; i-- );
+}
+
+void aes_ctr( aes_ctx * c, uint8_t * ctr, const uint8_t * in, uint8_t * out, int len )
+{
+	uint8_t ks[16];
+	if( len <= 0 ) return;
+	aes_start( c, ctr, 0 );
+	aes_ctr_inc( ctr );
+	while( 1 )
+	{
+		int n = len < 16 ? len : 16;
+		aes_result( c, ks );
+		len -= n;
+		// The next block's keystream is made while this one is used.
+		if( len )
+		{
+			aes_start( c, ctr, 0 );
+			aes_ctr_inc( ctr );
+		}
+		aes_xor( out, in, ks, n );
+		if( !len ) return;
+		in += 16;
+		out += 16;
+	}
+}
+
+int aes_cbc_encrypt( aes_ctx * c, uint8_t * iv, const uint8_t * in, uint8_t * out, int len )
+{
+	if( len < 0 || ( len & 15 ) ) return -1;
+	for( ; len; len -= 16, in += 16, out += 16 )
+	{
+		aes_xor( iv, iv, in, 16 );
+		aes_encrypt_block( c, iv, iv );
+		memcpy( out, iv, 16 );
+	}
+	return 0;
+}
+
+int aes_cbc_decrypt( aes_ctx * c, uint8_t * iv, const uint8_t * in, uint8_t * out, int len )
+{
+	uint8_t cur[16], next[16], pt[16];
+	if( len < 0 || ( len & 15 ) ) return -1;
+	if( !len ) return 0;
+	// Keep the ciphertext, out may be in.
+	memcpy( cur, in, 16 );
+	aes_start( c, cur, 1 );
+	while( 1 )
+	{
+		aes_result( c, pt );
+		len -= 16;
+		if( len )
+		{
+			memcpy( next, in + 16, 16 );
+			aes_start( c, next, 1 );
+		}
+		aes_xor( out, pt, iv, 16 );
+		memcpy( iv, cur, 16 );
+		if( !len ) return 0;
+		memcpy( cur, next, 16 );
+		in += 16;
+		out += 16;
+	}
+}
+
+// CBC-MAC of CCM, the bytes are XORed into x, and x is encrypted each time
+// it's full.
+static void aes_mac( aes_ctx * c, uint8_t * x, int * pos, const uint8_t * d, int len )
+{
+	while( len-- )
+	{
+		x[( *pos )++] ^= *d++;
+		if( *pos == 16 )
+		{
+			aes_encrypt_block( c, x, x );
+			*pos = 0;
+		}
+	}
+}
+
+static void aes_mac_pad( aes_ctx * c, uint8_t * x, int * pos )
+{
+	if( *pos )
+	{
+		aes_encrypt_block( c, x, x );
+		*pos = 0;
+	}
+}
+
+static int aes_ccm( aes_ctx * c, const uint8_t * nonce, int nlen, const uint8_t * aad, int alen,
+	const uint8_t * pt, int len, uint8_t * ctr, uint8_t * tag, int mlen )
+{
+	uint8_t x[16], s0[16];
+	int q = 15 - nlen, pos = 0, i;
+	if( nlen < 7 || nlen > 13 || mlen < 4 || mlen > 16 || ( mlen & 1 ) ) return -1;
+	if( alen < 0 || alen >= 0xff00 || len < 0 || ( q < 4 && len >= 1 << ( 8 * q ) ) ) return -1;
+
+	// B0: flags, nonce, length of the message
+	x[0] = ( alen ? 0x40 : 0 ) | ( ( mlen - 2 ) / 2 ) << 3 | ( q - 1 );
+	memcpy( x + 1, nonce, nlen );
+	for( i = 0; i < q; i++ ) x[15 - i] = i < 4 ? len >> ( 8 * i ) : 0;
+	aes_encrypt_block( c, x, x );
+	if( alen )
+	{
+		uint8_t l[2] = { alen >> 8, alen };
+		aes_mac( c, x, &pos, l, 2 );
+		aes_mac( c, x, &pos, aad, alen );
+		aes_mac_pad( c, x, &pos );
+	}
+	aes_mac( c, x, &pos, pt, len );
+	aes_mac_pad( c, x, &pos );
+
+	// A0 encrypts the tag, A1 on the message.
+	ctr[0] = q - 1;
+	memcpy( ctr + 1, nonce, nlen );
+	memset( ctr + 1 + nlen, 0, q );
+	aes_encrypt_block( c, ctr, s0 );
+	aes_xor( tag, x, s0, mlen );
+	ctr[15] = 1;
+	return 0;
+}
+
+int aes_ccm_encrypt( aes_ctx * c, const uint8_t * nonce, int nlen, const uint8_t * aad, int alen,
+	const uint8_t * in, uint8_t * out, int len, uint8_t * tag, int mlen )
+{
+	uint8_t ctr[16];
+	if( aes_ccm( c, nonce, nlen, aad, alen, in, len, ctr, tag, mlen ) ) return -1;
+	aes_ctr( c, ctr, in, out, len );
+	return 0;
+}
+
+int aes_ccm_decrypt( aes_ctx * c, const uint8_t * nonce, int nlen, const uint8_t * aad, int alen,
+	const uint8_t * in, uint8_t * out, int len, const uint8_t * tag, int mlen )
+{
+	uint8_t ctr[16], t[16];
+	uint8_t diff = 0;
+	int i;
+	if( nlen < 7 || nlen > 13 || len < 0 ) return -1;
+	ctr[0] = 15 - nlen - 1;
+	memcpy( ctr + 1, nonce, nlen );
+	memset( ctr + 1 + nlen, 0, 15 - nlen );
+	ctr[15] = 1;
+	aes_ctr( c, ctr, in, out, len );
+	if( aes_ccm( c, nonce, nlen, aad, alen, out, len, ctr, t, mlen ) )
+	{
+		memset( out, 0, len );
+		return -1;
+	}
+	// Every byte, no matter where it differs.
+	for( i = 0; i < mlen; i++ ) diff |= t[i] ^ tag[i];
+	if( diff )
+	{
+		memset( out, 0, len );
+		return -1;
+	}
+	return 0;
+}
+
+#endif
@@ -0,0 +1,233 @@
+#ifndef _LIB_FLASH_H
+#define _LIB_FLASH_H
+
+/* Writing the chip's own flash from firmware, the same calls on every family.
+
+		flash_unlock();
+		flash_erase_page( addr );        // FLASH_ERASE_SIZE bytes, aligned
+		flash_write_page( addr, buf );   // FLASH_PAGE_SIZE bytes, aligned, erased before
+		flash_lock();
+
+	On the CH32 parts this is the fast page controller (FTPG/FTER), which
+	erases and programs a whole page at a time:
+
+		V003                    64 bytes
+		V10x                   128 bytes (BUF_LOAD every 4 words)
+		V00x, X03x, L103       256 bytes
+		V20x, V30x             256 bytes (words go straight into the page
+		                                  buffer, started with PGSTRT)
+
+	On CH5xx it goes through the ROM commands of ch5xx_flash.h, which write
+	any number of words but erase 4K sectors.  Include ch5xx_flash.h before
+	this file there, and note the same rule applies: the code calling the
+	write/erase functions has to run from RAM (FLASHLIB_CODE puts the ones
+	here in RAM, use it on your own functions that call them).
+
+	FLASH_PAGE_SIZE   what flash_write_page() writes.
+	FLASH_ERASE_SIZE  what flash_erase_page() erases.
+	FLASH_WRITE_SIZE  the smallest write: a page on CH32, a word on CH5xx.
+	                  A CH32 page must only be programmed once between
+	                  erases, so anything smaller is padded with 0xff.
+
+	flash_write( addr, data, len ) writes any length from an address aligned
+	to FLASH_WRITE_SIZE, flash_is_erased( addr, len ) checks for all 0xff.
+	Data is read a word at a time, so it has to be word aligned.
+
+	All of them return 0, or -1 if the flash was locked, write protected or
+	doesn't read back right.  Erasing or programming stalls the core (and
+	interrupts) while it runs from flash, a few ms per page, so erase ahead
+	of time where you can, see lib_kvstore.h.
+*/
+
+#include <stdint.h>
+
+#if defined(CH5xx)
+	#define FLASH_PAGE_SIZE  256
+	#define FLASH_ERASE_SIZE 4096
+	#define FLASH_WRITE_SIZE 4
+	#define FLASHLIB_CODE __HIGH_CODE
+#elif defined(CH32H41x)
+	#error lib_flash.h does not support the H41x yet
+#else
+	#if defined(CH32V003)
+		#define FLASH_PAGE_SIZE 64
+	#elif defined(CH32V10x)
+		#define FLASH_PAGE_SIZE 128
+		#define FLASHLIB_WORDS_PER_LOAD 4
+	#else
+		#define FLASH_PAGE_SIZE 256
+	#endif
+	#define FLASH_ERASE_SIZE FLASH_PAGE_SIZE
+	#define FLASH_WRITE_SIZE FLASH_PAGE_SIZE
+	#define FLASHLIB_CODE
+#endif
+
+#ifndef FLASHLIB_WORDS_PER_LOAD
+#define FLASHLIB_WORDS_PER_LOAD 1
+#endif
+
+// Not in every family's header
+#define FLASHLIB_CR_FLOCK    0x00008000
+#define FLASHLIB_CR_BUF_LOAD 0x00040000
+#define FLASHLIB_CR_BUF_RST  0x00080000
+#define FLASHLIB_CR_PGSTRT   0x00200000
+#define FLASHLIB_SR_WRBSY    0x02
+
+int flash_unlock( void );
+void flash_lock( void );
+int flash_erase_page( uint32_t addr );
+int flash_write_page( uint32_t addr, const void * data );
+int flash_write( uint32_t addr, const void * data, int len );
+int flash_is_erased( uint32_t addr, int len );
+
+int flash_is_erased( uint32_t addr, int len )
+{
+	const uint32_t * p = (const uint32_t *)addr;
+	int i;
+	for( i = 0; i < len / 4; i++ )
+		if( p[i] != 0xffffffff ) return 0;
+	return 1;
+}
+
+static int flash_verify( uint32_t addr, const void * data, int len )
+{
+	const uint32_t * p = (const uint32_t *)addr;
+	const uint32_t * d = (const uint32_t *)data;
+	int i;
+	for( i = 0; i < ( len + 3 ) / 4; i++ )
+		if( p[i] != d[i] ) return -1;
+	return 0;
+}
+
+#if defined(CH5xx)
+
+// The ROM commands open and close the flash themselves.
+int flash_unlock( void ) { return 0; }
+void flash_lock( void ) { }
+
+FLASHLIB_CODE int flash_erase_page( uint32_t addr )
+{
+	if( ch5xx_flash_cmd_erase( addr, FLASH_ERASE_SIZE ) ) return -1;
+	return flash_is_erased( addr, FLASH_ERASE_SIZE ) ? 0 : -1;
+}
+
+FLASHLIB_CODE int flash_write( uint32_t addr, const void * data, int len )
+{
+	if( ch5xx_flash_cmd_write( addr, (uint8_t *)data, len ) ) return -1;
+	return flash_verify( addr, data, len );
+}
+
+FLASHLIB_CODE int flash_write_page( uint32_t addr, const void * data )
+{
+	return flash_write( addr, data, FLASH_PAGE_SIZE );
+}
+
+#else
+
+static void flash_wait( uint32_t bits )
+{
+	while( FLASH->STATR & bits );
+}
+
+static int flash_status( void )
+{
+	FLASH->CTLR = 0;
+	if( FLASH->STATR & FLASH_STATR_WRPRTERR )
+	{
+		FLASH->STATR = FLASH_STATR_WRPRTERR;
+		return -1;
+	}
+	return 0;
+}
+
+int flash_unlock( void )
+{
+	// A key written when it's already unlocked is a wrong sequence, which locks it until reset.
+	if( FLASH->CTLR & CR_LOCK_Set )
+	{
+		FLASH->KEYR = FLASH_KEY1;
+		FLASH->KEYR = FLASH_KEY2;
+	}
+	if( FLASH->CTLR & FLASHLIB_CR_FLOCK )
+	{
+		FLASH->MODEKEYR = FLASH_KEY1;
+		FLASH->MODEKEYR = FLASH_KEY2;
+	}
+	return ( FLASH->CTLR & ( CR_LOCK_Set | FLASHLIB_CR_FLOCK ) ) ? -1 : 0;
+}
+
+void flash_lock( void )
+{
+	FLASH->CTLR = CR_LOCK_Set | FLASHLIB_CR_FLOCK;
+}
+
+int flash_erase_page( uint32_t addr )
+{
+	flash_wait( FLASH_STATR_BSY );
+	FLASH->CTLR = CR_PAGE_ER;
+	FLASH->ADDR = addr;
+	FLASH->CTLR = CR_PAGE_ER | CR_STRT_Set;
+	flash_wait( FLASH_STATR_BSY );
+	if( flash_status() ) return -1;
+	return flash_is_erased( addr, FLASH_ERASE_SIZE ) ? 0 : -1;
+}
+
+int flash_write_page( uint32_t addr, const void * data )
+{
+	volatile uint32_t * dst = (volatile uint32_t *)addr;
+	const uint32_t * src = (const uint32_t *)data;
+	int i;
+
+	flash_wait( FLASH_STATR_BSY );
+	FLASH->CTLR = CR_PAGE_PG;
+#if defined(CH32V20x) || defined(CH32V30x)
+	for( i = 0; i < FLASH_PAGE_SIZE / 4; i++ )
+	{
+		dst[i] = src[i];
+		flash_wait( FLASHLIB_SR_WRBSY );
+	}
+	FLASH->CTLR = CR_PAGE_PG | FLASHLIB_CR_PGSTRT;
+#else
+	FLASH->CTLR = CR_PAGE_PG | FLASHLIB_CR_BUF_RST;
+	flash_wait( FLASH_STATR_BSY );
+	for( i = 0; i < FLASH_PAGE_SIZE / 4; i++ )
+	{
+		dst[i] = src[i];
+		if( ( i + 1 ) % FLASHLIB_WORDS_PER_LOAD == 0 )
+		{
+			FLASH->CTLR = CR_PAGE_PG | FLASHLIB_CR_BUF_LOAD;
+			flash_wait( FLASH_STATR_BSY );
+		}
+	}
+	FLASH->ADDR = addr;
+	FLASH->CTLR = CR_PAGE_PG | CR_STRT_Set;
+#endif
+	flash_wait( FLASH_STATR_BSY );
+	if( flash_status() ) return -1;
+	return flash_verify( addr, data, FLASH_PAGE_SIZE );
+}
+
+int flash_write( uint32_t addr, const void * data, int len )
+{
+	const uint8_t * src = (const uint8_t *)data;
+	for( ; len >= FLASH_PAGE_SIZE; len -= FLASH_PAGE_SIZE )
+	{
+		if( flash_write_page( addr, src ) ) return -1;
+		addr += FLASH_PAGE_SIZE;
+		src += FLASH_PAGE_SIZE;
+	}
+	if( len > 0 )
+	{
+		uint32_t page[FLASH_PAGE_SIZE / 4];
+		uint8_t * p = (uint8_t *)page;
+		int i;
+		for( i = 0; i < FLASH_PAGE_SIZE; i++ )
+			p[i] = i < len ? src[i] : 0xff;
+		if( flash_write_page( addr, page ) ) return -1;
+	}
+	return 0;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,124 @@
+#ifndef _LIB_FUNPROF_H
+#define _LIB_FUNPROF_H
+
+/* Function and zone profiler.
+
+	Records enter/exit events with a timestamp into a ring buffer in RAM
+	(funprof), which minichlink can pull over the debug interface and turn
+	into flat and call graph timing reports:
+
+		make FUNPROF=1 flash     // Build with -finstrument-functions
+		make cv_profile          // Halt, read funprof, report, resume
+
+	cv_profile runs "nm -n" on the elf and then "minichlink -F <target>.nm".
+
+	Zones can be used with or without -finstrument-functions:
+
+		FUN_PROF_BEGIN( adc_read );
+		...
+		FUN_PROF_END( adc_read );   // Must be in the same block as the BEGIN.
+
+	Events are recorded with interrupts masked for a few cycles, so it is
+	safe to profile ISRs, they just show up nested inside whatever they
+	interrupted.  With FUNPROF=1, everything under ch32fun/ is left alone.
+
+	Timestamps are SysTick counts.  For cycle-accurate numbers, set
+	FUNCONF_SYSTICK_USE_HCLK.  Override FUNPROF_TIME() to use another
+	source, the report assumes it counts at funprof.ticks_per_ms.
+
+	Each event is 8 bytes, set FUNPROF_ENTRIES (a power of two) to fit.
+	The ring overwrites the oldest events unless FUNPROF_ONESHOT is set,
+	in which case it stops when full.  Set funprof.enabled to 0 (from code,
+	or the debugger) to pause recording.
+*/
+
+#ifndef FUNPROF_ENTRIES
+#define FUNPROF_ENTRIES 128
+#endif
+
+#ifndef FUNPROF_TIME
+	#if defined(CH571_CH573)
+	#define FUNPROF_TIME() ( 0 - funSysTick32() ) // Counts down
+	#else
+	#define FUNPROF_TIME() funSysTick32()
+	#endif
+#endif
+
+#if ( FUNPROF_ENTRIES & ( FUNPROF_ENTRIES - 1 ) )
+#error FUNPROF_ENTRIES must be a power of two
+#endif
+
+// minichlink depends on this layout.
+#define FUNPROF_MAGIC 0x666e7072
+#define FUNPROF_EXIT  1  // Set in where for exit events.
+
+typedef struct
+{
+	uint32_t time;
+	uint32_t where; // Function or zone address, | FUNPROF_EXIT on the way out.
+} funprof_event;
+
+typedef struct
+{
+	uint32_t magic;
+	uint32_t entries;
+	uint32_t ticks_per_ms;
+	volatile uint32_t head;     // Total events recorded, free-running.
+	volatile uint32_t enabled;
+	funprof_event events[FUNPROF_ENTRIES];
+} funprof_ring;
+
+funprof_ring funprof;
+
+#define FUNPROF_NOINST __attribute__((no_instrument_function))
+
+// The zone is a symbol, so the report can find its name.
+#define FUN_PROF_BEGIN( name ) \
+	static const uint32_t funprof_zone_##name __attribute__((used)) = 0; \
+	FunProfRecord( (uint32_t)&funprof_zone_##name )
+#define FUN_PROF_END( name ) \
+	FunProfRecord( (uint32_t)&funprof_zone_##name | FUNPROF_EXIT )
+
+static inline FUNPROF_NOINST void FunProfRecord( uint32_t where )
+{
+	uint32_t t = FUNPROF_TIME();
+	uint32_t mstatus;
+	__asm__ volatile( "csrrci %0, mstatus, 8" : "=r"(mstatus) );
+	uint32_t head = funprof.head;
+#ifdef FUNPROF_ONESHOT
+	if( funprof.enabled && head < FUNPROF_ENTRIES )
+#else
+	if( funprof.enabled )
+#endif
+	{
+		funprof_event * e = &funprof.events[head & ( FUNPROF_ENTRIES - 1 )];
+		e->time = t;
+		e->where = where;
+		funprof.head = head + 1;
+	}
+	if( mstatus & 8 ) __asm__ volatile( "csrsi mstatus, 8" );
+}
+
+// Call once at startup, before anything you want to see.
+static inline FUNPROF_NOINST void FunProfInit( void )
+{
+	funprof.entries = FUNPROF_ENTRIES;
+	funprof.ticks_per_ms = DELAY_MS_TIME;
+	funprof.head = 0;
+	funprof.enabled = 1;
+	funprof.magic = FUNPROF_MAGIC;
+}
+
+#ifdef FUNPROF_INSTRUMENT
+FUNPROF_NOINST void __cyg_profile_func_enter( void * fn, void * site )
+{
+	FunProfRecord( (uint32_t)fn );
+}
+
+FUNPROF_NOINST void __cyg_profile_func_exit( void * fn, void * site )
+{
+	FunProfRecord( (uint32_t)fn | FUNPROF_EXIT );
+}
+#endif
+
+#endif
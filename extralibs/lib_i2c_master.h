@@ -0,0 +1,473 @@
+#ifndef _LIB_I2C_MASTER_H
+#define _LIB_I2C_MASTER_H
+
+/* Non-blocking I2C master for I2C1, with a queue of transactions.
+
+	Works on the CH32 parts with the STM32-style I2C1 and DMA1 (V003/V00x,
+	X035, V10x, V20x, V30x, L103).  Payloads go over DMA (I2C1_TX on DMA1
+	channel 6, I2C1_RX on channel 7), the event/error interrupts run the
+	protocol, so a transaction costs a handful of interrupts no matter how
+	long it is, and main never waits on the bus.
+
+	Each transaction is an optional write, then an optional read after a
+	repeated start.  Up to 4 header bytes (register address, EEPROM address,
+	SSD1306 control byte) are sent before the write buffer, so payloads don't
+	have to be copied to make room for them.
+
+		static uint8_t accel[6];
+		static i2cm_xfer imu = { .addr = 0x68, .hdr = { 0x3b }, .hdrlen = 1,
+			.rbuf = accel, .rlen = 6, .done = imu_done };
+
+		i2cm_init();
+		i2cm_submit( &imu );  // returns right away
+		...
+		i2cm_poll();          // now and then from main, handles timeouts
+
+	imu_done( i2cm_xfer * x ) is called from the interrupt when it's finished,
+	x->status is I2CM_OK or one of the I2CM_ERR_ codes.  It may submit more
+	transactions, including x itself.  Without a callback, just watch
+	x->status, it stays I2CM_QUEUED / I2CM_BUSY until the transaction is done.
+	A transaction must not be changed while it is queued.
+
+	A transaction with nothing to write or read is a probe (ACK check).
+
+	Timeouts: i2cm_poll() gives up on a transaction that took longer than its
+	timeout_ms (I2CM_TIMEOUT_MS if 0), frees the bus and resets the
+	peripheral.  It uses funSysTick32(), so SysTick must be running.
+
+	Bus recovery: i2cm_recover() switches the pins to GPIO, clocks SCL until a
+	slave that was stuck mid-byte lets go of SDA and sends a STOP.  i2cm_init()
+	does this if SDA is low at startup.
+
+	Pins default to I2C1 without remapping, define I2CM_SCL / I2CM_SDA (and do
+	the AFIO remap yourself) for other pins.  This library owns I2C1, DMA1
+	channels 6 and 7, and their interrupt handlers.
+*/
+
+#include <stdint.h>
+
+#ifndef I2CM_CLKRATE
+#define I2CM_CLKRATE 400000 // Bus clock
+#endif
+
+#ifndef I2CM_PRERATE
+#define I2CM_PRERATE 2000000 // Logic clock, must be higher than the bus clock
+#endif
+
+#ifndef I2CM_TIMEOUT_MS
+#define I2CM_TIMEOUT_MS 20
+#endif
+
+#ifndef I2CM_SCL
+	#if defined(CH32V003) || defined(CH32V00x)
+		#define I2CM_SCL PC2
+		#define I2CM_SDA PC1
+	#elif defined(CH32X03x)
+		#define I2CM_SCL PA10
+		#define I2CM_SDA PA11
+	#else
+		#define I2CM_SCL PB6
+		#define I2CM_SDA PB7
+	#endif
+#endif
+
+#ifndef I2CM_PIN_MODE
+	#if defined(CH32X03x)
+		#define I2CM_PIN_MODE GPIO_CFGLR_OUT_50Mhz_AF_PP // The X035 I2C drives its pins open drain itself
+	#else
+		#define I2CM_PIN_MODE GPIO_CFGLR_OUT_10Mhz_AF_OD
+	#endif
+#endif
+
+#define I2CM_OK           0
+#define I2CM_QUEUED       1
+#define I2CM_BUSY         2
+#define I2CM_ERR_NACK    -1 // Address or data not acknowledged
+#define I2CM_ERR_ARLO    -2 // Lost arbitration to another master
+#define I2CM_ERR_BUS     -3 // Misplaced START/STOP
+#define I2CM_ERR_TIMEOUT -4
+
+typedef struct i2cm_xfer_s i2cm_xfer;
+
+struct i2cm_xfer_s
+{
+	uint8_t addr;               // 7-bit address
+	uint8_t hdrlen;             // 0..4 bytes of hdr, sent before wbuf
+	uint8_t hdr[4];
+	const uint8_t * wbuf;
+	uint16_t wlen;
+	uint16_t rlen;              // Read after a repeated start (or just a read if nothing to write)
+	uint8_t * rbuf;
+	uint16_t timeout_ms;        // 0 = I2CM_TIMEOUT_MS
+	void (*done)( i2cm_xfer * x ); // Called from interrupt context, may be 0
+	void * user;
+	volatile int8_t status;
+	i2cm_xfer * next;
+};
+
+void i2cm_init( void );
+// Queue a transaction.  Returns 0, or -1 if it is already queued.
+int i2cm_submit( i2cm_xfer * x );
+// Checks the running transaction for a timeout.
+void i2cm_poll( void );
+// Spins (calling i2cm_poll()) until x is done, returns its status.
+int i2cm_wait( i2cm_xfer * x );
+// Clocks a stuck bus free and resets the peripheral.  Do not call while a transaction is running.
+void i2cm_recover( void );
+
+#define I2CM_PH_WRITE   0 // START/address for writing
+#define I2CM_PH_HDR     1 // Sending header bytes on TXE
+#define I2CM_PH_DMA_TX  2 // DMA is sending wbuf
+#define I2CM_PH_BTF     3 // Waiting for the last byte to go out
+#define I2CM_PH_READ    4 // START/address for reading, then DMA (or RXNE for 1 byte)
+
+static i2cm_xfer * volatile i2cm_head;
+static i2cm_xfer * i2cm_tail;
+static volatile uint8_t i2cm_phase;
+static uint8_t i2cm_idx;
+static uint32_t i2cm_started;
+
+static void i2cm_lock( void )
+{
+	NVIC_DisableIRQ( I2C1_EV_IRQn );
+	NVIC_DisableIRQ( I2C1_ER_IRQn );
+	NVIC_DisableIRQ( DMA1_Channel7_IRQn );
+}
+
+static void i2cm_unlock( void )
+{
+	NVIC_EnableIRQ( I2C1_EV_IRQn );
+	NVIC_EnableIRQ( I2C1_ER_IRQn );
+	NVIC_EnableIRQ( DMA1_Channel7_IRQn );
+}
+
+static void i2cm_setup( void )
+{
+	uint16_t tempreg;
+
+	// Reset I2C1 to init all regs
+	RCC->APB1PRSTR |= RCC_APB1Periph_I2C1;
+	RCC->APB1PRSTR &= ~RCC_APB1Periph_I2C1;
+
+	I2C1->CTLR2 = ( ( FUNCONF_SYSTEM_CORE_CLOCK / I2CM_PRERATE ) & I2C_CTLR2_FREQ ) | I2C_CTLR2_ITEVTEN | I2C_CTLR2_ITERREN;
+
+#if I2CM_CLKRATE <= 100000
+	tempreg = ( FUNCONF_SYSTEM_CORE_CLOCK / ( 2 * I2CM_CLKRATE ) ) & I2C_CKCFGR_CCR;
+#else
+	tempreg = ( ( FUNCONF_SYSTEM_CORE_CLOCK / ( 3 * I2CM_CLKRATE ) ) & I2C_CKCFGR_CCR ) | I2C_CKCFGR_FS;
+#endif
+	I2C1->CKCFGR = tempreg;
+
+	I2C1->CTLR1 |= I2C_CTLR1_PE;
+}
+
+static void i2cm_dma_stop( void )
+{
+	I2C1->CTLR2 &= ~( I2C_CTLR2_ITBUFEN | I2C_CTLR2_DMAEN | I2C_CTLR2_LAST );
+	DMA1_Channel6->CFGR &= ~DMA_CFGR1_EN;
+	DMA1_Channel7->CFGR &= ~DMA_CFGR1_EN;
+	DMA1->INTFCR = DMA1_IT_GL7;
+}
+
+static void i2cm_start_next( void )
+{
+	i2cm_xfer * x = i2cm_head;
+	if( !x || x->status != I2CM_QUEUED )
+		return;
+
+	// A STOP we just asked for must be out before the next START.
+	int timeout = 1000;
+	while( ( I2C1->CTLR1 & I2C_CTLR1_STOP ) && --timeout );
+
+	x->status = I2CM_BUSY;
+	i2cm_started = funSysTick32();
+	i2cm_phase = ( x->hdrlen || x->wlen || !x->rlen ) ? I2CM_PH_WRITE : I2CM_PH_READ;
+	I2C1->CTLR1 |= I2C_CTLR1_START | I2C_CTLR1_ACK;
+}
+
+// Called from interrupt context, or with the interrupts locked.
+static void i2cm_complete( int status )
+{
+	i2cm_xfer * x = i2cm_head;
+	i2cm_dma_stop();
+	if( !x ) return;
+
+	i2cm_head = x->next;
+	if( !i2cm_head ) i2cm_tail = 0;
+	x->status = status;
+	if( x->done ) x->done( x );
+	i2cm_start_next();
+}
+
+static void i2cm_dma_start( DMA_Channel_TypeDef * ch, uint8_t * buf, uint16_t len )
+{
+	ch->MADDR = (uint32_t)buf;
+	ch->CNTR = len;
+	ch->CFGR |= DMA_CFGR1_EN;
+}
+
+// Everything that was to be written is out.
+static void i2cm_write_done( i2cm_xfer * x )
+{
+	i2cm_dma_stop();
+	if( x->rlen )
+	{
+		i2cm_phase = I2CM_PH_READ;
+		I2C1->CTLR1 |= I2C_CTLR1_START | I2C_CTLR1_ACK; // Repeated start
+	}
+	else
+	{
+		I2C1->CTLR1 |= I2C_CTLR1_STOP;
+		i2cm_complete( I2CM_OK );
+	}
+}
+
+void I2C1_EV_IRQHandler( void ) __attribute__((interrupt));
+void I2C1_EV_IRQHandler( void )
+{
+	uint16_t star1 = I2C1->STAR1;
+	i2cm_xfer * x = i2cm_head;
+
+	if( !x || x->status != I2CM_BUSY )
+	{
+		// Nothing should be going on, clear whatever it was.
+		(void)I2C1->STAR2;
+		I2C1->CTLR2 &= ~I2C_CTLR2_ITBUFEN;
+		return;
+	}
+
+	if( star1 & I2C_STAR1_SB )
+	{
+		I2C1->DATAR = ( x->addr << 1 ) | ( i2cm_phase == I2CM_PH_READ );
+		return;
+	}
+
+	if( star1 & I2C_STAR1_ADDR )
+	{
+		if( i2cm_phase == I2CM_PH_READ )
+		{
+			if( x->rlen == 1 )
+			{
+				// NACK and STOP have to be set up around clearing ADDR.
+				I2C1->CTLR1 &= ~I2C_CTLR1_ACK;
+				(void)I2C1->STAR2;
+				I2C1->CTLR1 |= I2C_CTLR1_STOP;
+				I2C1->CTLR2 |= I2C_CTLR2_ITBUFEN;
+			}
+			else
+			{
+				// DMA has to be ready before ADDR is cleared, LAST NACKs the final byte.
+				i2cm_dma_start( DMA1_Channel7, x->rbuf, x->rlen );
+				I2C1->CTLR2 |= I2C_CTLR2_DMAEN | I2C_CTLR2_LAST;
+				(void)I2C1->STAR2;
+			}
+			return;
+		}
+
+		(void)I2C1->STAR2;
+		if( x->hdrlen )
+		{
+			i2cm_idx = 0;
+			i2cm_phase = I2CM_PH_HDR;
+			I2C1->CTLR2 |= I2C_CTLR2_ITBUFEN; // TXE is set right away
+		}
+		else if( x->wlen )
+		{
+			i2cm_phase = I2CM_PH_DMA_TX;
+			i2cm_dma_start( DMA1_Channel6, (uint8_t *)x->wbuf, x->wlen );
+			I2C1->CTLR2 |= I2C_CTLR2_DMAEN;
+		}
+		else if( x->rlen )
+		{
+			i2cm_write_done( x ); // Can't happen, reads without a write start in I2CM_PH_READ
+		}
+		else
+		{
+			// Probe, the address was ACKed.
+			I2C1->CTLR1 |= I2C_CTLR1_STOP;
+			i2cm_complete( I2CM_OK );
+		}
+		return;
+	}
+
+	if( i2cm_phase == I2CM_PH_HDR && ( star1 & I2C_STAR1_TXE ) )
+	{
+		I2C1->DATAR = x->hdr[i2cm_idx++];
+		if( i2cm_idx >= x->hdrlen )
+		{
+			I2C1->CTLR2 &= ~I2C_CTLR2_ITBUFEN;
+			if( x->wlen )
+			{
+				i2cm_phase = I2CM_PH_DMA_TX;
+				i2cm_dma_start( DMA1_Channel6, (uint8_t *)x->wbuf, x->wlen );
+				I2C1->CTLR2 |= I2C_CTLR2_DMAEN;
+			}
+			else
+			{
+				i2cm_phase = I2CM_PH_BTF;
+			}
+		}
+		return;
+	}
+
+	if( star1 & I2C_STAR1_BTF )
+	{
+		// No need for the TX DMA interrupt, BTF comes once the last byte it wrote is out.
+		if( i2cm_phase == I2CM_PH_BTF || ( i2cm_phase == I2CM_PH_DMA_TX && DMA1_Channel6->CNTR == 0 ) )
+			i2cm_write_done( x );
+		return;
+	}
+
+	if( i2cm_phase == I2CM_PH_READ && ( star1 & I2C_STAR1_RXNE ) && x->rlen == 1 )
+	{
+		x->rbuf[0] = I2C1->DATAR;
+		i2cm_complete( I2CM_OK );
+	}
+}
+
+void I2C1_ER_IRQHandler( void ) __attribute__((interrupt));
+void I2C1_ER_IRQHandler( void )
+{
+	uint16_t star1 = I2C1->STAR1;
+	int status = I2CM_ERR_BUS;
+
+	I2C1->STAR1 = ~( star1 & ( I2C_STAR1_AF | I2C_STAR1_ARLO | I2C_STAR1_BERR | I2C_STAR1_OVR ) );
+
+	if( star1 & I2C_STAR1_AF )
+	{
+		status = I2CM_ERR_NACK;
+		I2C1->CTLR1 |= I2C_CTLR1_STOP;
+	}
+	else if( star1 & I2C_STAR1_ARLO )
+	{
+		status = I2CM_ERR_ARLO; // The peripheral is already back in slave mode, no STOP
+	}
+	else if( star1 & I2C_STAR1_BERR )
+	{
+		I2C1->CTLR1 |= I2C_CTLR1_STOP;
+	}
+	else
+	{
+		return; // OVR, only possible in slave mode
+	}
+
+	if( i2cm_head && i2cm_head->status == I2CM_BUSY )
+		i2cm_complete( status );
+}
+
+void DMA1_Channel7_IRQHandler( void ) __attribute__((interrupt));
+void DMA1_Channel7_IRQHandler( void )
+{
+	// Read finished, the last byte was already NACKed because of LAST.
+	DMA1->INTFCR = DMA1_IT_GL7;
+	I2C1->CTLR1 |= I2C_CTLR1_STOP;
+	i2cm_complete( I2CM_OK );
+}
+
+void i2cm_recover( void )
+{
+	int i;
+
+	I2C1->CTLR1 &= ~I2C_CTLR1_PE;
+	funDigitalWrite( I2CM_SCL, FUN_HIGH );
+	funDigitalWrite( I2CM_SDA, FUN_HIGH );
+	funPinMode( I2CM_SCL, GPIO_CFGLR_OUT_10Mhz_OD );
+	funPinMode( I2CM_SDA, GPIO_CFGLR_OUT_10Mhz_OD );
+	Delay_Us( 5 );
+
+	// A slave in the middle of sending a 0 lets go of SDA after at most 9 clocks.
+	for( i = 0; i < 9 && !funDigitalRead( I2CM_SDA ); i++ )
+	{
+		funDigitalWrite( I2CM_SCL, FUN_LOW );
+		Delay_Us( 5 );
+		funDigitalWrite( I2CM_SCL, FUN_HIGH );
+		Delay_Us( 5 );
+	}
+
+	// STOP
+	funDigitalWrite( I2CM_SCL, FUN_LOW );
+	Delay_Us( 5 );
+	funDigitalWrite( I2CM_SDA, FUN_LOW );
+	Delay_Us( 5 );
+	funDigitalWrite( I2CM_SCL, FUN_HIGH );
+	Delay_Us( 5 );
+	funDigitalWrite( I2CM_SDA, FUN_HIGH );
+	Delay_Us( 5 );
+
+	funPinMode( I2CM_SCL, I2CM_PIN_MODE );
+	funPinMode( I2CM_SDA, I2CM_PIN_MODE );
+	i2cm_setup();
+}
+
+void i2cm_init( void )
+{
+	funGpioInitAll();
+	RCC->APB1PCENR |= RCC_APB1Periph_I2C1;
+	RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+
+	i2cm_head = i2cm_tail = 0;
+
+	DMA1_Channel6->CFGR = 0;
+	DMA1_Channel6->PADDR = (uint32_t)&I2C1->DATAR;
+	DMA1_Channel6->CFGR = DMA_CFGR1_MINC | DMA_CFGR1_DIR | DMA_CFGR1_PL_1;
+	DMA1_Channel7->CFGR = 0;
+	DMA1_Channel7->PADDR = (uint32_t)&I2C1->DATAR;
+	DMA1_Channel7->CFGR = DMA_CFGR1_MINC | DMA_CFGR1_TCIE | DMA_CFGR1_PL_1;
+
+	funPinMode( I2CM_SCL, I2CM_PIN_MODE );
+	funPinMode( I2CM_SDA, I2CM_PIN_MODE );
+	if( !funDigitalRead( I2CM_SDA ) )
+		i2cm_recover();
+	else
+		i2cm_setup();
+
+	i2cm_unlock();
+}
+
+int i2cm_submit( i2cm_xfer * x )
+{
+	if( x->status == I2CM_QUEUED || x->status == I2CM_BUSY )
+		return -1;
+
+	x->status = I2CM_QUEUED;
+	x->next = 0;
+
+	i2cm_lock();
+	if( i2cm_head )
+		i2cm_tail->next = x;
+	else
+		i2cm_head = x;
+	i2cm_tail = x;
+	i2cm_start_next();
+	i2cm_unlock();
+	return 0;
+}
+
+void i2cm_poll( void )
+{
+	i2cm_xfer * x = i2cm_head;
+	if( !x || x->status != I2CM_BUSY )
+		return;
+
+	uint32_t timeout = x->timeout_ms ? x->timeout_ms : I2CM_TIMEOUT_MS;
+	if( TimeElapsed32( funSysTick32(), i2cm_started ) < (int32_t)Ticks_from_Ms( timeout ) )
+		return;
+
+	i2cm_lock();
+	if( i2cm_head == x && x->status == I2CM_BUSY )
+	{
+		i2cm_dma_stop();
+		i2cm_recover();
+		i2cm_complete( I2CM_ERR_TIMEOUT );
+	}
+	i2cm_unlock();
+}
+
+int i2cm_wait( i2cm_xfer * x )
+{
+	while( x->status == I2CM_QUEUED || x->status == I2CM_BUSY )
+		i2cm_poll();
+	return x->status;
+}
+
+#endif
@@ -0,0 +1,400 @@
+#ifndef _LIB_I2C_SLAVE_H
+#define _LIB_I2C_SLAVE_H
+
+/* DMA register-map I2C slave for I2C1, on one or two addresses.
+
+	Works on the same parts as lib_i2c_master.h (V003/V00x, X035, V10x,
+	V20x, V30x, L103).  Unlike examples/i2c_slave, which takes an interrupt
+	for every byte, the bytes here are moved by DMA (I2C1_TX on DMA1 channel
+	6, I2C1_RX on channel 7), so a transaction costs two or three interrupts
+	however long it is.  That keeps up with back to back reads at 400kHz
+	(Fast-mode, the most the I2C peripheral is rated for) without
+	stretching the clock between bytes.
+
+	The protocol is the usual EEPROM-like one:  the first byte of a write
+	sets the register pointer, the rest of it is written from there.  Reads
+	start at the register pointer.
+
+		static uint8_t regs[16], regs_shadow[16];
+		static i2cs_map map = { .regs = regs, .shadow = regs_shadow,
+			.size = sizeof(regs), .wsize = 4, .on_write = on_write };
+
+		i2cs_init( 0x09, &map );
+
+		uint8_t * r = i2cs_edit( &map );  // The copy the master doesn't see
+		r[4] = temp >> 8;
+		r[5] = temp;
+		i2cs_publish( &map );             // Both bytes show up together
+
+	Writes from the master are collected in a buffer (I2CS_RX_MAX bytes,
+	including the register pointer) and copied into the map at the STOP (or
+	repeated start), then on_write( reg, len ) is called from the interrupt.
+	Only registers below wsize can be written, 0 makes the map read-only.
+	Bytes past I2CS_RX_MAX are dropped.
+
+	Reads are sent from the map by DMA, past the end of the map the master
+	gets 0xff.  on_read( reg, len ) is called after, len is the number of
+	bytes the master took.
+
+	Double buffering: with a shadow buffer, main edits the shadow and
+	i2cs_publish() swaps it with the live copy.  If the master is in the
+	middle of a read, the swap waits for it to end, so a multi-byte value is
+	never read half old and half new.  i2cs_edit() waits for a pending swap.
+	Without a shadow, i2cs_edit() just returns regs.
+
+	A second address with its own map can be added with i2cs_init_secondary(),
+	the hardware only matches two.
+
+	Define I2CS_STATS to 1 to count interrupts and the SysTick ticks spent in
+	them, in i2cs_stats.  A transaction is counted where it ends, at the
+	STOP, or for a read at the master's NACK (which doesn't set STOPF).
+
+	This library owns I2C1, DMA1 channels 6 and 7, and their interrupt
+	handlers, so it can't be used together with lib_i2c_master.h.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef I2CS_PRERATE
+#define I2CS_PRERATE 2000000 // Logic clock
+#endif
+
+#ifndef I2CS_RX_MAX
+#define I2CS_RX_MAX 33 // Register pointer + 32 bytes of data
+#endif
+
+#ifndef I2CS_STATS
+#define I2CS_STATS 0
+#endif
+
+#ifndef I2CS_SCL
+	#if defined(CH32V003) || defined(CH32V00x)
+		#define I2CS_SCL PC2
+		#define I2CS_SDA PC1
+	#elif defined(CH32X03x)
+		#define I2CS_SCL PA10
+		#define I2CS_SDA PA11
+	#else
+		#define I2CS_SCL PB6
+		#define I2CS_SDA PB7
+	#endif
+#endif
+
+#ifndef I2CS_PIN_MODE
+	#if defined(CH32X03x)
+		#define I2CS_PIN_MODE GPIO_CFGLR_OUT_50Mhz_AF_PP
+	#else
+		#define I2CS_PIN_MODE GPIO_CFGLR_OUT_10Mhz_AF_OD
+	#endif
+#endif
+
+typedef struct i2cs_map_s
+{
+	uint8_t * regs;   // Live copy, what the master reads
+	uint8_t * shadow; // Copy main edits, may be 0
+	uint16_t size;    // Up to 256
+	uint16_t wsize;   // Registers below this can be written by the master
+	void (*on_write)( uint8_t reg, uint8_t len ); // Called from interrupt context
+	void (*on_read)( uint8_t reg, uint8_t len );  // Called from interrupt context
+	volatile uint8_t pending; // Publish waiting for a read to end
+	uint8_t ptr;              // Register pointer
+} i2cs_map;
+
+#if I2CS_STATS
+struct i2cs_stats_s
+{
+	uint32_t transactions;
+	uint32_t irqs;
+	uint32_t ticks;     // Total SysTick ticks in the interrupts
+	uint32_t max_ticks; // Longest interrupt
+} i2cs_stats;
+#define I2CS_STAT_BEGIN() uint32_t i2cs_t0 = funSysTick32()
+#define I2CS_STAT_END() i2cs_stat_end( i2cs_t0 )
+
+static void i2cs_stat_end( uint32_t t0 )
+{
+	uint32_t t = funSysTick32() - t0;
+	i2cs_stats.irqs++;
+	i2cs_stats.ticks += t;
+	if( t > i2cs_stats.max_ticks ) i2cs_stats.max_ticks = t;
+}
+#else
+#define I2CS_STAT_BEGIN()
+#define I2CS_STAT_END()
+#endif
+
+void i2cs_init( uint8_t addr, i2cs_map * map );
+// addr 0 turns the second address off.
+void i2cs_init_secondary( uint8_t addr, i2cs_map * map );
+// Returns the buffer to change, waits for a swap that is still pending.
+uint8_t * i2cs_edit( i2cs_map * map );
+// Makes the edits visible to the master, all at once.
+void i2cs_publish( i2cs_map * map );
+
+static i2cs_map * i2cs_maps[2];
+static i2cs_map * i2cs_cur;
+static uint8_t i2cs_rx[I2CS_RX_MAX];
+static uint8_t i2cs_rx_active;
+static uint8_t i2cs_tx_active;
+static uint16_t i2cs_tx_len;
+static uint8_t i2cs_tx_pad;
+
+static void i2cs_swap( i2cs_map * m )
+{
+	uint8_t * t = m->regs;
+	m->regs = m->shadow;
+	m->shadow = t;
+	memcpy( m->shadow, m->regs, m->size );
+	m->pending = 0;
+}
+
+// A write ended (STOP or repeated start), commit what came in.
+static void i2cs_end_write( void )
+{
+	if( !i2cs_rx_active )
+		return;
+	i2cs_rx_active = 0;
+
+	int n = I2CS_RX_MAX - DMA1_Channel7->CNTR;
+	DMA1_Channel7->CFGR &= ~DMA_CFGR1_EN;
+	DMA1->INTFCR = DMA1_IT_GL7;
+
+	i2cs_map * m = i2cs_cur;
+	if( n < 1 || !m )
+		return;
+
+	m->ptr = i2cs_rx[0];
+	n--;
+	if( !n )
+		return; // Just setting the pointer for a read
+
+	int reg = m->ptr;
+	if( reg >= m->wsize )
+		return;
+	if( n > m->wsize - reg )
+		n = m->wsize - reg;
+
+	memcpy( m->regs + reg, i2cs_rx + 1, n );
+	if( m->shadow )
+		memcpy( m->shadow + reg, i2cs_rx + 1, n );
+	if( m->on_write )
+		m->on_write( reg, n );
+}
+
+// The master NACKed (or STOPped) a read.
+static void i2cs_end_read( void )
+{
+	if( !i2cs_tx_active )
+		return;
+	i2cs_tx_active = 0;
+
+	int fetched = i2cs_tx_len - DMA1_Channel6->CNTR;
+	DMA1_Channel6->CFGR &= ~DMA_CFGR1_EN;
+	DMA1->INTFCR = DMA1_IT_GL6;
+
+	// DMA keeps one byte ahead in DATAR, that one was never sent.
+	if( !i2cs_tx_pad && fetched > 0 )
+		fetched--;
+	i2cs_tx_pad = 0;
+	I2C1->CTLR2 &= ~I2C_CTLR2_ITBUFEN;
+
+	i2cs_map * m = i2cs_cur;
+	if( !m )
+		return;
+	if( m->pending )
+		i2cs_swap( m );
+	if( m->on_read )
+		m->on_read( m->ptr, fetched );
+}
+
+void I2C1_EV_IRQHandler( void ) __attribute__((interrupt));
+void I2C1_EV_IRQHandler( void )
+{
+	I2CS_STAT_BEGIN();
+	uint16_t star1 = I2C1->STAR1;
+
+	if( star1 & I2C_STAR1_ADDR )
+	{
+		// Reading STAR2 releases SCL, DMA picks up TXE/RXNE once DMAEN is set.
+		uint16_t star2 = I2C1->STAR2;
+
+		i2cs_end_write(); // Repeated start after setting the pointer
+		i2cs_end_read();
+
+		i2cs_map * m = i2cs_maps[!!( star2 & I2C_STAR2_DUALF )];
+		i2cs_cur = m;
+
+		if( star2 & I2C_STAR2_TRA )
+		{
+			int len = ( m && m->ptr < m->size ) ? m->size - m->ptr : 0;
+			i2cs_tx_active = 1;
+			i2cs_tx_len = len;
+			if( len )
+			{
+				DMA1_Channel6->MADDR = (uint32_t)( m->regs + m->ptr );
+				DMA1_Channel6->CNTR = len;
+				DMA1_Channel6->CFGR |= DMA_CFGR1_EN;
+				I2C1->CTLR2 |= I2C_CTLR2_DMAEN;
+			}
+			else
+			{
+				i2cs_tx_pad = 1;
+				I2C1->CTLR2 |= I2C_CTLR2_ITBUFEN;
+			}
+		}
+		else
+		{
+			i2cs_rx_active = 1;
+			DMA1_Channel7->MADDR = (uint32_t)i2cs_rx;
+			DMA1_Channel7->CNTR = I2CS_RX_MAX;
+			DMA1_Channel7->CFGR |= DMA_CFGR1_EN;
+			I2C1->CTLR2 |= I2C_CTLR2_DMAEN;
+		}
+	}
+
+	if( star1 & I2C_STAR1_STOPF )
+	{
+		I2C1->CTLR1 &= ~I2C_CTLR1_STOP; // Writing CTLR1 clears STOPF
+		I2C1->CTLR2 &= ~( I2C_CTLR2_DMAEN | I2C_CTLR2_ITBUFEN );
+#if I2CS_STATS
+		// Not a read that the NACK already ended and counted.
+		if( i2cs_rx_active || i2cs_tx_active )
+			i2cs_stats.transactions++;
+#endif
+		i2cs_end_write();
+		i2cs_end_read();
+	}
+
+	// Only with ITBUFEN, when DMA ran out of buffer.
+	if( ( I2C1->CTLR2 & I2C_CTLR2_ITBUFEN ) )
+	{
+		if( star1 & I2C_STAR1_TXE )
+			I2C1->DATAR = 0xff;
+		if( star1 & I2C_STAR1_RXNE )
+			(void)I2C1->DATAR;
+	}
+	I2CS_STAT_END();
+}
+
+void I2C1_ER_IRQHandler( void ) __attribute__((interrupt));
+void I2C1_ER_IRQHandler( void )
+{
+	I2CS_STAT_BEGIN();
+	uint16_t star1 = I2C1->STAR1;
+
+	I2C1->STAR1 = ~( star1 & ( I2C_STAR1_AF | I2C_STAR1_ARLO | I2C_STAR1_BERR | I2C_STAR1_OVR ) );
+
+	// AF is how a read ends, the master NACKs the last byte.
+	if( star1 & ( I2C_STAR1_AF | I2C_STAR1_BERR ) )
+	{
+		I2C1->CTLR2 &= ~I2C_CTLR2_DMAEN;
+#if I2CS_STATS
+		if( ( star1 & I2C_STAR1_AF ) && i2cs_tx_active )
+			i2cs_stats.transactions++;
+#endif
+		i2cs_end_read();
+	}
+	I2CS_STAT_END();
+}
+
+// DMA ran out of buffer, the rest goes through TXE/RXNE.
+void DMA1_Channel6_IRQHandler( void ) __attribute__((interrupt));
+void DMA1_Channel6_IRQHandler( void )
+{
+	I2CS_STAT_BEGIN();
+	DMA1->INTFCR = DMA1_IT_GL6;
+	i2cs_tx_pad = 1;
+	I2C1->CTLR2 |= I2C_CTLR2_ITBUFEN;
+	I2CS_STAT_END();
+}
+
+void DMA1_Channel7_IRQHandler( void ) __attribute__((interrupt));
+void DMA1_Channel7_IRQHandler( void )
+{
+	I2CS_STAT_BEGIN();
+	DMA1->INTFCR = DMA1_IT_GL7;
+	I2C1->CTLR2 |= I2C_CTLR2_ITBUFEN;
+	I2CS_STAT_END();
+}
+
+void i2cs_init( uint8_t addr, i2cs_map * map )
+{
+	funGpioInitAll();
+	RCC->APB1PCENR |= RCC_APB1Periph_I2C1;
+	RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+
+	RCC->APB1PRSTR |= RCC_APB1Periph_I2C1;
+	RCC->APB1PRSTR &= ~RCC_APB1Periph_I2C1;
+
+	funPinMode( I2CS_SCL, I2CS_PIN_MODE );
+	funPinMode( I2CS_SDA, I2CS_PIN_MODE );
+
+	i2cs_maps[0] = map;
+	i2cs_maps[1] = 0;
+	if( map->shadow )
+		memcpy( map->shadow, map->regs, map->size );
+
+	DMA1_Channel6->CFGR = 0;
+	DMA1_Channel6->PADDR = (uint32_t)&I2C1->DATAR;
+	DMA1_Channel6->CFGR = DMA_CFGR1_MINC | DMA_CFGR1_DIR | DMA_CFGR1_TCIE | DMA_CFGR1_PL;
+	DMA1_Channel7->CFGR = 0;
+	DMA1_Channel7->PADDR = (uint32_t)&I2C1->DATAR;
+	DMA1_Channel7->CFGR = DMA_CFGR1_MINC | DMA_CFGR1_TCIE | DMA_CFGR1_PL;
+
+	I2C1->CTLR2 = ( ( FUNCONF_SYSTEM_CORE_CLOCK / I2CS_PRERATE ) & I2C_CTLR2_FREQ ) | I2C_CTLR2_ITEVTEN | I2C_CTLR2_ITERREN;
+	I2C1->OADDR1 = addr << 1;
+	I2C1->OADDR2 = 0;
+	I2C1->CTLR1 |= I2C_CTLR1_PE;
+	I2C1->CTLR1 |= I2C_CTLR1_ACK;
+
+	NVIC_SetPriority( I2C1_EV_IRQn, 2 << 4 );
+	NVIC_SetPriority( I2C1_ER_IRQn, 2 << 4 );
+	NVIC_EnableIRQ( I2C1_EV_IRQn );
+	NVIC_EnableIRQ( I2C1_ER_IRQn );
+	NVIC_EnableIRQ( DMA1_Channel6_IRQn );
+	NVIC_EnableIRQ( DMA1_Channel7_IRQn );
+}
+
+void i2cs_init_secondary( uint8_t addr, i2cs_map * map )
+{
+	NVIC_DisableIRQ( I2C1_EV_IRQn );
+	if( addr )
+	{
+		if( map->shadow )
+			memcpy( map->shadow, map->regs, map->size );
+		i2cs_maps[1] = map;
+		I2C1->OADDR2 = ( addr << 1 ) | 1;
+	}
+	else
+	{
+		I2C1->OADDR2 = 0;
+		i2cs_maps[1] = 0;
+	}
+	NVIC_EnableIRQ( I2C1_EV_IRQn );
+}
+
+uint8_t * i2cs_edit( i2cs_map * map )
+{
+	if( !map->shadow )
+		return map->regs;
+	while( map->pending );
+	return map->shadow;
+}
+
+void i2cs_publish( i2cs_map * map )
+{
+	if( !map->shadow )
+		return;
+
+	NVIC_DisableIRQ( I2C1_EV_IRQn );
+	NVIC_DisableIRQ( I2C1_ER_IRQn );
+	if( i2cs_tx_active && i2cs_cur == map )
+		map->pending = 1; // Swapped when the read ends
+	else
+		i2cs_swap( map );
+	NVIC_EnableIRQ( I2C1_EV_IRQn );
+	NVIC_EnableIRQ( I2C1_ER_IRQn );
+}
+
+#endif
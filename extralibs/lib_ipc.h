@@ -0,0 +1,214 @@
+#ifndef _LIB_IPC_H
+#define _LIB_IPC_H
+
+/* Talking between the V3F and V5F cores of the CH32H41x.
+
+	Cross-core locks, for the two cores only:
+
+		ipc_lock( 3 );           // Spins until this core holds lock 3
+		...                      // touch the shared thing
+		ipc_unlock( 3 );
+		if( ipc_trylock( 3 ) == 0 ) { ...; ipc_unlock( 3 ); }
+
+	There are IPC_LOCKS of them.  A lock is held by a core, not a task, so
+	inside one core they don't exclude anything (use __disable_irq() there).
+
+	Mailboxes, a lib_spsc.h record ring in the shared SRAM with a doorbell
+	that wakes the other core.  One core sends, the other receives:
+
+		struct msg q[16];                              // in .bss, shared RAM
+		ipc_mbox to_v5f;
+		ipc_mbox_init( &to_v5f, q, sizeof(q[0]), 16 ); // once, before StartV5F()
+
+		ipc_send( &to_v5f, &m );                       // V3F, -1 if full
+		ipc_recv( &to_v5f, &m );                       // V5F, -1 if empty
+		ipc_wait( &to_v5f, &m );                       // V5F, sleeps until there is one
+
+	Offloading work to the V5F:
+
+		int __ITCM fir( void * arg ) { ... }   // Code in ITCM runs at full speed
+
+		int main_V5F() { ipc_worker(); }       // Never returns
+		...
+		StartV5F( main_V5F );
+		ipc_job job;
+		ipc_offload( &job, fir, &block );      // -1 if the queue is full
+		...                                    // V3F does I/O meanwhile
+		int r = ipc_job_wait( &job );          // or poll ipc_job_done( &job )
+
+	The V5F's stack already lives in its DTCM (_v5f_stack), so a job only
+	touches the shared SRAM for what arg points to.  The job struct must stay
+	valid until it's done.
+
+	ch32h41xhw.h has the IPC_CHx and HSEM interrupts but not their registers,
+	so none of this touches them.  The doorbell is the PFIC's SETEVENT, the
+	way StartV5F() wakes the V5F, and the waiting core sleeps in WFE.  The
+	locks are Peterson's algorithm in shared RAM, which only needs ordinary
+	loads and stores with fences between them.
+*/
+
+#include <stdint.h>
+#include "lib_spsc.h"
+
+#if !defined(CH32H41x)
+#error lib_ipc.h is only for the dual-core CH32H41x
+#endif
+
+#ifndef IPC_LOCKS
+#define IPC_LOCKS 8
+#endif
+
+#ifndef IPC_JOB_QUEUE
+#define IPC_JOB_QUEUE 8 // Power of 2
+#endif
+
+#define IPC_FENCE() __asm__ volatile( "fence rw, rw" : : : "memory" )
+
+typedef struct
+{
+	spsc_records q;
+} ipc_mbox;
+
+typedef int (*ipc_job_fn)( void * arg );
+
+typedef struct
+{
+	ipc_job_fn fn;
+	void * arg;
+	volatile int result;
+	volatile uint32_t done;
+} ipc_job;
+
+int ipc_trylock( int lock );
+void ipc_lock( int lock );
+void ipc_unlock( int lock );
+void ipc_ring( void );
+void ipc_sleep( void );
+int ipc_mbox_init( ipc_mbox * mb, void * buf, uint32_t recsize, uint32_t count );
+int ipc_send( ipc_mbox * mb, const void * rec );
+int ipc_recv( ipc_mbox * mb, void * rec );
+void ipc_wait( ipc_mbox * mb, void * rec );
+int ipc_offload( ipc_job * job, ipc_job_fn fn, void * arg );
+int ipc_job_done( ipc_job * job );
+int ipc_job_wait( ipc_job * job );
+void ipc_worker( void );
+
+// Both cores run this image, so these are the same RAM for both.
+static volatile uint32_t ipc_want[IPC_LOCKS][2];
+static volatile uint32_t ipc_turn[IPC_LOCKS];
+
+int ipc_trylock( int lock )
+{
+	int me = __get_MHARTID(), other = !me;
+	ipc_want[lock][me] = 1;
+	ipc_turn[lock] = other;
+	// Our want and turn have to be out before we look at theirs.
+	IPC_FENCE();
+	if( ipc_want[lock][other] && ipc_turn[lock] == other )
+	{
+		ipc_want[lock][me] = 0;
+		return -1;
+	}
+	SPSC_FENCE_ACQUIRE();
+	return 0;
+}
+
+void ipc_lock( int lock )
+{
+	int me = __get_MHARTID(), other = !me;
+	ipc_want[lock][me] = 1;
+	ipc_turn[lock] = other;
+	IPC_FENCE();
+	while( ipc_want[lock][other] && ipc_turn[lock] == other );
+	SPSC_FENCE_ACQUIRE();
+}
+
+void ipc_unlock( int lock )
+{
+	SPSC_FENCE_RELEASE();
+	ipc_want[lock][__get_MHARTID()] = 0;
+}
+
+void ipc_ring( void )
+{
+	// Everything we wrote must be visible before the other core wakes up.
+	IPC_FENCE();
+	NVIC->SCTLR |= (1<<5);  // SETEVENT
+	NVIC->SCTLR &= ~(1<<5);
+}
+
+void ipc_sleep( void )
+{
+	// A doorbell since the caller last looked is held as a pending event,
+	// so this WFE returns right away instead of missing it.  Interrupts are
+	// off so nothing in between can turn it back into a WFI.
+	__disable_irq();
+	NVIC->SCTLR |= (1<<3);  // wfi->wfe
+	__ASM volatile( "wfi" );
+	NVIC->SCTLR &= ~(1<<3);
+	__enable_irq();
+}
+
+int ipc_mbox_init( ipc_mbox * mb, void * buf, uint32_t recsize, uint32_t count )
+{
+	return spsc_rec_init( &mb->q, buf, recsize, count );
+}
+
+int ipc_send( ipc_mbox * mb, const void * rec )
+{
+	if( spsc_rec_push( &mb->q, rec ) ) return -1;
+	ipc_ring();
+	return 0;
+}
+
+int ipc_recv( ipc_mbox * mb, void * rec )
+{
+	return spsc_rec_pop( &mb->q, rec );
+}
+
+void ipc_wait( ipc_mbox * mb, void * rec )
+{
+	while( spsc_rec_pop( &mb->q, rec ) )
+		ipc_sleep();
+}
+
+static ipc_job * ipc_jobq_buf[IPC_JOB_QUEUE];
+static ipc_mbox ipc_jobq = { { 0, 0, IPC_JOB_QUEUE - 1, sizeof( ipc_job * ), (uint8_t *)ipc_jobq_buf } };
+
+int ipc_offload( ipc_job * job, ipc_job_fn fn, void * arg )
+{
+	job->fn = fn;
+	job->arg = arg;
+	job->done = 0;
+	return ipc_send( &ipc_jobq, &job );
+}
+
+int ipc_job_done( ipc_job * job )
+{
+	if( !job->done ) return 0;
+	SPSC_FENCE_ACQUIRE();
+	return 1;
+}
+
+int ipc_job_wait( ipc_job * job )
+{
+	while( !job->done )
+		ipc_sleep();
+	SPSC_FENCE_ACQUIRE();
+	return job->result;
+}
+
+void ipc_worker( void )
+{
+	while( 1 )
+	{
+		ipc_job * job;
+		ipc_wait( &ipc_jobq, &job );
+		job->result = job->fn( job->arg );
+		SPSC_FENCE_RELEASE();
+		job->done = 1;
+		ipc_ring();
+	}
+}
+
+#endif
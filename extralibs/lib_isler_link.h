@@ -0,0 +1,538 @@
+#ifndef _LIB_ISLER_LINK_H
+#define _LIB_ISLER_LINK_H
+
+/* Packet link layer on top of iSLER.h, for CH5xx sensor networks.
+
+	Nodes have a one byte address, 0xff is everyone.  Frames to one node
+	are acknowledged and sent again until they are, frames to everyone are
+	sent once on every channel.  Nothing busy-waits: reception happens in
+	the radio interrupt, which also starts the acknowledgement, sending and
+	going back to listening after an acknowledgement happen in isl_poll(),
+	which only looks at the radio and returns.
+
+		#include "lib_isler_link.h"  // instead of iSLER.h
+
+		isl_init( 0x5A1E4C3B, my_node, LL_TX_POWER_0_DBM );
+
+		isl_send( 3, &reading, sizeof(reading) );  // -1 if the queue is full
+
+		while( 1 )
+		{
+			isl_poll();                         // sends, waits for acks
+			isl_packet p;
+			while( isl_recv( &p ) == 0 )        // from the interrupt's queue
+				printf( "%d says %d bytes, RSSI %d\n", p.src, p.len, p.rssi );
+			if( !isl_busy() ) __WFI();          // woken by the next frame
+		}
+
+	Pick your own access address, not the BLE advertising one.  isl_init()
+	takes the place of iSLERInit(), and the link owns the radio afterwards.
+
+	Channel hopping: every node listens on one channel of ISL_CHANNELS, and
+	moves on to the next one when it gets ISL_HOP_AFTER_BAD broken frames in
+	a row (CRC errors, only the CH570/2 reports them), or when you call
+	isl_hop().  A sender remembers which channel each peer answered on.
+	When a peer stops answering there after ISL_RETRIES tries, it goes
+	through the other channels, ISL_RETRIES tries each, until it finds it
+	again, or gives up and counts the frame as lost.
+
+	Statistics, for deciding where to put the nodes:
+
+		isl_peer p;
+		isl_peer_stats( 3, &p );                // sent, acked, retries, lost, rx, rssi
+		isl_chan_stats[i]                       // per channel of ISL_CHANNELS
+		isl_stats                               // totals, including dropped frames
+
+	RSSI is a running average of what was heard from the peer, acks
+	included.  Up to ISL_MAX_PEERS peers are tracked, the oldest one is
+	forgotten for a new one.
+
+	Before sleeping, isl_radio_off() stops listening (once !isl_busy()),
+	isl_radio_on() starts again.  Frames are stamped with ISL_TIMESTAMP()
+	when they arrive, and if ISL_RX_HOOK is defined, it sees every frame
+	from the interrupt first and can return 1 to keep it out of the queue.
+	lib_isler_slots.h uses both for its beacons.
+
+	Frame: PDU type, length, destination, source, sequence number, payload.
+*/
+
+#ifdef RFCoreInit
+#error Include lib_isler_link.h instead of iSLER.h, it needs the radio interrupt
+#endif
+
+void isl_rx_isr( void );
+#define ISLER_CALLBACK isl_rx_isr
+
+#include "iSLER.h"
+#include "lib_spsc.h"
+
+#ifndef ISL_CHANNELS
+// The advertising channels, and data channels between Wi-Fi channels 1, 6 and 11.
+#define ISL_CHANNELS { 37, 10, 38, 22, 39, 35 }
+#endif
+
+#ifndef ISL_PHY
+#define ISL_PHY PHY_1M
+#endif
+
+#ifndef ISL_MAX_PAYLOAD
+#define ISL_MAX_PAYLOAD 32 // Up to 250
+#endif
+
+#ifndef ISL_TX_QUEUE
+#define ISL_TX_QUEUE 8 // Power of 2
+#endif
+
+#ifndef ISL_RX_QUEUE
+#define ISL_RX_QUEUE 8 // Power of 2
+#endif
+
+#ifndef ISL_MAX_PEERS
+#define ISL_MAX_PEERS 8
+#endif
+
+#ifndef ISL_RETRIES
+#define ISL_RETRIES 3 // Per channel
+#endif
+
+#ifndef ISL_ACK_TIMEOUT_US
+#define ISL_ACK_TIMEOUT_US 1500
+#endif
+
+#ifndef ISL_HOP_AFTER_BAD
+#define ISL_HOP_AFTER_BAD 8
+#endif
+
+#ifndef ISL_TIMESTAMP
+#define ISL_TIMESTAMP() funSysTick32()
+#endif
+
+#define ISL_BROADCAST 0xff
+
+#define ISL_PDU_DATA 0x11
+#define ISL_PDU_ACK  0x12
+#define ISL_HEADER   5 // PDU, length, destination, source, sequence
+
+typedef struct
+{
+	uint32_t time; // ISL_TIMESTAMP() when it came in
+	uint8_t src;
+	uint8_t dst;
+	int8_t rssi;
+	uint8_t len;
+	uint8_t data[ISL_MAX_PAYLOAD];
+} isl_packet;
+
+typedef struct
+{
+	uint8_t addr;
+	uint8_t chan;   // Index into ISL_CHANNELS it last answered on
+	uint8_t txseq;
+	uint8_t rxseq;  // Of the last frame taken from it, to drop repeats
+	int8_t rssi;
+	uint8_t used;
+	uint32_t sent;
+	uint32_t acked;
+	uint32_t retries;
+	uint32_t lost;
+	uint32_t rx;
+} isl_peer;
+
+typedef struct
+{
+	uint32_t tx;
+	uint32_t acked;
+	uint32_t rx;
+	uint32_t bad;
+} isl_chan;
+
+typedef struct
+{
+	uint32_t sent;
+	uint32_t acked;
+	uint32_t lost;
+	uint32_t rx;
+	uint32_t repeats;    // Frames sent again after a lost ack, acked but not queued
+	uint32_t rx_dropped; // The receive queue was full
+	uint32_t hops;
+} isl_totals;
+
+int isl_init( uint32_t access_address, uint8_t node, uint8_t txpower );
+int isl_send( uint8_t dst, const void * data, int len );
+int isl_recv( isl_packet * p );
+void isl_poll( void );
+int isl_busy( void );
+void isl_hop( void );
+void isl_radio_off( void );
+void isl_radio_on( void );
+int isl_peer_stats( uint8_t addr, isl_peer * out );
+
+#ifdef ISL_RX_HOOK
+int ISL_RX_HOOK( isl_packet * p );
+#endif
+
+static const uint8_t isl_channels[] = ISL_CHANNELS;
+#define ISL_NCHANNELS ( sizeof( isl_channels ) )
+
+isl_chan isl_chan_stats[ISL_NCHANNELS];
+isl_totals isl_stats;
+
+enum
+{
+	ISL_IDLE,
+	ISL_TX,
+	ISL_WAIT_ACK,
+};
+
+static struct
+{
+	uint32_t aa;
+	uint8_t node;
+	uint8_t home;              // Index of the channel we listen on
+	volatile uint8_t listen;   // Channel the radio receives on now
+	volatile uint8_t state;
+	volatile uint8_t acked;
+	volatile uint8_t want_hop;
+	volatile uint8_t acking;   // The interrupt is sending an ack, isl_poll() finishes it
+	uint8_t off;
+	uint8_t bad_run;
+	uint8_t next_peer;
+	uint8_t chan;              // Index of the channel we are sending on
+	uint16_t tries;
+	uint32_t deadline;
+	isl_peer * to;
+	isl_peer peers[ISL_MAX_PEERS];
+	spsc_records txq;
+	spsc_records rxq;
+} isl;
+
+static isl_packet isl_txbuf[ISL_TX_QUEUE];
+static isl_packet isl_rxbuf[ISL_RX_QUEUE];
+__attribute__((aligned(4))) static uint8_t isl_frame[ISL_HEADER + ISL_MAX_PAYLOAD];
+__attribute__((aligned(4))) static uint8_t isl_ack[ISL_HEADER];
+
+// Only with LLE_IRQn off, or from the interrupt.
+static isl_peer * isl_find_peer( uint8_t addr )
+{
+	int i;
+	for( i = 0; i < ISL_MAX_PEERS; i++ )
+		if( isl.peers[i].used && isl.peers[i].addr == addr ) return &isl.peers[i];
+	return 0;
+}
+
+static isl_peer * isl_get_peer( uint8_t addr )
+{
+	isl_peer * p = isl_find_peer( addr );
+	if( p ) return p;
+	// Not the one a frame is on its way to.
+	if( &isl.peers[isl.next_peer] == isl.to ) isl.next_peer = ( isl.next_peer + 1 ) % ISL_MAX_PEERS;
+	p = &isl.peers[isl.next_peer];
+	isl.next_peer = ( isl.next_peer + 1 ) % ISL_MAX_PEERS;
+	memset( p, 0, sizeof( *p ) );
+	p->addr = addr;
+	p->chan = isl.home;
+	p->rssi = -127;
+	p->used = 1;
+	return p;
+}
+
+static void isl_rssi( isl_peer * p, int rssi )
+{
+	p->rssi = ( p->rssi == -127 ) ? rssi : ( p->rssi * 3 + rssi ) / 4;
+}
+
+static void isl_listen( uint8_t channel )
+{
+	isl.listen = channel;
+	iSLERRX( isl.aa, channel, ISL_PHY );
+}
+
+__HIGH_CODE
+void isl_rx_isr( void )
+{
+	uint8_t * f = (uint8_t *)LLE_BUF;
+	isl_chan * cs = &isl_chan_stats[0];
+	int i;
+	for( i = 0; i < ISL_NCHANNELS; i++ )
+		if( isl_channels[i] == isl.listen ) cs = &isl_chan_stats[i];
+
+	// The radio has stopped for this frame.  Mid-send it's a late interrupt
+	// for a frame from before, which isl_poll() doesn't want touched.
+	if( isl.state == ISL_TX || isl.acking || ( isl.off && isl.state == ISL_IDLE ) ) return;
+
+	if( iSLERCRCOK() == 0 || f[1] < ISL_HEADER - 2 || ( f[0] != ISL_PDU_DATA && f[0] != ISL_PDU_ACK ) )
+	{
+		cs->bad++;
+		if( isl.listen == isl_channels[isl.home] && ++isl.bad_run >= ISL_HOP_AFTER_BAD ) isl.want_hop = 1;
+		isl_listen( isl.listen );
+		return;
+	}
+	cs->rx++;
+	isl.bad_run = 0;
+
+	uint32_t time = ISL_TIMESTAMP();
+	uint8_t dst = f[2], src = f[3], seq = f[4];
+	int rssi = iSLERRSSI();
+	if( dst != isl.node && dst != ISL_BROADCAST )
+	{
+		isl_listen( isl.listen );
+		return;
+	}
+
+	if( f[0] == ISL_PDU_ACK )
+	{
+		if( isl.state == ISL_WAIT_ACK && isl.to && src == isl.to->addr && seq == isl.to->txseq )
+		{
+			isl_rssi( isl.to, rssi );
+			isl.acked = 1;
+		}
+		isl_listen( isl.listen );
+		return;
+	}
+
+	// While waiting for an ack, the peer table is ours to use too: isl_poll()
+	// runs with this interrupt off.
+	isl_peer * p = isl_get_peer( src );
+	isl_rssi( p, rssi );
+	p->rx++;
+	isl_stats.rx++;
+
+	if( dst != ISL_BROADCAST )
+	{
+		// Ack right away, on the same channel, the sender is listening there.
+		// It goes out while we queue the frame, isl_poll() sees it done and
+		// listens again.
+		isl_ack[0] = ISL_PDU_ACK;
+		isl_ack[1] = ISL_HEADER - 2;
+		isl_ack[2] = src;
+		isl_ack[3] = isl.node;
+		isl_ack[4] = seq;
+		isl.acking = 1;
+		iSLERTXStart( isl.aa, isl_ack, sizeof( isl_ack ), isl.listen, ISL_PHY );
+		if( p->rx > 1 && seq == p->rxseq )
+		{
+			isl_stats.repeats++;
+			return;
+		}
+		p->rxseq = seq;
+	}
+
+	isl_packet * pk = spsc_rec_alloc( &isl.rxq );
+	if( pk )
+	{
+		int len = f[1] - ( ISL_HEADER - 2 );
+		if( len > ISL_MAX_PAYLOAD ) len = ISL_MAX_PAYLOAD;
+		pk->time = time;
+		pk->src = src;
+		pk->dst = dst;
+		pk->rssi = rssi;
+		pk->len = len;
+		memcpy( pk->data, f + ISL_HEADER, len );
+#ifdef ISL_RX_HOOK
+		if( !ISL_RX_HOOK( pk ) )
+#endif
+		spsc_rec_commit( &isl.rxq );
+	}
+	else
+		isl_stats.rx_dropped++;
+	if( !isl.acking ) isl_listen( isl.listen );
+}
+
+int isl_init( uint32_t access_address, uint8_t node, uint8_t txpower )
+{
+	memset( &isl, 0, sizeof( isl ) );
+	isl.aa = access_address;
+	isl.node = node;
+	if( spsc_rec_init( &isl.txq, isl_txbuf, sizeof( isl_packet ), ISL_TX_QUEUE ) ) return -1;
+	if( spsc_rec_init( &isl.rxq, isl_rxbuf, sizeof( isl_packet ), ISL_RX_QUEUE ) ) return -1;
+	iSLERInit( txpower );
+	isl_listen( isl_channels[0] );
+	return 0;
+}
+
+int isl_send( uint8_t dst, const void * data, int len )
+{
+	if( len > ISL_MAX_PAYLOAD || len < 0 ) return -1;
+	isl_packet * pk = spsc_rec_alloc( &isl.txq );
+	if( !pk ) return -1;
+	pk->src = isl.node;
+	pk->dst = dst;
+	pk->len = len;
+	memcpy( pk->data, data, len );
+	spsc_rec_commit( &isl.txq );
+	return 0;
+}
+
+int isl_recv( isl_packet * p )
+{
+	return spsc_rec_pop( &isl.rxq, p );
+}
+
+int isl_busy( void )
+{
+	return isl.state != ISL_IDLE || isl.acking || !spsc_rec_empty( &isl.txq );
+}
+
+int isl_peer_stats( uint8_t addr, isl_peer * out )
+{
+	NVIC_DisableIRQ( LLE_IRQn );
+	isl_peer * p = isl_find_peer( addr );
+	if( p ) *out = *p;
+	NVIC_EnableIRQ( LLE_IRQn );
+	return p ? 0 : -1;
+}
+
+static void isl_do_hop( void )
+{
+	isl.home = ( isl.home + 1 ) % ISL_NCHANNELS;
+	isl.bad_run = 0;
+	isl.want_hop = 0;
+	isl_stats.hops++;
+	if( isl.state == ISL_IDLE && !isl.off && !isl.acking ) isl_listen( isl_channels[isl.home] );
+}
+
+void isl_hop( void )
+{
+	NVIC_DisableIRQ( LLE_IRQn );
+	isl_do_hop();
+	NVIC_EnableIRQ( LLE_IRQn );
+}
+
+static void isl_stop( void )
+{
+	DevSetMode( 0 );
+	if( LL->LL0 & 3 )
+	{
+		LL->CTRL_MOD &= CTRL_MOD_RFSTOP;
+		LL->LL0 |= 0x08;
+	}
+}
+
+void isl_radio_off( void )
+{
+	NVIC_DisableIRQ( LLE_IRQn );
+	isl.off = 1;
+	// Otherwise isl_poll() stops it when it's done sending.
+	if( isl.state == ISL_IDLE && !isl.acking ) isl_stop();
+	NVIC_EnableIRQ( LLE_IRQn );
+}
+
+void isl_radio_on( void )
+{
+	NVIC_DisableIRQ( LLE_IRQn );
+	isl.off = 0;
+	if( isl.state == ISL_IDLE && !isl.acking ) isl_listen( isl_channels[isl.home] );
+	NVIC_EnableIRQ( LLE_IRQn );
+}
+
+static void isl_start_tx( void )
+{
+	isl_packet * pk = spsc_rec_peek( &isl.txq );
+	isl_frame[0] = ISL_PDU_DATA;
+	isl_frame[1] = ISL_HEADER - 2 + pk->len;
+	isl_frame[2] = pk->dst;
+	isl_frame[3] = isl.node;
+	isl_frame[4] = isl.to ? isl.to->txseq : 0;
+	memcpy( isl_frame + ISL_HEADER, pk->data, pk->len );
+	isl.state = ISL_TX;
+	isl_chan_stats[isl.chan].tx++;
+	iSLERTXStart( isl.aa, isl_frame, ISL_HEADER + pk->len, isl_channels[isl.chan], ISL_PHY );
+}
+
+static void isl_finish( void )
+{
+	spsc_rec_release( &isl.txq );
+	isl.to = 0;
+	isl.state = ISL_IDLE;
+	if( isl.off )
+		isl_stop();
+	else
+		isl_listen( isl_channels[isl.home] );
+}
+
+void isl_poll( void )
+{
+	NVIC_DisableIRQ( LLE_IRQn );
+	if( isl.acking )
+	{
+		// Nothing else can use the radio until the interrupt's ack is out.
+		if( !iSLERTXDone() )
+		{
+			NVIC_EnableIRQ( LLE_IRQn );
+			return;
+		}
+		NVIC_ClearPendingIRQ( LLE_IRQn );
+		isl.acking = 0;
+		if( isl.state != ISL_IDLE )
+			isl_listen( isl.listen );
+		else if( isl.off )
+			isl_stop();
+		else
+			isl_listen( isl_channels[isl.home] );
+	}
+	switch( isl.state )
+	{
+	case ISL_IDLE:
+	{
+		if( isl.want_hop ) isl_do_hop();
+		isl_packet * pk = spsc_rec_peek( &isl.txq );
+		if( !pk ) break;
+		isl.tries = 0;
+		isl.to = 0;
+		isl.chan = 0;
+		if( pk->dst != ISL_BROADCAST )
+		{
+			isl.to = isl_get_peer( pk->dst );
+			isl.to->txseq++;
+			isl.to->sent++;
+			isl.chan = isl.to->chan;
+		}
+		isl_stats.sent++;
+		isl_start_tx();
+		break;
+	}
+	case ISL_TX:
+		if( !iSLERTXDone() ) break;
+		if( !isl.to )
+		{
+			// Broadcasts go out once on every channel.
+			if( ++isl.chan < ISL_NCHANNELS )
+				isl_start_tx();
+			else
+				isl_finish();
+			break;
+		}
+		isl.acked = 0;
+		isl.state = ISL_WAIT_ACK;
+		isl.deadline = funSysTick32() + Ticks_from_Us( ISL_ACK_TIMEOUT_US );
+		isl_listen( isl_channels[isl.chan] );
+		break;
+	case ISL_WAIT_ACK:
+		if( isl.acked )
+		{
+			isl.to->chan = isl.chan;
+			isl.to->acked++;
+			isl_chan_stats[isl.chan].acked++;
+			isl_stats.acked++;
+			isl_finish();
+			break;
+		}
+		if( (int32_t)( funSysTick32() - isl.deadline ) < 0 ) break;
+		if( ++isl.tries >= ISL_RETRIES * ISL_NCHANNELS )
+		{
+			isl.to->lost++;
+			isl_stats.lost++;
+			isl_finish();
+			break;
+		}
+		// Not there any more, look for it on the next channel.
+		if( isl.tries % ISL_RETRIES == 0 )
+			isl.chan = ( isl.chan + 1 ) % ISL_NCHANNELS;
+		isl.to->retries++;
+		isl_start_tx();
+		break;
+	}
+	NVIC_EnableIRQ( LLE_IRQn );
+}
+
+#endif
@@ -0,0 +1,291 @@
+#ifndef _LIB_ISLER_SLOTS_H
+#define _LIB_ISLER_SLOTS_H
+
+/* Battery iSLER nodes that sleep, and wake up for a coordinator's beacons.
+
+	The coordinator is always listening (mains powered) and broadcasts a
+	beacon every period.  A node learns the period from the first beacon it
+	hears, then sleeps with the RTC until just before the next one is due,
+	listens for ISL_SLOT_WINDOW_MS around it, and sleeps again.  That is the
+	time to talk: the node sends what it has right after the beacon, and
+	the coordinator sends what it has for the node then too.
+
+	On top of lib_isler_link.h, include this instead:
+
+		#include "lib_isler_slots.h"
+
+		// Coordinator
+		isl_init( ACCESS_ADDRESS, 1, LL_TX_POWER_0_DBM );
+		isl_slot_beacon_init( 1000 );          // ms
+		while( 1 )
+		{
+			isl_slot_beacon_poll();             // queues the beacon when due
+			isl_poll();
+			...                                 // isl_recv(), isl_send() as usual
+		}
+
+		// Node
+		isl_init( ACCESS_ADDRESS, 7, LL_TX_POWER_0_DBM );
+		isl_slot_init();
+		while( 1 )
+		{
+			if( isl_slot_wait() ) continue;     // sleeps, -1 if no beacon came
+			isl_send( 1, &reading, sizeof(reading) );
+			isl_slot_stay( 10 );                // sends, and receives for 10 ms
+			while( isl_recv( &p ) == 0 ) ...
+		}
+
+	Clocks drift, the LSI by as much as a few percent, so the node measures
+	the period in its own RTC ticks from beacon to beacon and predicts the
+	next one with that.  isl_slot_stats.error is how far off the last
+	prediction was.  The window widens with every missed beacon, and after
+	ISL_SLOT_MAX_MISSES in a row the node searches again: it listens for up
+	to ISL_SLOT_SEARCH_MS, and if nothing comes, isl_slot_wait() returns
+	-1 so the application can sleep for longer before trying again.
+
+	Sleeping is LowPower() from ch5xxhw.h, with ISL_SLOT_POWER_PLAN, which
+	keeps the RAM and the radio's setup.  It wakes on the RTC trigger, so
+	the RTC has to run (SleepInit() is called by isl_slot_init()), and
+	there's an RTC_IRQHandler here, unless you define
+	ISL_SLOT_NO_RTC_HANDLER (then clear RB_RTC_TRIG_CLR in yours).  If you
+	turned on the DCDC, define ISL_SLOT_AFTER_SLEEP() DCDCEnable(), sleep
+	turns it off.
+
+	The beacon is a broadcast, so it goes out on every channel of
+	ISL_CHANNELS and a node hears it on whichever it listens on.  Queue
+	the coordinator's other frames after it, a busy queue delays it.
+
+	At a 1 s period and a 5 ms window the radio is on 0.5% of the time.
+*/
+
+#if !defined(CH5xx)
+#error lib_isler_slots.h is for the CH5xx, it sleeps with their RTC
+#endif
+
+#ifdef _LIB_ISLER_LINK_H
+#error Include lib_isler_slots.h instead of lib_isler_link.h
+#endif
+
+// Frames are stamped with the RTC, which keeps counting in sleep.
+#define ISL_TIMESTAMP() R32_RTC_CNT_32K
+#define ISL_RX_HOOK isl_slot_rx_hook
+
+#include "lib_isler_link.h"
+
+#ifndef ISL_SLOT_WINDOW_MS
+#define ISL_SLOT_WINDOW_MS 5
+#endif
+
+#ifndef ISL_SLOT_MAX_MISSES
+#define ISL_SLOT_MAX_MISSES 8
+#endif
+
+#ifndef ISL_SLOT_SEARCH_MS
+#define ISL_SLOT_SEARCH_MS 5000
+#endif
+
+#ifndef ISL_SLOT_POWER_PLAN
+#define ISL_SLOT_POWER_PLAN ( RB_PWR_RAMX | RB_PWR_RAM2K | RB_PWR_EXTEND )
+#endif
+
+#ifndef ISL_SLOT_AFTER_SLEEP
+#define ISL_SLOT_AFTER_SLEEP()
+#endif
+
+#define ISL_SLOT_BEACON 0xb5 // First byte of a beacon, then the period in ms and the beacon number
+
+typedef struct
+{
+	uint32_t beacons;
+	uint32_t missed;
+	uint32_t searches;
+	int32_t error;   // RTC ticks the last beacon came after it was expected
+	uint32_t period; // RTC ticks between beacons, measured
+} isl_slot_totals;
+
+isl_slot_totals isl_slot_stats;
+
+void isl_slot_beacon_init( uint16_t period_ms );
+void isl_slot_beacon_poll( void );
+void isl_slot_init( void );
+int isl_slot_wait( void );
+void isl_slot_stay( uint32_t ms );
+
+static struct
+{
+	// Set by the radio interrupt
+	volatile uint8_t heard;
+	volatile uint32_t b_time;
+	volatile uint32_t b_number;
+	volatile uint16_t b_period_ms;
+
+	uint8_t synced;
+	uint8_t misses;
+	uint16_t period_ms;
+	uint32_t number;      // Beacon due next on the coordinator, this period's on a node
+	uint32_t last;        // When the last beacon was heard
+	uint32_t last_number; // and its number
+	uint32_t next;
+	uint32_t period_q8; // Measured RTC ticks per period, in 1/256ths
+} isl_slot;
+
+// The RTC count wraps after a day (RTC_MAX_COUNT), these are modulo that.
+static int32_t isl_rtc_diff( uint32_t a, uint32_t b )
+{
+	uint32_t d = ( a >= b ) ? a - b : a + ( RTC_MAX_COUNT - b );
+	return ( d > RTC_MAX_COUNT / 2 ) ? -(int32_t)( RTC_MAX_COUNT - d ) : (int32_t)d;
+}
+
+static uint32_t isl_rtc_add( uint32_t a, int32_t d )
+{
+	if( d < 0 )
+		return ( a >= (uint32_t)-d ) ? a + d : a + RTC_MAX_COUNT + d;
+	a += d;
+	return ( a >= RTC_MAX_COUNT ) ? a - RTC_MAX_COUNT : a;
+}
+
+static uint32_t isl_rtc_ms( uint32_t ms )
+{
+	return ms * RTC_FREQ / 1000;
+}
+
+int isl_slot_rx_hook( isl_packet * p )
+{
+	if( p->dst != ISL_BROADCAST || p->len < 7 || p->data[0] != ISL_SLOT_BEACON ) return 0;
+	isl_slot.b_time = p->time;
+	isl_slot.b_period_ms = p->data[1] | p->data[2] << 8;
+	isl_slot.b_number = p->data[3] | p->data[4] << 8 | p->data[5] << 16 | (uint32_t)p->data[6] << 24;
+	isl_slot.heard = 1;
+	return 1;
+}
+
+#ifndef ISL_SLOT_NO_RTC_HANDLER
+void RTC_IRQHandler( void ) __attribute__((interrupt));
+void RTC_IRQHandler( void )
+{
+	R8_RTC_FLAG_CTRL = RB_RTC_TRIG_CLR;
+}
+#endif
+
+void isl_slot_beacon_init( uint16_t period_ms )
+{
+	isl_slot.period_ms = period_ms;
+	isl_slot.next = R32_RTC_CNT_32K;
+}
+
+void isl_slot_beacon_poll( void )
+{
+	if( isl_rtc_diff( R32_RTC_CNT_32K, isl_slot.next ) < 0 ) return;
+	uint32_t n = isl_slot.number++;
+	uint8_t b[7] = { ISL_SLOT_BEACON, isl_slot.period_ms, isl_slot.period_ms >> 8, n, n >> 8, n >> 16, n >> 24 };
+	isl_send( ISL_BROADCAST, b, sizeof( b ) );
+	isl_slot.next = isl_rtc_add( isl_slot.next, isl_rtc_ms( isl_slot.period_ms ) );
+}
+
+void isl_slot_init( void )
+{
+	memset( &isl_slot, 0, sizeof( isl_slot ) );
+	SleepInit();
+}
+
+// Keeps the radio going until a beacon comes, or the RTC gets to end.  0 if
+// one came.
+static int isl_slot_listen( uint32_t end )
+{
+	while( 1 )
+	{
+		isl_poll();
+		if( isl_slot.heard ) return 0;
+		int32_t left = isl_rtc_diff( end, R32_RTC_CNT_32K );
+		if( left <= 0 ) return -1;
+		// Any frame wakes this up, or the RTC at the end.
+		if( !isl_busy() ) LowPowerIdle( left );
+	}
+}
+
+static void isl_slot_sync( void )
+{
+	uint32_t t = isl_slot.b_time;
+	// Missed ones advance number, not last, so count periods from the last one heard.
+	uint32_t n = isl_slot.b_number - isl_slot.last_number;
+	uint32_t nominal = isl_rtc_ms( isl_slot.b_period_ms );
+
+	if( isl_slot.synced && n > 0 && n <= ISL_SLOT_MAX_MISSES + 1 && isl_slot.b_period_ms == isl_slot.period_ms )
+	{
+		// Average the measured period in slowly, a late beacon (the
+		// coordinator was busy sending) shouldn't throw it off.
+		int32_t measured = isl_rtc_diff( t, isl_slot.last ) / n;
+		isl_slot_stats.error = isl_rtc_diff( t, isl_slot.next );
+		isl_slot.period_q8 += ( ( measured << 8 ) - (int32_t)isl_slot.period_q8 ) / 8;
+	}
+	else
+		isl_slot.period_q8 = nominal << 8;
+
+	isl_slot.period_ms = isl_slot.b_period_ms;
+	isl_slot.number = isl_slot.b_number;
+	isl_slot.last = t;
+	isl_slot.last_number = isl_slot.b_number;
+	isl_slot.next = isl_rtc_add( t, isl_slot.period_q8 >> 8 );
+	isl_slot.synced = 1;
+	isl_slot.misses = 0;
+	isl_slot_stats.beacons++;
+	isl_slot_stats.period = isl_slot.period_q8 >> 8;
+}
+
+int isl_slot_wait( void )
+{
+	isl_slot.heard = 0;
+
+	if( !isl_slot.synced )
+	{
+		isl_slot_stats.searches++;
+		isl_radio_on();
+		int r = isl_slot_listen( isl_rtc_add( R32_RTC_CNT_32K, isl_rtc_ms( ISL_SLOT_SEARCH_MS ) ) );
+		if( r == 0 ) isl_slot_sync();
+		else isl_radio_off();
+		return r;
+	}
+
+	// Open the window half before the beacon is due, wider the longer
+	// we've gone without one.
+	int32_t half = isl_rtc_ms( ISL_SLOT_WINDOW_MS ) * ( isl_slot.misses + 1 ) / 2;
+	uint32_t open = isl_rtc_add( isl_slot.next, -half );
+
+	// Finish sending first.
+	while( isl_busy() ) isl_poll();
+	isl_radio_off();
+	int32_t sleep = isl_rtc_diff( open, R32_RTC_CNT_32K );
+	if( sleep > 500 ) sleep -= WAKE_UP_RTC_MAX_TIME; // LowPower() sleeps deeply from 500 ticks, and takes this to wake
+	if( sleep > (int32_t)SLEEP_RTC_MIN_TIME )
+	{
+		LowPower( sleep, ISL_SLOT_POWER_PLAN );
+		ISL_SLOT_AFTER_SLEEP();
+	}
+	isl_radio_on();
+
+	if( isl_slot_listen( isl_rtc_add( isl_slot.next, half ) ) == 0 )
+	{
+		isl_slot_sync();
+		return 0;
+	}
+
+	isl_radio_off();
+	isl_slot_stats.missed++;
+	isl_slot.number++;
+	isl_slot.next = isl_rtc_add( isl_slot.next, isl_slot.period_q8 >> 8 );
+	if( ++isl_slot.misses >= ISL_SLOT_MAX_MISSES ) isl_slot.synced = 0;
+	return -1;
+}
+
+void isl_slot_stay( uint32_t ms )
+{
+	uint32_t end = isl_rtc_add( R32_RTC_CNT_32K, isl_rtc_ms( ms ) );
+	while( isl_busy() || isl_rtc_diff( end, R32_RTC_CNT_32K ) > 0 )
+	{
+		isl_poll();
+		int32_t left = isl_rtc_diff( end, R32_RTC_CNT_32K );
+		if( !isl_busy() && left > 0 ) LowPowerIdle( left );
+	}
+}
+
+#endif
@@ -0,0 +1,377 @@
+#ifndef _LIB_KVSTORE_H
+#define _LIB_KVSTORE_H
+
+/* A small key/value store in flash, for calibration, settings and counters
+	that change often.
+
+		#define KV_BASE 0x08003800    // 2 sectors of 1K at the end of a V003
+		#include "lib_flash.h"
+		#include "lib_kvstore.h"
+
+		kv_init();                             // once at boot
+		if( kv_get( KEY_BOOTS, &boots, sizeof( boots ) ) < 0 ) boots = 0;
+		boots++;
+		kv_set( KEY_BOOTS, &boots, sizeof( boots ) );
+		...
+		kv_idle();                             // now and then, when nothing's going on
+
+	Nothing is ever rewritten in place.  kv_set() appends a new record to a
+	log and kv_get() finds the newest one through an index in RAM (one
+	uint16_t per key, rebuilt by kv_init()), so a write is one page program
+	and no erase, and a read is a lookup and a copy out of flash.
+
+	The log is a ring of KV_SECTORS sectors of KV_SECTOR_SIZE, and one of
+	them is always erased.  When the sector being written fills up the log
+	moves on to the erased one, copies in whatever is still current in the
+	oldest sector, and erases that, so it becomes the spare.  That way every
+	page of the area gets written and erased the same number of times, and
+	the only erases are of sectors that have gone around the whole ring.
+	kv_idle() erases the spare ahead of time a page at a time, so kv_set()
+	doesn't have to when it moves on (erasing stalls the core for a few ms
+	per page when it runs from flash).
+
+	Power loss: every record has a CRC and a sequence number, a record that
+	didn't finish is skipped, and kv_init() finishes a move that was
+	interrupted.  The worst that can happen is losing the kv_set() that was
+	running.
+
+	Records are aligned to FLASH_WRITE_SIZE, so on CH32 each one takes a
+	whole page (64 bytes on V003, 256 on the others), on CH5xx they're
+	packed.  Everything that is current has to fit in one sector, so
+	KV_MAX_KEYS defaults to what fits with the smallest values and room
+	for one more write (15 on a V003), and more than that is an error.
+
+	Keys are 0..KV_MAX_KEYS-1, values 1..KV_MAX_VALUE bytes.  kv_set() of
+	the value that's already there doesn't write anything.  None of this is
+	reentrant, call it from one place.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef KV_BASE
+#error Define KV_BASE, the start of the flash area for lib_kvstore.h
+#endif
+
+#ifndef KV_SECTOR_SIZE
+	#if FLASH_ERASE_SIZE > 1024
+		#define KV_SECTOR_SIZE FLASH_ERASE_SIZE
+	#else
+		#define KV_SECTOR_SIZE 1024
+	#endif
+#endif
+
+#ifndef KV_SECTORS
+#define KV_SECTORS 2 // At least 2, one of them is the spare
+#endif
+
+// Keys a move can keep: records of the smallest values (8 byte header, 2 of
+// value, CRC) in a sector, less one for the write that caused the move.
+#define KV_SECTOR_RECORDS ( KV_SECTOR_SIZE / ( ( 12 + FLASH_WRITE_SIZE - 1 ) / FLASH_WRITE_SIZE * FLASH_WRITE_SIZE ) - 1 )
+
+#ifndef KV_MAX_KEYS
+	#if KV_SECTOR_RECORDS < 32
+		#define KV_MAX_KEYS KV_SECTOR_RECORDS
+	#else
+		#define KV_MAX_KEYS 32
+	#endif
+#endif
+
+#if KV_MAX_KEYS > KV_SECTOR_RECORDS
+#error KV_MAX_KEYS is more than fits in one sector, a move could not keep them all
+#endif
+
+#ifndef KV_MAX_VALUE
+#define KV_MAX_VALUE 32
+#endif
+
+#if KV_SECTOR_SIZE % FLASH_ERASE_SIZE || KV_BASE % FLASH_ERASE_SIZE
+#error KV_BASE and KV_SECTOR_SIZE must be multiples of FLASH_ERASE_SIZE
+#endif
+
+#if KV_SECTORS < 2 || KV_SECTORS * KV_SECTOR_SIZE > 0x3fffc
+#error KV_SECTORS must be at least 2, and the area at most 256K
+#endif
+
+typedef struct
+{
+	uint32_t seq; // 0xffffffff = erased
+	uint16_t key;
+	uint16_t len; // 0 = deleted
+	// value, padded to 2 bytes, then a CRC16 of all of it
+} kv_hdr;
+
+#define KV_NONE 0xffff
+#define KV_REC_SIZE( len ) ( ( sizeof( kv_hdr ) + ( ( (len) + 1 ) & ~1 ) + 2 + FLASH_WRITE_SIZE - 1 ) & ~( FLASH_WRITE_SIZE - 1 ) )
+
+int kv_init( void );
+const void * kv_find( uint16_t key, int * len );
+int kv_get( uint16_t key, void * buf, int maxlen );
+int kv_set( uint16_t key, const void * data, int len );
+int kv_delete( uint16_t key );
+int kv_idle( void );
+
+static uint16_t kv_index[KV_MAX_KEYS]; // Offset of the newest record / 4, or KV_NONE
+static uint32_t kv_buf[KV_REC_SIZE( KV_MAX_VALUE ) / 4];
+static uint32_t kv_seq;
+static int kv_head;
+static int kv_tail;
+
+static uint32_t kv_sector( int s )
+{
+	return KV_BASE + s * KV_SECTOR_SIZE;
+}
+
+static int kv_next( int s )
+{
+	return s + 1 == KV_SECTORS ? 0 : s + 1;
+}
+
+static const kv_hdr * kv_at( uint16_t idx )
+{
+	return (const kv_hdr *)( KV_BASE + idx * 4 );
+}
+
+static uint16_t kv_crc16( const uint8_t * p, int len )
+{
+	uint16_t crc = 0xffff;
+	while( len-- )
+	{
+		int i;
+		crc ^= *p++ << 8;
+		for( i = 0; i < 8; i++ )
+			crc = ( crc & 0x8000 ) ? ( crc << 1 ) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+// Size of the record at h, 0 if it's erased, -1 if it can't be a record.
+// *ok says whether its CRC is right.
+static int kv_parse( const kv_hdr * h, int room, int * ok )
+{
+	*ok = 0;
+	if( room < (int)sizeof( kv_hdr ) ) return -1;
+	if( h->seq == 0xffffffff && h->key == 0xffff && h->len == 0xffff ) return 0;
+	if( h->len > KV_MAX_VALUE || (int)KV_REC_SIZE( h->len ) > room ) return -1;
+	int crcat = sizeof( kv_hdr ) + ( ( h->len + 1 ) & ~1 );
+	*ok = kv_crc16( (const uint8_t *)h, crcat ) == *(const uint16_t *)( (const uint8_t *)h + crcat );
+	return KV_REC_SIZE( h->len );
+}
+
+// The next good record in sector s at or after *o, 0 at the end.  Anything
+// else (a write that didn't finish) is stepped over a write unit at a time,
+// *end is set past the last thing that isn't erased.
+static const kv_hdr * kv_scan( int s, int * o, int * end )
+{
+	while( *o < KV_SECTOR_SIZE )
+	{
+		const kv_hdr * h = (const kv_hdr *)( kv_sector( s ) + *o );
+		int ok;
+		int n = kv_parse( h, KV_SECTOR_SIZE - *o, &ok );
+		if( n > 0 && ok )
+		{
+			*o += n;
+			if( end ) *end = *o;
+			return h;
+		}
+		*o += FLASH_WRITE_SIZE;
+		if( n && end ) *end = *o;
+	}
+	return 0;
+}
+
+static int kv_in_use( int s )
+{
+	int o = 0;
+	return kv_scan( s, &o, 0 ) != 0;
+}
+
+// Steps the tail over anything left by a write that didn't finish, returns
+// whether size bytes fit there.
+static int kv_room( int size )
+{
+	while( kv_tail + size <= KV_SECTOR_SIZE )
+	{
+		if( flash_is_erased( kv_sector( kv_head ) + kv_tail, size ) ) return 1;
+		kv_tail += FLASH_WRITE_SIZE;
+	}
+	return 0;
+}
+
+// Erases what isn't erased yet, first page first.  With one, stops after
+// the first page it erased and returns 1.
+FLASHLIB_CODE static int kv_erase( int s, int one )
+{
+	uint32_t a;
+	for( a = kv_sector( s ); a < kv_sector( s ) + KV_SECTOR_SIZE; a += FLASH_ERASE_SIZE )
+	{
+		if( flash_is_erased( a, FLASH_ERASE_SIZE ) ) continue;
+		if( flash_erase_page( a ) ) return -1;
+		if( one ) return 1;
+	}
+	return 0;
+}
+
+FLASHLIB_CODE static int kv_write( uint16_t key, const void * data, int len )
+{
+	int size = KV_REC_SIZE( len );
+	uint32_t addr = kv_sector( kv_head ) + kv_tail;
+	uint8_t * b = (uint8_t *)kv_buf;
+	kv_hdr * h = (kv_hdr *)kv_buf;
+	int crcat = sizeof( kv_hdr ) + ( ( len + 1 ) & ~1 );
+
+	memset( kv_buf, 0xff, size );
+	h->seq = kv_seq++;
+	h->key = key;
+	h->len = len;
+	memcpy( b + sizeof( kv_hdr ), data, len );
+	*(uint16_t *)( b + crcat ) = kv_crc16( b, crcat );
+
+	kv_tail += size;
+	if( flash_write( addr, kv_buf, size ) ) return -1;
+	kv_index[key] = ( addr - KV_BASE ) / 4;
+	return 0;
+}
+
+// Copies what's still current out of sector s into the head, then erases it.
+FLASHLIB_CODE static int kv_collect( int s )
+{
+	const kv_hdr * h;
+	int o = 0;
+	while( ( h = kv_scan( s, &o, 0 ) ) )
+	{
+		if( h->key >= KV_MAX_KEYS || kv_index[h->key] != ( (uint32_t)h - KV_BASE ) / 4 ) continue;
+		// A deletion in the oldest sector has nothing older left to hide.
+		if( h->len == 0 )
+			kv_index[h->key] = KV_NONE;
+		else if( !kv_room( KV_REC_SIZE( h->len ) ) || kv_write( h->key, h + 1, h->len ) )
+			return -1;
+	}
+	return kv_erase( s, 0 );
+}
+
+FLASHLIB_CODE static int kv_advance( void )
+{
+	// Only after a move that didn't fit, everything current is in there.
+	if( kv_in_use( kv_next( kv_head ) ) ) return -1;
+	kv_head = kv_next( kv_head );
+	kv_tail = 0;
+	if( kv_erase( kv_head, 0 ) ) return -1;
+	if( kv_in_use( kv_next( kv_head ) ) )
+		return kv_collect( kv_next( kv_head ) );
+	return 0;
+}
+
+FLASHLIB_CODE static int kv_put( uint16_t key, const void * data, int len )
+{
+	int size = KV_REC_SIZE( len );
+	int tries;
+	int ret = -1;
+	if( flash_unlock() ) return -1;
+	for( tries = 0; tries < KV_SECTORS; tries++ )
+	{
+		if( kv_room( size ) )
+		{
+			ret = kv_write( key, data, len );
+			break;
+		}
+		if( kv_advance() ) break;
+	}
+	flash_lock();
+	return ret;
+}
+
+int kv_init( void )
+{
+	uint32_t newest = 0;
+	int s;
+	int keys = 0;
+
+	memset( kv_index, 0xff, sizeof( kv_index ) );
+	kv_seq = 0;
+	kv_head = -1;
+	kv_tail = 0;
+	for( s = 0; s < KV_SECTORS; s++ )
+	{
+		const kv_hdr * h;
+		int o = 0;
+		int end = 0;
+		while( ( h = kv_scan( s, &o, &end ) ) )
+		{
+			if( h->key < KV_MAX_KEYS && ( kv_index[h->key] == KV_NONE || kv_at( kv_index[h->key] )->seq < h->seq ) )
+				kv_index[h->key] = ( (uint32_t)h - KV_BASE ) / 4;
+			if( kv_head < 0 || h->seq >= newest )
+			{
+				kv_head = s;
+				newest = h->seq;
+			}
+		}
+		if( s == kv_head ) kv_tail = end;
+	}
+	kv_seq = kv_head < 0 ? 0 : newest + 1;
+
+	// Finish a move that was cut short, so there's a spare again.
+	if( flash_unlock() ) return -1;
+	int ret;
+	if( kv_head < 0 )
+	{
+		kv_head = 0;
+		ret = kv_erase( 0, 0 );
+	}
+	else
+	{
+		ret = kv_in_use( kv_next( kv_head ) ) ? kv_collect( kv_next( kv_head ) ) : 0;
+	}
+	flash_lock();
+	if( ret < 0 ) return -1;
+
+	for( s = 0; s < KV_MAX_KEYS; s++ )
+		if( kv_index[s] != KV_NONE && kv_at( kv_index[s] )->len ) keys++;
+	return keys;
+}
+
+const void * kv_find( uint16_t key, int * len )
+{
+	if( key >= KV_MAX_KEYS || kv_index[key] == KV_NONE ) return 0;
+	const kv_hdr * h = kv_at( kv_index[key] );
+	if( h->len == 0 ) return 0;
+	if( len ) *len = h->len;
+	return h + 1;
+}
+
+int kv_get( uint16_t key, void * buf, int maxlen )
+{
+	int len;
+	const void * v = kv_find( key, &len );
+	if( !v ) return -1;
+	memcpy( buf, v, len < maxlen ? len : maxlen );
+	return len;
+}
+
+FLASHLIB_CODE int kv_set( uint16_t key, const void * data, int len )
+{
+	int curlen;
+	if( key >= KV_MAX_KEYS || len < 1 || len > KV_MAX_VALUE ) return -1;
+	const void * cur = kv_find( key, &curlen );
+	if( cur && curlen == len && memcmp( cur, data, len ) == 0 ) return 0;
+	return kv_put( key, data, len );
+}
+
+FLASHLIB_CODE int kv_delete( uint16_t key )
+{
+	if( !kv_find( key, 0 ) ) return 0;
+	return kv_put( key, 0, 0 );
+}
+
+// Erases one page of the spare, returns 1 if there was one to erase.
+FLASHLIB_CODE int kv_idle( void )
+{
+	int s = kv_next( kv_head );
+	if( kv_in_use( s ) ) return 0;
+	if( flash_unlock() ) return -1;
+	int ret = kv_erase( s, 1 );
+	flash_lock();
+	return ret;
+}
+
+#endif
@@ -0,0 +1,204 @@
+#ifndef _LIB_PINTABLE_H
+#define _LIB_PINTABLE_H
+
+/* A whole board's pin setup as one table, folded at compile time.
+
+	Every funPinMode() is a read-modify-write of CFGLR/CFGHR with shifts and
+	masks worked out for that pin, so setting up 20 pins is 20 RMWs, and in
+	between the port is in a half configured state (an output may come up
+	before its level is set).  Here the table is folded by the compiler into
+	one constant store per OUTDR, CFGLR, CFGHR, plus one for the port clocks
+	and one for AFIO->PCFR1.  OUTDR goes first, so outputs come up at their
+	initial level and pull-ups/pull-downs are right from the start.
+
+	C, as an X-macro.  The third column is the initial level for outputs, or
+	1 = pull-up / 0 = pull-down for GPIO_CFGLR_IN_PUPD:
+
+		#define BOARD_PINS( X ) \
+			X( PD0, GPIO_CFGLR_OUT_10Mhz_PP, 1 ) \
+			X( PC1, GPIO_CFGLR_OUT_10Mhz_AF_OD, 1 ) \
+			X( PC2, GPIO_CFGLR_OUT_10Mhz_AF_OD, 1 ) \
+			X( PC3, GPIO_CFGLR_IN_PUPD, 1 )
+
+		FUNPINS_INIT( BOARD_PINS, 0 );  // Instead of funGpioInitAll() + funPinMode()s
+
+	FUNPINS_INIT( table, pcfr1 ) is for startup, it enables the clocks of the
+	ports in the table (and AFIO), writes pcfr1 to AFIO->PCFR1 if it's not 0,
+	and assumes pins that aren't in the table are still at their reset state
+	(floating input, 0 in OUTDR), so every register is a plain store.
+
+	FUNPINS_APPLY( table ) is for switching a set of pins later (for example
+	to analog inputs before sleeping).  It leaves the other pins alone, so
+	it's one read-modify-write per register instead of one per pin.
+
+	C++, the same with a constexpr table:
+
+		struct Board {
+			static constexpr funpins::pin pins[] = {
+				{ PD0, GPIO_CFGLR_OUT_10Mhz_PP, 1 },
+				{ PC3, GPIO_CFGLR_IN_PUPD, 1 },
+			};
+		};
+
+		funpins::init<Board>();     // or funpins::init<Board>( pcfr1 )
+		funpins::apply<Board>();
+
+	For the parts with CFGLR/CFGHR GPIO (V003/V00x, V10x, V20x, V30x, X03x,
+	L103).  Ports A-E.
+*/
+
+#include <stdint.h>
+
+#if defined(CH5xx) || defined(CH32H41x)
+#error lib_pintable.h is only for parts with CFGLR/CFGHR GPIO ports
+#endif
+
+#define FUNPINS_CFG_RESET 0x44444444 // Floating input
+
+#define FUNPINS_PORT_( pin ) ( (uint32_t)( pin ) >> 4 )
+#define FUNPINS_IN_REG_( pin ) ( FUNPINS_PORT_( pin ) == funpins_port_ && ( ( (pin) >> 3 ) & 1 ) == funpins_hi_ )
+
+#define FUNPINS_CFG_MASK_( pin, mode, lvl ) | ( FUNPINS_IN_REG_( pin ) ? ( 0xfu << ( 4 * ( (pin) & 7 ) ) ) : 0 )
+#define FUNPINS_CFG_VAL_( pin, mode, lvl ) | ( FUNPINS_IN_REG_( pin ) ? ( (uint32_t)( mode ) << ( 4 * ( (pin) & 7 ) ) ) : 0 )
+#define FUNPINS_OUT_MASK_( pin, mode, lvl ) | ( FUNPINS_PORT_( pin ) == funpins_port_ ? ( 1u << ( (pin) & 15 ) ) : 0 )
+#define FUNPINS_OUT_VAL_( pin, mode, lvl ) | ( ( FUNPINS_PORT_( pin ) == funpins_port_ && (lvl) ) ? ( 1u << ( (pin) & 15 ) ) : 0 )
+#define FUNPINS_CLOCKS_( pin, mode, lvl ) | ( RCC_APB2Periph_GPIOA << FUNPINS_PORT_( pin ) )
+
+// One register.  mask and val are constant, so this is a single store (init),
+// or a single RMW (apply), or nothing at all if no pin of the table is in it.
+#define FUNPINS_WRITE_( reg, mask, val, reset, init ) do { \
+	if( mask ) { \
+		if( (init) ) (reg) = ( (reset) & ~(mask) ) | (val); \
+		else if( (mask) == 0xffffffff ) (reg) = (val); \
+		else (reg) = ( (reg) & ~(mask) ) | (val); \
+	} } while( 0 )
+
+#define FUNPINS_PORT_WRITE_( table, n, init ) do { \
+	GPIO_TypeDef * funpins_gpio_ = (GPIO_TypeDef *)( GPIOA_BASE + 0x400 * (n) ); \
+	{ \
+		enum { funpins_port_ = (n), funpins_hi_ = 0 }; \
+		FUNPINS_WRITE_( funpins_gpio_->OUTDR, 0 table( FUNPINS_OUT_MASK_ ), 0 table( FUNPINS_OUT_VAL_ ), 0, init ); \
+		FUNPINS_WRITE_( funpins_gpio_->CFGLR, 0 table( FUNPINS_CFG_MASK_ ), 0 table( FUNPINS_CFG_VAL_ ), FUNPINS_CFG_RESET, init ); \
+	} \
+	{ \
+		enum { funpins_port_ = (n), funpins_hi_ = 1 }; \
+		FUNPINS_WRITE_( funpins_gpio_->CFGHR, 0 table( FUNPINS_CFG_MASK_ ), 0 table( FUNPINS_CFG_VAL_ ), FUNPINS_CFG_RESET, init ); \
+	} } while( 0 )
+
+#define FUNPINS_PORTS_WRITE_( table, init ) do { \
+	FUNPINS_PORT_WRITE_( table, 0, init ); \
+	FUNPINS_PORT_WRITE_( table, 1, init ); \
+	FUNPINS_PORT_WRITE_( table, 2, init ); \
+	FUNPINS_PORT_WRITE_( table, 3, init ); \
+	FUNPINS_PORT_WRITE_( table, 4, init ); \
+	} while( 0 )
+
+#define FUNPINS_INIT( table, pcfr1 ) do { \
+	RCC->APB2PCENR |= RCC_APB2Periph_AFIO table( FUNPINS_CLOCKS_ ); \
+	if( (pcfr1) ) AFIO->PCFR1 = (pcfr1); \
+	FUNPINS_PORTS_WRITE_( table, 1 ); \
+	} while( 0 )
+
+#define FUNPINS_APPLY( table ) FUNPINS_PORTS_WRITE_( table, 0 )
+
+#ifdef __cplusplus
+namespace funpins
+{
+
+struct pin
+{
+	uint8_t num;   // PA0..PE15
+	uint8_t mode;  // GPIO_CFGLR_*
+	uint8_t level; // Initial output level, or 1 = pull-up for GPIO_CFGLR_IN_PUPD
+};
+
+template<typename T> constexpr uint32_t cfg_mask( int port, int hi )
+{
+	uint32_t m = 0;
+	for( const pin & p : T::pins )
+		if( p.num >> 4 == port && ( ( p.num >> 3 ) & 1 ) == hi )
+			m |= 0xfu << ( 4 * ( p.num & 7 ) );
+	return m;
+}
+
+template<typename T> constexpr uint32_t cfg_val( int port, int hi )
+{
+	uint32_t v = 0;
+	for( const pin & p : T::pins )
+		if( p.num >> 4 == port && ( ( p.num >> 3 ) & 1 ) == hi )
+			v |= (uint32_t)p.mode << ( 4 * ( p.num & 7 ) );
+	return v;
+}
+
+template<typename T> constexpr uint32_t out_mask( int port )
+{
+	uint32_t m = 0;
+	for( const pin & p : T::pins )
+		if( p.num >> 4 == port )
+			m |= 1u << ( p.num & 15 );
+	return m;
+}
+
+template<typename T> constexpr uint32_t out_val( int port )
+{
+	uint32_t v = 0;
+	for( const pin & p : T::pins )
+		if( p.num >> 4 == port && p.level )
+			v |= 1u << ( p.num & 15 );
+	return v;
+}
+
+template<typename T> constexpr uint32_t clocks()
+{
+	uint32_t c = RCC_APB2Periph_AFIO;
+	for( const pin & p : T::pins )
+		c |= RCC_APB2Periph_GPIOA << ( p.num >> 4 );
+	return c;
+}
+
+template<uint32_t mask, uint32_t val, uint32_t reset, bool init>
+inline void write( volatile uint32_t & reg )
+{
+	if constexpr( mask == 0 )
+		return;
+	else if constexpr( init )
+		reg = ( reset & ~mask ) | val;
+	else if constexpr( mask == 0xffffffff )
+		reg = val;
+	else
+		reg = ( reg & ~mask ) | val;
+}
+
+template<typename T, int n, bool init> inline void port()
+{
+	GPIO_TypeDef * g = (GPIO_TypeDef *)( GPIOA_BASE + 0x400 * n );
+	write<out_mask<T>( n ), out_val<T>( n ), 0, init>( g->OUTDR );
+	write<cfg_mask<T>( n, 0 ), cfg_val<T>( n, 0 ), FUNPINS_CFG_RESET, init>( g->CFGLR );
+	write<cfg_mask<T>( n, 1 ), cfg_val<T>( n, 1 ), FUNPINS_CFG_RESET, init>( g->CFGHR );
+}
+
+template<typename T, bool init> inline void ports()
+{
+	port<T, 0, init>();
+	port<T, 1, init>();
+	port<T, 2, init>();
+	port<T, 3, init>();
+	port<T, 4, init>();
+}
+
+template<typename T> inline void init( uint32_t pcfr1 = 0 )
+{
+	RCC->APB2PCENR |= clocks<T>();
+	if( pcfr1 ) AFIO->PCFR1 = pcfr1;
+	ports<T, true>();
+}
+
+template<typename T> inline void apply()
+{
+	ports<T, false>();
+}
+
+} // namespace funpins
+#endif
+
+#endif
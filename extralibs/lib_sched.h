@@ -0,0 +1,248 @@
+#ifndef _LIB_SCHED_H
+#define _LIB_SCHED_H
+
+/* Tiny cooperative, stackless task scheduler.
+
+	Tasks are protothread-style functions: they run until they hit one of
+	the TASK_ macros below, return to the scheduler, and pick up right after
+	that macro the next time they are run.  Since there is no per-task stack,
+	local variables do NOT survive across TASK_SLEEP / TASK_YIELD / etc.
+	Keep state in statics, or in a struct that starts with a sched_task.
+
+	Tasks are kept in a list sorted by deadline (SysTick time).  When nothing
+	is due, the SysTick compare interrupt is armed for the earliest deadline
+	and the core sleeps in __WFI().  Any other interrupt also wakes it, and
+	tasks waiting with TASK_WAIT_UNTIL re-check their condition after every
+	wake-up.
+
+	The SysTick counter is left free-running, so Delay_Ms(), funSysTick32()
+	etc. keep working.  Deadlines are 32-bit, so no single sleep may exceed
+	2^31 SysTicks (~357s on a 48MHz V003 with HCLK/8).
+
+	Usage:
+
+		sched_task blinker;
+
+		int blink_task( sched_task * t )
+		{
+			TASK_BEGIN( t );
+			while( 1 )
+			{
+				funDigitalWrite( PC1, FUN_HIGH );
+				TASK_EVERY( t, Ticks_from_Ms( 100 ) );
+				funDigitalWrite( PC1, FUN_LOW );
+				TASK_EVERY( t, Ticks_from_Ms( 900 ) );
+			}
+			TASK_END( t );
+		}
+
+		sched_init();
+		sched_add( &blinker, blink_task, 0 );
+		sched_run(); // Never returns.
+
+	If you want to use SysTick_Handler yourself, define
+	SCHED_NO_SYSTICK_HANDLER, and call sched_systick_irq() from it.
+
+	If lib_tickless.h is included first and SCHED_TICKLESS is defined, long
+	idle gaps are spent in Standby/Stop instead of __WFI().  Only EXTI
+	sources can wake the part from there, so TASK_WAIT_UNTIL tasks must be
+	waiting on pin interrupts, not on other peripherals.
+*/
+
+#define SCHED_WAIT  0 // Run again when the deadline is reached
+#define SCHED_POLL  1 // Run again on every scheduler pass (after any interrupt)
+#define SCHED_DONE  2 // Remove from the scheduler
+
+typedef struct sched_task_s sched_task;
+typedef int (*sched_fn)( sched_task * t );
+
+struct sched_task_s
+{
+	sched_fn fn;
+	uint32_t deadline;          // funSysTick32() time this task is next due
+	struct sched_task_s * next;
+	uint16_t lc;                // Where to resume (line number)
+	uint8_t polling;
+};
+
+#define TASK_BEGIN( t )   switch( (t)->lc ) { case 0:
+#define TASK_END( t )     } (t)->lc = 0; return SCHED_DONE;
+
+// Sleep for ticks SysTicks from now.
+#define TASK_SLEEP( t, ticks ) \
+	do { (t)->deadline = funSysTick32() + (ticks); (t)->lc = __LINE__; return SCHED_WAIT; case __LINE__:; } while(0)
+
+// Sleep until ticks after this task's previous deadline.  Does not drift, use for periodic work.
+#define TASK_EVERY( t, ticks ) \
+	do { (t)->deadline += (ticks); (t)->lc = __LINE__; return SCHED_WAIT; case __LINE__:; } while(0)
+
+// Let everything else that is due run, then continue.
+#define TASK_YIELD( t ) TASK_SLEEP( t, 0 )
+
+// Re-checks cond after every interrupt / scheduler pass, i.e. for flags set in ISRs.
+#define TASK_WAIT_UNTIL( t, cond ) \
+	do { (t)->lc = __LINE__; case __LINE__: if( !(cond) ) return SCHED_POLL; (t)->deadline = funSysTick32(); } while(0)
+
+// Removes the task.  It may be re-added with sched_add().
+#define TASK_EXIT( t ) do { (t)->lc = 0; return SCHED_DONE; } while(0)
+
+void sched_init( void );
+void sched_add( sched_task * t, sched_fn fn, uint32_t delay_ticks );
+void sched_remove( sched_task * t );
+// Runs everything that is due once. Returns nonzero if any timed task ran.
+int sched_step( void );
+// Runs forever, sleeping when nothing is due.
+void sched_run( void ) __attribute__((noreturn));
+void sched_systick_irq( void );
+
+#if defined(CH571_CH573)
+	#error lib_sched does not support count-down SysTicks.
+#endif
+
+sched_task * sched_head;     // Timed tasks, sorted by deadline.
+sched_task * sched_pollers;  // Tasks in TASK_WAIT_UNTIL.
+
+void sched_init( void )
+{
+	sched_head = 0;
+	sched_pollers = 0;
+	SysTick->SR = 0;
+	SysTick->CTLR |= SYSTICK_CTLR_STIE;
+	NVIC_EnableIRQ( SysTick_IRQn );
+}
+
+static void sched_insert( sched_task * t )
+{
+	sched_task ** p = &sched_head;
+	// Equal deadlines keep FIFO order.
+	while( *p && TimeElapsed32( t->deadline, (*p)->deadline ) >= 0 )
+		p = &(*p)->next;
+	t->next = *p;
+	*p = t;
+}
+
+static void sched_unlink( sched_task ** list, sched_task * t )
+{
+	sched_task ** p = list;
+	while( *p )
+	{
+		if( *p == t ) { *p = t->next; return; }
+		p = &(*p)->next;
+	}
+}
+
+void sched_add( sched_task * t, sched_fn fn, uint32_t delay_ticks )
+{
+	t->fn = fn;
+	t->lc = 0;
+	t->polling = 0;
+	t->deadline = funSysTick32() + delay_ticks;
+	sched_insert( t );
+}
+
+void sched_remove( sched_task * t )
+{
+	sched_unlink( t->polling ? &sched_pollers : &sched_head, t );
+}
+
+static void sched_dispatch( sched_task * t )
+{
+	int r = t->fn( t );
+	if( r == SCHED_POLL )
+	{
+		if( !t->polling )
+		{
+			t->polling = 1;
+			t->next = sched_pollers;
+			sched_pollers = t;
+		}
+		return;
+	}
+
+	if( t->polling )
+	{
+		sched_unlink( &sched_pollers, t );
+		t->polling = 0;
+	}
+
+	if( r == SCHED_WAIT )
+		sched_insert( t );
+}
+
+int sched_step( void )
+{
+	int ran = 0;
+	sched_task * t;
+
+	// Pollers first, they are usually waiting on something an interrupt did.
+	t = sched_pollers;
+	while( t )
+	{
+		sched_task * next = t->next;
+		sched_dispatch( t );
+		t = next;
+	}
+
+	while( ( t = sched_head ) && TimeElapsed32( funSysTick32(), t->deadline ) >= 0 )
+	{
+		sched_head = t->next;
+		sched_dispatch( t );
+		ran = 1;
+	}
+	return ran;
+}
+
+void sched_run( void )
+{
+	while( 1 )
+	{
+		if( sched_step() ) continue;
+
+		// Nothing due, sleep until the next deadline, or any interrupt.
+		// Interrupts are held off so one can't sneak in between deciding to
+		// sleep and the wfi.  A pending interrupt still wakes wfi.
+		__disable_irq();
+		if( sched_head )
+		{
+			uint32_t deadline = sched_head->deadline;
+#ifdef SCHED_TICKLESS
+			int32_t left = TimeElapsed32( deadline, funSysTick32() );
+			if( left >= (int32_t)Ticks_from_Ms( TICKLESS_MIN_MS ) && TicklessSleepMs( left / DELAY_MS_TIME ) )
+			{
+				__enable_irq();
+				continue;
+			}
+#endif
+#if defined(CH32V003) || defined(CH32V00x)
+			SysTick->CMP = deadline;
+#else
+			SysTick->CMP = SysTick->CNT + (uint32_t)( deadline - funSysTick32() );
+#endif
+			// The compare only fires on a match, so make sure we didn't just miss it.
+			if( TimeElapsed32( funSysTick32(), deadline ) < 0 )
+				__WFI();
+		}
+		else
+		{
+			// Only pollers (or nothing), wait for any interrupt.
+			__WFI();
+		}
+		__enable_irq();
+	}
+}
+
+void sched_systick_irq( void )
+{
+	// Just here to wake the core.
+	SysTick->SR = 0;
+}
+
+#ifndef SCHED_NO_SYSTICK_HANDLER
+void SysTick_Handler( void ) __attribute__((interrupt));
+void SysTick_Handler( void )
+{
+	sched_systick_irq();
+}
+#endif
+
+#endif
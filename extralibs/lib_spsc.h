@@ -0,0 +1,265 @@
+#ifndef _LIB_SPSC_H
+#define _LIB_SPSC_H
+
+/* Lock-free single-producer / single-consumer ring buffers.
+
+	For handing data between an ISR and main (or a DMA channel and main)
+	without disabling interrupts.  One side only ever writes head, the other
+	only ever writes tail, so no critical sections are needed as long as
+	there is exactly one producer and one consumer.
+
+	Sizes must be a power of two.  head and tail are free-running 32-bit
+	counters, (head - tail) is always the number of used entries, so the
+	whole buffer is usable (no "one empty slot" rule).
+
+	Byte rings:
+		uint8_t buf[64];
+		spsc_bytes rb;
+		spsc_init( &rb, buf, sizeof(buf) );
+
+		spsc_put( &rb, c );                 // 0 on success, -1 if full
+		spsc_get( &rb, &c );                // 0 on success, -1 if empty
+		spsc_write( &rb, data, len );       // returns number of bytes written
+		spsc_read( &rb, data, len );        // returns number of bytes read
+
+	Contiguous spans, for DMA or memcpy-free use:
+		uint8_t * p;
+		int n = spsc_write_span( &rb, &p ); // fill up to n bytes at p, then
+		spsc_write_commit( &rb, filled );
+		n = spsc_read_span( &rb, &p );      // use up to n bytes at p, then
+		spsc_read_release( &rb, used );
+
+	If a circular DMA channel is the producer, tell the ring where the DMA
+	is now, i.e. spsc_produce_to( &rb, sizeof(buf) - DMA1_Channel5->CNTR );
+
+	Fixed-size records:
+		struct msg q[8];
+		spsc_records rr;
+		spsc_rec_init( &rr, q, sizeof(q[0]), 8 );
+
+		spsc_rec_push( &rr, &m );           // copy in, 0 on success
+		spsc_rec_pop( &rr, &m );            // copy out, 0 on success
+		struct msg * w = spsc_rec_alloc( &rr ); ... spsc_rec_commit( &rr ); // zero-copy
+		struct msg * r = spsc_rec_peek( &rr );  ... spsc_rec_release( &rr ); // zero-copy
+
+	Ordering:  The producer's data writes must be visible before the new
+	head, and the consumer must be done with the data before publishing the
+	new tail.  On RISC-V this is done with fence instructions, which also act
+	as compiler barriers.  This header does not depend on ch32fun.h, so it
+	may also be built for the host, where C11-style fences are used instead.
+*/
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__riscv) || defined(__riscv__)
+	#define SPSC_FENCE_ACQUIRE() __asm__ volatile( "fence r, rw" : : : "memory" )
+	#define SPSC_FENCE_RELEASE() __asm__ volatile( "fence rw, w" : : : "memory" )
+#else
+	#define SPSC_FENCE_ACQUIRE() __atomic_thread_fence( __ATOMIC_ACQUIRE )
+	#define SPSC_FENCE_RELEASE() __atomic_thread_fence( __ATOMIC_RELEASE )
+#endif
+
+typedef struct
+{
+	volatile uint32_t head; // Only written by the producer
+	volatile uint32_t tail; // Only written by the consumer
+	uint32_t mask;
+	uint8_t * buf;
+} spsc_bytes;
+
+typedef struct
+{
+	volatile uint32_t head; // Only written by the producer, in records
+	volatile uint32_t tail; // Only written by the consumer, in records
+	uint32_t mask;
+	uint32_t recsize;
+	uint8_t * buf;
+} spsc_records;
+
+// size must be a power of two.  Returns -1 if not.
+static inline int spsc_init( spsc_bytes * r, void * buf, uint32_t size )
+{
+	if( size == 0 || ( size & ( size - 1 ) ) ) return -1;
+	r->head = 0;
+	r->tail = 0;
+	r->mask = size - 1;
+	r->buf = (uint8_t*)buf;
+	return 0;
+}
+
+static inline uint32_t spsc_count( const spsc_bytes * r ) { return r->head - r->tail; }
+static inline uint32_t spsc_free( const spsc_bytes * r ) { return r->mask + 1 - ( r->head - r->tail ); }
+static inline int spsc_empty( const spsc_bytes * r ) { return r->head == r->tail; }
+
+// Producer side
+
+static inline int spsc_put( spsc_bytes * r, uint8_t c )
+{
+	uint32_t head = r->head;
+	if( head - r->tail > r->mask ) return -1;
+	SPSC_FENCE_ACQUIRE(); // Don't overwrite the slot before the consumer let go of it.
+	r->buf[head & r->mask] = c;
+	SPSC_FENCE_RELEASE();
+	r->head = head + 1;
+	return 0;
+}
+
+// Largest contiguous free region, *ptr is set to its start.
+static inline uint32_t spsc_write_span( spsc_bytes * r, uint8_t ** ptr )
+{
+	uint32_t head = r->head;
+	uint32_t avail = r->mask + 1 - ( head - r->tail );
+	uint32_t idx = head & r->mask;
+	uint32_t toend = r->mask + 1 - idx;
+	SPSC_FENCE_ACQUIRE();
+	*ptr = r->buf + idx;
+	return ( avail < toend ) ? avail : toend;
+}
+
+static inline void spsc_write_commit( spsc_bytes * r, uint32_t n )
+{
+	SPSC_FENCE_RELEASE();
+	r->head = r->head + n;
+}
+
+// For when something else (i.e. a circular DMA) writes the buffer.
+// pos is the index the writer will write next, 0..size.
+static inline void spsc_produce_to( spsc_bytes * r, uint32_t pos )
+{
+	uint32_t head = r->head;
+	SPSC_FENCE_RELEASE();
+	r->head = head + ( ( pos - head ) & r->mask );
+}
+
+static inline uint32_t spsc_write( spsc_bytes * r, const void * data, uint32_t len )
+{
+	const uint8_t * src = (const uint8_t*)data;
+	uint32_t done = 0;
+	while( done < len )
+	{
+		uint8_t * p;
+		uint32_t n = spsc_write_span( r, &p );
+		if( n == 0 ) break;
+		if( n > len - done ) n = len - done;
+		memcpy( p, src + done, n );
+		spsc_write_commit( r, n );
+		done += n;
+	}
+	return done;
+}
+
+// Consumer side
+
+static inline int spsc_get( spsc_bytes * r, uint8_t * c )
+{
+	uint32_t tail = r->tail;
+	if( r->head == tail ) return -1;
+	SPSC_FENCE_ACQUIRE(); // Read the data only after seeing head.
+	*c = r->buf[tail & r->mask];
+	SPSC_FENCE_RELEASE();
+	r->tail = tail + 1;
+	return 0;
+}
+
+// Largest contiguous readable region, *ptr is set to its start.
+static inline uint32_t spsc_read_span( spsc_bytes * r, uint8_t ** ptr )
+{
+	uint32_t tail = r->tail;
+	uint32_t avail = r->head - tail;
+	uint32_t idx = tail & r->mask;
+	uint32_t toend = r->mask + 1 - idx;
+	SPSC_FENCE_ACQUIRE();
+	*ptr = r->buf + idx;
+	return ( avail < toend ) ? avail : toend;
+}
+
+static inline void spsc_read_release( spsc_bytes * r, uint32_t n )
+{
+	SPSC_FENCE_RELEASE();
+	r->tail = r->tail + n;
+}
+
+static inline uint32_t spsc_read( spsc_bytes * r, void * data, uint32_t len )
+{
+	uint8_t * dst = (uint8_t*)data;
+	uint32_t done = 0;
+	while( done < len )
+	{
+		uint8_t * p;
+		uint32_t n = spsc_read_span( r, &p );
+		if( n == 0 ) break;
+		if( n > len - done ) n = len - done;
+		memcpy( dst + done, p, n );
+		spsc_read_release( r, n );
+		done += n;
+	}
+	return done;
+}
+
+// Fixed-size records.  count must be a power of two.
+
+static inline int spsc_rec_init( spsc_records * r, void * buf, uint32_t recsize, uint32_t count )
+{
+	if( count == 0 || ( count & ( count - 1 ) ) ) return -1;
+	r->head = 0;
+	r->tail = 0;
+	r->mask = count - 1;
+	r->recsize = recsize;
+	r->buf = (uint8_t*)buf;
+	return 0;
+}
+
+static inline uint32_t spsc_rec_count( const spsc_records * r ) { return r->head - r->tail; }
+static inline int spsc_rec_empty( const spsc_records * r ) { return r->head == r->tail; }
+static inline int spsc_rec_full( const spsc_records * r ) { return r->head - r->tail > r->mask; }
+
+// Returns a slot to fill in, or 0 if full.  Call spsc_rec_commit() when done.
+static inline void * spsc_rec_alloc( spsc_records * r )
+{
+	uint32_t head = r->head;
+	if( head - r->tail > r->mask ) return 0;
+	SPSC_FENCE_ACQUIRE();
+	return r->buf + ( head & r->mask ) * r->recsize;
+}
+
+static inline void spsc_rec_commit( spsc_records * r )
+{
+	SPSC_FENCE_RELEASE();
+	r->head = r->head + 1;
+}
+
+// Returns the oldest record, or 0 if empty.  Call spsc_rec_release() when done.
+static inline void * spsc_rec_peek( spsc_records * r )
+{
+	uint32_t tail = r->tail;
+	if( r->head == tail ) return 0;
+	SPSC_FENCE_ACQUIRE();
+	return r->buf + ( tail & r->mask ) * r->recsize;
+}
+
+static inline void spsc_rec_release( spsc_records * r )
+{
+	SPSC_FENCE_RELEASE();
+	r->tail = r->tail + 1;
+}
+
+static inline int spsc_rec_push( spsc_records * r, const void * rec )
+{
+	void * slot = spsc_rec_alloc( r );
+	if( !slot ) return -1;
+	memcpy( slot, rec, r->recsize );
+	spsc_rec_commit( r );
+	return 0;
+}
+
+static inline int spsc_rec_pop( spsc_records * r, void * rec )
+{
+	void * slot = spsc_rec_peek( r );
+	if( !slot ) return -1;
+	memcpy( rec, slot, r->recsize );
+	spsc_rec_release( r );
+	return 0;
+}
+
+#endif
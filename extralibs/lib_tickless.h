@@ -0,0 +1,255 @@
+#ifndef _LIB_TICKLESS_H
+#define _LIB_TICKLESS_H
+
+/* Tickless low-power delays.
+
+	Long delays put the part to sleep instead of spinning on SysTick:
+
+	CH32V003 / CH32V00x:  AWU (clocked from LSI) + Standby.  No extra setup.
+		The AWU can't be read back, so sleeps go in TICKLESS_AWU_STEP_MS
+		steps, and a pin interrupt ends the sleep right away without
+		counting the step it came in: the time slept is never overstated,
+		and is short by less than a step.  For that, sleep with interrupts
+		disabled (lib_sched does), or the interrupt handler clears the EXTI
+		flag before we can see it.
+	CH32V10x / V20x / V30x / L103:  RTC alarm + Stop.  Include rtc.h first
+		and call RTC_init().  For ms granularity, set
+		#define RTC_CLOCK_TICKS_PER_INCREMENT (RTC_CLOCK_TICKS_PER_SECOND / 1000)
+		before including rtc.h.  The RTC counter is also used to measure
+		how long we actually slept, so early wake-ups are accounted for.
+
+	Whatever cannot be slept (below TICKLESS_MIN_MS, or finer than the
+	wake-up timer resolution) is done with the normal Delay_Ms().
+
+	The system clock configuration is restored on wake-up, and the time slept
+	is added to SysTick->CNT, so funSysTick32()/funSysTick64() keep counting
+	monotonically (within LSI / RTC accuracy).  SysTick stops while asleep.
+
+	WARNING: While in Standby/Stop, the debugger cannot talk to the part.
+	Give yourself a few seconds after power-up before sleeping, or you may
+	need to unbrick (minichlink -u) to reflash.
+
+	In Standby/Stop, only EXTI sources (pins, AWU, RTC alarm) can wake the
+	part, peripheral interrupts like USART RX will not.
+
+	API:
+		TicklessInit();            // Call once after SystemInit() (and RTC_init()).
+		TicklessDelayMs( ms );     // Drop-in for Delay_Ms().
+		TicklessSleepMs( ms );     // Sleeps at most ms, returns ms actually slept.
+		TicklessReport( run_uA, sleep_uA ); // Prints time budget and estimated average current.
+
+	Defining TICKLESS_OVERRIDE_DELAY_MS before including this file makes any
+	following Delay_Ms() use TicklessDelayMs().
+*/
+
+#ifndef TICKLESS_MIN_MS
+#define TICKLESS_MIN_MS 10 // Shorter delays are not worth the clock restart.
+#endif
+
+#if defined(CH32V003) || defined(CH32V00x)
+	#define TICKLESS_AWU 1
+	#ifndef TICKLESS_LSI_HZ
+	#define TICKLESS_LSI_HZ 128000 // Nominal, trim this if you have measured your LSI.
+	#endif
+	#ifndef TICKLESS_AWU_STEP_MS
+	#define TICKLESS_AWU_STEP_MS 32 // How well an early wake-up is timed, see above.
+	#endif
+#elif defined(CH32V10x) || defined(CH32V20x) || defined(CH32V30x) || defined(CH32L103)
+	#define TICKLESS_RTC 1
+	#ifndef RTC_INCREMENTS_PER_SECOND
+		#error lib_tickless needs rtc.h to be included first on this part.
+	#endif
+#else
+	#error lib_tickless does not support this part yet.
+#endif
+
+typedef struct
+{
+	uint64_t start;     // funSysTick64() when TicklessInit() was called
+	uint32_t slept_ms;  // Total time spent in Standby/Stop
+	uint32_t wakeups;
+} tickless_stats_t;
+
+tickless_stats_t tickless_stats;
+
+void TicklessInit( void );
+uint32_t TicklessSleepMs( uint32_t ms );
+void TicklessDelayMs( uint32_t ms );
+void TicklessReport( uint32_t run_uA, uint32_t sleep_uA );
+
+static uint32_t tickless_saved_ctlr;
+static uint32_t tickless_saved_cfgr0;
+
+static void TicklessSaveClock( void )
+{
+	tickless_saved_ctlr = RCC->CTLR;
+	tickless_saved_cfgr0 = RCC->CFGR0;
+}
+
+// Coming out of Standby/Stop, we are running from HSI, HSE and PLL are off.
+static void TicklessRestoreClock( void )
+{
+	RCC->CTLR = tickless_saved_ctlr;
+	if( tickless_saved_ctlr & RCC_HSEON )
+		while( !( RCC->CTLR & RCC_HSERDY ) );
+	if( tickless_saved_ctlr & RCC_PLLON )
+		while( !( RCC->CTLR & RCC_PLLRDY ) );
+	RCC->CFGR0 = tickless_saved_cfgr0;
+	while( ( RCC->CFGR0 & RCC_SWS ) != ( ( tickless_saved_cfgr0 & RCC_SW ) << 2 ) );
+}
+
+static void TicklessAdvanceSysTick( uint32_t ms )
+{
+	// Only ever a few counts lost between the read and the write.
+	SysTick->CNT += (uint64_t)ms * DELAY_MS_TIME;
+	tickless_stats.slept_ms += ms;
+	tickless_stats.wakeups++;
+}
+
+#if TICKLESS_AWU
+
+void TicklessInit( void )
+{
+	RCC->APB1PCENR |= RCC_APB1Periph_PWR;
+
+	RCC->RSTSCKR |= RCC_LSION;
+	while( !( RCC->RSTSCKR & RCC_LSIRDY ) );
+
+	// AutoWakeUp is an event on EXTI line 9.
+	EXTI->EVENR |= EXTI_Line9;
+	EXTI->FTENR |= EXTI_Line9;
+
+	tickless_stats.start = funSysTick64();
+}
+
+uint32_t TicklessSleepMs( uint32_t ms )
+{
+	// Prescaler register values and what they divide LSI by.
+	static const uint16_t divs[] = { 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 10240, 61440 };
+	int code;
+	uint32_t step = ( ms < TICKLESS_AWU_STEP_MS ) ? ms : TICKLESS_AWU_STEP_MS;
+	uint32_t lsiticks = step * ( TICKLESS_LSI_HZ / 1000 );
+	uint32_t window, slept = 0;
+
+	if( ms < TICKLESS_MIN_MS ) return 0;
+
+	// Smallest prescaler that still fits in the 6-bit window, for the best resolution.
+	for( code = 0; code < (int)( sizeof(divs)/sizeof(divs[0]) ) - 1; code++ )
+		if( lsiticks / divs[code] <= 63 ) break;
+	window = lsiticks / divs[code];
+	if( window > 63 ) window = 63;
+	if( window == 0 ) return 0;
+	step = window * divs[code] / ( TICKLESS_LSI_HZ / 1000 );
+	if( step == 0 ) return 0;
+
+	// The AWU keeps going off every step.  There's no counter to read back,
+	// so sleep a step at a time, and stop at the first one something else
+	// woke us up in, without counting it.
+	uint32_t pending = EXTI->INTFR;
+	PWR->AWUCSR &= ~PWR_AWUCSR_AWUEN;
+	PWR->AWUPSC = ( PWR->AWUPSC & AWUPSC_MASK ) | ( code + 2 );
+	PWR->AWUWR = ( PWR->AWUWR & AWUWR_MASK ) | window;
+	PWR->AWUCSR |= PWR_AWUCSR_AWUEN;
+
+	TicklessSaveClock();
+	PWR->CTLR |= PWR_CTLR_PDDS;
+	NVIC->SCTLR |= ( 1 << 2 ) | ( 1 << 4 ); // Deep sleep, and pending interrupts wake us up even while disabled
+	while( slept + step <= ms )
+	{
+		__WFE();
+		if( EXTI->INTFR & ~pending & ~EXTI_Line9 ) break;
+		slept += step;
+	}
+	NVIC->SCTLR &= ~( ( 1 << 2 ) | ( 1 << 4 ) );
+	PWR->AWUCSR &= ~PWR_AWUCSR_AWUEN;
+	TicklessRestoreClock();
+
+	TicklessAdvanceSysTick( slept );
+	return slept;
+}
+
+#elif TICKLESS_RTC
+
+volatile uint8_t tickless_alarm;
+
+void TicklessRTCAlarmIRQ( void )
+{
+	RTC->CTLRL &= ~RTC_CTLRL_ALRF;
+	EXTI->INTFR = EXTI_Line17;
+	tickless_alarm = 1;
+}
+
+#ifndef TICKLESS_NO_RTC_HANDLER
+void RTCAlarm_IRQHandler( void ) __attribute__((interrupt));
+void RTCAlarm_IRQHandler( void )
+{
+	TicklessRTCAlarmIRQ();
+}
+#endif
+
+void TicklessInit( void )
+{
+	RCC->APB1PCENR |= RCC_APB1Periph_PWR;
+	tickless_stats.start = funSysTick64();
+}
+
+uint32_t TicklessSleepMs( uint32_t ms )
+{
+	uint32_t increments = (uint64_t)ms * RTC_INCREMENTS_PER_SECOND / 1000;
+	if( ms < TICKLESS_MIN_MS || increments == 0 ) return 0;
+
+	uint32_t begin = RTC_getCounter();
+	tickless_alarm = 0;
+	RTC_setAlarm( begin + increments );
+
+	TicklessSaveClock();
+	PWR->CTLR = ( PWR->CTLR & ~PWR_CTLR_PDDS ) | PWR_CTLR_LPDS;
+	NVIC->SCTLR |= ( 1 << 2 ); // Deep sleep
+	__WFI();
+	NVIC->SCTLR &= ~( 1 << 2 );
+	TicklessRestoreClock();
+
+	// Something else may have woken us up, so see how long we actually slept.
+	uint32_t slept = (uint64_t)( RTC_getCounter() - begin ) * 1000 / RTC_INCREMENTS_PER_SECOND;
+	if( slept > ms ) slept = ms;
+	if( !tickless_alarm )
+		RTC->CTLRH &= ~RTC_CTLRH_ALRIE;
+
+	TicklessAdvanceSysTick( slept );
+	return slept;
+}
+
+#endif
+
+void TicklessDelayMs( uint32_t ms )
+{
+	while( ms >= TICKLESS_MIN_MS )
+	{
+		uint32_t slept = TicklessSleepMs( ms );
+		if( slept == 0 ) break;
+		ms -= slept;
+	}
+	if( ms ) DelaySysTick( ms * DELAY_MS_TIME );
+}
+
+void TicklessReport( uint32_t run_uA, uint32_t sleep_uA )
+{
+	uint32_t total_ms = ( funSysTick64() - tickless_stats.start ) / DELAY_MS_TIME;
+	uint32_t sleep_ms = tickless_stats.slept_ms;
+	uint32_t run_ms = ( total_ms > sleep_ms ) ? total_ms - sleep_ms : 0;
+	if( !total_ms ) return;
+
+	// uA*ms fits in 64 bits for any realistic uptime.
+	uint32_t avg_uA = ( (uint64_t)run_ms * run_uA + (uint64_t)sleep_ms * sleep_uA ) / total_ms;
+
+	printf( "Up %lu ms: awake %lu ms, asleep %lu ms (%lu%%) in %lu sleeps\n",
+		total_ms, run_ms, sleep_ms, (uint32_t)( (uint64_t)sleep_ms * 100 / total_ms ), tickless_stats.wakeups );
+	printf( "Average current ~%lu uA (at %lu uA awake, %lu uA asleep)\n", avg_uA, run_uA, sleep_uA );
+}
+
+#ifdef TICKLESS_OVERRIDE_DELAY_MS
+	#undef Delay_Ms
+	#define Delay_Ms(n) TicklessDelayMs( n )
+#endif
+
+#endif
@@ -0,0 +1,323 @@
+/* Single-File-Header for driving up to 16 WS2812B strips in parallel, by DMA'ing
+   words into a GPIO port's BSHR, paced by TIM1.
+
+   Every bit is 3 time slices at 2.4MHz (1.25us):  set all strip pins high,
+   reset the pins whose bit is 0, reset all pins.  A frame takes as long as the
+   longest strip, so 8 strips of 1000 LEDs take 30ms instead of 240ms.
+
+   The framebuffer is transposed into bit planes from the DMA half/full
+   interrupt, a few LEDs at a time, through a gamma/brightness LUT, so only a
+   small DMA buffer is needed.
+
+   Works on CH32V003, CH32V00x, CH32V10x, CH32V20x and CH32V30x (TIM1_UP is
+   DMA1 channel 5 on all of them).  On the CH32V003, the 8 pins of GPIOC are a
+   good choice.
+
+   If you are including this in main, simply
+	#define WS2812BPAR_IMPLEMENTATION
+
+   Other defines include:
+	#define WS2812BPAR_STRIPS 8        // Number of strips, on consecutive pins.
+	#define WS2812BPAR_PORT GPIOC
+	#define WS2812BPAR_FIRST_PIN 0     // Strip 0 is on this pin.  FIRST_PIN + STRIPS <= 16
+	#define WS2812BPAR_BYTES_PER_LED 3 // 4 for RGBW (SK6812)
+	#define WS2812BPAR_DMALEDS 2       // LEDs in the DMA buffer (even).  Each is 288 bytes.
+	#define WS2812BPAR_RESET_LEDS 10   // Low time after a frame, in LED times (30us).
+	#define WS2812BPAR_NO_GAMMA        // Linear LUT, brightness only.
+
+   The framebuffer holds WS2812BPAR_STRIPS strips one after another, each leds *
+   WS2812BPAR_BYTES_PER_LED bytes.  Bytes are sent in memory order, so store
+   them as G, R, B for WS2812B's.
+
+	WS2812BParInit();
+	WS2812BParSetBrightness( 128 );    // Optional, defaults to 255.
+	WS2812BParStart( framebuffer, leds );
+	while( WS2812BParInUse );          // Don't touch the framebuffer until done.
+*/
+
+#ifndef _WS2812B_DMA_PARALLEL_H
+#define _WS2812B_DMA_PARALLEL_H
+
+#include <stdint.h>
+
+void WS2812BParInit( void );
+void WS2812BParSetBrightness( uint8_t brightness );
+void WS2812BParStart( const uint8_t * framebuffer, int leds );
+
+extern volatile int WS2812BParInUse;
+
+#ifdef WS2812BPAR_IMPLEMENTATION
+
+#ifndef WS2812BPAR_STRIPS
+#define WS2812BPAR_STRIPS 8
+#endif
+
+#ifndef WS2812BPAR_PORT
+#define WS2812BPAR_PORT GPIOC
+#endif
+
+#ifndef WS2812BPAR_FIRST_PIN
+#define WS2812BPAR_FIRST_PIN 0
+#endif
+
+#ifndef WS2812BPAR_BYTES_PER_LED
+#define WS2812BPAR_BYTES_PER_LED 3
+#endif
+
+#ifndef WS2812BPAR_DMALEDS
+#define WS2812BPAR_DMALEDS 2
+#endif
+
+#ifndef WS2812BPAR_RESET_LEDS
+#define WS2812BPAR_RESET_LEDS 10
+#endif
+
+#if WS2812BPAR_STRIPS < 1 || WS2812BPAR_FIRST_PIN + WS2812BPAR_STRIPS > 16
+#error WS2812BPAR_STRIPS must fit on one GPIO port
+#endif
+
+#if ( WS2812BPAR_DMALEDS & 1 ) || WS2812BPAR_DMALEDS < 2
+#error WS2812BPAR_DMALEDS must be even
+#endif
+
+#if WS2812BPAR_RESET_LEDS < WS2812BPAR_DMALEDS / 2 + 1
+#error WS2812BPAR_RESET_LEDS too short for WS2812BPAR_DMALEDS
+#endif
+
+#if !( defined(CH32V003) || defined(CH32V00x) || defined(CH32V10x) || defined(CH32V20x) || defined(CH32V30x) )
+#error ws2812b_dma_parallel does not support this part yet.
+#endif
+
+#define WS2812BPAR_MASK      ( ( ( 1u << WS2812BPAR_STRIPS ) - 1 ) << WS2812BPAR_FIRST_PIN )
+#define WS2812BPAR_SLICES    3
+#define WS2812BPAR_LED_WORDS ( WS2812BPAR_BYTES_PER_LED * 8 * WS2812BPAR_SLICES )
+#define WS2812BPAR_BUFFER_LEN ( WS2812BPAR_DMALEDS * WS2812BPAR_LED_WORDS )
+
+static uint32_t WS2812BParDMABuff[WS2812BPAR_BUFFER_LEN];
+static const uint8_t * WS2812BParFB;
+static int WS2812BParLEDs;
+static int WS2812BParPlace;
+static int WS2812BParStopping;
+volatile int WS2812BParInUse;
+
+uint8_t WS2812BParLUT[256];
+
+#ifndef WS2812BPAR_NO_GAMMA
+// x^2.2
+static const uint8_t WS2812BParGamma[256] = {
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+	0x03, 0x03, 0x03, 0x03, 0x03, 0x04, 0x04, 0x04, 0x04, 0x05, 0x05, 0x05, 0x05, 0x06, 0x06, 0x06,
+	0x06, 0x07, 0x07, 0x07, 0x08, 0x08, 0x08, 0x09, 0x09, 0x09, 0x0a, 0x0a, 0x0b, 0x0b, 0x0b, 0x0c,
+	0x0c, 0x0d, 0x0d, 0x0d, 0x0e, 0x0e, 0x0f, 0x0f, 0x10, 0x10, 0x11, 0x11, 0x12, 0x12, 0x13, 0x13,
+	0x14, 0x14, 0x15, 0x16, 0x16, 0x17, 0x17, 0x18, 0x19, 0x19, 0x1a, 0x1a, 0x1b, 0x1c, 0x1c, 0x1d,
+	0x1e, 0x1e, 0x1f, 0x20, 0x21, 0x21, 0x22, 0x23, 0x23, 0x24, 0x25, 0x26, 0x27, 0x27, 0x28, 0x29,
+	0x2a, 0x2b, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+	0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47,
+	0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f, 0x51, 0x52, 0x53, 0x54, 0x55, 0x57, 0x58, 0x59, 0x5a,
+	0x5b, 0x5d, 0x5e, 0x5f, 0x61, 0x62, 0x63, 0x64, 0x66, 0x67, 0x69, 0x6a, 0x6b, 0x6d, 0x6e, 0x6f,
+	0x71, 0x72, 0x74, 0x75, 0x77, 0x78, 0x79, 0x7b, 0x7c, 0x7e, 0x7f, 0x81, 0x82, 0x84, 0x85, 0x87,
+	0x89, 0x8a, 0x8c, 0x8d, 0x8f, 0x91, 0x92, 0x94, 0x95, 0x97, 0x99, 0x9a, 0x9c, 0x9e, 0x9f, 0xa1,
+	0xa3, 0xa5, 0xa6, 0xa8, 0xaa, 0xac, 0xad, 0xaf, 0xb1, 0xb3, 0xb5, 0xb6, 0xb8, 0xba, 0xbc, 0xbe,
+	0xc0, 0xc2, 0xc4, 0xc5, 0xc7, 0xc9, 0xcb, 0xcd, 0xcf, 0xd1, 0xd3, 0xd5, 0xd7, 0xd9, 0xdb, 0xdd,
+	0xdf, 0xe1, 0xe3, 0xe5, 0xe7, 0xea, 0xec, 0xee, 0xf0, 0xf2, 0xf4, 0xf6, 0xf8, 0xfb, 0xfd, 0xff, };
+#endif
+
+void WS2812BParSetBrightness( uint8_t brightness )
+{
+	int i;
+	for( i = 0; i < 256; i++ )
+	{
+#ifdef WS2812BPAR_NO_GAMMA
+		WS2812BParLUT[i] = ( i * ( brightness + 1 ) ) >> 8;
+#else
+		WS2812BParLUT[i] = ( WS2812BParGamma[i] * ( brightness + 1 ) ) >> 8;
+#endif
+	}
+}
+
+// Looks up one byte from 8 strips (starting at strip) and transposes them, so
+// that byte j of the result (j = 0 is the MSB) has strip n's bit 7-j in bit n.
+// This is the 8x8 bit matrix transpose from Hacker's Delight.
+static inline void WS2812BParPlane8( const uint8_t * src, int stride, int strip, uint32_t * hi, uint32_t * lo )
+{
+	uint32_t a[8];
+	uint32_t x, y, t;
+	int i;
+	for( i = 0; i < 8; i++ )
+	{
+		int s = strip + 7 - i;
+		a[i] = ( s < WS2812BPAR_STRIPS ) ? WS2812BParLUT[src[s * stride]] : 0;
+	}
+
+	x = ( a[0] << 24 ) | ( a[1] << 16 ) | ( a[2] << 8 ) | a[3];
+	y = ( a[4] << 24 ) | ( a[5] << 16 ) | ( a[6] << 8 ) | a[7];
+
+	t = ( x ^ ( x >> 7 ) ) & 0x00AA00AA;  x = x ^ t ^ ( t << 7 );
+	t = ( y ^ ( y >> 7 ) ) & 0x00AA00AA;  y = y ^ t ^ ( t << 7 );
+	t = ( x ^ ( x >> 14 ) ) & 0x0000CCCC; x = x ^ t ^ ( t << 14 );
+	t = ( y ^ ( y >> 14 ) ) & 0x0000CCCC; y = y ^ t ^ ( t << 14 );
+	t = ( x & 0xF0F0F0F0 ) | ( ( y >> 4 ) & 0x0F0F0F0F );
+	y = ( ( x << 4 ) & 0xF0F0F0F0 ) | ( y & 0x0F0F0F0F );
+
+	*hi = t;
+	*lo = y;
+}
+
+static void WS2812BParFillLED( uint32_t * ptr, int led )
+{
+	const uint8_t * src = WS2812BParFB + led * WS2812BPAR_BYTES_PER_LED;
+	int stride = WS2812BParLEDs * WS2812BPAR_BYTES_PER_LED;
+	int c, j;
+
+	for( c = 0; c < WS2812BPAR_BYTES_PER_LED; c++ )
+	{
+		uint32_t hi0, lo0;
+		WS2812BParPlane8( src + c, stride, 0, &hi0, &lo0 );
+#if WS2812BPAR_STRIPS > 8
+		uint32_t hi1, lo1;
+		WS2812BParPlane8( src + c, stride, 8, &hi1, &lo1 );
+#endif
+		for( j = 0; j < 8; j++ )
+		{
+			int shift = 24 - ( j & 3 ) * 8;
+			uint32_t bits = ( ( ( j < 4 ) ? hi0 : lo0 ) >> shift ) & 0xff;
+#if WS2812BPAR_STRIPS > 8
+			bits |= ( ( ( ( j < 4 ) ? hi1 : lo1 ) >> shift ) & 0xff ) << 8;
+#endif
+			// Pins with a 0 bit go low a third of the way in.
+			ptr[0] = WS2812BPAR_MASK;
+			ptr[1] = ( ~( bits << WS2812BPAR_FIRST_PIN ) & WS2812BPAR_MASK ) << 16;
+			ptr[2] = WS2812BPAR_MASK << 16;
+			ptr += WS2812BPAR_SLICES;
+		}
+	}
+}
+
+static void WS2812BParFillBuffSec( uint32_t * ptr )
+{
+	uint32_t * end = ptr + WS2812BPAR_BUFFER_LEN / 2;
+	int place = WS2812BParPlace;
+
+	while( ptr != end )
+	{
+		if( place >= 0 && place < WS2812BParLEDs )
+		{
+			WS2812BParFillLED( ptr, place );
+		}
+		else
+		{
+			// Before and after the frame, just hold everything low.
+			uint32_t * le = ptr + WS2812BPAR_LED_WORDS;
+			uint32_t * p;
+			for( p = ptr; p != le; p++ )
+				*p = WS2812BPAR_MASK << 16;
+		}
+		ptr += WS2812BPAR_LED_WORDS;
+		place++;
+	}
+	WS2812BParPlace = place;
+}
+
+void DMA1_Channel5_IRQHandler( void ) __attribute__((interrupt));
+void DMA1_Channel5_IRQHandler( void )
+{
+	volatile int intfr = DMA1->INTFR;
+	do
+	{
+		DMA1->INTFCR = DMA1_IT_GL5;
+
+		// First half has been sent, refill it while the second half goes out.
+		if( intfr & DMA1_IT_HT5 )
+			WS2812BParFillBuffSec( WS2812BParDMABuff );
+
+		if( intfr & DMA1_IT_TC5 )
+		{
+			if( WS2812BParStopping )
+			{
+				// Out of circular mode, the DMA has now stopped.
+				DMA1_Channel5->CFGR &= ~DMA_CFGR1_EN;
+				WS2812BParStopping = 0;
+				WS2812BParInUse = 0;
+			}
+			else
+			{
+				WS2812BParFillBuffSec( WS2812BParDMABuff + WS2812BPAR_BUFFER_LEN / 2 );
+
+				// What we just filled goes out after the first half, then stop.
+				if( WS2812BParPlace >= WS2812BParLEDs + WS2812BPAR_RESET_LEDS )
+				{
+					DMA1_Channel5->CFGR &= ~DMA_Mode_Circular;
+					WS2812BParStopping = 1;
+				}
+			}
+		}
+		intfr = DMA1->INTFR;
+	} while( intfr & DMA1_IT_GL5 );
+}
+
+void WS2812BParStart( const uint8_t * framebuffer, int leds )
+{
+	DMA1_Channel5->CFGR &= ~DMA_CFGR1_EN;
+
+	WS2812BParFB = framebuffer;
+	WS2812BParLEDs = leds;
+	WS2812BParPlace = -1; // One LED time of low first.
+	WS2812BParStopping = 0;
+	WS2812BParInUse = 1;
+
+	WS2812BParFillBuffSec( WS2812BParDMABuff );
+	WS2812BParFillBuffSec( WS2812BParDMABuff + WS2812BPAR_BUFFER_LEN / 2 );
+
+	DMA1->INTFCR = DMA1_IT_GL5;
+	DMA1_Channel5->MADDR = (uint32_t)WS2812BParDMABuff;
+	DMA1_Channel5->CNTR = WS2812BPAR_BUFFER_LEN;
+	DMA1_Channel5->CFGR |= DMA_Mode_Circular | DMA_CFGR1_EN;
+}
+
+void WS2812BParInit( void )
+{
+	GPIO_TypeDef * port = WS2812BPAR_PORT;
+	int i;
+
+	WS2812BParSetBrightness( 255 );
+
+	// GPIOA's enable is bit 2, and the ports are 0x400 apart.
+	RCC->AHBPCENR |= RCC_AHBPeriph_DMA1;
+	RCC->APB2PCENR |= RCC_APB2Periph_TIM1 | ( RCC_APB2Periph_GPIOA << ( ( (uint32_t)port - GPIOA_BASE ) / 0x400 ) );
+
+	port->BSHR = WS2812BPAR_MASK << 16;
+	for( i = WS2812BPAR_FIRST_PIN; i < WS2812BPAR_FIRST_PIN + WS2812BPAR_STRIPS; i++ )
+	{
+		volatile uint32_t * cfg = ( i < 8 ) ? &port->CFGLR : &port->CFGHR;
+		int shift = ( i & 7 ) * 4;
+		*cfg = ( *cfg & ~( 0xf << shift ) ) | ( ( GPIO_Speed_10MHz | GPIO_CNF_OUT_PP ) << shift );
+	}
+
+	DMA1_Channel5->PADDR = (uint32_t)&port->BSHR;
+	DMA1_Channel5->MADDR = (uint32_t)WS2812BParDMABuff;
+	DMA1_Channel5->CNTR = 0;
+	DMA1_Channel5->CFGR =
+		DMA_M2M_Disable |
+		DMA_Priority_VeryHigh |
+		DMA_MemoryDataSize_Word |
+		DMA_PeripheralDataSize_Word |
+		DMA_MemoryInc_Enable |
+		DMA_Mode_Normal |
+		DMA_DIR_PeripheralDST |
+		DMA_IT_TC | DMA_IT_HT;
+	NVIC_EnableIRQ( DMA1_Channel5_IRQn );
+
+	// TIM1 update at 2.4MHz, each one moves a word to BSHR.
+	RCC->APB2PRSTR |= RCC_APB2Periph_TIM1;
+	RCC->APB2PRSTR &= ~RCC_APB2Periph_TIM1;
+	TIM1->PSC = 0;
+	TIM1->ATRLR = FUNCONF_SYSTEM_CORE_CLOCK / 2400000 - 1;
+	TIM1->SWEVGR = TIM_UG;
+	TIM1->DMAINTENR = TIM_UDE;
+	TIM1->CTLR1 = TIM_CEN;
+}
+
+#endif
+
+#endif
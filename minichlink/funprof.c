@@ -0,0 +1,548 @@
+// Reads the funprof ring from extralibs/lib_funprof.h off a running target
+// and prints flat and call graph timing reports.  Also a sampling profiler
+// that needs nothing in the firmware, by halting the core to read its PC.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "minichlink.h"
+#include "funprof.h"
+
+#define FUNPROF_MAGIC 0x666e7072
+#define FUNPROF_EXIT  1
+#define FUNPROF_HEADER_SIZE 20
+#define FUNPROF_MAX_DEPTH 64
+
+int LoadSymbols( const char * fname, struct SymbolTable * st )
+{
+	FILE * f = fopen( fname, "r" );
+	if( !f ) return -1;
+
+	char line[1024];
+	int alloc = 0;
+	st->count = 0;
+	st->syms = 0;
+	while( fgets( line, sizeof( line ), f ) )
+	{
+		unsigned long long addr;
+		char type;
+		char name[900];
+		if( sscanf( line, "%llx %c %899s", &addr, &type, name ) != 3 ) continue;
+		if( st->count == alloc )
+		{
+			alloc = alloc ? alloc * 2 : 256;
+			st->syms = realloc( st->syms, alloc * sizeof( struct Symbol ) );
+		}
+		st->syms[st->count].address = (uint32_t)addr;
+		st->syms[st->count].type = type;
+		st->syms[st->count].name = strdup( name );
+		st->count++;
+	}
+	fclose( f );
+	return 0;
+}
+
+void FreeSymbols( struct SymbolTable * st )
+{
+	int i;
+	for( i = 0; i < st->count; i++ )
+		free( st->syms[i].name );
+	free( st->syms );
+	st->syms = 0;
+	st->count = 0;
+}
+
+static int IsCodeOrConstSymbol( char type )
+{
+	return type == 'T' || type == 't' || type == 'W' || type == 'w' || type == 'R' || type == 'r';
+}
+
+// Closest code/const symbol at or below address, or 0.
+const struct Symbol * LookupSymbol( const struct SymbolTable * st, uint32_t address )
+{
+	const struct Symbol * best = 0;
+	int i;
+	for( i = 0; i < st->count; i++ )
+	{
+		const struct Symbol * s = &st->syms[i];
+		if( !IsCodeOrConstSymbol( s->type ) || s->address > address ) continue;
+		if( !best || s->address > best->address ) best = s;
+	}
+	return best;
+}
+
+const struct Symbol * FindSymbol( const struct SymbolTable * st, const char * name )
+{
+	int i;
+	for( i = 0; i < st->count; i++ )
+		if( strcmp( st->syms[i].name, name ) == 0 ) return &st->syms[i];
+	return 0;
+}
+
+struct FunProfFn
+{
+	uint32_t where;
+	uint32_t calls;
+	uint64_t incl;
+	uint64_t self;
+	uint32_t max;
+};
+
+struct FunProfEdge
+{
+	uint32_t caller;
+	uint32_t callee;
+	uint32_t calls;
+	uint64_t incl;
+};
+
+struct FunProfFrame
+{
+	uint32_t where;
+	uint32_t start;
+	uint64_t child;
+};
+
+static const struct SymbolTable * fp_syms;
+static uint32_t fp_ticks_per_ms;
+
+static const char * FunProfName( uint32_t where, char * buf, int buflen )
+{
+	const struct Symbol * s = fp_syms ? LookupSymbol( fp_syms, where ) : 0;
+	if( !s )
+	{
+		snprintf( buf, buflen, "0x%08x", where );
+		return buf;
+	}
+	const char * name = s->name;
+	if( strncmp( name, "funprof_zone_", 13 ) == 0 )
+	{
+		// Zone, drop the prefix and gcc's ".N" suffix for local statics.
+		name += 13;
+		int len = strcspn( name, "." );
+		snprintf( buf, buflen, "[%.*s]", len, name );
+	}
+	else if( s->address != where )
+		snprintf( buf, buflen, "%s+0x%x", name, where - s->address );
+	else
+		snprintf( buf, buflen, "%s", name );
+	return buf;
+}
+
+static double FunProfUs( uint64_t ticks )
+{
+	return ticks * 1000.0 / fp_ticks_per_ms;
+}
+
+static struct FunProfFn * FunProfGetFn( struct FunProfFn ** fns, int * nfns, uint32_t where )
+{
+	int i;
+	for( i = 0; i < *nfns; i++ )
+		if( (*fns)[i].where == where ) return &(*fns)[i];
+	*fns = realloc( *fns, ( *nfns + 1 ) * sizeof( struct FunProfFn ) );
+	struct FunProfFn * f = &(*fns)[(*nfns)++];
+	memset( f, 0, sizeof( *f ) );
+	f->where = where;
+	return f;
+}
+
+static void FunProfAddEdge( struct FunProfEdge ** edges, int * nedges, uint32_t caller, uint32_t callee, uint32_t incl )
+{
+	int i;
+	for( i = 0; i < *nedges; i++ )
+	{
+		struct FunProfEdge * e = &(*edges)[i];
+		if( e->caller == caller && e->callee == callee )
+		{
+			e->calls++;
+			e->incl += incl;
+			return;
+		}
+	}
+	*edges = realloc( *edges, ( *nedges + 1 ) * sizeof( struct FunProfEdge ) );
+	struct FunProfEdge * e = &(*edges)[(*nedges)++];
+	e->caller = caller;
+	e->callee = callee;
+	e->calls = 1;
+	e->incl = incl;
+}
+
+static int FunProfCompareSelf( const void * a, const void * b )
+{
+	const struct FunProfFn * fa = a, * fb = b;
+	return ( fb->self > fa->self ) - ( fb->self < fa->self );
+}
+
+static int FunProfCompareEdge( const void * a, const void * b )
+{
+	const struct FunProfEdge * ea = a, * eb = b;
+	return ( eb->incl > ea->incl ) - ( eb->incl < ea->incl );
+}
+
+static uint32_t ReadLE32( const uint8_t * p )
+{
+	return p[0] | ( p[1] << 8 ) | ( p[2] << 16 ) | ( (uint32_t)p[3] << 24 );
+}
+
+int FunProfReport( void * dev, const char * target )
+{
+	struct SymbolTable st = { 0 };
+	uint32_t address;
+
+	// Either the address of funprof, or nm output to find it in.
+	int64_t addr = SimpleReadNumberInt( target, -1 );
+	if( addr >= 0 )
+	{
+		address = (uint32_t)addr;
+	}
+	else
+	{
+		if( LoadSymbols( target, &st ) )
+		{
+			fprintf( stderr, "Error: can't open symbol file \"%s\"\n", target );
+			return -1;
+		}
+		const struct Symbol * s = FindSymbol( &st, "funprof" );
+		if( !s )
+		{
+			fprintf( stderr, "Error: no funprof symbol in \"%s\", is lib_funprof.h included?\n", target );
+			FreeSymbols( &st );
+			return -1;
+		}
+		address = s->address;
+		fp_syms = &st;
+	}
+
+	uint8_t header[FUNPROF_HEADER_SIZE];
+	if( MCF.ReadBinaryBlob( dev, address, sizeof( header ), header ) < 0 )
+	{
+		fprintf( stderr, "Fault reading device\n" );
+		FreeSymbols( &st );
+		return -1;
+	}
+
+	uint32_t magic = ReadLE32( header + 0 );
+	uint32_t entries = ReadLE32( header + 4 );
+	uint32_t head = ReadLE32( header + 12 );
+	fp_ticks_per_ms = ReadLE32( header + 8 );
+	if( magic != FUNPROF_MAGIC || entries == 0 || ( entries & ( entries - 1 ) ) || entries > 65536 || fp_ticks_per_ms == 0 )
+	{
+		fprintf( stderr, "Error: no funprof ring at 0x%08x, was FunProfInit() called?\n", address );
+		FreeSymbols( &st );
+		return -1;
+	}
+
+	uint8_t * raw = malloc( entries * 8 );
+	if( MCF.ReadBinaryBlob( dev, address + FUNPROF_HEADER_SIZE, entries * 8, raw ) < 0 )
+	{
+		fprintf( stderr, "Fault reading device\n" );
+		free( raw );
+		FreeSymbols( &st );
+		return -1;
+	}
+
+	uint32_t count = ( head < entries ) ? head : entries;
+	uint32_t first = head - count;
+
+	struct FunProfFn * fns = 0;
+	struct FunProfEdge * edges = 0;
+	int nfns = 0, nedges = 0;
+	struct FunProfFrame stack[FUNPROF_MAX_DEPTH];
+	int depth = 0;
+	uint32_t unmatched = 0;
+	uint32_t i;
+
+	for( i = 0; i < count; i++ )
+	{
+		const uint8_t * ev = raw + ( ( first + i ) & ( entries - 1 ) ) * 8;
+		uint32_t time = ReadLE32( ev );
+		uint32_t where = ReadLE32( ev + 4 );
+
+		if( !( where & FUNPROF_EXIT ) )
+		{
+			if( depth == FUNPROF_MAX_DEPTH ) { unmatched++; continue; }
+			stack[depth].where = where;
+			stack[depth].start = time;
+			stack[depth].child = 0;
+			depth++;
+			continue;
+		}
+
+		where &= ~FUNPROF_EXIT;
+
+		// Exits for things entered before the window started have no frame.
+		int d;
+		for( d = depth - 1; d >= 0; d-- )
+			if( stack[d].where == where ) break;
+		if( d < 0 ) { unmatched++; continue; }
+		unmatched += depth - 1 - d;
+		depth = d;
+
+		uint32_t incl = time - stack[d].start;
+		struct FunProfFn * f = FunProfGetFn( &fns, &nfns, where );
+		f->calls++;
+		f->incl += incl;
+		f->self += ( incl > stack[d].child ) ? incl - stack[d].child : 0;
+		if( incl > f->max ) f->max = incl;
+
+		uint32_t caller = 0;
+		if( d > 0 )
+		{
+			stack[d-1].child += incl;
+			caller = stack[d-1].where;
+		}
+		FunProfAddEdge( &edges, &nedges, caller, where, incl );
+	}
+	unmatched += depth;
+
+	uint64_t total_self = 0;
+	for( i = 0; i < nfns; i++ )
+		total_self += fns[i].self;
+
+	uint32_t span = 0;
+	if( count )
+	{
+		uint32_t t0 = ReadLE32( raw + ( first & ( entries - 1 ) ) * 8 );
+		uint32_t t1 = ReadLE32( raw + ( ( head - 1 ) & ( entries - 1 ) ) * 8 );
+		span = t1 - t0;
+	}
+
+	printf( "%u events (%u recorded), %.1f us, %u ticks/ms, %u unmatched\n",
+		count, head, FunProfUs( span ), fp_ticks_per_ms, unmatched );
+
+	qsort( fns, nfns, sizeof( struct FunProfFn ), FunProfCompareSelf );
+	printf( "\nFlat profile:\n" );
+	printf( "  self%%     self us     incl us    calls    avg us    max us  name\n" );
+	for( i = 0; i < nfns; i++ )
+	{
+		struct FunProfFn * f = &fns[i];
+		char name[256];
+		printf( "%6.2f %11.1f %11.1f %8u %9.2f %9.2f  %s\n",
+			total_self ? f->self * 100.0 / total_self : 0.0,
+			FunProfUs( f->self ), FunProfUs( f->incl ), f->calls,
+			FunProfUs( f->incl ) / f->calls, FunProfUs( f->max ),
+			FunProfName( f->where, name, sizeof( name ) ) );
+	}
+
+	qsort( edges, nedges, sizeof( struct FunProfEdge ), FunProfCompareEdge );
+	printf( "\nCall graph (caller -> callee, inclusive time):\n" );
+	printf( "     incl us    calls  caller -> callee\n" );
+	for( i = 0; i < nedges; i++ )
+	{
+		struct FunProfEdge * e = &edges[i];
+		char caller[256], callee[256];
+		printf( "%12.1f %8u  %s -> %s\n", FunProfUs( e->incl ), e->calls,
+			e->caller ? FunProfName( e->caller, caller, sizeof( caller ) ) : "(top)",
+			FunProfName( e->callee, callee, sizeof( callee ) ) );
+	}
+
+	free( fns );
+	free( edges );
+	free( raw );
+	fp_syms = 0;
+	FreeSymbols( &st );
+	return 0;
+}
+
+struct PCSampleFn
+{
+	const struct Symbol * sym;
+	const struct Symbol * caller;
+	uint32_t samples;
+};
+
+static void PCSampleAdd( struct PCSampleFn ** fns, int * nfns, const struct Symbol * sym, const struct Symbol * caller )
+{
+	int i;
+	for( i = 0; i < *nfns; i++ )
+	{
+		if( (*fns)[i].sym == sym && (*fns)[i].caller == caller )
+		{
+			(*fns)[i].samples++;
+			return;
+		}
+	}
+	*fns = realloc( *fns, ( *nfns + 1 ) * sizeof( struct PCSampleFn ) );
+	struct PCSampleFn * f = &(*fns)[(*nfns)++];
+	f->sym = sym;
+	f->caller = caller;
+	f->samples = 1;
+}
+
+static int PCSampleCompare( const void * a, const void * b )
+{
+	const struct PCSampleFn * fa = a, * fb = b;
+	return ( fb->samples > fa->samples ) - ( fb->samples < fa->samples );
+}
+
+// One register through an abstract command, -1 if it didn't work, so
+// DMDATA0 is never taken for the value without checking cmderr.
+static int PCSampleReadReg( void * dev, uint32_t regno, uint32_t * value )
+{
+	uint32_t abstractcs = 0;
+	int tries;
+	MCF.WriteReg32( dev, DMCOMMAND, 0x00220000 | regno );
+	for( tries = 0; tries < 10; tries++ )
+	{
+		if( MCF.ReadReg32( dev, DMABSTRACTCS, &abstractcs ) ) return -1;
+		if( !( abstractcs & ( 1<<12 ) ) ) break; // busy
+	}
+	if( abstractcs & ( ( 1<<12 ) | 0x700 ) )
+	{
+		MCF.WriteReg32( dev, DMABSTRACTCS, 0x00000700 );
+		return -1;
+	}
+	return MCF.ReadReg32( dev, DMDATA0, value );
+}
+
+int PCSampleReport( void * dev, int seconds, const char * symfile )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	struct SymbolTable st = { 0 };
+	if( LoadSymbols( symfile, &st ) )
+	{
+		fprintf( stderr, "Error: can't open symbol file \"%s\"\n", symfile );
+		return -1;
+	}
+
+	// Halt, read DPC and RA, resume.  HaltMode() would do the same but waits
+	// 10ms each time.
+	MCF.WriteReg32( dev, DMSHDWCFGR, 0x5aa50000 | (1<<10) );
+	MCF.WriteReg32( dev, DMCFGR, 0x5aa50000 | (1<<10) );
+	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0x00000000 );
+	iss->statetag = STTAG( "PCSM" );
+
+	// Startup halts the core, let it go like -T does.  With -k nothing here
+	// halted it, so someone else did, and resuming it would be a surprise.
+	uint32_t status = 0;
+	if( MCF.ReadReg32( dev, DMSTATUS, &status ) )
+	{
+		FreeSymbols( &st );
+		return -1;
+	}
+	if( status & ( 1<<9 ) )
+	{
+		if( iss->init_skip || !MCF.HaltMode )
+		{
+			fprintf( stderr, "Error: the core is halted, not sampling it\n" );
+			FreeSymbols( &st );
+			return -1;
+		}
+		MCF.HaltMode( dev, HALT_MODE_RESUME );
+	}
+
+	uint32_t * pcs = 0;
+	int nsamples = 0, alloc = 0, missed = 0;
+	time_t end = time( 0 ) + seconds;
+	while( time( 0 ) < end )
+	{
+		uint32_t pc, ra, data0, data1;
+		int tries;
+		status = 0;
+		MCF.WriteReg32( dev, DMCONTROL, 0x80000001 ); // haltreq
+		for( tries = 0; tries < 10; tries++ )
+			if( MCF.ReadReg32( dev, DMSTATUS, &status ) || ( status & ( 1<<9 ) ) ) break; // allhalted
+		if( !( status & ( 1<<9 ) ) )
+		{
+			// Take the request back, and only resume if it halted after all.
+			MCF.WriteReg32( dev, DMCONTROL, 0x00000001 );
+			if( MCF.ReadReg32( dev, DMSTATUS, &status ) || !( status & ( 1<<9 ) ) )
+			{
+				missed++;
+				continue;
+			}
+		}
+
+		// The firmware may be printing through DMDATA0/1 (debugprintf).
+		int r = MCF.ReadReg32( dev, DMDATA0, &data0 );
+		r |= MCF.ReadReg32( dev, DMDATA1, &data1 );
+		r |= PCSampleReadReg( dev, 0x7b1, &pc ); // DPC
+		r |= PCSampleReadReg( dev, 0x1001, &ra ); // x1
+		MCF.WriteReg32( dev, DMDATA0, data0 );
+		MCF.WriteReg32( dev, DMDATA1, data1 );
+		MCF.WriteReg32( dev, DMCONTROL, 0x40000001 ); // resumereq
+		if( r )
+		{
+			missed++;
+			continue;
+		}
+		if( nsamples == alloc )
+		{
+			alloc = alloc ? alloc * 2 : 4096;
+			pcs = realloc( pcs, alloc * 2 * sizeof( uint32_t ) );
+		}
+		pcs[nsamples*2+0] = pc;
+		pcs[nsamples*2+1] = ra;
+		nsamples++;
+	}
+	MCF.FlushLLCommands( dev );
+
+	if( !nsamples )
+	{
+		fprintf( stderr, "Error: no samples, %d missed\n", missed );
+		free( pcs );
+		FreeSymbols( &st );
+		return -1;
+	}
+
+	// Without frame pointers there's no walking the stack, but where RA is in
+	// another function it's the caller: in leaf functions, and in others
+	// before their first call.  That gives two deep stacks, for the rest
+	// only the function itself.
+	struct PCSampleFn * flat = 0, * folded = 0;
+	int nflat = 0, nfolded = 0, i;
+	for( i = 0; i < nsamples; i++ )
+	{
+		const struct Symbol * sym = LookupSymbol( &st, pcs[i*2+0] );
+		const struct Symbol * caller = LookupSymbol( &st, pcs[i*2+1] );
+		PCSampleAdd( &flat, &nflat, sym, 0 );
+		PCSampleAdd( &folded, &nfolded, sym, ( caller && caller != sym ) ? caller : 0 );
+	}
+	qsort( flat, nflat, sizeof( struct PCSampleFn ), PCSampleCompare );
+	qsort( folded, nfolded, sizeof( struct PCSampleFn ), PCSampleCompare );
+
+	printf( "%d samples in %d s (%d/s), %d missed\n", nsamples, seconds, nsamples / ( seconds ? seconds : 1 ), missed );
+	printf( "\nFlat profile:\n" );
+	printf( "   samples      %%  name\n" );
+	for( i = 0; i < nflat; i++ )
+		printf( "%10u %6.2f  %s\n", flat[i].samples, flat[i].samples * 100.0 / nsamples, flat[i].sym ? flat[i].sym->name : "[unknown]" );
+
+	// <symfile without .nm>.prof for misc/fastplace.py, .folded for flamegraph.pl.
+	printf( "\n" );
+	char fname[1024];
+	int baselen = strlen( symfile );
+	if( baselen > 3 && strcmp( symfile + baselen - 3, ".nm" ) == 0 ) baselen -= 3;
+	snprintf( fname, sizeof( fname ), "%.*s.prof", baselen, symfile );
+	FILE * f = fopen( fname, "w" );
+	if( f )
+	{
+		fprintf( f, "# %d samples\n", nsamples );
+		for( i = 0; i < nflat; i++ )
+			if( flat[i].sym ) fprintf( f, "%u %s\n", flat[i].samples, flat[i].sym->name );
+		fclose( f );
+		printf( "Wrote %s\n", fname );
+	}
+	snprintf( fname, sizeof( fname ), "%.*s.folded", baselen, symfile );
+	f = fopen( fname, "w" );
+	if( f )
+	{
+		for( i = 0; i < nfolded; i++ )
+		{
+			const char * name = folded[i].sym ? folded[i].sym->name : "[unknown]";
+			if( folded[i].caller )
+				fprintf( f, "%s;%s %u\n", folded[i].caller->name, name, folded[i].samples );
+			else
+				fprintf( f, "%s %u\n", name, folded[i].samples );
+		}
+		fclose( f );
+		printf( "Wrote %s\n", fname );
+	}
+
+	free( flat );
+	free( folded );
+	free( pcs );
+	FreeSymbols( &st );
+	return 0;
+}
@@ -0,0 +1,33 @@
+#ifndef _FUNPROF_H
+#define _FUNPROF_H
+
+#include <stdint.h>
+
+// Symbols, as printed by "nm -n firmware.elf".
+struct Symbol
+{
+	uint32_t address;
+	char type;
+	char * name;
+};
+
+struct SymbolTable
+{
+	struct Symbol * syms;
+	int count;
+};
+
+int LoadSymbols( const char * fname, struct SymbolTable * st );
+void FreeSymbols( struct SymbolTable * st );
+const struct Symbol * LookupSymbol( const struct SymbolTable * st, uint32_t address );
+const struct Symbol * FindSymbol( const struct SymbolTable * st, const char * name );
+
+// target is either nm output containing funprof, or its address.
+int FunProfReport( void * dev, const char * target );
+
+// Samples the PC for some seconds, by halting the core, and prints a flat
+// profile.  Writes it to <symfile>.prof (minus .nm) for misc/fastplace.py,
+// and folded stacks to .folded.
+int PCSampleReport( void * dev, int seconds, const char * symfile );
+
+#endif
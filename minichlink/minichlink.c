@@ -14,6 +14,7 @@
 #include "../ch32fun/ch32fun.h"
 #include "chips.h"
 #include "ch5xx.h"
+#include "funprof.h"
 
 #if defined(WINDOWS) || defined(WIN32) || defined(_WIN32)
 extern int isatty(int);
@@ -35,6 +36,9 @@ int DefaultConfigureReadProtection( void * dev, int one_if_yes_protect );
 void TestFunction(void * v );
 static void readCSR( void * dev, uint32_t csr );
 static int DefaultRebootIntoBootloader( void * dev );
+static void PrintStackWatermark( void * dev );
+static int HaltSavingRegisters( void * dev, uint32_t * saved );
+static void ResumeRestoringRegisters( void * dev, uint32_t * saved );
 struct MiniChlinkFunctions MCF;
 
 void * MiniCHLinkInitAsDLL( struct MiniChlinkFunctions ** MCFO, const init_hints_t* init_hints )
@@ -56,6 +60,10 @@ void * MiniCHLinkInitAsDLL( struct MiniChlinkFunctions ** MCFO, const init_hints
 			dev = TryInit_B003Fun(SimpleReadNumberInt(init_hints->serial_port, 0x1209b003));
 		else if( strcmp( specpgm, "ardulink" ) == 0 )
 			dev = TryInit_Ardulink(init_hints);
+		else if( strcmp( specpgm, "sim" ) == 0 )
+			dev = TryInit_Sim(init_hints);
+		else if( strcmp( specpgm, "uartboot" ) == 0 )
+			dev = TryInit_UARTBoot(init_hints);
 	}
 	else
 	{
@@ -737,6 +745,12 @@ keep_going:
 					goto unimplemented;
 				break;
 			}
+			case 'W':
+			{
+				if( !MCF.ReadBinaryBlob ) goto unimplemented;
+				PrintStackWatermark( dev );
+				break;
+			}
 			case 'X':
 			{
 				iarg++;
@@ -841,6 +855,42 @@ keep_going:
 				if( f != stdout ) fclose( f );
 				break;
 			}
+			case 'F':
+			{
+				if( argchar[2] != 0 ) goto help;
+				iarg++;
+				argchar = 0; // Stop advancing
+				if( iarg >= argc )
+				{
+					fprintf( stderr, "Error: -F needs nm output for the firmware, or the address of funprof.\n" );
+					goto help;
+				}
+				if( !MCF.ReadBinaryBlob ) goto unimplemented;
+
+				// Halt so the ring is consistent, then let it carry on.
+				uint32_t saved[35];
+				int halted = HaltSavingRegisters( dev, saved );
+				int r = FunProfReport( dev, argv[iarg] );
+				if( halted == 0 ) ResumeRestoringRegisters( dev, saved );
+				if( r ) return -9;
+				break;
+			}
+			case 'O':
+			{
+				if( argchar[2] != 0 ) goto help;
+				iarg += 2;
+				argchar = 0; // Stop advancing
+				if( iarg >= argc )
+				{
+					fprintf( stderr, "Error: -O needs a number of seconds and nm output for the firmware.\n" );
+					goto help;
+				}
+				if( !MCF.WriteReg32 || !MCF.ReadReg32 ) goto unimplemented;
+
+				int seconds = SimpleReadNumberInt( argv[iarg-1], 10 );
+				if( PCSampleReport( dev, seconds, argv[iarg] ) ) return -9;
+				break;
+			}
 			case 'w':
 			{
 				//struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
@@ -1042,7 +1092,7 @@ help:
 	fprintf( stderr, " -f Disable 5V\n" );
 	fprintf( stderr, " -k Skip programmer initialization\n" );
 	fprintf( stderr, " -c [serial port for Ardulink, try /dev/ttyACM0 or COM11 etc] or [VID+PID of USB for b003boot, try 0x1209b003]\n" );
-	fprintf( stderr, " -C [specified programmer, eg. b003boot, ardulink, esp32s2chfun, funprog, isp]\n" );
+	fprintf( stderr, " -C [specified programmer, eg. b003boot, ardulink, esp32s2chfun, funprog, isp, sim, uartboot]\n" );
 	fprintf( stderr, " -u Clear all code flash - by power off (also can unbrick)\n" );
 	fprintf( stderr, " -a Reboot into Halt\n" );
 	fprintf( stderr, " -A Go into Halt without reboot\n" );
@@ -1053,6 +1103,7 @@ help:
 	fprintf( stderr, " -D Configure NRST as GPIO\n" );
 	fprintf( stderr, " -d Configure NRST as NRST\n" );
 	fprintf( stderr, " -i Show chip info\n" );
+	fprintf( stderr, " -W Show stack use, for firmware built with FUNCONF_STACK_WATERMARK (halts to read RAM)\n" );
 	fprintf( stderr, " -s [debug register] [value]\n" );
 	fprintf( stderr, " -m [debug register]\n" );
 	fprintf( stderr, " -T Terminal Only (must be last arg)\n" );
@@ -1066,6 +1117,8 @@ help:
 	fprintf( stderr, " -r [output binary image] [memory address, decimal or 0x, try 0x08000000] [size, decimal or 0x, try 16384]\n" );
 	fprintf( stderr, "   Note: for memory addresses, you can use 'flash' 'bootloader' 'option' 'eeprom' 'ram' and say \"ram+0x10\" for instance\n" );
 	fprintf( stderr, "   For filename, you can use - for raw (terminal) or + for hex (inline).\n" );
+	fprintf( stderr, " -F [nm -n output, or address of funprof] Profile report from extralibs/lib_funprof.h\n" );
+	fprintf( stderr, " -O [seconds] [nm -n output] Sampling profile, by halting for the PC, writes .prof and .folded files\n" );
 	fprintf( stderr, " -X [programmer-specific command, for esp32-s2 programmer, -X ECLK:1:0:0:8:3 for 24MHz clock out]\n" );
 
 	return -1;	
@@ -1105,6 +1158,87 @@ int64_t SimpleReadNumberInt( const char * number, int64_t defaultNumber )
 	}
 }
 
+// For reading memory while the firmware runs: halt, and keep what the
+// reads overwrite.  Memory reads go through the program buffer, which
+// uses x8 to x13 and DATA0/1 (which the firmware may be printing through),
+// and HALT_MODE_RESUME puts none of it back.  saved needs 35 words.
+static int HaltSavingRegisters( void * dev, uint32_t * saved )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	if( !MCF.HaltMode || !MCF.ReadReg32 || !MCF.ReadAllCPURegisters || !MCF.WriteAllCPURegisters ) return -1;
+	MCF.HaltMode( dev, HALT_MODE_HALT_BUT_NO_RESET );
+	MCF.ReadReg32( dev, DMDATA0, saved + 33 );
+	MCF.ReadReg32( dev, DMDATA1, saved + 34 );
+	if( iss->nr_registers_for_debug > 32 || MCF.ReadAllCPURegisters( dev, saved ) )
+	{
+		fprintf( stderr, "Error: could not save the registers, not resuming\n" );
+		return -1;
+	}
+	return 0;
+}
+
+static void ResumeRestoringRegisters( void * dev, uint32_t * saved )
+{
+	MCF.WriteAllCPURegisters( dev, saved ); // And DPC, which is right after them.
+	if( MCF.VoidHighLevelState ) MCF.VoidHighLevelState( dev ); // The program buffer setup is gone with them.
+	MCF.WriteReg32( dev, DMDATA0, saved[33] );
+	MCF.WriteReg32( dev, DMDATA1, saved[34] );
+	MCF.HaltMode( dev, HALT_MODE_RESUME );
+}
+
+// Same as FUN_STACK_CANARY in ch32fun.h, for firmware built with FUNCONF_STACK_WATERMARK.
+#define STACK_WATERMARK_CANARY 0xf0cacc1a
+
+static void PrintStackWatermark( void * dev )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	if( !iss->ram_size || iss->ram_size > 128*1024 )
+	{
+		fprintf( stderr, "Error: don't know this chip's RAM\n" );
+		return;
+	}
+
+	uint8_t * ram = malloc( iss->ram_size );
+	uint32_t saved[35];
+	if( HaltSavingRegisters( dev, saved ) )
+	{
+		free( ram );
+		return;
+	}
+	int r = MCF.ReadBinaryBlob( dev, iss->ram_base, iss->ram_size, ram );
+	ResumeRestoringRegisters( dev, saved );
+	if( r < 0 )
+	{
+		free( ram );
+		return;
+	}
+
+	// The unused stack is the longest run of canaries, the stack grows down from the top of RAM.
+	int words = iss->ram_size / 4;
+	int best_start = 0, best_len = 0, i, run = 0;
+	for( i = 0; i < words; i++ )
+	{
+		uint32_t w = ram[i*4] | ( ram[i*4+1] << 8 ) | ( ram[i*4+2] << 16 ) | ( (uint32_t)ram[i*4+3] << 24 );
+		run = ( w == STACK_WATERMARK_CANARY ) ? run + 1 : 0;
+		if( run > best_len )
+		{
+			best_len = run;
+			best_start = i - run + 1;
+		}
+	}
+	free( ram );
+
+	if( best_len < 4 )
+	{
+		printf( "No stack watermark, build with FUNCONF_STACK_WATERMARK\n" );
+		return;
+	}
+	uint32_t low = iss->ram_base + best_start * 4;
+	uint32_t high = low + best_len * 4;
+	uint32_t top = iss->ram_base + iss->ram_size;
+	printf( "Stack watermark: 0x%08x, %d bytes used, %d never touched\n", high, top - high, high - low );
+}
+
 static int64_t StringToMemoryAddress( void * dev, const char * number )
 {
 	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
@@ -2032,6 +2166,307 @@ static int DefaultWriteWord( void * dev, uint32_t address_to_write, uint32_t dat
 	return ret;
 }
 
+// Flash loader for the CH32V/X parts, see misc/attic/ch32_blobs_for_minichlink/ch32_write_block.asm
+// Runs from RAM and does the page erase, page buffer and page start itself, so
+// for every page the programmer only sends the data and waits once.  Pages
+// can be sent compressed, the loader decodes them into RAM before programming.
+static const unsigned char ch32_write_block_bin[] = {
+	0x01, 0x44, 0x85, 0x41, 0x91, 0xcb, 0xb7, 0x02, 0x02, 0x00, 0x23, 0x28,
+	0x56, 0x00, 0x48, 0xca, 0x93, 0x82, 0x02, 0x04, 0x23, 0x28, 0x56, 0x00,
+	0x05, 0x2a, 0x09, 0x04, 0xc0, 0xc1, 0x97, 0x03, 0x00, 0x00, 0x93, 0x83,
+	0xa3, 0x13, 0x33, 0x83, 0xd3, 0x00, 0x11, 0x22, 0xa6, 0x82, 0x13, 0x92,
+	0x14, 0x00, 0x13, 0x52, 0x12, 0x00, 0x63, 0xd3, 0x02, 0x00, 0x1e, 0x83,
+	0xcd, 0x28, 0x23, 0x20, 0x93, 0x00, 0x11, 0x03, 0x7d, 0x12, 0xe3, 0x1b,
+	0x02, 0xfe, 0x63, 0xc9, 0x02, 0x06, 0x33, 0x83, 0xd3, 0x00, 0x33, 0x82,
+	0xd3, 0x00, 0x63, 0xf3, 0x43, 0x06, 0x83, 0x42, 0x03, 0x00, 0x05, 0x03,
+	0x93, 0xf1, 0xf2, 0x07, 0x93, 0xf2, 0x02, 0x08, 0x63, 0x9d, 0x02, 0x00,
+	0x85, 0x01, 0x83, 0x42, 0x03, 0x00, 0x05, 0x03, 0x23, 0x80, 0x53, 0x00,
+	0x85, 0x03, 0xfd, 0x11, 0xe3, 0x99, 0x01, 0xfe, 0xd9, 0xbf, 0x8d, 0x01,
+	0x83, 0x42, 0x03, 0x00, 0x83, 0x44, 0x13, 0x00, 0x09, 0x03, 0xa2, 0x04,
+	0xb3, 0xe2, 0x92, 0x00, 0xb3, 0x84, 0x53, 0x40, 0xb3, 0x00, 0xd2, 0x40,
+	0xa6, 0x82, 0x63, 0xf5, 0x14, 0x00, 0xb3, 0x82, 0x14, 0x40, 0xaa, 0x92,
+	0x83, 0xc2, 0x02, 0x00, 0x23, 0x80, 0x53, 0x00, 0x85, 0x03, 0x85, 0x04,
+	0xfd, 0x11, 0xe3, 0x93, 0x01, 0xfe, 0x71, 0xbf, 0x85, 0x41, 0xc1, 0x62,
+	0x23, 0x28, 0x56, 0x00, 0x11, 0xc7, 0xb7, 0x02, 0x09, 0x00, 0x23, 0x28,
+	0x56, 0x00, 0xad, 0x28, 0x17, 0x03, 0x00, 0x00, 0x13, 0x03, 0x83, 0x08,
+	0x2a, 0x82, 0xba, 0x83, 0x83, 0x24, 0x03, 0x00, 0x23, 0x20, 0x92, 0x00,
+	0x11, 0x03, 0x11, 0x02, 0x09, 0xe7, 0x89, 0x41, 0xb1, 0x28, 0x85, 0x41,
+	0x11, 0xa8, 0xfd, 0x13, 0x63, 0x98, 0x03, 0x00, 0xba, 0x83, 0xb7, 0x02,
+	0x05, 0x00, 0x23, 0x28, 0x56, 0x00, 0x99, 0x20, 0xb3, 0x02, 0xa2, 0x40,
+	0xe3, 0x9a, 0xd2, 0xfc, 0x01, 0xe7, 0xb7, 0x02, 0x21, 0x00, 0x29, 0xa0,
+	0x48, 0xca, 0xc1, 0x62, 0x93, 0x82, 0x02, 0x04, 0x23, 0x28, 0x56, 0x00,
+	0x25, 0x20, 0x12, 0x85, 0xe3, 0x1f, 0x25, 0xec, 0x09, 0x04, 0xc0, 0xc1,
+	0x01, 0xa0, 0x84, 0x41, 0x89, 0xe8, 0xc4, 0x41, 0xfd, 0x14, 0xe5, 0xfc,
+	0x84, 0x41, 0x81, 0xe4, 0x23, 0xa2, 0x05, 0x00, 0x82, 0x80, 0x23, 0xa0,
+	0x05, 0x00, 0x82, 0x80, 0x83, 0x22, 0xc6, 0x00, 0xb3, 0xf2, 0x32, 0x00,
+	0xe3, 0x9c, 0x02, 0xfe, 0x82, 0x80, 0x01, 0x00
+};
+
+#define MICROBLOB_HASH_BITS 12
+#define MICROBLOB_MAX_OFFSET 65535
+#define MICROBLOB_MAX_COPY 130
+#define MICROBLOB_CHAIN 64
+
+// Words per BUF_LOAD for the RAM flash loader, 0 for the V20x/V30x page
+// buffer which doesn't need one, -1 if the loader isn't used on this part.
+static int InternalMicroblobWordsPerLoad( struct InternalState * iss )
+{
+	if( iss->no_flash_microblob || iss->current_area == BOOTLOADER_AREA )
+		return -1;
+
+	// The loader, then the page buffer and the input buffer.
+	if( sizeof( ch32_write_block_bin ) + 2 * iss->sector_size > iss->target_chip->ram_size )
+		return -1;
+
+	switch( iss->target_chip_type )
+	{
+	case CHIP_CH32V003:
+	case CHIP_CH32V00x:
+	case CHIP_CH32X03x:
+	case CHIP_CH32L103:
+	case CHIP_CH641:
+	case CHIP_CH643:
+		return 1;
+	case CHIP_CH32V10x:
+		return 4;
+	case CHIP_CH32V20x:
+	case CHIP_CH32V30x:
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+static void InternalMicroblobInsert( const uint8_t * data, int pos, int len, int32_t * head, int32_t * prev )
+{
+	if( pos + 3 > len ) return;
+	uint32_t h = ( ( data[pos] | ( data[pos+1] << 8 ) | ( data[pos+2] << 16 ) ) * 2654435761u ) >> ( 32 - MICROBLOB_HASH_BITS );
+	prev[pos] = head[h];
+	head[h] = pos;
+}
+
+// Compresses data[start...end) into the loader's format (see the .asm), with
+// copies that can go back as far as data[0].  Every position before start
+// must already be in the hash chains.  Returns the size, or -1 if it
+// doesn't fit in outmax.
+static int InternalMicroblobCompress( const uint8_t * data, int start, int end, int len, int32_t * head, int32_t * prev, uint8_t * out, int outmax )
+{
+	int pos = start;
+	int o = 0;
+	int lit = -1; // Token of the literal run being added to
+
+	while( pos < end )
+	{
+		int best = 0;
+		int bestoff = 0;
+		int max = end - pos;
+		if( max > MICROBLOB_MAX_COPY ) max = MICROBLOB_MAX_COPY;
+		if( max >= 3 && pos + 3 <= len )
+		{
+			uint32_t h = ( ( data[pos] | ( data[pos+1] << 8 ) | ( data[pos+2] << 16 ) ) * 2654435761u ) >> ( 32 - MICROBLOB_HASH_BITS );
+			int cand = head[h];
+			int chain = MICROBLOB_CHAIN;
+			while( cand >= 0 && pos - cand <= MICROBLOB_MAX_OFFSET && chain-- )
+			{
+				// Copies can overlap the bytes they write, the loader copies a byte at a time.
+				int l = 0;
+				while( l < max && data[cand+l] == data[pos+l] ) l++;
+				if( l > best )
+				{
+					best = l;
+					bestoff = pos - cand;
+					if( l == max ) break;
+				}
+				cand = prev[cand];
+			}
+		}
+
+		if( best >= 3 )
+		{
+			if( o + 3 > outmax ) return -1;
+			out[o++] = 0x80 | ( best - 3 );
+			out[o++] = bestoff & 0xff;
+			out[o++] = bestoff >> 8;
+			lit = -1;
+			while( best-- )
+				InternalMicroblobInsert( data, pos++, len, head, prev );
+		}
+		else
+		{
+			if( lit < 0 || out[lit] == 0x7f )
+			{
+				if( o + 2 > outmax ) return -1;
+				lit = o;
+				out[o++] = 0;
+			}
+			else
+			{
+				if( o + 1 > outmax ) return -1;
+				out[lit]++;
+			}
+			out[o++] = data[pos];
+			InternalMicroblobInsert( data, pos++, len, head, prev );
+		}
+	}
+	return o;
+}
+
+// The loader acknowledges through DMDATA1: the page counter when it is ready
+// for a page, and 0 when it has taken a 0 word (or already the next page
+// counter, if that was the last word of a page).  Only words in DMDATA0 go
+// without an answer.  If one is lost (written before the loader took the one
+// before), the loader never asks for the next page and this times out, so a
+// slow core costs a fallback, never a bad page.
+static int InternalMicroblobWait( void * dev, uint32_t expect, int until_not )
+{
+	uint64_t start = GetTimeMicroseconds();
+	uint32_t rr = 0;
+	int timeout = 0;
+	do
+	{
+		if( MCF.ReadReg32( dev, DMDATA1, &rr ) ) return -1;
+		if( until_not ? rr != expect : rr == expect ) return 0;
+	} while( timeout++ < 1000 || GetTimeMicroseconds() - start < 250000 );
+
+	fprintf( stderr, "Error: Flash loader timed out (DATA1 = %08x, %s %08x)\n", rr, until_not ? "waiting for it to change from" : "expected", expect );
+	return -2;
+}
+
+static int InternalMicroblobSendWord( void * dev, uint32_t word )
+{
+	if( word )
+		return MCF.WriteReg32( dev, DMDATA0, word );
+
+	// 0 can't go through DATA0.  Nothing else is sent until the loader has
+	// taken it, or a word after it could get to the loader first.
+	int ret = MCF.WriteReg32( dev, DMDATA1, 1 );
+	return ret ? ret : InternalMicroblobWait( dev, 1, 1 );
+}
+
+// Writes whole pages of flash with the loader in RAM.  address and length
+// must be page aligned.  This clobbers the start of RAM and the registers.
+static int InternalWriteFlashWithMicroblob( void * dev, uint32_t address, uint32_t length, const uint8_t * blob, int words_per_load )
+{
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	uint32_t ram = iss->target_chip->ram_base;
+	int sectorsize = iss->sector_size;
+	int pages = length / sectorsize;
+	uint32_t dmdata0_addr = 0;
+	uint32_t dcsr = 0;
+	uint32_t rr = 0;
+	int erase = 0;
+	int ret = 0;
+	int sent = 0;
+	int i, p;
+
+	int32_t head[1<<MICROBLOB_HASH_BITS];
+	int32_t * prev = malloc( length * sizeof( int32_t ) );
+	uint8_t packed[sectorsize];
+	if( !prev ) return -1;
+	for( i = 0; i < ( 1<<MICROBLOB_HASH_BITS ); i++ )
+		head[i] = -1;
+
+	for( p = 0; p < pages; p++ )
+		if( !InternalIsMemoryErased( iss, address + p * sectorsize ) )
+			erase = 1;
+
+	MCF.ReadReg32( dev, DMHARTINFO, &dmdata0_addr );
+	dmdata0_addr = 0xe0000000 | ( dmdata0_addr & 0x7ff );
+
+	for( i = 0; i < sizeof( ch32_write_block_bin ); i += 4 )
+	{
+		uint32_t word = 0;
+		int n = sizeof( ch32_write_block_bin ) - i;
+		memcpy( &word, ch32_write_block_bin + i, n < 4 ? n : 4 );
+		if( ( ret = MCF.WriteWord( dev, ram + i, word ) ) ) goto done;
+	}
+
+	const uint32_t regs[][2] = {
+		{ 0x1002, address + length }, // sp = end
+		{ 0x100a, address },          // a0 = first page
+		{ 0x100b, dmdata0_addr },     // a1 = DMDATA0
+		{ 0x100c, 0x40022000 },       // a2 = FLASH
+		{ 0x100d, sectorsize },       // a3 = page size
+		{ 0x100e, words_per_load },   // a4
+		{ 0x100f, erase },            // a5
+		{ 0x0300, 0 },                // mstatus, no interrupts
+		{ 0x07b1, ram },              // dpc
+	};
+
+	MCF.WriteReg32( dev, DMABSTRACTAUTO, 0x00000000 ); // Disable Autoexec.
+	iss->statetag = STTAG( "MBLB" );
+	for( i = 0; i < sizeof( regs ) / sizeof( regs[0] ); i++ )
+	{
+		MCF.WriteReg32( dev, DMDATA0, regs[i][1] );
+		MCF.WriteReg32( dev, DMCOMMAND, 0x00230000 | regs[i][0] ); // Write register from DATA0.
+	}
+
+	// Single step would stop the loader after one instruction.
+	MCF.WriteReg32( dev, DMCOMMAND, 0x00220000 | 0x7b0 ); // Read dcsr into DATA0.
+	MCF.ReadReg32( dev, DMDATA0, &dcsr );
+	if( dcsr & 4 )
+	{
+		MCF.WriteReg32( dev, DMDATA0, dcsr & ~4 );
+		MCF.WriteReg32( dev, DMCOMMAND, 0x00230000 | 0x7b0 );
+	}
+
+	MCF.ReadReg32( dev, DMABSTRACTCS, &rr );
+	if( rr & 0x700 )
+	{
+		fprintf( stderr, "Error: Could not set up the flash loader (ABSTRACTCS = %08x)\n", rr );
+		MCF.WriteReg32( dev, DMABSTRACTCS, 0x00000700 ); // Clear cmderr.
+		ret = -1;
+		goto done;
+	}
+
+	MCF.WriteReg32( dev, DMDATA0, 0 );
+	MCF.WriteReg32( dev, DMDATA1, 0 );
+	MCF.WriteReg32( dev, DMCONTROL, 0x40000001 ); // resumereq
+
+	for( p = 0; p < pages; p++ )
+	{
+		// Compressed, unless that's no smaller.  Either way the header is never 0.
+		int start = p * sectorsize;
+		int n = InternalMicroblobCompress( blob, start, start + sectorsize, length, head, prev, packed, sectorsize - 4 );
+		const uint8_t * src = blob + start;
+		int words = sectorsize / 4;
+		uint32_t header = 0x80000000 | words;
+		if( n >= 0 )
+		{
+			memset( packed + n, 0, ( 4 - ( n & 3 ) ) & 3 );
+			src = packed;
+			words = header = ( n + 3 ) / 4;
+		}
+
+		// The loader has erased the page and is ready for it.
+		if( ( ret = InternalMicroblobWait( dev, ( p + 1 ) * 2, 0 ) ) ) goto halt;
+		if( ( ret = InternalMicroblobSendWord( dev, header ) ) ) goto halt;
+		for( i = 0; i < words; i++ )
+		{
+			uint32_t word;
+			memcpy( &word, src + i * 4, 4 );
+			if( ( ret = InternalMicroblobSendWord( dev, word ) ) ) goto halt;
+		}
+		sent += words + 1;
+		InternalMarkMemoryNotErased( iss, address + start );
+	}
+	ret = InternalMicroblobWait( dev, ( pages + 1 ) * 2, 0 );
+	if( !ret && length >= 4096 )
+		fprintf( stderr, "Flash loader: %d bytes sent as %d words (%d%%)\n", length, sent, sent * 400 / length );
+
+halt:
+	MCF.WriteReg32( dev, DMCONTROL, 0x80000001 ); // Halt the loader.
+	if( dcsr & 4 )
+	{
+		MCF.WriteReg32( dev, DMDATA0, dcsr );
+		MCF.WriteReg32( dev, DMCOMMAND, 0x00230000 | 0x7b0 );
+	}
+	MCF.VoidHighLevelState( dev );
+done:
+	free( prev );
+	return ret;
+}
+
 int DefaultWriteBinaryBlob( void * dev, uint32_t address_to_write, uint32_t blob_size, const uint8_t * blob )
 {
 	// NOTE IF YOU FIX SOMETHING IN THIS FUNCTION PLEASE ALSO UPDATE THE PROGRAMMERS.
@@ -2178,6 +2613,29 @@ int DefaultWriteBinaryBlob( void * dev, uint32_t address_to_write, uint32_t blob
 		return 0;
 	}
 
+	// Whole pages go through the flash loader in RAM, then only the data
+	// words go over the link.  The loader isn't worth it for a page or two.
+	int words_per_load = InternalMicroblobWordsPerLoad( iss );
+	if( is_flash && words_per_load >= 0 && ( !MCF.BlockWrite64 || iss->target_chip_type == CHIP_CH32V10x ) )
+	{
+		uint32_t first = ( address_to_write + sectorsizemask ) & ~sectorsizemask;
+		uint32_t last = ( address_to_write + blob_size ) & ~sectorsizemask;
+		if( last > first && ( last - first ) / sectorsize >= 4 )
+		{
+			uint32_t head = first - address_to_write;
+			if( head && ( ret = DefaultWriteBinaryBlob( dev, address_to_write, head, blob ) ) )
+				return ret;
+			if( InternalWriteFlashWithMicroblob( dev, first, last - first, blob + head, words_per_load ) )
+			{
+				fprintf( stderr, "Warning: Flash loader failed, writing through the debug module instead\n" );
+				iss->no_flash_microblob = 1;
+				if( ( ret = DefaultWriteBinaryBlob( dev, first, last - first, blob + head ) ) )
+					return ret;
+			}
+			return DefaultWriteBinaryBlob( dev, last, address_to_write + blob_size - last, blob + ( last - address_to_write ) );
+		}
+	}
+
 	uint8_t tempblock[sectorsize];
 	int sblock =  address_to_write / sectorsize;
 	int eblock = ( address_to_write + blob_size + (sectorsize-1) ) / sectorsize;
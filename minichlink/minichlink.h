@@ -196,6 +196,7 @@ struct InternalState
 	uint32_t clock_set;
 	uint8_t init_skip;
 	uint8_t debugger;
+	uint8_t no_flash_microblob; // The RAM flash loader failed once, don't try it again.
 };
 
 
@@ -275,6 +276,8 @@ void * TryInit_ESP32S2CHFUN(void);
 void * TryInit_NHCLink042(void);
 void * TryInit_B003Fun(uint32_t id);
 void * TryInit_Ardulink(const init_hints_t*);
+void * TryInit_Sim(const init_hints_t*);
+void * TryInit_UARTBoot(const init_hints_t*);
 
 // Returns 0 if ok, populated, 1 if not populated.
 int SetupAutomaticHighLevelFunctions( void * dev );
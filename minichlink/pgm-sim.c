@@ -0,0 +1,1009 @@
+// Simulated target, for testing and benchmarking minichlink without hardware.
+//
+// Models the parts of a CH32 the default high-level functions talk to:
+//  * The RISC-V debug module: DMCONTROL/DMSTATUS, abstract register access,
+//    the program buffer (run on a small RV32IC interpreter) and autoexec.
+//  * Flash, RAM and the system area (ESIG, UUID, option bytes).
+//  * The flash controller: keys/locks, fast page erase/program with the
+//    page buffer (BUF_RST/BUF_LOAD on V003-style parts, direct on V20x/V30x),
+//    sector and mass erase, option byte erase/program and a BSY flag that
+//    stays set for a few polls.
+//  * A core that runs code in RAM after a resume (for RAM loaders), getting
+//    a slice of instructions after every transaction, as much as it would
+//    run in the link latency at 24 MHz.
+//
+// Every ReadReg32/WriteReg32 is counted as one round trip.  On exit, the
+// counts (and the link time they would cost at the configured latency) are
+// printed, so changes to the high level functions can be compared.
+//
+// Use with "-C sim".  Configured through the environment:
+//   MINICHLINK_SIM_CHIP        v003 (default), v006, x035, l103, v203, v307.  "-c <chip>" works too.
+//   MINICHLINK_SIM_LATENCY_US  Simulated time per transaction, default 100.
+//   MINICHLINK_SIM_CORE_STEPS  Instructions a resumed core runs per transaction, instead of
+//                              what fits in the latency.  Small values model a slow core.
+//   MINICHLINK_SIM_FLASH_BUSY  STATR polls that read BSY after each flash operation, default 2.
+//   MINICHLINK_SIM_FLASH       Flash image to load on start and save on exit.
+//   MINICHLINK_SIM_STATS       Also write the counters to this file as key=value lines.
+//   MINICHLINK_SIM_TRACE       If set, print every transaction.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "minichlink.h"
+#include "chips.h"
+#include "../ch32fun/ch32fun.h"
+
+#define SIM_DATA0_ADDR   0xe00000f4
+#define SIM_SYS_BASE     0x1fff0000
+#define SIM_SYS_SIZE     0x10000
+#define SIM_MAX_STEPS    100000
+#define SIM_MHZ          24
+#define SIM_FLASH_KEY1   0x45670123
+#define SIM_FLASH_KEY2   0xCDEF89AB
+
+// Flash controller, offsets from 0x40022000
+#define SIM_FLASH_BASE   0x40022000
+#define SIM_F_KEYR       0x04
+#define SIM_F_OBKEYR     0x08
+#define SIM_F_STATR      0x0c
+#define SIM_F_CTLR       0x10
+#define SIM_F_ADDR       0x14
+#define SIM_F_OBR        0x1c
+#define SIM_F_WPR        0x20
+#define SIM_F_MODEKEYR   0x24
+#define SIM_F_BOOTKEYR   0x28
+
+#define SIM_CTLR_FLOCK   0x8000
+#define SIM_CTLR_PGSTRT  0x00200000 // V20x/V30x fast page program start
+
+struct SimChip
+{
+	const char * name;
+	const struct RiscVChip_s * chip;
+	uint32_t sevenf_id;
+	uint32_t chip_id;
+	int rv32e;
+	int v20x_flash; // Page buffer without BUF_LOAD, started with PGSTRT.
+};
+
+static const struct SimChip sim_chips[] = {
+	{ "v003", &ch32v003, 0x00300500, 0x00300500, 1, 0 },
+	{ "v006", &ch32v006, 0x00600600, 0x00600600, 1, 0 },
+	{ "x035", &ch32x035, 0x03500601, 0x03500601, 0, 0 },
+	{ "l103", &ch32l103, 0x10300700, 0x10300700, 0, 0 },
+	{ "v203", &ch32v203, 0x20300500, 0x2031050c, 0, 1 },
+	{ "v307", &ch32v307, 0x30700508, 0x30700508, 0, 1 },
+};
+
+struct SimStats
+{
+	uint64_t writes;
+	uint64_t reads;
+	uint64_t flushes;
+	uint64_t reg_writes[128];
+	uint64_t reg_reads[128];
+	uint64_t commands;
+	uint64_t autoexecs;
+	uint64_t instructions;
+	uint64_t cmd_errors;
+	uint64_t page_erases;
+	uint64_t sector_erases;
+	uint64_t mass_erases;
+	uint64_t page_programs;
+	uint64_t unerased_programs;
+	uint64_t lost_buffer_words;
+	uint64_t option_writes;
+	uint64_t delay_us;
+};
+
+struct SimState
+{
+	struct ProgrammerStructBase psb;
+	const struct SimChip * sc;
+
+	// Debug module
+	uint32_t data[2];
+	uint32_t progbuf[8];
+	uint32_t command;
+	uint32_t abstractauto;
+	uint32_t cmderr;
+	uint32_t cfgr, shdwcfgr;
+	int halted;
+	int resumeack;
+	int running;  // Resumed into RAM, the core runs from pc
+	uint32_t pc;
+
+	// Hart
+	uint32_t x[32];
+	uint32_t csr[4096];
+
+	// Memories
+	uint8_t * flash;
+	uint8_t * flash_erased; // Per page
+	uint8_t * ram;
+	uint8_t sys[SIM_SYS_SIZE];
+
+	// Flash controller
+	uint32_t fctlr, fstatr, faddr;
+	int key_stage, obkey_stage, modekey_stage, bootkey_stage;
+	int boot_unlocked;
+	uint8_t page_buf[256];
+	uint32_t latch_addr, latch_data;
+	int latch_full;
+	uint32_t last_prog_addr;
+	int busy_polls;
+
+	// Config
+	uint32_t latency_us;
+	uint32_t core_steps;
+	int busy_reads;
+	int trace;
+	const char * image;
+	const char * stats_file;
+
+	struct SimStats st;
+};
+
+static int SimLoad( struct SimState * s, uint32_t addr, int size, uint32_t * val );
+static int SimStore( struct SimState * s, uint32_t addr, int size, uint32_t val );
+
+static uint32_t SimGetLE( const uint8_t * p, int size )
+{
+	uint32_t r = 0;
+	int i;
+	for( i = size - 1; i >= 0; i-- ) r = ( r << 8 ) | p[i];
+	return r;
+}
+
+static void SimPutLE( uint8_t * p, int size, uint32_t v )
+{
+	int i;
+	for( i = 0; i < size; i++ ) { p[i] = v; v >>= 8; }
+}
+
+static uint32_t SimFlashSize( struct SimState * s ) { return s->sc->chip->flash_size; }
+static uint32_t SimPageSize( struct SimState * s ) { return s->sc->chip->sector_size; }
+
+static void SimFlashErase( struct SimState * s, uint32_t addr, uint32_t len )
+{
+	addr &= 0x00ffffff;
+	addr &= ~( len - 1 );
+	if( addr >= SimFlashSize( s ) ) return;
+	if( addr + len > SimFlashSize( s ) ) len = SimFlashSize( s ) - addr;
+	memset( s->flash + addr, 0xff, len );
+	uint32_t p;
+	for( p = addr / SimPageSize( s ); p < ( addr + len ) / SimPageSize( s ); p++ )
+		s->flash_erased[p] = 1;
+}
+
+static void SimFlashProgram( struct SimState * s, uint32_t addr )
+{
+	uint32_t ps = SimPageSize( s );
+	addr = ( addr & 0x00ffffff ) & ~( ps - 1 );
+	if( addr >= SimFlashSize( s ) ) return;
+	if( !s->flash_erased[addr / ps] )
+	{
+		s->st.unerased_programs++;
+		fprintf( stderr, "sim: page at 0x%08x programmed without being erased\n", addr | 0x08000000 );
+	}
+	memcpy( s->flash + addr, s->page_buf, ps );
+	s->flash_erased[addr / ps] = 0;
+	s->st.page_programs++;
+}
+
+static void SimFlashReset( struct SimState * s )
+{
+	s->fctlr = CR_LOCK_Set | SIM_CTLR_FLOCK;
+	s->fstatr = 0;
+	s->faddr = 0;
+	s->key_stage = s->obkey_stage = s->modekey_stage = s->bootkey_stage = 0;
+	s->latch_full = 0;
+	s->busy_polls = 0;
+}
+
+static void SimKey( int * stage, uint32_t val, int * unlocked )
+{
+	if( *stage == 0 && val == SIM_FLASH_KEY1 ) { *stage = 1; return; }
+	if( *stage == 1 && val == SIM_FLASH_KEY2 ) *unlocked = 1;
+	*stage = 0;
+}
+
+static void SimFlashCtlrWrite( struct SimState * s, uint32_t val )
+{
+	if( val & CR_LOCK_Set )
+	{
+		s->fctlr = ( s->fctlr & ~FLASH_CTLR_OPTWRE ) | CR_LOCK_Set | SIM_CTLR_FLOCK;
+		return;
+	}
+	if( s->fctlr & CR_LOCK_Set ) return;
+
+	// FLOCK, LOCK and OPTWRE are only changed by the key sequences.
+	uint32_t keep = s->fctlr & ( SIM_CTLR_FLOCK | FLASH_CTLR_OPTWRE );
+	if( ( s->fctlr & SIM_CTLR_FLOCK ) ) val &= ~( CR_PAGE_PG | CR_PAGE_ER | CR_BUF_LOAD | CR_BUF_RST | SIM_CTLR_PGSTRT );
+	s->fctlr = ( val & ~( CR_STRT_Set | CR_BUF_LOAD | CR_BUF_RST | SIM_CTLR_PGSTRT | SIM_CTLR_FLOCK | FLASH_CTLR_OPTWRE ) ) | keep;
+
+	if( val & CR_BUF_RST )
+	{
+		memset( s->page_buf, 0xff, sizeof( s->page_buf ) );
+		s->latch_full = 0;
+	}
+
+	if( ( val & CR_BUF_LOAD ) && ( val & CR_PAGE_PG ) && s->latch_full )
+	{
+		SimPutLE( s->page_buf + ( s->latch_addr & ( SimPageSize( s ) - 1 ) ), 4, s->latch_data );
+		s->latch_full = 0;
+	}
+
+	if( ( val & SIM_CTLR_PGSTRT ) && s->sc->v20x_flash )
+	{
+		SimFlashProgram( s, s->last_prog_addr );
+		s->busy_polls = s->busy_reads;
+	}
+
+	if( !( val & CR_STRT_Set ) ) return;
+
+	s->busy_polls = s->busy_reads;
+	s->fstatr |= 0x20; // EOP
+	if( val & FLASH_CTLR_MER )
+	{
+		SimFlashErase( s, 0, SimFlashSize( s ) );
+		s->st.mass_erases++;
+	}
+	else if( val & CR_PAGE_ER )
+	{
+		SimFlashErase( s, s->faddr, SimPageSize( s ) );
+		s->st.page_erases++;
+	}
+	else if( val & CR_PER_Set )
+	{
+		SimFlashErase( s, s->faddr, s->sc->v20x_flash ? 4096 : 1024 );
+		s->st.sector_erases++;
+	}
+	else if( val & CR_PAGE_PG )
+	{
+		SimFlashProgram( s, s->faddr );
+	}
+	else if( ( val & FLASH_CTLR_OPTER ) && ( s->fctlr & FLASH_CTLR_OPTWRE ) )
+	{
+		const struct RiscVChip_s * c = s->sc->chip;
+		memset( s->sys + ( c->options_offset - SIM_SYS_BASE ), 0xff, c->options_size );
+	}
+}
+
+static uint32_t SimFlashRegRead( struct SimState * s, uint32_t off )
+{
+	switch( off )
+	{
+	case SIM_F_STATR:
+	{
+		uint32_t r = s->fstatr;
+		if( s->busy_polls > 0 )
+		{
+			s->busy_polls--;
+			r |= 1 | ( s->sc->v20x_flash ? 2 : 0 );
+		}
+		if( !s->boot_unlocked ) r |= 0x8000;
+		return r;
+	}
+	case SIM_F_CTLR: return s->fctlr;
+	case SIM_F_ADDR: return s->faddr;
+	case SIM_F_OBR: return 0;
+	case SIM_F_WPR: return 0xffffffff;
+	default: return 0;
+	}
+}
+
+static void SimFlashRegWrite( struct SimState * s, uint32_t off, uint32_t val )
+{
+	int unlocked = 0;
+	switch( off )
+	{
+	case SIM_F_KEYR:
+		SimKey( &s->key_stage, val, &unlocked );
+		if( unlocked ) s->fctlr &= ~CR_LOCK_Set;
+		break;
+	case SIM_F_OBKEYR:
+		SimKey( &s->obkey_stage, val, &unlocked );
+		if( unlocked && !( s->fctlr & CR_LOCK_Set ) ) s->fctlr |= FLASH_CTLR_OPTWRE;
+		break;
+	case SIM_F_MODEKEYR:
+		SimKey( &s->modekey_stage, val, &unlocked );
+		if( unlocked && !( s->fctlr & CR_LOCK_Set ) ) s->fctlr &= ~SIM_CTLR_FLOCK;
+		break;
+	case SIM_F_BOOTKEYR:
+		SimKey( &s->bootkey_stage, val, &unlocked );
+		if( unlocked ) s->boot_unlocked = 1;
+		break;
+	case SIM_F_STATR:
+		s->fstatr &= ~( val & 0x30 );
+		if( s->boot_unlocked ) s->fstatr = ( s->fstatr & ~0x4000 ) | ( val & 0x4000 );
+		break;
+	case SIM_F_CTLR:
+		SimFlashCtlrWrite( s, val );
+		break;
+	case SIM_F_ADDR:
+		s->faddr = val;
+		break;
+	}
+}
+
+static int SimStoreFlash( struct SimState * s, uint32_t addr, int size, uint32_t val )
+{
+	uint32_t ps = SimPageSize( s );
+	if( ( s->fctlr & CR_PAGE_PG ) && size == 4 )
+	{
+		if( s->sc->v20x_flash )
+		{
+			SimPutLE( s->page_buf + ( addr & ( ps - 1 ) ), 4, val );
+			s->busy_polls = 1; // WRBSY, briefly
+		}
+		else
+		{
+			// Each word must be moved to the page buffer with BUF_LOAD.
+			if( s->latch_full ) s->st.lost_buffer_words++;
+			s->latch_addr = addr;
+			s->latch_data = val;
+			s->latch_full = 1;
+		}
+		s->last_prog_addr = addr;
+		return 0;
+	}
+
+	const struct RiscVChip_s * c = s->sc->chip;
+	if( ( s->fctlr & FLASH_CTLR_OPTPG ) && ( s->fctlr & FLASH_CTLR_OPTWRE ) &&
+		addr >= c->options_offset && addr + size <= c->options_offset + c->options_size )
+	{
+		SimPutLE( s->sys + ( addr - SIM_SYS_BASE ), size, val );
+		s->st.option_writes++;
+		return 0;
+	}
+
+	return -1;
+}
+
+static int SimLoad( struct SimState * s, uint32_t addr, int size, uint32_t * val )
+{
+	const struct RiscVChip_s * c = s->sc->chip;
+	if( addr & ( size - 1 ) ) return -1;
+
+	if( addr < SimFlashSize( s ) )
+		addr |= 0x08000000;
+	if( addr >= 0x08000000 && addr < 0x08000000 + SimFlashSize( s ) )
+		*val = SimGetLE( s->flash + ( addr - 0x08000000 ), size );
+	else if( addr >= c->ram_base && addr < c->ram_base + c->ram_size )
+		*val = SimGetLE( s->ram + ( addr - c->ram_base ), size );
+	else if( addr >= SIM_SYS_BASE && addr - SIM_SYS_BASE < SIM_SYS_SIZE )
+		*val = SimGetLE( s->sys + ( addr - SIM_SYS_BASE ), size );
+	else if( addr >= SIM_DATA0_ADDR && addr < SIM_DATA0_ADDR + 8 )
+		*val = SimGetLE( (uint8_t*)s->data + ( addr - SIM_DATA0_ADDR ), size );
+	else if( ( addr & 0xffffff00 ) == SIM_FLASH_BASE )
+		*val = SimFlashRegRead( s, addr & 0xff );
+	else if( ( addr >= 0x40000000 && addr < 0x60000000 ) || ( addr & 0xfff00000 ) == 0xe0000000 )
+		*val = 0; // Other peripherals
+	else
+	{
+		if( s->trace ) fprintf( stderr, "sim: load fault at 0x%08x\n", addr );
+		return -1;
+	}
+	return 0;
+}
+
+static int SimStore( struct SimState * s, uint32_t addr, int size, uint32_t val )
+{
+	const struct RiscVChip_s * c = s->sc->chip;
+	if( addr & ( size - 1 ) ) return -1;
+
+	if( addr < SimFlashSize( s ) )
+		addr |= 0x08000000;
+	if( ( addr >= 0x08000000 && addr < 0x08000000 + SimFlashSize( s ) ) ||
+		( addr >= SIM_SYS_BASE && addr - SIM_SYS_BASE < SIM_SYS_SIZE ) )
+	{
+		if( SimStoreFlash( s, addr, size, val ) ) goto fault;
+	}
+	else if( addr >= c->ram_base && addr < c->ram_base + c->ram_size )
+		SimPutLE( s->ram + ( addr - c->ram_base ), size, val );
+	else if( addr >= SIM_DATA0_ADDR && addr < SIM_DATA0_ADDR + 8 )
+		SimPutLE( (uint8_t*)s->data + ( addr - SIM_DATA0_ADDR ), size, val );
+	else if( ( addr & 0xffffff00 ) == SIM_FLASH_BASE && size == 4 )
+		SimFlashRegWrite( s, addr & 0xff, val );
+	else if( ( addr >= 0x40000000 && addr < 0x60000000 ) || ( addr & 0xfff00000 ) == 0xe0000000 )
+		; // Other peripherals
+	else
+		goto fault;
+	return 0;
+fault:
+	if( s->trace ) fprintf( stderr, "sim: store fault at 0x%08x (CTLR = %08x)\n", addr, s->fctlr );
+	return -1;
+}
+
+static uint32_t SimFetch( struct SimState * s, uint32_t pc, int from_ram, int * ok )
+{
+	uint8_t * pb = (uint8_t*)s->progbuf;
+	*ok = 0;
+	if( from_ram )
+	{
+		const struct RiscVChip_s * c = s->sc->chip;
+		if( pc < c->ram_base || pc + 2 > c->ram_base + c->ram_size ) return 0;
+		uint32_t insn = SimGetLE( s->ram + ( pc - c->ram_base ), 2 );
+		if( ( insn & 3 ) == 3 )
+		{
+			if( pc + 4 > c->ram_base + c->ram_size ) return 0;
+			insn = SimGetLE( s->ram + ( pc - c->ram_base ), 4 );
+		}
+		*ok = 1;
+		return insn;
+	}
+	if( pc + 2 > sizeof( s->progbuf ) ) return 0;
+	uint32_t insn = SimGetLE( pb + pc, 2 );
+	if( ( insn & 3 ) == 3 )
+	{
+		if( pc + 4 > sizeof( s->progbuf ) ) return 0;
+		insn = SimGetLE( pb + pc, 4 );
+	}
+	*ok = 1;
+	return insn;
+}
+
+static int32_t SimSext( uint32_t v, int bits )
+{
+	return (int32_t)( v << ( 32 - bits ) ) >> ( 32 - bits );
+}
+
+static int SimCSR( struct SimState * s, int csr, uint32_t * old, uint32_t val, int op )
+{
+	*old = s->csr[csr & 0xfff];
+	if( op == 1 ) s->csr[csr & 0xfff] = val;
+	else if( op == 2 ) s->csr[csr & 0xfff] |= val;
+	else if( op == 3 ) s->csr[csr & 0xfff] &= ~val;
+	return 0;
+}
+
+// Runs the program buffer (or RAM) from *ppc until ebreak.  Returns 0, -1 on
+// an exception, or 1 if it's still going after max_steps.
+static int SimExec( struct SimState * s, uint32_t * ppc, int from_ram, int max_steps )
+{
+	uint32_t pc = *ppc;
+	uint32_t * x = s->x;
+	int steps;
+	int nregs = s->sc->rv32e ? 16 : 32;
+
+	for( steps = 0; steps < max_steps; steps++ )
+	{
+		int ok;
+		*ppc = pc;
+		uint32_t i = SimFetch( s, pc, from_ram, &ok );
+		// Running off the end of the program buffer is an implicit ebreak.
+		if( !ok ) return ( !from_ram && pc == sizeof( s->progbuf ) ) ? 0 : -1;
+		s->st.instructions++;
+		x[0] = 0;
+
+		if( ( i & 3 ) != 3 )
+		{
+			// Compressed
+			uint32_t npc = pc + 2;
+			int op = i & 3;
+			int f3 = ( i >> 13 ) & 7;
+			int rd = ( i >> 7 ) & 31;
+			int rs2 = ( i >> 2 ) & 31;
+			int rdp = 8 + ( ( i >> 2 ) & 7 );  // rd' / rs2'
+			int rs1p = 8 + ( ( i >> 7 ) & 7 );
+			uint32_t v;
+			if( i == 0 ) return -1;
+
+			if( op == 0 )
+			{
+				uint32_t uimm = ( ( i >> 7 ) & 0x38 ) | ( ( i >> 4 ) & 4 ) | ( ( i << 1 ) & 0x40 );
+				if( f3 == 0 ) // c.addi4spn
+					x[rdp] = x[2] + ( ( ( i >> 7 ) & 0x30 ) | ( ( i >> 1 ) & 0x3c0 ) | ( ( i >> 4 ) & 4 ) | ( ( i >> 2 ) & 8 ) );
+				else if( f3 == 2 ) // c.lw
+				{
+					if( SimLoad( s, x[rs1p] + uimm, 4, &v ) ) return -1;
+					x[rdp] = v;
+				}
+				else if( f3 == 6 ) // c.sw
+				{
+					if( SimStore( s, x[rs1p] + uimm, 4, x[rdp] ) ) return -1;
+				}
+				else return -1;
+			}
+			else if( op == 1 )
+			{
+				int32_t imm = SimSext( ( ( i >> 7 ) & 0x20 ) | ( ( i >> 2 ) & 0x1f ), 6 );
+				int32_t jimm = SimSext( ( ( i >> 1 ) & 0x800 ) | ( ( i >> 7 ) & 0x10 ) | ( ( i >> 1 ) & 0x300 ) |
+					( ( i << 2 ) & 0x400 ) | ( ( i >> 1 ) & 0x40 ) | ( ( i << 1 ) & 0x80 ) | ( ( i >> 2 ) & 0xe ) | ( ( i << 3 ) & 0x20 ), 12 );
+				int32_t bimm = SimSext( ( ( i >> 4 ) & 0x100 ) | ( ( i << 1 ) & 0xc0 ) | ( ( i << 3 ) & 0x20 ) | ( ( i >> 7 ) & 0x18 ) | ( ( i >> 2 ) & 6 ), 9 );
+				switch( f3 )
+				{
+				case 0: x[rd] += imm; break;                            // c.addi / c.nop
+				case 1: x[1] = npc; npc = pc + jimm; break;             // c.jal
+				case 2: x[rd] = imm; break;                             // c.li
+				case 3:
+					if( rd == 2 ) // c.addi16sp
+						x[2] += SimSext( ( ( i >> 3 ) & 0x200 ) | ( ( i >> 2 ) & 0x10 ) | ( ( i << 1 ) & 0x40 ) | ( ( i << 4 ) & 0x180 ) | ( ( i << 3 ) & 0x20 ), 10 );
+					else // c.lui
+						x[rd] = imm << 12;
+					break;
+				case 4:
+				{
+					int f2 = ( i >> 10 ) & 3;
+					uint32_t shamt = imm & 31;
+					if( f2 == 0 ) x[rs1p] >>= shamt;                    // c.srli
+					else if( f2 == 1 ) x[rs1p] = (int32_t)x[rs1p] >> shamt; // c.srai
+					else if( f2 == 2 ) x[rs1p] &= imm;                  // c.andi
+					else
+					{
+						int f = ( i >> 5 ) & 3;
+						if( i & 0x1000 ) return -1;
+						if( f == 0 ) x[rs1p] -= x[rdp];
+						else if( f == 1 ) x[rs1p] ^= x[rdp];
+						else if( f == 2 ) x[rs1p] |= x[rdp];
+						else x[rs1p] &= x[rdp];
+					}
+					break;
+				}
+				case 5: npc = pc + jimm; break;                         // c.j
+				case 6: if( x[rs1p] == 0 ) npc = pc + bimm; break;      // c.beqz
+				case 7: if( x[rs1p] != 0 ) npc = pc + bimm; break;      // c.bnez
+				}
+			}
+			else
+			{
+				switch( f3 )
+				{
+				case 0: x[rd] <<= rs2 | ( ( i >> 7 ) & 0x20 ); break;    // c.slli
+				case 2:                                                  // c.lwsp
+					if( SimLoad( s, x[2] + ( ( ( i >> 7 ) & 0x20 ) | ( ( i >> 2 ) & 0x1c ) | ( ( i << 4 ) & 0xc0 ) ), 4, &v ) ) return -1;
+					x[rd] = v;
+					break;
+				case 4:
+					if( !( i & 0x1000 ) )
+					{
+						if( rs2 == 0 ) npc = x[rd];                      // c.jr
+						else x[rd] = x[rs2];                             // c.mv
+					}
+					else
+					{
+						if( rd == 0 && rs2 == 0 ) return 0;              // c.ebreak
+						if( rs2 == 0 ) { uint32_t t = x[rd]; x[1] = npc; npc = t; } // c.jalr
+						else x[rd] += x[rs2];                            // c.add
+					}
+					break;
+				case 6:                                                  // c.swsp
+					if( SimStore( s, x[2] + ( ( ( i >> 7 ) & 0x3c ) | ( ( i >> 1 ) & 0xc0 ) ), 4, x[rs2] ) ) return -1;
+					break;
+				default: return -1;
+				}
+			}
+			pc = npc;
+			continue;
+		}
+
+		uint32_t npc = pc + 4;
+		int opc = i & 0x7f;
+		int rd = ( i >> 7 ) & 31;
+		int f3 = ( i >> 12 ) & 7;
+		int rs1 = ( i >> 15 ) & 31;
+		int rs2 = ( i >> 20 ) & 31;
+		int32_t iimm = (int32_t)i >> 20;
+		int32_t simm = ( (int32_t)( i & 0xfe000000 ) >> 20 ) | ( ( i >> 7 ) & 31 );
+		uint32_t v;
+
+		// RV32E: only x0-x15, in the fields this format really has.
+		int has_rd = opc != 0x23 && opc != 0x63;
+		int has_rs1 = opc != 0x37 && opc != 0x17 && opc != 0x6f && !( opc == 0x73 && ( f3 & 4 ) );
+		int has_rs2 = opc == 0x23 || opc == 0x63 || opc == 0x33;
+		if( ( has_rd && rd >= nregs ) || ( has_rs1 && rs1 >= nregs ) || ( has_rs2 && rs2 >= nregs ) ) return -1;
+
+		switch( opc )
+		{
+		case 0x37: x[rd] = i & 0xfffff000; break; // lui
+		case 0x17: x[rd] = pc + ( i & 0xfffff000 ); break; // auipc
+		case 0x6f: // jal
+			x[rd] = npc;
+			npc = pc + SimSext( ( ( i >> 11 ) & 0x100000 ) | ( i & 0xff000 ) | ( ( i >> 9 ) & 0x800 ) | ( ( i >> 20 ) & 0x7fe ), 21 );
+			break;
+		case 0x67: { uint32_t t = ( x[rs1] + iimm ) & ~1; x[rd] = npc; npc = t; break; } // jalr
+		case 0x63: // branches
+		{
+			int32_t bimm = SimSext( ( ( i >> 19 ) & 0x1000 ) | ( ( i << 4 ) & 0x800 ) | ( ( i >> 20 ) & 0x7e0 ) | ( ( i >> 7 ) & 0x1e ), 13 );
+			int take;
+			switch( f3 )
+			{
+			case 0: take = x[rs1] == x[rs2]; break;
+			case 1: take = x[rs1] != x[rs2]; break;
+			case 4: take = (int32_t)x[rs1] < (int32_t)x[rs2]; break;
+			case 5: take = (int32_t)x[rs1] >= (int32_t)x[rs2]; break;
+			case 6: take = x[rs1] < x[rs2]; break;
+			case 7: take = x[rs1] >= x[rs2]; break;
+			default: return -1;
+			}
+			if( take ) npc = pc + bimm;
+			break;
+		}
+		case 0x03: // loads
+		{
+			int size = 1 << ( f3 & 3 );
+			if( size > 4 || SimLoad( s, x[rs1] + iimm, size, &v ) ) return -1;
+			if( f3 == 0 ) v = SimSext( v, 8 );
+			else if( f3 == 1 ) v = SimSext( v, 16 );
+			x[rd] = v;
+			break;
+		}
+		case 0x23: // stores
+			if( f3 > 2 || SimStore( s, x[rs1] + simm, 1 << f3, x[rs2] ) ) return -1;
+			break;
+		case 0x13: // op-imm
+		{
+			uint32_t a = x[rs1];
+			switch( f3 )
+			{
+			case 0: x[rd] = a + iimm; break;
+			case 1: x[rd] = a << ( iimm & 31 ); break;
+			case 2: x[rd] = (int32_t)a < iimm; break;
+			case 3: x[rd] = a < (uint32_t)iimm; break;
+			case 4: x[rd] = a ^ iimm; break;
+			case 5: x[rd] = ( i & 0x40000000 ) ? (uint32_t)( (int32_t)a >> ( iimm & 31 ) ) : a >> ( iimm & 31 ); break;
+			case 6: x[rd] = a | iimm; break;
+			case 7: x[rd] = a & iimm; break;
+			}
+			break;
+		}
+		case 0x33: // op
+		{
+			uint32_t a = x[rs1], b = x[rs2];
+			if( i & 0x02000000 ) return -1; // No M extension here.
+			switch( f3 )
+			{
+			case 0: x[rd] = ( i & 0x40000000 ) ? a - b : a + b; break;
+			case 1: x[rd] = a << ( b & 31 ); break;
+			case 2: x[rd] = (int32_t)a < (int32_t)b; break;
+			case 3: x[rd] = a < b; break;
+			case 4: x[rd] = a ^ b; break;
+			case 5: x[rd] = ( i & 0x40000000 ) ? (uint32_t)( (int32_t)a >> ( b & 31 ) ) : a >> ( b & 31 ); break;
+			case 6: x[rd] = a | b; break;
+			case 7: x[rd] = a & b; break;
+			}
+			break;
+		}
+		case 0x0f: break; // fence
+		case 0x73: // system
+		{
+			if( i == 0x00100073 ) return 0; // ebreak
+			int csr = i >> 20;
+			uint32_t src = ( f3 & 4 ) ? (uint32_t)rs1 : x[rs1];
+			int op = f3 & 3;
+			if( op == 0 ) return -1;
+			if( op != 1 && rs1 == 0 ) op = 0; // Read only
+			SimCSR( s, csr, &v, src, op );
+			x[rd] = v;
+			break;
+		}
+		default:
+			return -1;
+		}
+		pc = npc;
+	}
+
+	*ppc = pc;
+	if( from_ram ) return 1;
+	fprintf( stderr, "sim: program buffer did not reach ebreak\n" );
+	return -1;
+}
+
+static int SimAccessRegister( struct SimState * s, int regno, int write )
+{
+	if( regno >= 0x1000 && regno < 0x1020 )
+	{
+		int r = regno - 0x1000;
+		if( r >= ( s->sc->rv32e ? 16 : 32 ) ) return -1;
+		if( write ) { if( r ) s->x[r] = s->data[0]; }
+		else s->data[0] = r ? s->x[r] : 0;
+		return 0;
+	}
+	if( regno < 0x1000 )
+	{
+		if( write ) s->csr[regno] = s->data[0];
+		else s->data[0] = s->csr[regno];
+		return 0;
+	}
+	return -1;
+}
+
+static void SimCommand( struct SimState * s )
+{
+	uint32_t cmd = s->command;
+	s->st.commands++;
+	if( s->cmderr ) return; // Commands are ignored until cmderr is cleared.
+	if( !s->halted ) { s->cmderr = 4; goto fail; }
+	if( ( cmd >> 24 ) != 0 ) { s->cmderr = 2; goto fail; }
+
+	if( cmd & ( 1 << 17 ) ) // transfer
+	{
+		if( ( ( cmd >> 20 ) & 7 ) != 2 ) { s->cmderr = 2; goto fail; }
+		if( SimAccessRegister( s, cmd & 0xffff, cmd & ( 1 << 16 ) ) ) { s->cmderr = 3; goto fail; }
+	}
+	if( cmd & ( 1 << 18 ) ) // postexec
+	{
+		uint32_t pc = 0;
+		if( SimExec( s, &pc, 0, SIM_MAX_STEPS ) ) { s->cmderr = 3; goto fail; }
+	}
+	return;
+fail:
+	s->st.cmd_errors++;
+}
+
+// Gives a core that was resumed into RAM us microseconds.  It stops (halts)
+// on ebreak or on a fault.
+static void SimRun( struct SimState * s, uint32_t us )
+{
+	if( !s->running ) return;
+	int r = SimExec( s, &s->pc, 1, s->core_steps ? s->core_steps : us * SIM_MHZ + 1 );
+	if( r == 1 ) return;
+	if( r < 0 ) fprintf( stderr, "sim: fault running from RAM at 0x%08x\n", s->pc );
+	s->running = 0;
+	s->halted = 1;
+	s->csr[0x7b1] = s->pc;
+}
+
+static void SimReset( struct SimState * s )
+{
+	s->running = 0;
+	memset( s->x, 0, sizeof( s->x ) );
+	memset( s->ram, 0, s->sc->chip->ram_size );
+	SimFlashReset( s );
+	s->boot_unlocked = 0;
+}
+
+static int SimWriteReg32( void * dev, uint8_t reg_7_bit, uint32_t value )
+{
+	struct SimState * s = dev;
+	s->st.writes++;
+	s->st.reg_writes[reg_7_bit & 0x7f]++;
+	if( s->trace ) fprintf( stderr, "sim: W %02x = %08x\n", reg_7_bit, value );
+
+	switch( reg_7_bit )
+	{
+	case DMDATA0:
+	case DMDATA1:
+		s->data[reg_7_bit - DMDATA0] = value;
+		if( s->abstractauto & ( 1 << ( reg_7_bit - DMDATA0 ) ) )
+		{
+			s->st.autoexecs++;
+			SimCommand( s );
+		}
+		break;
+	case DMCONTROL:
+		if( !( value & 1 ) ) break; // dmactive
+		if( value & 2 ) SimReset( s ); // ndmreset
+		if( value & 0x80000000 )
+		{
+			if( s->running ) s->csr[0x7b1] = s->pc;
+			s->halted = 1;
+			s->running = 0;
+		}
+		else if( value & 0x40000000 )
+		{
+			const struct RiscVChip_s * c = s->sc->chip;
+			uint32_t dpc = s->csr[0x7b1];
+			s->halted = 0;
+			s->resumeack = 1;
+			// Only code in RAM is run, a resume into the firmware in flash just lets it go.
+			s->running = dpc >= c->ram_base && dpc < c->ram_base + c->ram_size;
+			s->pc = dpc;
+		}
+		break;
+	case DMABSTRACTCS:
+		s->cmderr &= ~( ( value >> 8 ) & 7 );
+		break;
+	case DMCOMMAND:
+		s->command = value;
+		SimCommand( s );
+		break;
+	case DMABSTRACTAUTO:
+		s->abstractauto = value;
+		break;
+	case DMCFGR: s->cfgr = value; break;
+	case DMSHDWCFGR: s->shdwcfgr = value; break;
+	default:
+		if( reg_7_bit >= DMPROGBUF0 && reg_7_bit < DMPROGBUF0 + 8 )
+			s->progbuf[reg_7_bit - DMPROGBUF0] = value;
+		break;
+	}
+	SimRun( s, s->latency_us );
+	return 0;
+}
+
+static int SimReadReg32( void * dev, uint8_t reg_7_bit, uint32_t * value )
+{
+	struct SimState * s = dev;
+	s->st.reads++;
+	s->st.reg_reads[reg_7_bit & 0x7f]++;
+
+	switch( reg_7_bit )
+	{
+	case DMDATA0:
+	case DMDATA1:
+		*value = s->data[reg_7_bit - DMDATA0];
+		if( s->abstractauto & ( 1 << ( reg_7_bit - DMDATA0 ) ) )
+		{
+			s->st.autoexecs++;
+			SimCommand( s );
+		}
+		break;
+	case DMSTATUS:
+		*value = 0x00000082 | ( s->halted ? 0x300 : 0xc00 ) | ( s->resumeack ? 0x30000 : 0 );
+		break;
+	case DMHARTINFO: *value = 0x002120f4; break;
+	case DMABSTRACTCS: *value = ( 8 << 24 ) | ( s->cmderr << 8 ) | 2; break;
+	case DMCOMMAND: *value = s->command; break;
+	case DMABSTRACTAUTO: *value = s->abstractauto; break;
+	case DMCPBR: *value = 0; break;
+	case DMCFGR: *value = s->cfgr; break;
+	case DMSHDWCFGR: *value = s->shdwcfgr; break;
+	case 0x7f: *value = s->sc->sevenf_id; break;
+	default:
+		if( reg_7_bit >= DMPROGBUF0 && reg_7_bit < DMPROGBUF0 + 8 )
+			*value = s->progbuf[reg_7_bit - DMPROGBUF0];
+		else
+			*value = 0;
+		break;
+	}
+	if( s->trace ) fprintf( stderr, "sim: R %02x = %08x\n", reg_7_bit, *value );
+	SimRun( s, s->latency_us );
+	return 0;
+}
+
+static int SimFlushLLCommands( void * dev )
+{
+	struct SimState * s = dev;
+	s->st.flushes++;
+	return 0;
+}
+
+static int SimDelayUS( void * dev, int microseconds )
+{
+	struct SimState * s = dev;
+	s->st.delay_us += microseconds;
+	SimRun( s, microseconds );
+	return 0;
+}
+
+static void SimPrintStats( struct SimState * s, FILE * f, int kv )
+{
+	struct SimStats * st = &s->st;
+	uint64_t transactions = st->writes + st->reads;
+	uint64_t link_us = transactions * s->latency_us + st->delay_us;
+	if( kv )
+	{
+		fprintf( f, "transactions=%llu\nwrites=%llu\nreads=%llu\nflushes=%llu\n",
+			(unsigned long long)transactions, (unsigned long long)st->writes, (unsigned long long)st->reads, (unsigned long long)st->flushes );
+		fprintf( f, "link_us=%llu\ndelay_us=%llu\ncommands=%llu\nautoexecs=%llu\ninstructions=%llu\ncmd_errors=%llu\n",
+			(unsigned long long)link_us, (unsigned long long)st->delay_us, (unsigned long long)st->commands, (unsigned long long)st->autoexecs,
+			(unsigned long long)st->instructions, (unsigned long long)st->cmd_errors );
+		fprintf( f, "page_erases=%llu\nsector_erases=%llu\nmass_erases=%llu\npage_programs=%llu\nunerased_programs=%llu\nlost_buffer_words=%llu\noption_writes=%llu\n",
+			(unsigned long long)st->page_erases, (unsigned long long)st->sector_erases, (unsigned long long)st->mass_erases,
+			(unsigned long long)st->page_programs, (unsigned long long)st->unerased_programs, (unsigned long long)st->lost_buffer_words,
+			(unsigned long long)st->option_writes );
+		return;
+	}
+	fprintf( f, "sim: %llu transactions (%llu writes, %llu reads), %llu flushes, ~%.3f s of link time at %u us each\n",
+		(unsigned long long)transactions, (unsigned long long)st->writes, (unsigned long long)st->reads,
+		(unsigned long long)st->flushes, link_us / 1000000.0, s->latency_us );
+	fprintf( f, "sim: %llu abstract commands (%llu by autoexec), %llu instructions, %llu command errors\n",
+		(unsigned long long)st->commands, (unsigned long long)st->autoexecs, (unsigned long long)st->instructions,
+		(unsigned long long)st->cmd_errors );
+	fprintf( f, "sim: %llu page erases, %llu sector erases, %llu mass erases, %llu page programs\n",
+		(unsigned long long)st->page_erases, (unsigned long long)st->sector_erases, (unsigned long long)st->mass_erases,
+		(unsigned long long)st->page_programs );
+	if( st->unerased_programs || st->lost_buffer_words )
+		fprintf( f, "sim: WARNING: %llu pages programmed without erase, %llu words lost without BUF_LOAD\n",
+			(unsigned long long)st->unerased_programs, (unsigned long long)st->lost_buffer_words );
+}
+
+static int SimExit( void * dev )
+{
+	struct SimState * s = dev;
+	SimPrintStats( s, stderr, 0 );
+
+	if( s->stats_file )
+	{
+		FILE * f = fopen( s->stats_file, "w" );
+		if( f )
+		{
+			SimPrintStats( s, f, 1 );
+			fclose( f );
+		}
+		else
+			fprintf( stderr, "sim: can't write \"%s\"\n", s->stats_file );
+	}
+
+	if( s->image )
+	{
+		FILE * f = fopen( s->image, "wb" );
+		if( f )
+		{
+			fwrite( s->flash, SimFlashSize( s ), 1, f );
+			fclose( f );
+		}
+		else
+			fprintf( stderr, "sim: can't write \"%s\"\n", s->image );
+	}
+
+	free( s->flash );
+	free( s->flash_erased );
+	free( s->ram );
+	free( s );
+	return 0;
+}
+
+void * TryInit_Sim( const init_hints_t * hints )
+{
+	const char * chipname = getenv( "MINICHLINK_SIM_CHIP" );
+	const char * env;
+	if( hints && hints->serial_port ) chipname = hints->serial_port;
+	if( !chipname ) chipname = "v003";
+
+	const struct SimChip * sc = 0;
+	int i;
+	for( i = 0; i < sizeof( sim_chips ) / sizeof( sim_chips[0] ); i++ )
+		if( strcmp( sim_chips[i].name, chipname ) == 0 ) sc = &sim_chips[i];
+	if( !sc )
+	{
+		fprintf( stderr, "sim: unknown chip \"%s\", try:", chipname );
+		for( i = 0; i < sizeof( sim_chips ) / sizeof( sim_chips[0] ); i++ )
+			fprintf( stderr, " %s", sim_chips[i].name );
+		fprintf( stderr, "\n" );
+		return 0;
+	}
+
+	struct SimState * s = calloc( 1, sizeof( struct SimState ) );
+	const struct RiscVChip_s * c = sc->chip;
+	s->sc = sc;
+	s->flash = malloc( c->flash_size );
+	s->flash_erased = calloc( 1, c->flash_size / c->sector_size );
+	s->ram = calloc( 1, c->ram_size );
+
+	s->latency_us = ( env = getenv( "MINICHLINK_SIM_LATENCY_US" ) ) ? atoi( env ) : 100;
+	s->core_steps = ( env = getenv( "MINICHLINK_SIM_CORE_STEPS" ) ) ? atoi( env ) : 0;
+	s->busy_reads = ( env = getenv( "MINICHLINK_SIM_FLASH_BUSY" ) ) ? atoi( env ) : 2;
+	s->trace = getenv( "MINICHLINK_SIM_TRACE" ) != 0;
+	s->image = getenv( "MINICHLINK_SIM_FLASH" );
+	s->stats_file = getenv( "MINICHLINK_SIM_STATS" );
+
+	// Start blank, unless we have an image from last time.
+	SimFlashErase( s, 0, c->flash_size );
+	if( s->image )
+	{
+		FILE * f = fopen( s->image, "rb" );
+		if( f )
+		{
+			if( fread( s->flash, 1, c->flash_size, f ) > 0 )
+				memset( s->flash_erased, 0, c->flash_size / c->sector_size );
+			fclose( f );
+		}
+	}
+
+	// System area: ESIG, UUID and option bytes.
+	memset( s->sys, 0xff, sizeof( s->sys ) );
+	SimPutLE( s->sys + ( 0x1ffff7c4 - SIM_SYS_BASE ), 4, sc->chip_id );
+	SimPutLE( s->sys + ( 0x1ffff704 - SIM_SYS_BASE ), 4, sc->chip_id );
+	SimPutLE( s->sys + ( 0x1ffff7e0 - SIM_SYS_BASE ), 2, c->flash_size / 1024 );
+	SimPutLE( s->sys + ( 0x1ffff7e8 - SIM_SYS_BASE ), 4, 0x12345678 );
+	SimPutLE( s->sys + ( 0x1ffff7ec - SIM_SYS_BASE ), 4, 0x9abcdef0 );
+	if( c->options_size )
+		SimPutLE( s->sys + ( c->options_offset - SIM_SYS_BASE ), 2, 0x5aa5 ); // RDPR, unprotected
+
+	s->csr[0xf12] = 0xdc68d882; // marchid
+	SimFlashReset( s );
+
+	fprintf( stderr, "sim: simulating %s\n", c->name_str );
+
+	MCF.WriteReg32 = SimWriteReg32;
+	MCF.ReadReg32 = SimReadReg32;
+	MCF.FlushLLCommands = SimFlushLLCommands;
+	MCF.DelayUS = SimDelayUS;
+	MCF.Exit = SimExit;
+
+	return s;
+}
@@ -0,0 +1,360 @@
+// Talks to projects/uartboot, a serial bootloader in the CH32V003 boot area.
+//
+// Flash writes are delta updates, only pages with a different CRC are sent.
+// Page 0 (the reset vector) is erased first and written last, so a broken
+// update leaves the chip in the bootloader instead of starting half an app.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "serial_dev.h"
+#include "minichlink.h"
+#include "chips.h"
+
+void * TryInit_UARTBoot(const init_hints_t*);
+
+#define UB_SYNC_REQUEST 0x5a
+#define UB_SYNC_REPLY   0xa5
+#define UB_MAX_PAYLOAD  ( 4 + 256 )
+#define UB_TIMEOUT_MS   200
+#define UB_RETRIES      3
+
+typedef struct {
+	struct ProgrammerStructBase psb;
+	serial_dev_t serial;
+	uint8_t node;
+	uint32_t page_size;
+	uint32_t flash_base;
+	uint32_t flash_size;
+} uartboot_ctx_t;
+
+static uint32_t UBCRC32( const uint8_t * p, uint32_t len )
+{
+	uint32_t crc = 0xffffffff;
+	while( len-- )
+	{
+		int i;
+		crc ^= *p++;
+		for( i = 0; i < 8; i++ )
+			crc = ( crc >> 1 ) ^ ( 0xedb88320 & -( crc & 1 ) );
+	}
+	return ~crc;
+}
+
+static void UBPut32( uint8_t * p, uint32_t v )
+{
+	p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+
+static uint32_t UBGet32( const uint8_t * p )
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Reads until there are need bytes in rx.  Returns 0 once there are.
+static int UBFill( uartboot_ctx_t * ctx, uint8_t * rx, int * got, int need, int timeout_ms )
+{
+	if( *got >= need ) return 0;
+	int r = serial_dev_read_timeout( &ctx->serial, rx + *got, need - *got, timeout_ms );
+	if( r > 0 ) *got += r;
+	return *got < need;
+}
+
+// One request and its reply.  Returns the reply length, or negative on a timeout, bad frame or error status.
+static int UBCommandOnce( uartboot_ctx_t * ctx, uint8_t cmd, const uint8_t * payload, int len, uint8_t * reply, int replymax, int timeout_ms )
+{
+	uint8_t buf[1 + 4 + UB_MAX_PAYLOAD + 4];
+	uint8_t rx[sizeof( buf )];
+	int got = 0;
+	buf[0] = UB_SYNC_REQUEST;
+	buf[1] = ctx->node;
+	buf[2] = cmd;
+	buf[3] = len;
+	buf[4] = len >> 8;
+	memcpy( buf + 5, payload, len );
+	UBPut32( buf + 5 + len, UBCRC32( buf + 1, 4 + len ) );
+
+	serial_dev_flush_rx( &ctx->serial );
+	if( serial_dev_write( &ctx->serial, buf, 9 + len ) != 9 + len )
+		return -1;
+
+	// On a half duplex bus our own request comes back first, all 9+len bytes
+	// of it.  Its payload can hold UB_SYNC_REPLY bytes, so it's dropped whole.
+	if( UBFill( ctx, rx, &got, 1, timeout_ms ) )
+		return -2;
+	if( rx[0] == UB_SYNC_REQUEST && UBFill( ctx, rx, &got, 9 + len, timeout_ms ) == 0 && memcmp( rx, buf, 9 + len ) == 0 )
+		got = 0;
+
+	// Anything else before the reply is skipped.  A frame that doesn't check out
+	// started on a UB_SYNC_REPLY that was data (a damaged echo, noise), the
+	// search goes on from the byte after it.
+	int rlen;
+	for( ;; )
+	{
+		int skip = 0;
+		while( skip < got && rx[skip] != UB_SYNC_REPLY ) skip++;
+		got -= skip;
+		memmove( rx, rx + skip, got );
+		if( !got )
+		{
+			if( UBFill( ctx, rx, &got, 1, timeout_ms ) ) return -2;
+			continue;
+		}
+
+		int timedout = UBFill( ctx, rx, &got, 5, timeout_ms );
+		rlen = timedout ? 0 : rx[3] | rx[4] << 8;
+		if( !timedout && rlen <= UB_MAX_PAYLOAD )
+		{
+			timedout = UBFill( ctx, rx, &got, 9 + rlen, timeout_ms );
+			if( !timedout && UBGet32( rx + 5 + rlen ) == UBCRC32( rx + 1, 4 + rlen ) )
+				break;
+		}
+		if( timedout && !memchr( rx + 1, UB_SYNC_REPLY, got - 1 ) )
+			return -3;
+		got--;
+		memmove( rx, rx + 1, got );
+	}
+
+	if( rx[2] )
+	{
+		fprintf( stderr, "UARTBoot: node %02x refused command '%c' (%s)\n", rx[1], cmd, rx[2] == 1 ? "bad argument" : "flash error" );
+		return -4;
+	}
+	if( rlen > replymax ) rlen = replymax;
+	if( reply ) memcpy( reply, rx + 5, rlen );
+	return rlen;
+}
+
+static int UBCommand( uartboot_ctx_t * ctx, uint8_t cmd, const uint8_t * payload, int len, uint8_t * reply, int replymax )
+{
+	int tries, r = -1;
+	for( tries = 0; tries < UB_RETRIES; tries++ )
+	{
+		r = UBCommandOnce( ctx, cmd, payload, len, reply, replymax, UB_TIMEOUT_MS );
+		// A refused command would just be refused again.
+		if( r >= 0 || r == -4 ) break;
+	}
+	if( r < 0 && r != -4 )
+		fprintf( stderr, "UARTBoot: no answer to command '%c'\n", cmd );
+	return r;
+}
+
+static int UBCRCCommand( uartboot_ctx_t * ctx, uint32_t addr, uint32_t len, uint32_t * crc )
+{
+	uint8_t p[8], r[4];
+	UBPut32( p, addr );
+	UBPut32( p + 4, len );
+	if( UBCommand( ctx, 'c', p, 8, r, 4 ) != 4 ) return -1;
+	*crc = UBGet32( r );
+	return 0;
+}
+
+static int UBWritePage( uartboot_ctx_t * ctx, uint32_t addr, const uint8_t * data )
+{
+	uint8_t p[UB_MAX_PAYLOAD];
+	UBPut32( p, addr );
+	memcpy( p + 4, data, ctx->page_size );
+	return UBCommand( ctx, 'w', p, 4 + ctx->page_size, 0, 0 ) < 0 ? -1 : 0;
+}
+
+int UARTBootWriteReg32( void * dev, uint8_t reg_7_bit, uint32_t command ) { fprintf( stderr, "UARTBootWriteReg32\n" ); return -100; }
+int UARTBootReadReg32( void * dev, uint8_t reg_7_bit, uint32_t * commandresp ) { fprintf( stderr, "UARTBootReadReg32\n" ); return -100; }
+int UARTBootWriteWord( void * dev, uint32_t address_to_write, uint32_t data ) { fprintf( stderr, "UARTBootWriteWord\n" ); return -100; }
+int UARTBootFlushLLCommands( void * dev ) { return 0; }
+
+int UARTBootSetupInterface( void * dev )
+{
+	uartboot_ctx_t * ctx = (uartboot_ctx_t *)dev;
+	struct InternalState * iss = (struct InternalState*)(((struct ProgrammerStructBase*)dev)->internal);
+	uint8_t r[16];
+	int i;
+
+	// The bootloader only listens for a moment after reset, keep asking while the chip is reset.
+	fprintf( stderr, "UARTBoot: waiting for node %02x, reset the chip now\n", ctx->node );
+	for( i = 0; i < 100; i++ )
+		if( UBCommandOnce( ctx, 'i', 0, 0, r, sizeof( r ), 50 ) == 16 ) break;
+	if( i == 100 )
+	{
+		fprintf( stderr, "UARTBoot: no bootloader answered\n" );
+		return -1;
+	}
+
+	uint32_t version = UBGet32( r ) & 0xffff;
+	uint32_t chip_id = UBGet32( r + 12 );
+	ctx->page_size = UBGet32( r ) >> 16;
+	ctx->flash_base = UBGet32( r + 4 );
+	ctx->flash_size = UBGet32( r + 8 );
+
+	if( ( chip_id & 0xfff00f00 ) != 0x00300500 || ctx->page_size == 0 || ctx->page_size > UB_MAX_PAYLOAD - 4 )
+	{
+		fprintf( stderr, "UARTBoot: unsupported chip %08x (page size %u)\n", chip_id, ctx->page_size );
+		return -1;
+	}
+
+	iss->target_chip = &ch32v003;
+	iss->target_chip_type = CHIP_CH32V003;
+	iss->sector_size = ctx->page_size;
+	iss->flash_size = ctx->flash_size / 1024;
+	fprintf( stderr, "UARTBoot: version %u, chip %08x, %u kB flash, %u byte pages\n", version, chip_id, iss->flash_size, ctx->page_size );
+	return 0;
+}
+
+int UARTBootWriteBinaryBlob( void * dev, uint32_t address_to_write, uint32_t blob_size, const uint8_t * blob )
+{
+	uartboot_ctx_t * ctx = (uartboot_ctx_t *)dev;
+	uint32_t ps = ctx->page_size;
+	uint32_t pages = ( blob_size + ps - 1 ) / ps;
+	uint32_t i, changed = 0;
+	int ret = -1;
+
+	if( address_to_write % ps )
+	{
+		fprintf( stderr, "UARTBoot: writes must start on a %u byte page\n", ps );
+		return -1;
+	}
+	if( address_to_write < ctx->flash_base || address_to_write + pages * ps > ctx->flash_base + ctx->flash_size )
+	{
+		fprintf( stderr, "UARTBoot: %08x+%u is outside the application flash\n", address_to_write, blob_size );
+		return -1;
+	}
+
+	uint8_t * image = malloc( pages * ps );
+	uint32_t * remote = malloc( pages * 4 );
+	uint8_t * dirty = malloc( pages );
+	memset( image, 0xff, pages * ps );
+	memcpy( image, blob, blob_size );
+
+	// Ask for the CRC of every page, as many at a time as fit in a reply (a write's worth).
+	uint32_t chunk = ( 4 + ps ) / 4;
+	for( i = 0; i < pages; i += chunk )
+	{
+		uint8_t p[8], r[UB_MAX_PAYLOAD];
+		uint32_t n = ( pages - i < chunk ) ? pages - i : chunk;
+		uint32_t j;
+		UBPut32( p, address_to_write + i * ps );
+		UBPut32( p + 4, n );
+		if( UBCommand( ctx, 'h', p, 8, r, sizeof( r ) ) != (int)( n * 4 ) ) goto done;
+		for( j = 0; j < n; j++ )
+			remote[i + j] = UBGet32( r + j * 4 );
+	}
+	for( i = 0; i < pages; i++ )
+	{
+		dirty[i] = UBCRC32( image + i * ps, ps ) != remote[i];
+		changed += dirty[i];
+	}
+
+	fprintf( stderr, "UARTBoot: %u of %u pages changed\n", changed, pages );
+	if( !changed )
+	{
+		ret = 0;
+		goto done;
+	}
+
+	// With the first page of the app erased the bootloader won't start it, whatever happens from here on.
+	int has_vector = address_to_write == ctx->flash_base;
+	if( has_vector )
+	{
+		uint8_t p[4];
+		UBPut32( p, ctx->flash_base );
+		if( UBCommand( ctx, 'e', p, 4, 0, 0 ) < 0 ) goto done;
+		dirty[0] = 1;
+	}
+
+	for( i = has_vector; i < pages; i++ )
+	{
+		if( !dirty[i] ) continue;
+		if( UBWritePage( ctx, address_to_write + i * ps, image + i * ps ) ) goto done;
+		fprintf( stderr, "." );
+	}
+
+	uint32_t crc;
+	if( pages > (uint32_t)has_vector )
+	{
+		uint32_t start = has_vector * ps;
+		if( UBCRCCommand( ctx, address_to_write + start, pages * ps - start, &crc ) ) goto done;
+		if( crc != UBCRC32( image + start, pages * ps - start ) )
+		{
+			fprintf( stderr, "\nUARTBoot: image CRC mismatch\n" );
+			goto done;
+		}
+	}
+
+	if( has_vector )
+	{
+		if( UBWritePage( ctx, address_to_write, image ) ) goto done;
+		if( UBCRCCommand( ctx, address_to_write, pages * ps, &crc ) ) goto done;
+		if( crc != UBCRC32( image, pages * ps ) )
+		{
+			fprintf( stderr, "\nUARTBoot: image CRC mismatch\n" );
+			goto done;
+		}
+	}
+	fprintf( stderr, "\n" );
+	ret = 0;
+
+done:
+	free( image );
+	free( remote );
+	free( dirty );
+	return ret;
+}
+
+int UARTBootHaltMode( void * dev, int mode )
+{
+	// It's always halted in the bootloader, the only thing to do is leave it.
+	if( mode == HALT_MODE_REBOOT || mode == HALT_MODE_RESUME )
+	{
+		if( UBCommand( (uartboot_ctx_t *)dev, 'r', 0, 0, 0, 0 ) < 0 ) return -1;
+		printf( "Rebooting...\n" );
+	}
+	return 0;
+}
+
+int UARTBootExit( void * dev )
+{
+	serial_dev_close( &((uartboot_ctx_t*)dev)->serial );
+	free( dev );
+	return 0;
+}
+
+void * TryInit_UARTBoot( const init_hints_t* hints )
+{
+	uartboot_ctx_t * ctx;
+	const char * serial_to_open = NULL;
+	const char * env;
+	unsigned baud = 1000000;
+
+	if( !( ctx = calloc( sizeof( uartboot_ctx_t ), 1 ) ) )
+	{
+		perror( "calloc" );
+		return NULL;
+	}
+
+	// Same as Ardulink: the -c hint, then MINICHLINK_SERIAL, then the default.
+	if( hints && hints->serial_port != NULL )
+		serial_to_open = hints->serial_port;
+	else if( ( serial_to_open = getenv( "MINICHLINK_SERIAL" ) ) == NULL )
+		serial_to_open = DEFAULT_SERIAL_NAME;
+
+	if( ( env = getenv( "MINICHLINK_BAUD" ) ) ) baud = strtoul( env, 0, 0 );
+	ctx->node = ( env = getenv( "MINICHLINK_NODE" ) ) ? strtoul( env, 0, 0 ) : 0xff;
+
+	if( serial_dev_create( &ctx->serial, serial_to_open, baud ) == -1 || serial_dev_open( &ctx->serial ) == -1 )
+	{
+		perror( "open" );
+		free( ctx );
+		return NULL;
+	}
+
+	MCF.WriteReg32 = UARTBootWriteReg32;
+	MCF.ReadReg32 = UARTBootReadReg32;
+	MCF.WriteWord = UARTBootWriteWord;
+	MCF.FlushLLCommands = UARTBootFlushLLCommands;
+	MCF.SetupInterface = UARTBootSetupInterface;
+	MCF.WriteBinaryBlob = UARTBootWriteBinaryBlob;
+	MCF.HaltMode = UARTBootHaltMode;
+	MCF.Exit = UARTBootExit;
+
+	return ctx;
+}
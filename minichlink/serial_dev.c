@@ -131,6 +131,42 @@ int serial_dev_read(serial_dev_t *dev, void* data, size_t len) {
 #endif
 }
 
+int serial_dev_read_timeout(serial_dev_t *dev, void* data, size_t len, int timeout_ms) {
+#ifdef IS_WINDOWS
+	DWORD dwBytesRead = 0;
+	COMMTIMEOUTS timeouts, old;
+	if (!GetCommTimeouts(dev->handle, &old)) {
+		return -1;
+	}
+	timeouts = old;
+	timeouts.ReadIntervalTimeout = timeout_ms;
+	timeouts.ReadTotalTimeoutConstant = timeout_ms;
+	timeouts.ReadTotalTimeoutMultiplier = 0;
+	if (!SetCommTimeouts(dev->handle, &timeouts)) {
+		return -1;
+	}
+	BOOL ok = ReadFile(dev->handle, data, len, &dwBytesRead, NULL);
+	SetCommTimeouts(dev->handle, &old);
+	return ok ? (int) dwBytesRead : -1;
+#else
+	int got, count = 0;
+	struct pollfd pfd = { .fd = dev->fd, .events = POLLIN };
+
+	while (count < len) {
+		got = poll(&pfd, 1, timeout_ms);
+		if (got < 0)
+			return got;
+		if (got == 0)
+			break;
+		got = read(dev->fd, (char *)data + count, len - count);
+		if (got < 0)
+			return got;
+		count += got;
+	}
+	return count;
+#endif
+}
+
 int serial_dev_do_dtr_reset(serial_dev_t *dev) {
 #ifdef IS_WINDOWS
 	// EscapeCommFunction returns 0 on fail
@@ -13,6 +13,7 @@
 #include <termios.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <poll.h>
 #define IS_POSIX
 #define DEFAULT_SERIAL_NAME "/dev/ttyACM0"
 #endif
@@ -38,6 +39,8 @@ int serial_dev_open(serial_dev_t *dev);
 int serial_dev_write(serial_dev_t *dev, const void* data, size_t len);
 /* returns -1 on read error */
 int serial_dev_read(serial_dev_t *dev, void* data, size_t len);
+/* returns the bytes read, fewer than len if nothing came for timeout_ms, -1 on read error */
+int serial_dev_read_timeout(serial_dev_t *dev, void* data, size_t len, int timeout_ms);
 /* returns -1 on reset error */
 int serial_dev_do_dtr_reset(serial_dev_t *dev);
 /* returns -1 on flush error */
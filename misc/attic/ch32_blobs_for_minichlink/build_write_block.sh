@@ -0,0 +1,5 @@
+#!/bin/bash
+rm -f ch32_write_block.o ch32_write_block.bin
+riscv64-unknown-elf-as ch32_write_block.asm -march=rv32ec -mabi=ilp32e -o ch32_write_block.o
+riscv64-unknown-elf-objcopy -O binary ch32_write_block.o ch32_write_block.bin
+xxd -i ch32_write_block.bin > ch32_write_block.h
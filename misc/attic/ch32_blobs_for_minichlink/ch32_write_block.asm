@@ -0,0 +1,193 @@
+#
+# A procedure to write data to flash on the CH32V/X families (everything with
+# the FTPG/FTER fast page controller at 0x40022000).  Only uses x0-x15 so it
+# also runs on the RV32EC parts.
+# This should be compiled into a binary blob and placed into RAM.  Then the
+# programmer sets the registers below, resumes the core at the start of the
+# blob and streams the data words into DMDATA0.
+#
+# Protocol:
+#  * DMDATA0 != 0: a word of input.  The blob clears DMDATA0 when it has taken it.
+#  * DMDATA1 == 1: a word of 0 (which can't be sent through DMDATA0).
+#    The blob clears DMDATA1 when it has taken it, and the programmer waits
+#    for that before it sends anything else.  A word in DMDATA0 at the same
+#    time was sent before the 0, so it is taken first.
+#  * Nothing else is acknowledged word by word.  A word written to DMDATA0
+#    before the blob took the one before is lost.  The blob then waits for
+#    the rest of the page forever and never asks for the next one, so the
+#    programmer sees it (times out) and writes the pages the slow way.  A
+#    slow link or a fast core only makes this faster, it never makes it wrong.
+#  * Before every page the blob erases it (if a5 != 0) and then writes 2, 4,
+#    6... into DMDATA1.  The programmer waits for that before sending the
+#    page, it's the only time it has to read anything.
+#  * A page is a header word and the words it says:
+#      bit 31 set: the page as it is, the low bits are the number of words.
+#      bit 31 clear: that many words of compressed data (below).
+#    The blob takes them all into RAM first, so it never has to keep up
+#    with the programmer while decoding, that happens while it waits.
+#  * After the last page it writes the next number and spins, the programmer
+#    halts the core.
+#
+# Compressed data is a series of tokens, decoded until the page is full:
+#  0x00-0x7f  T+1 literal bytes follow.
+#  0x80-0xff  Copy (T&0x7f)+3 bytes from the offset in the next 2 bytes
+#             (little endian) back in the output.  That can be in pages
+#             written before (read back from flash), and can overlap the
+#             bytes being written, so a run of 0xff is a literal and a copy
+#             from 1 back.
+#
+# Page buffer (page size) and input buffer (page size) are in RAM after the blob.
+#
+#a0 = address of the page being written (page aligned)
+#a1 = address of DMDATA0 (DMDATA1 is at +4)
+#a2 = flash controller base, 0x40022000
+#a3 = page size
+#a4 = words per BUF_LOAD (1 on V003/X035/L103, 4 on V10x), 0 on V20x/V30x where words go straight into the page buffer
+#a5 = erase every page before programming it
+#sp = end address
+#s0 = page counter, what goes in DMDATA1
+#s1 = incoming word / general reg
+#t0 = general reg / page header
+#t1 = input pointer
+#t2 = output pointer / words until next BUF_LOAD
+#tp = words left / end of output / flash pointer
+#gp = byte count / STATR bits to wait on (1 = BSY, 2 = WRBSY)
+#ra = return address / start of page buffer
+	.option norelax
+	c.li s0,0
+PAGE:
+	c.li gp,1
+	c.beqz a5,READY
+	lui t0,0x20
+	sw t0,0x10(a2)
+	sw a0,0x14(a2)
+	addi t0,t0,0x40
+	sw t0,0x10(a2)
+READY:
+	jal WAIT
+	c.addi s0,2
+	c.sw s0,4(a1)
+	lla t2,BUFFERS
+	add t1,t2,a3
+	jal RECV
+	c.mv t0,s1
+	slli tp,s1,1
+	srli tp,tp,1
+	bgez t0,RECV_LOOP
+	c.mv t1,t2
+RECV_LOOP:
+	jal RECV
+	sw s1,0(t1)
+	addi t1,t1,4
+	addi tp,tp,-1
+	bnez tp,RECV_LOOP
+	bltz t0,PROGRAM
+DECODE:
+	add t1,t2,a3
+	add tp,t2,a3
+TOKEN:
+	bgeu t2,tp,PROGRAM
+	lbu t0,0(t1)
+	addi t1,t1,1
+	andi gp,t0,0x7f
+	andi t0,t0,0x80
+	bnez t0,COPY
+	addi gp,gp,1
+LITERAL:
+	lbu t0,0(t1)
+	addi t1,t1,1
+	sb t0,0(t2)
+	addi t2,t2,1
+	addi gp,gp,-1
+	bnez gp,LITERAL
+	c.j TOKEN
+COPY:
+	addi gp,gp,3
+	lbu t0,0(t1)
+	lbu s1,1(t1)
+	addi t1,t1,2
+	c.slli s1,8
+	or t0,t0,s1
+	sub s1,t2,t0
+	sub ra,tp,a3
+COPY_LOOP:
+	c.mv t0,s1
+	bgeu s1,ra,COPY_BYTE
+	sub t0,s1,ra
+	c.add t0,a0
+COPY_BYTE:
+	lbu t0,0(t0)
+	sb t0,0(t2)
+	addi t2,t2,1
+	c.addi s1,1
+	addi gp,gp,-1
+	bnez gp,COPY_LOOP
+	c.j TOKEN
+PROGRAM:
+	c.li gp,1
+	lui t0,0x10
+	sw t0,0x10(a2)
+	c.beqz a4,PROGRAM_WORDS
+	lui t0,0x90
+	sw t0,0x10(a2)
+	jal WAIT
+PROGRAM_WORDS:
+	lla t1,BUFFERS
+	c.mv tp,a0
+	c.mv t2,a4
+STORE:
+	lw s1,0(t1)
+	sw s1,0(tp)
+	addi t1,t1,4
+	addi tp,tp,4
+	c.bnez a4,BUF_LOAD
+	c.li gp,2
+	jal WAIT
+	c.li gp,1
+	c.j NEXT
+BUF_LOAD:
+	addi t2,t2,-1
+	bnez t2,NEXT
+	c.mv t2,a4
+	lui t0,0x50
+	sw t0,0x10(a2)
+	jal WAIT
+NEXT:
+	sub t0,tp,a0
+	bne t0,a3,STORE
+	c.bnez a4,PAGE_START
+	lui t0,0x210
+	c.j GO
+PAGE_START:
+	sw a0,0x14(a2)
+	lui t0,0x10
+	addi t0,t0,0x40
+GO:
+	sw t0,0x10(a2)
+	jal WAIT
+	c.mv a0,tp
+	bne a0,sp,PAGE
+	c.addi s0,2
+	c.sw s0,4(a1)
+DONE:
+	c.j DONE
+RECV:
+	c.lw s1,0(a1)
+	c.bnez s1,RECV_GOT
+	c.lw s1,4(a1)
+	c.addi s1,-1
+	c.bnez s1,RECV
+	c.lw s1,0(a1)
+	c.bnez s1,RECV_GOT
+	sw zero,4(a1)
+	ret
+RECV_GOT:
+	sw zero,0(a1)
+	ret
+WAIT:
+	lw t0,0x0c(a2)
+	and t0,t0,gp
+	bnez t0,WAIT
+	ret
+	.balign 4
+BUFFERS:
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+# Picks the functions that take the most time in a profile and moves them
+# to RAM (ITCM on the H41x), for "make fastplace".
+#
+# The profile is a text file, either a flat profile with "samples name" on
+# each line (what minichlink -O writes to <target>.prof), or one sampled PC
+# per line ("0x00000a1c"), which are looked up in the ELF.  Lines starting
+# with # are skipped.
+#
+# Functions are taken hottest first, as long as they fit in --budget bytes.
+# The output is a list of input sections that ch32fun.ld includes in the
+# RAM code section (.highcode, .itcm on the H41x), which comes before .text
+# and so wins over its *(.text.*).  That needs -ffunction-sections, which
+# ch32fun.mk has.  With the list there, ch32fun.mk also turns on FUNFAST=1,
+# so the startup code copies .highcode.  LTO and IPA clones (foo.lto_priv.0, foo.constprop.0) are
+# matched by their base name, main in .text.startup.main too.
+#
+# usage: fastplace.py [--prefix riscv64-elf] [--budget 1024] firmware.elf profile -o firmware.fast.ld
+
+import argparse
+import re
+import subprocess
+import sys
+
+NM_RE = re.compile( r'^([0-9a-f]+) ([0-9a-f]+) ([tTwW]) (\S+)$' )
+
+# Startup code runs before RAM is filled in.
+NEVER = { 'handle_reset', 'InterruptVector', 'SystemInit', 'start_v5f' }
+
+def base_name( name ):
+	return name.split( '.' )[0]
+
+def load_functions( prefix, elf ):
+	out = subprocess.run( [ prefix + '-nm', '-S', '--defined-only', elf ], check=True, capture_output=True, text=True ).stdout
+	funcs = []
+	for line in out.splitlines():
+		m = NM_RE.match( line )
+		if m:
+			funcs.append( ( int( m.group( 1 ), 16 ), int( m.group( 2 ), 16 ), m.group( 4 ) ) )
+	funcs.sort()
+	return funcs
+
+def lookup( funcs, addr ):
+	lo, hi = 0, len( funcs )
+	while lo < hi:
+		mid = ( lo + hi ) // 2
+		if funcs[mid][0] <= addr:
+			lo = mid + 1
+		else:
+			hi = mid
+	if lo and addr < funcs[lo - 1][0] + funcs[lo - 1][1]:
+		return funcs[lo - 1][2]
+	return None
+
+def load_profile( fn, funcs ):
+	samples = {}
+	with open( fn ) as f:
+		for line in f:
+			p = line.split()
+			if not p or p[0].startswith( '#' ):
+				continue
+			if len( p ) == 1:
+				name = lookup( funcs, int( p[0], 16 ) )
+				n = 1
+			else:
+				n = int( p[0] )
+				name = p[1]
+			if name:
+				samples[name] = samples.get( name, 0 ) + n
+	return samples
+
+def main():
+	ap = argparse.ArgumentParser( description='Move the hottest functions of a profile to RAM' )
+	ap.add_argument( '--prefix', default='riscv64-elf' )
+	ap.add_argument( '--budget', type=int, default=1024, help='bytes of RAM to use' )
+	ap.add_argument( '-o', '--output', required=True )
+	ap.add_argument( 'elf' )
+	ap.add_argument( 'profile' )
+	args = ap.parse_args()
+
+	funcs = load_functions( args.prefix, args.elf )
+	sizes = {}
+	for addr, size, name in funcs:
+		sizes[base_name( name )] = sizes.get( base_name( name ), 0 ) + size
+
+	samples = {}
+	for name, n in load_profile( args.profile, funcs ).items():
+		samples[base_name( name )] = samples.get( base_name( name ), 0 ) + n
+	total = sum( samples.values() )
+	if not total:
+		print( 'No samples in ' + args.profile, file=sys.stderr )
+		return 1
+
+	chosen = []
+	used = 0
+	got = 0
+	for name, n in sorted( samples.items(), key=lambda s: -s[1] ):
+		size = sizes.get( name )
+		if size is None or name in NEVER:
+			continue
+		# Functions take 4 byte alignment in RAM.
+		size = ( size + 3 ) & ~3
+		if used + size > args.budget:
+			continue
+		chosen.append( ( name, n, size ) )
+		used += size
+		got += n
+
+	print( '  %-32s %7s %6s' % ( 'Function', 'Samples', 'Bytes' ) )
+	for name, n, size in chosen:
+		print( '  %-32s %6.1f%% %6d' % ( name, 100.0 * n / total, size ) )
+	print( '%d functions, %d of %d bytes, %.1f%% of the samples' % ( len( chosen ), used, args.budget, 100.0 * got / total ) )
+
+	with open( args.output, 'w' ) as f:
+		f.write( '/* From %s by fastplace.py, %d bytes, %.1f%% of the samples */\n' % ( args.profile, used, 100.0 * got / total ) )
+		for name, n, size in chosen:
+			f.write( '*(.text.%s .text.%s.* .text.*.%s)\n' % ( name, name, name ) )
+	return 0
+
+if __name__ == '__main__':
+	sys.exit( main() )
@@ -0,0 +1,205 @@
+#!/usr/bin/env python3
+# Worst case stack depth per entry point, for "make stackreport".
+#
+# Frame sizes come from the .su files gcc writes with -fstack-usage, or from
+# the "addi sp,sp,-N" in the prologue for functions that have none (libgcc,
+# asm).  The call graph comes from the disassembly: jal/call are calls, a
+# j/tail to the start of another function is a tail call (the caller's frame
+# is already gone).  Indirect calls (jalr through a pointer) can't be
+# followed and are flagged with "?", recursion with "+".
+#
+# Entry points are main and every *_Handler / *_IRQHandler.  Interrupts
+# land on top of whatever stack is in use, so the total is main plus the
+# deepest --nest handlers (1 unless interrupt nesting is on, as it is with
+# FUNCONF_ENABLE_HPE).  With HPE the registers of the first levels are saved
+# to the hardware stack, otherwise gcc saves them in the handler's frame, so
+# both cases are covered by the frame sizes.
+#
+# usage: stackreport.py [--prefix riscv64-elf] [--nest 1] firmware.elf [dir with .su files]
+
+import argparse
+import glob
+import os
+import re
+import subprocess
+import sys
+
+FUNC_RE = re.compile( r'^([0-9a-f]+) <([^>]+)>:$' )
+INSN_RE = re.compile( r'^\s*([0-9a-f]+):\s+(\S+)\s*(.*)$' )
+TARGET_RE = re.compile( r'\b([0-9a-f]+) <([^>+]+)(\+0x[0-9a-f]+)?>' )
+SP_ADJ_RE = re.compile( r'^sp,sp,(-?\d+)$' )
+
+def run( cmd ):
+	return subprocess.run( cmd, check=True, capture_output=True, text=True ).stdout
+
+def base_name( name ):
+	# LTO and IPA clones: foo.lto_priv.0, foo.constprop.0, foo.isra.0, foo.part.0
+	return name.split( '.' )[0]
+
+def load_su( path ):
+	frames = {}
+	dynamic = set()
+	if not path:
+		return frames, dynamic
+	for fn in glob.glob( os.path.join( path, '**', '*.su' ), recursive=True ):
+		with open( fn ) as f:
+			for line in f:
+				parts = line.rstrip( '\n' ).split( '\t' )
+				if len( parts ) < 3:
+					continue
+				name = parts[0].rsplit( ':', 1 )[-1]
+				size = int( parts[1] )
+				frames[name] = max( frames.get( name, 0 ), size )
+				if 'dynamic' in parts[2] and 'bounded' not in parts[2]:
+					dynamic.add( name )
+	return frames, dynamic
+
+def parse_disassembly( text ):
+	funcs = {}  # name -> dict( addr, frame, calls, tails, indirect )
+	cur = None
+	in_prologue = False
+	for line in text.splitlines():
+		m = FUNC_RE.match( line )
+		if m:
+			cur = { 'addr': int( m.group( 1 ), 16 ), 'frame': 0, 'calls': set(), 'tails': set(), 'indirect': False }
+			funcs[m.group( 2 )] = cur
+			in_prologue = True
+			continue
+		if cur is None:
+			continue
+		m = INSN_RE.match( line )
+		if not m:
+			continue
+		op = m.group( 2 ).replace( 'c.', '' )
+		args, _, comment = m.group( 3 ).partition( '#' )
+		args = args.strip()
+
+		if in_prologue:
+			a = SP_ADJ_RE.match( args.replace( ' ', '' ) ) if op in ( 'addi', 'addi16sp' ) else None
+			if a and int( a.group( 1 ) ) < 0:
+				cur['frame'] += -int( a.group( 1 ) )
+			elif op in ( 'sw', 'swsp', 'fsw', 'sd', 'mv', 'li', 'lui', 'addi' ):
+				pass
+			else:
+				in_prologue = False
+
+		t = TARGET_RE.search( args )
+		if op in ( 'jal', 'call' ):
+			if t:
+				# "jal zero,..." is a plain jump
+				if args.startswith( 'zero,' ) or args.startswith( 'x0,' ):
+					if not t.group( 3 ):
+						cur['tails'].add( t.group( 2 ) )
+				else:
+					cur['calls'].add( t.group( 2 ) )
+		elif op in ( 'j', 'tail' ):
+			if t and not t.group( 3 ):
+				cur['tails'].add( t.group( 2 ) )
+		elif op == 'jalr' and not args.startswith( 'zero' ):
+			# auipc+jalr is a far call, objdump puts the target in the comment.
+			t = TARGET_RE.search( comment )
+			if t:
+				cur['calls'].add( t.group( 2 ) )
+			else:
+				cur['indirect'] = True
+
+	# A jump to the start of yourself is a loop, not a call.
+	for name, f in funcs.items():
+		f['tails'].discard( name )
+		f['calls'] = { c for c in f['calls'] if c in funcs }
+		f['tails'] = { c for c in f['tails'] if c in funcs }
+	return funcs
+
+def main():
+	ap = argparse.ArgumentParser( description='Worst case stack depth per entry point' )
+	ap.add_argument( '--prefix', default='riscv64-elf' )
+	ap.add_argument( '--nest', type=int, default=1, help='interrupt levels that can be on the stack at once' )
+	ap.add_argument( 'elf' )
+	ap.add_argument( 'sudir', nargs='?' )
+	args = ap.parse_args()
+
+	funcs = parse_disassembly( run( [ args.prefix + '-objdump', '-d', '--no-show-raw-insn', args.elf ] ) )
+	su, dynamic = load_su( args.sudir )
+
+	from_su = 0
+	for name, f in funcs.items():
+		s = su.get( name, su.get( base_name( name ) ) )
+		if s is not None:
+			f['frame'] = s
+			from_su += 1
+
+	syms = {}
+	for line in run( [ args.prefix + '-nm', args.elf ] ).splitlines():
+		p = line.split()
+		if len( p ) == 3:
+			syms[p[2]] = int( p[0], 16 )
+
+	memo = {}
+	def worst( name, stack ):
+		# Returns ( depth, path, flags )
+		if name in stack:
+			return 0, [ name ], '+'
+		if name in memo:
+			return memo[name]
+		f = funcs[name]
+		stack.add( name )
+		# Anything unbounded anywhere below makes the number a lower bound, so flags add up over all callees.
+		flags = set()
+		best_call = ( 0, [], '' )
+		for c in f['calls']:
+			r = worst( c, stack )
+			flags.update( r[2] )
+			if r[0] > best_call[0] or not best_call[1]:
+				best_call = r
+		best_tail = ( 0, [], '' )
+		for c in f['tails']:
+			r = worst( c, stack )
+			flags.update( r[2] )
+			if r[0] > best_tail[0] or not best_tail[1]:
+				best_tail = r
+		stack.discard( name )
+
+		if f['indirect']:
+			flags.add( '?' )
+		if name in dynamic or base_name( name ) in dynamic:
+			flags.add( 'd' )
+		flags = ''.join( sorted( flags ) )
+		depth = f['frame'] + best_call[0]
+		path = [ name ] + best_call[1]
+		if best_tail[0] > depth:
+			depth = best_tail[0]
+			path = [ name + '~' ] + best_tail[1]
+		memo[name] = ( depth, path, flags )
+		return memo[name]
+
+	entries = [ n for n in funcs if n == 'main' or n.endswith( '_Handler' ) or n.endswith( 'IRQHandler' ) ]
+	if 'main' not in funcs:
+		print( 'No main in ' + args.elf, file=sys.stderr )
+		return 1
+
+	results = sorted( ( ( worst( n, set() ), n ) for n in entries ), key=lambda r: ( r[1] != 'main', -r[0][0] ) )
+
+	print( 'Stack report for %s, %d frames from .su files, %d from prologues' % ( args.elf, from_su, len( funcs ) - from_su ) )
+	print()
+	print( '  %-28s %6s  %s' % ( 'Entry point', 'Bytes', 'Deepest path' ) )
+	for ( depth, path, flags ), name in results:
+		print( '  %-28s %5d%-3s %s' % ( name, depth, flags, ' > '.join( path ) ) )
+	print()
+	print( '  ? indirect call not followed, + recursion not counted, d dynamic (alloca/VLA) frame, ~ tail call' )
+	print()
+
+	main_depth = memo['main'][0]
+	isrs = sorted( ( r[0][0] for r in results if r[1] != 'main' ), reverse=True )[:args.nest]
+	total = main_depth + sum( isrs )
+	print( 'Worst case: main %d + %d interrupt level(s) %d = %d bytes' % ( main_depth, args.nest, sum( isrs ), total ) )
+
+	top = syms.get( '_eusrstack', syms.get( '_v3f_stack' ) )
+	bottom = syms.get( 'end', syms.get( '_end' ) )
+	if top is not None and bottom is not None:
+		free = top - bottom
+		print( 'Stack space (end of RAM - end of .bss): %d bytes, %s' % ( free, 'OK' if total <= free else 'OVERFLOW by %d bytes' % ( total - free ) ) )
+		return 0 if total <= free else 2
+	return 0
+
+if __name__ == '__main__':
+	sys.exit( main() )
@@ -0,0 +1,125 @@
+// Host stress test for extralibs/lib_spsc.h: a producer and a consumer
+// thread push a known sequence through small rings as fast as they can, and
+// the consumer checks every byte and record.  A missing fence shows up as a
+// stale byte (on weakly ordered hosts, e.g. ARM) or a torn record.
+//
+// make -C misc/tests host
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include "lib_spsc.h"
+
+#define BYTES   ( 1 << 24 )
+#define RECORDS ( 1 << 22 )
+
+struct rec
+{
+	uint32_t seq;
+	uint32_t check;
+	uint8_t fill[24];
+};
+
+static spsc_bytes rb;
+static uint8_t rb_buf[64];
+static spsc_records rr;
+static struct rec rr_buf[8];
+static int mode; // 0: put/get, 1: write/read spans, 2: records
+
+static uint8_t expect( uint32_t i )
+{
+	return ( i * 2654435761u ) >> 24;
+}
+
+static void * producer( void * arg )
+{
+	uint32_t i = 0, n;
+	uint8_t chunk[37];
+	(void)arg;
+	while( i < ( mode == 2 ? RECORDS : BYTES ) )
+	{
+		if( mode == 0 )
+		{
+			if( spsc_put( &rb, expect( i ) ) == 0 ) i++;
+			else sched_yield();
+		}
+		else if( mode == 1 )
+		{
+			// Odd sized writes, so they wrap at every position.  What
+			// doesn't fit goes in the next one.
+			uint32_t len = 1 + i % sizeof( chunk );
+			if( len > BYTES - i ) len = BYTES - i;
+			for( n = 0; n < len; n++ ) chunk[n] = expect( i + n );
+			n = spsc_write( &rb, chunk, len );
+			if( !n ) sched_yield();
+			i += n;
+		}
+		else
+		{
+			struct rec * r = spsc_rec_alloc( &rr );
+			if( !r ) { sched_yield(); continue; }
+			r->seq = i;
+			for( n = 0; n < sizeof( r->fill ); n++ ) r->fill[n] = expect( i + n );
+			r->check = ~i;
+			spsc_rec_commit( &rr );
+			i++;
+		}
+	}
+	return 0;
+}
+
+static int consume( void )
+{
+	uint32_t i = 0, n;
+	uint8_t c, chunk[29];
+	while( i < ( mode == 2 ? RECORDS : BYTES ) )
+	{
+		if( mode == 0 )
+		{
+			if( spsc_get( &rb, &c ) ) { sched_yield(); continue; }
+			if( c != expect( i ) ) goto bad;
+			i++;
+		}
+		else if( mode == 1 )
+		{
+			uint32_t got = spsc_read( &rb, chunk, sizeof( chunk ) );
+			if( !got ) sched_yield();
+			for( n = 0; n < got; n++, i++ )
+				if( chunk[n] != expect( i ) ) goto bad;
+		}
+		else
+		{
+			struct rec * r = spsc_rec_peek( &rr );
+			if( !r ) { sched_yield(); continue; }
+			if( r->seq != i || r->check != ~i ) goto bad;
+			for( n = 0; n < sizeof( r->fill ); n++ )
+				if( r->fill[n] != expect( i + n ) ) goto bad;
+			spsc_rec_release( &rr );
+			i++;
+		}
+	}
+	return 0;
+bad:
+	printf( "FAIL mode %d at %u\n", mode, i );
+	return 1;
+}
+
+int main()
+{
+	static const char * names[] = { "put/get", "write/read", "records" };
+	int fail = 0;
+	for( mode = 0; mode < 3; mode++ )
+	{
+		pthread_t t;
+		spsc_init( &rb, rb_buf, sizeof( rb_buf ) );
+		spsc_rec_init( &rr, rr_buf, sizeof( rr_buf[0] ), 8 );
+		pthread_create( &t, 0, producer, 0 );
+		int r = consume();
+		if( r ) exit( 1 ); // The producer may be stuck on a full ring.
+		pthread_join( t, 0 );
+		printf( "ok   spsc %s\n", names[mode] );
+		fail |= r;
+	}
+	return fail;
+}
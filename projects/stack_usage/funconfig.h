@@ -3,6 +3,7 @@
 
 // Place configuration items here, you can see a full list in ch32fun/ch32fun.h
 // To reconfigure to a different processor, update TARGET_MCU in the  Makefile
+#define FUNCONF_STACK_WATERMARK   1 // SystemInit() fills the free stack with FUN_STACK_CANARY
 #if defined(CH570_CH572)
 #define FUNCONF_USE_HSI           0 // CH5xx does not have HSI
 #define FUNCONF_USE_HSE           1
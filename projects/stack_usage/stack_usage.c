@@ -4,8 +4,6 @@
 #define RANDOM_STRENGTH 2
 #include "lib_rand.h"
 
-#define CANARY 0xF0CACC1A
-
 // stack start and end defined in the linker script
 extern uint32_t _eusrstack;
 extern uint32_t end;
@@ -47,31 +45,6 @@ void print_stacktrace()
 	}
 }
 
-void fill_canary( uint32_t canary )
-{
-	uint32_t *p = get_stack_pointer();
-	printf( "Filling canary from 0x%lx to 0x%lx\n", (uint32_t)p, (uint32_t)&end );
-
-	while ( --p > &end )
-	{
-		*p = canary;
-	}
-}
-
-void *get_stack_watermark( uint32_t canary )
-{
-	const uint32_t *const top = get_stack_pointer();
-	uint32_t *p = &end;
-	while ( ++p < top )
-	{
-		if ( *p != canary )
-		{
-			break;
-		}
-	}
-	return p;
-}
-
 void test_function( int depth )
 {
 	if ( ( rand() & 0xf ) != 0 )
@@ -98,15 +71,12 @@ int main()
 	printf( "Stack Start: 0x%lx\n", (uint32_t)&_eusrstack );
 	printf( "Stack End:   0x%lx\n", (uint32_t)&end );
 
-	fill_canary( CANARY );
-
+	// SystemInit() already filled the free stack with FUN_STACK_CANARY (FUNCONF_STACK_WATERMARK).
 	printf( "Hello, Stack Usage!\n" );
-
-	const void *const used_stack = get_stack_watermark( CANARY );
-	const size_t used_bytes = (size_t)initial_sp - (size_t)used_stack;
-	printf( "Used Stack: %u bytes\n", (unsigned int)used_bytes );
+	printf( "Used Stack: %lu bytes\n", funStackUsed() );
 
 	test_function( 0 );
+	printf( "Used Stack after the trace: %lu bytes\n", funStackUsed() );
 
 	while ( 1 )
 		;
@@ -0,0 +1,14 @@
+#ifndef _FUNCONFIG_H
+#define _FUNCONFIG_H
+
+// Place configuration items here, you can see a full list in ch32fun/ch32fun.h
+// To reconfigure to a different processor, update TARGET_MCU in the  Makefile
+
+#define FUNCONF_USE_DEBUGPRINTF 0
+
+// #define UARTBOOT_BAUD 2000000
+// #define UARTBOOT_WINDOW_MS 100
+// #define UARTBOOT_DE_PIN PC3
+
+#endif
+
@@ -0,0 +1,244 @@
+// Serial bootloader for the CH32V003 boot area (0x1FFFF000, 1920 bytes).
+//
+// Listens on USART1 (TX PD5, RX PD6) for UARTBOOT_WINDOW_MS after reset,
+// and starts the application if nothing addressed to it comes in.  With no
+// application (the first word of flash erased) it stays here.  The UART is
+// received by DMA into a ring, so nothing is lost while the flash stalls the
+// core.  The protocol is in README.md, minichlink talks it with -C uartboot.
+
+#include "ch32fun.h"
+#include "lib_flash.h"
+
+#ifndef UARTBOOT_BAUD
+#define UARTBOOT_BAUD 1000000
+#endif
+
+#ifndef UARTBOOT_WINDOW_MS
+#define UARTBOOT_WINDOW_MS 100
+#endif
+
+#define APP_BASE 0x08000000
+#define RX_SIZE 512 // Power of 2
+#define BYTE_TIMEOUT ( DELAY_MS_TIME * 2 )
+#define MAX_PAYLOAD ( 4 + FLASH_PAGE_SIZE )
+
+#define SYNC_REQUEST 0x5a
+#define SYNC_REPLY   0xa5
+
+enum
+{
+	ST_OK,
+	ST_BAD_ARG,
+	ST_FLASH,
+};
+
+static uint8_t rxbuf[RX_SIZE];
+static uint32_t rxtail;
+
+// Header (address, command/status, length), payload, CRC.  Word aligned
+// from the payload on, so pages can go straight to the flash.
+static uint32_t frame[( 4 + MAX_PAYLOAD + 4 ) / 4];
+
+// The one-instruction vector table of examples/bootload, we use no interrupts.
+void InterruptVector() __attribute__((naked)) __attribute((section(".init")));
+void InterruptVector()
+{
+	asm volatile( "\n\
+	.align  2\n\
+	.option   push;\n\
+	.option   norvc;\n\
+	j handle_reset\n\
+	.option pop" );
+}
+
+static uint32_t crc32( const uint8_t * p, uint32_t len )
+{
+	uint32_t crc = 0xffffffff;
+	while( len-- )
+	{
+		int i;
+		crc ^= *p++;
+		for( i = 0; i < 8; i++ )
+			crc = ( crc >> 1 ) ^ ( 0xedb88320 & -( crc & 1 ) );
+	}
+	return ~crc;
+}
+
+static uint32_t rxhead( void )
+{
+	return RX_SIZE - DMA1_Channel5->CNTR;
+}
+
+static int rx( uint32_t timeout )
+{
+	uint32_t start = SysTick->CNT;
+	while( rxhead() == ( rxtail & ( RX_SIZE - 1 ) ) )
+		if( SysTick->CNT - start > timeout ) return -1;
+	return rxbuf[rxtail++ & ( RX_SIZE - 1 )];
+}
+
+static void tx( uint8_t c )
+{
+	while( !( USART1->STATR & USART_STATR_TXE ) );
+	USART1->DATAR = c;
+}
+
+static void reply( int status, int len )
+{
+	uint8_t * f = (uint8_t *)frame;
+	int i;
+	f[1] = status;
+	f[2] = len;
+	f[3] = len >> 8;
+	uint32_t crc = crc32( f, 4 + len );
+#ifdef UARTBOOT_DE_PIN
+	funDigitalWrite( UARTBOOT_DE_PIN, 1 );
+#endif
+	tx( SYNC_REPLY );
+	for( i = 0; i < 4 + len; i++ )
+		tx( f[i] );
+	for( i = 0; i < 4; i++ )
+		tx( crc >> ( i * 8 ) );
+	while( !( USART1->STATR & USART_STATR_TC ) );
+#ifdef UARTBOOT_DE_PIN
+	funDigitalWrite( UARTBOOT_DE_PIN, 0 );
+#endif
+	// Drop our own echo on a half duplex bus, the host waits for this reply anyway.
+	rxtail = rxhead();
+}
+
+static void run_app( void )
+{
+	// Clear the boot mode flag and reset, as in examples/bootload.
+	FLASH->KEYR = FLASH_KEY1;
+	FLASH->KEYR = FLASH_KEY2;
+	FLASH->BOOT_MODEKEYR = FLASH_KEY1;
+	FLASH->BOOT_MODEKEYR = FLASH_KEY2;
+	FLASH->STATR = 0;
+	FLASH->CTLR = CR_LOCK_Set;
+	PFIC->SCTLR = 1<<31;
+	while( 1 );
+}
+
+static void handle( int cmd, int len )
+{
+	uint32_t flash_size = ESIG->FLACAP * 1024;
+	uint32_t addr = frame[1];
+	uint32_t n = frame[2];
+	int status = ST_OK;
+	int rlen = 0;
+	uint32_t i;
+
+	// Everything but INFO and RUN works on whole pages of the application flash.
+	if( cmd != 'i' && cmd != 'r' && ( len < 4 || addr - APP_BASE >= flash_size || ( addr & ( FLASH_PAGE_SIZE - 1 ) ) ) )
+	{
+		reply( ST_BAD_ARG, 0 );
+		return;
+	}
+
+	switch( cmd )
+	{
+	case 'i': // Info: version, page size, flash base and size, chip ID
+		frame[1] = 1 | FLASH_PAGE_SIZE << 16;
+		frame[2] = APP_BASE;
+		frame[3] = flash_size;
+		frame[4] = *(uint32_t *)0x1FFFF7C4;
+		rlen = 16;
+		break;
+	case 'h': // CRCs of n pages from addr
+		if( n > MAX_PAYLOAD / 4 || addr - APP_BASE + n * FLASH_PAGE_SIZE > flash_size )
+		{
+			status = ST_BAD_ARG;
+			break;
+		}
+		for( i = 0; i < n; i++ )
+			frame[1 + i] = crc32( (uint8_t *)addr + i * FLASH_PAGE_SIZE, FLASH_PAGE_SIZE );
+		rlen = n * 4;
+		break;
+	case 'c': // CRC of n bytes from addr
+		// Written so nothing wraps, whatever n the host sends
+		if( addr < APP_BASE || n > flash_size || addr - APP_BASE > flash_size - n )
+		{
+			status = ST_BAD_ARG;
+			break;
+		}
+		frame[1] = crc32( (uint8_t *)addr, n );
+		rlen = 4;
+		break;
+	case 'e': // Erase the page at addr
+	case 'w': // Write the page after addr to addr
+		if( cmd == 'w' && len != 4 + FLASH_PAGE_SIZE )
+		{
+			status = ST_BAD_ARG;
+			break;
+		}
+		if( flash_unlock() ||
+			( !flash_is_erased( addr, FLASH_PAGE_SIZE ) && flash_erase_page( addr ) ) ||
+			( cmd == 'w' && flash_write_page( addr, &frame[2] ) ) )
+			status = ST_FLASH;
+		flash_lock();
+		break;
+	case 'r': // Run the application
+		reply( ST_OK, 0 );
+		run_app();
+		break;
+	default:
+		status = ST_BAD_ARG;
+	}
+	reply( status, rlen );
+}
+
+int main()
+{
+	SystemInit();
+
+	RCC->APB2PCENR |= RCC_APB2Periph_GPIOD | RCC_APB2Periph_USART1;
+	RCC->AHBPCENR |= RCC_DMA1EN;
+	funPinMode( PD5, GPIO_CFGLR_OUT_50Mhz_AF_PP );
+	funPinMode( PD6, GPIO_CFGLR_IN_PUPD );
+	funDigitalWrite( PD6, 1 );
+#ifdef UARTBOOT_DE_PIN
+	funPinMode( UARTBOOT_DE_PIN, GPIO_CFGLR_OUT_10Mhz_PP );
+#endif
+
+	DMA1_Channel5->MADDR = (uint32_t)rxbuf;
+	DMA1_Channel5->PADDR = (uint32_t)&USART1->DATAR;
+	DMA1_Channel5->CNTR = RX_SIZE;
+	DMA1_Channel5->CFGR = DMA_CFGR1_CIRC | DMA_CFGR1_MINC | DMA_CFGR1_EN;
+
+	USART1->BRR = ( FUNCONF_SYSTEM_CORE_CLOCK + UARTBOOT_BAUD / 2 ) / UARTBOOT_BAUD;
+	USART1->CTLR3 = USART_CTLR3_DMAR;
+	USART1->CTLR1 = USART_CTLR1_TE | USART_CTLR1_RE | USART_CTLR1_UE;
+
+	uint8_t * f = (uint8_t *)frame;
+	uint8_t node = OB->Data0;
+	int stay = *(uint32_t *)APP_BASE == 0xffffffff;
+	uint32_t start = SysTick->CNT;
+
+	while( 1 )
+	{
+		if( !stay && SysTick->CNT - start > UARTBOOT_WINDOW_MS * DELAY_MS_TIME )
+			run_app();
+
+		if( rx( 0 ) != SYNC_REQUEST ) continue;
+
+		int i, c = 0;
+		int len = MAX_PAYLOAD;
+		for( i = 0; i < 4 + len + 4 && ( c = rx( BYTE_TIMEOUT ) ) >= 0; i++ )
+		{
+			f[i] = c;
+			if( i == 3 ) len = f[2] | f[3] << 8;
+			if( len > MAX_PAYLOAD ) break;
+		}
+		if( c < 0 || len > MAX_PAYLOAD ) continue;
+
+		uint32_t crc = f[4 + len] | f[5 + len] << 8 | f[6 + len] << 16 | (uint32_t)f[7 + len] << 24;
+		if( crc != crc32( f, 4 + len ) ) continue;
+
+		// 0xff talks to whichever node is listening, for point to point links.
+		if( f[0] != node && f[0] != 0xff ) continue;
+		f[0] = node;
+		stay = 1;
+		handle( f[1], len );
+	}
+}